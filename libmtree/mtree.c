@@ -95,31 +95,51 @@ static const struct entry_type_map {
 };
 #define N_ENTRY_TYPES		(__arraycount(entry_types) - 1)
 
-static int
-compare_entry_name(const void *key, const void *map)
-{
-
-	return (strcmp((const char *)key, ((struct entry_type_map *)map)->name));
-}
-
 /*
  * Convert entry type string to an mtree_entry_type.
+ *
+ * The names are told apart by their first character and length, a single
+ * comparison then rejects unknown names. Add new names of entry_types[]
+ * here as well.
  */
+#define ENTRY_TYPE(s, type)						\
+	if (NAME_IS(name, len, s))					\
+		return (type)
+
 mtree_entry_type
 mtree_entry_type_parse(const char *name)
 {
-	struct entry_type_map *item;
+	size_t	len;
 
 	assert(name != NULL);
 
-	item = bsearch(name, entry_types,
-	    N_ENTRY_TYPES,
-	    sizeof(entry_types[0]), compare_entry_name);
-	if (item != NULL)
-		return (item->type);
+	len = strlen(name);
+	switch (name[0]) {
+	case 'b':
+		ENTRY_TYPE("block", MTREE_ENTRY_BLOCK);
+		break;
+	case 'c':
+		ENTRY_TYPE("char", MTREE_ENTRY_CHAR);
+		break;
+	case 'd':
+		ENTRY_TYPE("dir", MTREE_ENTRY_DIR);
+		break;
+	case 'f':
+		ENTRY_TYPE("fifo", MTREE_ENTRY_FIFO);
+		ENTRY_TYPE("file", MTREE_ENTRY_FILE);
+		break;
+	case 'l':
+		ENTRY_TYPE("link", MTREE_ENTRY_LINK);
+		break;
+	case 's':
+		ENTRY_TYPE("socket", MTREE_ENTRY_SOCKET);
+		break;
+	}
 	return (MTREE_ENTRY_UNKNOWN);
 }
 
+#undef ENTRY_TYPE
+
 /*
  * Convert mode to an mtree_entry_type.
  */
@@ -158,31 +178,90 @@ mtree_entry_type_string(mtree_entry_type type)
 	return (NULL);
 }
 
-static int
-compare_keyword_name(const void *key, const void *map)
-{
-
-	return (strcmp((const char *)key, ((struct mtree_keyword_map *)map)->name));
-}
-
 /*
  * Convert keyword string to the appropriate numeric constant.
+ *
+ * The keywords are told apart by their first character and length, a
+ * single comparison then rejects unknown keywords. Add new keywords of
+ * mtree_keywords[] here as well.
  */
+#define KEYWORD(s, value)						\
+	if (NAME_IS(keyword, len, s))					\
+		return (value)
+
 uint64_t
 mtree_keyword_parse(const char *keyword)
 {
-	struct mtree_keyword_map *item;
+	size_t	len;
 
 	assert(keyword != NULL);
 
-	item = bsearch(keyword, mtree_keywords,
-	    N_KEYWORDS,
-	    sizeof(mtree_keywords[0]), compare_keyword_name);
-	if (item != NULL)
-		return (item->keyword);
+	len = strlen(keyword);
+	switch (keyword[0]) {
+	case 'c':
+		KEYWORD("cksum", MTREE_KEYWORD_CKSUM);
+		KEYWORD("contents", MTREE_KEYWORD_CONTENTS);
+		break;
+	case 'd':
+		KEYWORD("device", MTREE_KEYWORD_DEVICE);
+		break;
+	case 'f':
+		KEYWORD("flags", MTREE_KEYWORD_FLAGS);
+		break;
+	case 'g':
+		KEYWORD("gid", MTREE_KEYWORD_GID);
+		KEYWORD("gname", MTREE_KEYWORD_GNAME);
+		break;
+	case 'i':
+		KEYWORD("ignore", MTREE_KEYWORD_IGNORE);
+		KEYWORD("inode", MTREE_KEYWORD_INODE);
+		break;
+	case 'l':
+		KEYWORD("link", MTREE_KEYWORD_LINK);
+		break;
+	case 'm':
+		KEYWORD("md5", MTREE_KEYWORD_MD5);
+		KEYWORD("md5digest", MTREE_KEYWORD_MD5DIGEST);
+		KEYWORD("mode", MTREE_KEYWORD_MODE);
+		break;
+	case 'n':
+		KEYWORD("nlink", MTREE_KEYWORD_NLINK);
+		KEYWORD("nochange", MTREE_KEYWORD_NOCHANGE);
+		break;
+	case 'o':
+		KEYWORD("optional", MTREE_KEYWORD_OPTIONAL);
+		break;
+	case 'r':
+		KEYWORD("ripemd160digest", MTREE_KEYWORD_RIPEMD160DIGEST);
+		KEYWORD("rmd160", MTREE_KEYWORD_RMD160);
+		KEYWORD("rmd160digest", MTREE_KEYWORD_RMD160DIGEST);
+		break;
+	case 's':
+		KEYWORD("sha1", MTREE_KEYWORD_SHA1);
+		KEYWORD("sha1digest", MTREE_KEYWORD_SHA1DIGEST);
+		KEYWORD("sha256", MTREE_KEYWORD_SHA256);
+		KEYWORD("sha256digest", MTREE_KEYWORD_SHA256DIGEST);
+		KEYWORD("sha384", MTREE_KEYWORD_SHA384);
+		KEYWORD("sha384digest", MTREE_KEYWORD_SHA384DIGEST);
+		KEYWORD("sha512", MTREE_KEYWORD_SHA512);
+		KEYWORD("sha512digest", MTREE_KEYWORD_SHA512DIGEST);
+		KEYWORD("size", MTREE_KEYWORD_SIZE);
+		break;
+	case 't':
+		KEYWORD("tags", MTREE_KEYWORD_TAGS);
+		KEYWORD("time", MTREE_KEYWORD_TIME);
+		KEYWORD("type", MTREE_KEYWORD_TYPE);
+		break;
+	case 'u':
+		KEYWORD("uid", MTREE_KEYWORD_UID);
+		KEYWORD("uname", MTREE_KEYWORD_UNAME);
+		break;
+	}
 	return (0);
 }
 
+#undef KEYWORD
+
 static int
 compare_keyword(const void *key, const void *map)
 {
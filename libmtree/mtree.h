@@ -33,6 +33,7 @@
 #include <stddef.h>
 #include <stdint.h>
 
+struct mtree_cache;
 struct mtree_cksum;
 struct mtree_device;
 struct mtree_digest;
@@ -81,6 +82,22 @@ uint32_t		 mtree_cksum_get_result(struct mtree_cksum *cksum);
 
 /*****************************************************************************/
 
+/* Cache options. */
+#define MTREE_CACHE_STRICT		0x01
+
+/*
+ * mtree_cache:
+ *
+ * Persistent cache of checksums and digests of files, which lets reading
+ * of paths skip files that have not changed.
+ */
+struct mtree_cache	*mtree_cache_open(const char *path, int options);
+int			 mtree_cache_flush(struct mtree_cache *cache);
+int			 mtree_cache_compact(struct mtree_cache *cache);
+int			 mtree_cache_close(struct mtree_cache *cache);
+
+/*****************************************************************************/
+
 /* Device formats. */
 typedef enum {
 	MTREE_DEVICE_386BSD,
@@ -160,6 +177,7 @@ const char		*mtree_digest_get_result(struct mtree_digest *digest,
 			    int type);
 int			 mtree_digest_get_types(struct mtree_digest *digest);
 int			 mtree_digest_get_available_types(void);
+const char		*mtree_digest_get_backend(int type);
 
 /*****************************************************************************/
 
@@ -342,8 +360,13 @@ uint64_t		 mtree_entry_get_keywords(struct mtree_entry *entry);
 
 #define MTREE_ENTRY_OVERWRITE		0x01
 #define MTREE_ENTRY_REMOVE_EXCLUDED	0x02
+#define MTREE_ENTRY_DROP_CACHE		0x04
+#define MTREE_ENTRY_FIRST_MISMATCH	0x08
 void			 mtree_entry_set_keywords(struct mtree_entry *entry,
 			    uint64_t keywords, int options);
+void			 mtree_entry_set_keywords_at(struct mtree_entry *entry,
+			    int dirfd, const char *path, uint64_t keywords,
+			    int options);
 void			 mtree_entry_set_keywords_stat(struct mtree_entry *entry,
 			    const struct stat *st, uint64_t keywords,
 			    int options);
@@ -354,6 +377,10 @@ int			 mtree_entry_compare_keywords(
 			    const struct mtree_entry *entry1,
 			    const struct mtree_entry *entry2, uint64_t keywords,
 			    uint64_t *diff);
+int			 mtree_entry_compare_file(
+			    const struct mtree_entry *entry,
+			    struct mtree_entry *file, uint64_t keywords,
+			    int options, uint64_t *diff);
 /*
  * Various list functions.
  */
@@ -545,12 +572,28 @@ int			 mtree_spec_copy_entries(struct mtree_spec *spec,
 #define MTREE_READ_PATH_SKIP_ON_ERROR		0x1000
 #define MTREE_READ_PATH_FOLLOW_SYMLINKS		0x2000
 #define MTREE_READ_PATH_DONT_CROSS_MOUNT	0x4000
+#define MTREE_READ_PATH_PARALLEL		0x8000
+#define MTREE_READ_PATH_DONT_SYNC		0x10000
+#define MTREE_READ_PATH_DEFER_CHECKSUMS		0x20000
+#define MTREE_READ_PATH_PIPELINE		0x40000
+#define MTREE_READ_PATH_DROP_CACHE		0x80000
+#define MTREE_READ_PATH_LAYOUT_ORDER		0x100000
+/*
+ * Spec reading options.
+ */
+#define MTREE_READ_SPEC_PARALLEL		0x200000
+#define MTREE_READ_SPEC_ARENA			0x400000
+#define MTREE_READ_SPEC_MMAP			0x800000
 
 int			 mtree_spec_read_path(struct mtree_spec *spec,
 			    const char *path);
+int			 mtree_spec_read_path_incremental(struct mtree_spec *spec,
+			    const char *path, struct mtree_spec *previous);
 int			 mtree_spec_read_spec_data(struct mtree_spec *spec,
 			    const char *data, size_t len);
 int			 mtree_spec_read_spec_data_finish(struct mtree_spec *spec);
+int			 mtree_spec_read_spec_path(struct mtree_spec *spec,
+			    const char *path);
 
 const char		*mtree_spec_get_read_error(struct mtree_spec *spec);
 int			 mtree_spec_get_read_options(struct mtree_spec *spec);
@@ -564,6 +607,34 @@ void			 mtree_spec_set_read_path_keywords(struct mtree_spec *spec,
 uint64_t		 mtree_spec_get_read_spec_keywords(struct mtree_spec *spec);
 void			 mtree_spec_set_read_spec_keywords(struct mtree_spec *spec,
 			    uint64_t keywords);
+int			 mtree_spec_get_read_threads(struct mtree_spec *spec);
+void			 mtree_spec_set_read_threads(struct mtree_spec *spec,
+			    int threads);
+int			 mtree_spec_get_read_checksum_threads(struct mtree_spec *spec);
+void			 mtree_spec_set_read_checksum_threads(struct mtree_spec *spec,
+			    int threads);
+struct mtree_cache	*mtree_spec_get_read_cache(struct mtree_spec *spec);
+void			 mtree_spec_set_read_cache(struct mtree_spec *spec,
+			    struct mtree_cache *cache);
+/*
+ * Limits on reading of file contents.
+ */
+#define MTREE_IO_PRIORITY_NORMAL		0
+#define MTREE_IO_PRIORITY_LOW			1
+#define MTREE_IO_PRIORITY_IDLE			2
+
+uint64_t		 mtree_spec_get_read_byte_rate(struct mtree_spec *spec);
+void			 mtree_spec_set_read_byte_rate(struct mtree_spec *spec,
+			    uint64_t rate);
+uint64_t		 mtree_spec_get_read_file_rate(struct mtree_spec *spec);
+void			 mtree_spec_set_read_file_rate(struct mtree_spec *spec,
+			    uint64_t rate);
+uint64_t		 mtree_spec_get_read_latency(struct mtree_spec *spec);
+void			 mtree_spec_set_read_latency(struct mtree_spec *spec,
+			    uint64_t usec);
+int			 mtree_spec_get_read_io_priority(struct mtree_spec *spec);
+void			 mtree_spec_set_read_io_priority(struct mtree_spec *spec,
+			    int priority);
 /*
  * Writing options.
  */
@@ -0,0 +1,195 @@
+/*-
+ * Copyright (c) 2015 Michal Ratajsky <michal@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mtree.h"
+#include "mtree_private.h"
+
+/*
+ * Arena for entries read from specs and their paths and names.
+ *
+ * Memory is taken from large slabs and never returned individually. The
+ * arena is reference counted, it is created with one reference held by its
+ * owner and every entry allocated from it holds another one. The slabs are
+ * freed when the last reference is released.
+ *
+ * Allocations must be made by one thread at a time, references may be
+ * released from any thread.
+ */
+#define ARENA_SLAB_SIZE		(1024 * 1024)
+#define ARENA_ALIGN		16
+
+struct arena_slab {
+	struct arena_slab	*next;
+	char			 data[];
+};
+
+struct mtree_arena {
+	struct arena_slab	*slabs;
+	char			*next;		/* free space of the last slab */
+	size_t			 avail;
+	unsigned long		 refs;
+};
+
+struct mtree_arena *
+mtree_arena_create(void)
+{
+	struct mtree_arena *arena;
+
+	arena = calloc(1, sizeof(struct mtree_arena));
+	if (arena == NULL)
+		return (NULL);
+	arena->refs = 1;
+	return (arena);
+}
+
+/*
+ * Add `n' references to the arena.
+ */
+void
+mtree_arena_ref(struct mtree_arena *arena, unsigned long n)
+{
+
+	assert(arena != NULL);
+
+	__atomic_add_fetch(&arena->refs, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Release `n' references to the arena, freeing it with the last one.
+ */
+void
+mtree_arena_release(struct mtree_arena *arena, unsigned long n)
+{
+	struct arena_slab *slab, *next;
+
+	assert(arena != NULL);
+
+	if (__atomic_sub_fetch(&arena->refs, n, __ATOMIC_ACQ_REL) != 0)
+		return;
+	for (slab = arena->slabs; slab != NULL; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+	free(arena);
+}
+
+/*
+ * Allocate memory with the given alignment, which must be a power of 2 no
+ * larger than ARENA_ALIGN.
+ */
+static void *
+arena_alloc(struct mtree_arena *arena, size_t size, size_t align)
+{
+	struct arena_slab	*slab;
+	size_t			 pad;
+	void			*p;
+
+	pad = -(uintptr_t)arena->next & (align - 1);
+	if (pad + size > arena->avail) {
+		if (size > ARENA_SLAB_SIZE / 4) {
+			/*
+			 * Large allocations get a slab of their own, leaving
+			 * the current slab to be filled.
+			 */
+			slab = malloc(sizeof(*slab) + align - 1 + size);
+			if (slab == NULL)
+				return (NULL);
+			slab->next   = arena->slabs;
+			arena->slabs = slab;
+			return ((void *)(((uintptr_t)slab->data + align - 1) &
+			    ~(uintptr_t)(align - 1)));
+		}
+		slab = malloc(sizeof(*slab) + ARENA_SLAB_SIZE);
+		if (slab == NULL)
+			return (NULL);
+		slab->next   = arena->slabs;
+		arena->slabs = slab;
+		arena->next  = slab->data;
+		arena->avail = ARENA_SLAB_SIZE;
+		pad = 0;
+	}
+	p = arena->next + pad;
+	arena->next  += pad + size;
+	arena->avail -= pad + size;
+	return (p);
+}
+
+/*
+ * Allocate zeroed memory suitably aligned for any object.
+ */
+void *
+mtree_arena_alloc(struct mtree_arena *arena, size_t size)
+{
+	void *p;
+
+	assert(arena != NULL);
+
+	p = arena_alloc(arena, size, ARENA_ALIGN);
+	if (p == NULL)
+		return (NULL);
+	return (memset(p, 0, size));
+}
+
+/*
+ * Allocate room for a string of `len' characters and the terminating NUL.
+ */
+char *
+mtree_arena_alloc_string(struct mtree_arena *arena, size_t len)
+{
+
+	assert(arena != NULL);
+
+	return (arena_alloc(arena, len + 1, 1));
+}
+
+/*
+ * Copy `len' characters of the string to the arena.
+ */
+char *
+mtree_arena_strndup(struct mtree_arena *arena, const char *s, size_t len)
+{
+	char *p;
+
+	assert(arena != NULL);
+	assert(s != NULL);
+
+	p = arena_alloc(arena, len + 1, 1);
+	if (p == NULL)
+		return (NULL);
+	memcpy(p, s, len);
+	p[len] = '\0';
+	return (p);
+}
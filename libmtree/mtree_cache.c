@@ -0,0 +1,647 @@
+/*-
+ * Copyright (c) 2015 Michal Ratajsky <michal@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <errno.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compat.h"
+#include "mtree.h"
+#include "mtree_private.h"
+
+/*
+ * Persistent cache of checksums and digests.
+ *
+ * The values are keyed by the device and inode number of the file and
+ * they are valid as long as the size and the modification and change
+ * times of the file are unchanged.
+ *
+ * The cache file consists of a header followed by records, each record
+ * being a fixed part and the digests listed in its `types' in the order
+ * of cache_digests. Integers are stored in the native byte order, the
+ * header identifies it.
+ */
+#define CACHE_MAGIC		"MTREECA1"
+#define CACHE_BYTE_ORDER	0x01020304
+#define CACHE_HEADER_SIZE	12
+#define CACHE_RECORD_SIZE	64
+
+/* Record holds the cksum value, other bits are digest types. */
+#define CACHE_CKSUM		0x8000
+
+/*
+ * In strict mode, values stored less than this many seconds after the last
+ * change of the file are not trusted. The file may have been changed again
+ * without updating its change time.
+ */
+#define CACHE_RACY_SECONDS	2
+
+#define CACHE_INITIAL_SIZE	1024
+
+static const struct {
+	int	type;
+	size_t	size;
+} cache_digests[] = {
+	{ MTREE_DIGEST_MD5,	16 },
+	{ MTREE_DIGEST_SHA1,	20 },
+	{ MTREE_DIGEST_SHA256,	32 },
+	{ MTREE_DIGEST_SHA384,	48 },
+	{ MTREE_DIGEST_SHA512,	64 },
+	{ MTREE_DIGEST_RMD160,	20 }
+};
+
+#define CACHE_DIGESTS	(sizeof(cache_digests) / sizeof(cache_digests[0]))
+
+struct cache_record {
+	struct mtree_cache_key	 key;
+	int64_t			 stamp;		/* when the values were stored */
+	uint32_t		 cksum;
+	int			 types;
+	int			 used;		/* looked up or stored */
+	unsigned char		 digests[];
+};
+
+struct mtree_cache {
+	char			 *path;
+	int			  options;
+	struct cache_record	**table;
+	size_t			  size;		/* power of two */
+	size_t			  count;
+	int			  dirty;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t		  lock;
+#endif
+};
+
+#ifdef HAVE_PTHREAD
+#define CACHE_LOCK(c)		pthread_mutex_lock(&(c)->lock)
+#define CACHE_UNLOCK(c)		pthread_mutex_unlock(&(c)->lock)
+#else
+#define CACHE_LOCK(c)		do { } while (0)
+#define CACHE_UNLOCK(c)		do { } while (0)
+#endif
+
+/*
+ * Get the size of digests stored in a record with the given types.
+ */
+static size_t
+digests_size(int types)
+{
+	size_t	size;
+	size_t	i;
+
+	size = 0;
+	for (i = 0; i < CACHE_DIGESTS; i++)
+		if (types & cache_digests[i].type)
+			size += cache_digests[i].size;
+	return (size);
+}
+
+/*
+ * Get the position of the digest of the given type in a record.
+ */
+static unsigned char *
+record_digest(struct cache_record *rec, int type)
+{
+	unsigned char	*p;
+	size_t		 i;
+
+	p = rec->digests;
+	for (i = 0; i < CACHE_DIGESTS && cache_digests[i].type != type; i++)
+		if (rec->types & cache_digests[i].type)
+			p += cache_digests[i].size;
+	return (p);
+}
+
+static size_t
+key_hash(const struct mtree_cache_key *key, size_t size)
+{
+	uint64_t h;
+
+	h = (key->dev * 0x9E3779B97F4A7C15ULL) ^ key->ino;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	return ((size_t)(h ^ (h >> 31)) & (size - 1));
+}
+
+static int
+key_equal(const struct mtree_cache_key *a, const struct mtree_cache_key *b)
+{
+
+	return (a->dev == b->dev &&
+	    a->ino == b->ino &&
+	    a->size == b->size &&
+	    a->mtime_sec == b->mtime_sec &&
+	    a->mtime_nsec == b->mtime_nsec &&
+	    a->ctime_sec == b->ctime_sec &&
+	    a->ctime_nsec == b->ctime_nsec);
+}
+
+/*
+ * Find the slot of the file with the key's device and inode number.
+ */
+static struct cache_record **
+find_slot(struct mtree_cache *cache, const struct mtree_cache_key *key)
+{
+	struct cache_record	**slot;
+	size_t			  i;
+
+	i = key_hash(key, cache->size);
+	for (;;) {
+		slot = &cache->table[i];
+		if (*slot == NULL || ((*slot)->key.dev == key->dev &&
+		    (*slot)->key.ino == key->ino))
+			return (slot);
+		i = (i + 1) & (cache->size - 1);
+	}
+}
+
+static int
+resize_table(struct mtree_cache *cache, size_t size)
+{
+	struct cache_record	**table, **old;
+	size_t			  oldsize, i;
+
+	table = calloc(size, sizeof(struct cache_record *));
+	if (table == NULL)
+		return (-1);
+	old     = cache->table;
+	oldsize = cache->size;
+	cache->table = table;
+	cache->size  = size;
+	for (i = 0; i < oldsize; i++)
+		if (old[i] != NULL)
+			*find_slot(cache, &old[i]->key) = old[i];
+	free(old);
+	return (0);
+}
+
+/*
+ * Store the record, replacing a record of the same file.
+ */
+static int
+insert_record(struct mtree_cache *cache, struct cache_record *rec)
+{
+	struct cache_record **slot;
+
+	if ((cache->count + 1) * 4 > cache->size * 3 &&
+	    resize_table(cache, cache->size * 2) == -1)
+		return (-1);
+	slot = find_slot(cache, &rec->key);
+	if (*slot != NULL)
+		free(*slot);
+	else
+		cache->count++;
+	*slot = rec;
+	return (0);
+}
+
+/*
+ * Check whether the values of the record can be used in the cache's mode.
+ */
+static int
+record_trusted(struct mtree_cache *cache, const struct cache_record *rec)
+{
+
+	if ((cache->options & MTREE_CACHE_STRICT) == 0)
+		return (1);
+	return (rec->stamp - rec->key.ctime_sec >= CACHE_RACY_SECONDS);
+}
+
+/*
+ * Read records from the cache file.
+ */
+static int
+read_records(struct mtree_cache *cache, FILE *fp)
+{
+	struct cache_record	*rec;
+	unsigned char		 buf[CACHE_RECORD_SIZE];
+	char			 magic[CACHE_HEADER_SIZE];
+	uint32_t		 order;
+	size_t			 n, size;
+
+	n = fread(magic, 1, CACHE_HEADER_SIZE, fp);
+	if (n == 0 && !ferror(fp))
+		return (0);
+	memcpy(&order, magic + 8, sizeof(order));
+	if (n != CACHE_HEADER_SIZE || memcmp(magic, CACHE_MAGIC, 8) != 0 ||
+	    order != CACHE_BYTE_ORDER) {
+		if (!ferror(fp))
+			errno = EINVAL;
+		return (-1);
+	}
+	while (fread(buf, 1, CACHE_RECORD_SIZE, fp) == CACHE_RECORD_SIZE) {
+		int types;
+
+		memcpy(&types, buf + 60, sizeof(types));
+		size = digests_size(types);
+		rec = malloc(sizeof(struct cache_record) + size);
+		if (rec == NULL)
+			return (-1);
+		memcpy(&rec->key.dev, buf, 8);
+		memcpy(&rec->key.ino, buf + 8, 8);
+		memcpy(&rec->key.size, buf + 16, 8);
+		memcpy(&rec->key.mtime_sec, buf + 24, 8);
+		memcpy(&rec->key.ctime_sec, buf + 32, 8);
+		memcpy(&rec->stamp, buf + 40, 8);
+		memcpy(&rec->key.mtime_nsec, buf + 48, 4);
+		memcpy(&rec->key.ctime_nsec, buf + 52, 4);
+		memcpy(&rec->cksum, buf + 56, 4);
+		rec->types = types;
+		rec->used  = 0;
+		/* A truncated record at the end is ignored. */
+		if (fread(rec->digests, 1, size, fp) != size) {
+			free(rec);
+			break;
+		}
+		if (insert_record(cache, rec) == -1) {
+			free(rec);
+			return (-1);
+		}
+	}
+	return (ferror(fp) ? -1 : 0);
+}
+
+/*
+ * Write all the records to the cache file.
+ */
+static int
+write_records(struct mtree_cache *cache, FILE *fp)
+{
+	struct cache_record	*rec;
+	unsigned char		 buf[CACHE_RECORD_SIZE];
+	char			 header[CACHE_HEADER_SIZE];
+	uint32_t		 order;
+	size_t			 i;
+
+	memcpy(header, CACHE_MAGIC, 8);
+	order = CACHE_BYTE_ORDER;
+	memcpy(header + 8, &order, sizeof(order));
+	if (fwrite(header, 1, CACHE_HEADER_SIZE, fp) != CACHE_HEADER_SIZE)
+		return (-1);
+	for (i = 0; i < cache->size; i++) {
+		rec = cache->table[i];
+		if (rec == NULL)
+			continue;
+		memcpy(buf, &rec->key.dev, 8);
+		memcpy(buf + 8, &rec->key.ino, 8);
+		memcpy(buf + 16, &rec->key.size, 8);
+		memcpy(buf + 24, &rec->key.mtime_sec, 8);
+		memcpy(buf + 32, &rec->key.ctime_sec, 8);
+		memcpy(buf + 40, &rec->stamp, 8);
+		memcpy(buf + 48, &rec->key.mtime_nsec, 4);
+		memcpy(buf + 52, &rec->key.ctime_nsec, 4);
+		memcpy(buf + 56, &rec->cksum, 4);
+		memcpy(buf + 60, &rec->types, 4);
+		if (fwrite(buf, 1, CACHE_RECORD_SIZE, fp) != CACHE_RECORD_SIZE)
+			return (-1);
+		if (fwrite(rec->digests, 1, digests_size(rec->types),
+		    fp) != digests_size(rec->types))
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Open the cache stored in the given file, the file doesn't need to exist.
+ */
+struct mtree_cache *
+mtree_cache_open(const char *path, int options)
+{
+	struct mtree_cache	*cache;
+	FILE			*fp;
+	int			 ret;
+
+	assert(path != NULL);
+
+	cache = calloc(1, sizeof(struct mtree_cache));
+	if (cache == NULL)
+		return (NULL);
+	cache->options = options;
+	cache->path    = strdup(path);
+	cache->table   = calloc(CACHE_INITIAL_SIZE,
+	    sizeof(struct cache_record *));
+	if (cache->path == NULL || cache->table == NULL)
+		goto fail;
+	cache->size = CACHE_INITIAL_SIZE;
+
+	fp = fopen(path, "rb");
+	if (fp != NULL) {
+		ret = read_records(cache, fp);
+		fclose(fp);
+		if (ret == -1)
+			goto fail;
+	} else if (errno != ENOENT)
+		goto fail;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&cache->lock, NULL);
+#endif
+	return (cache);
+fail:
+	ret = errno;
+	while (cache->size > 0)
+		free(cache->table[--cache->size]);
+	free(cache->table);
+	free(cache->path);
+	free(cache);
+	errno = ret;
+	return (NULL);
+}
+
+/*
+ * Write the cache to its file if it has been modified.
+ *
+ * The file is replaced at once, a new file is written and renamed.
+ */
+int
+mtree_cache_flush(struct mtree_cache *cache)
+{
+	FILE	*fp;
+	char	*tmp;
+	int	 fd;
+	int	 err;
+	int	 ret;
+
+	assert(cache != NULL);
+
+	CACHE_LOCK(cache);
+	if (!cache->dirty) {
+		CACHE_UNLOCK(cache);
+		return (0);
+	}
+	ret = -1;
+	tmp = malloc(strlen(cache->path) + 8);
+	if (tmp == NULL)
+		goto out;
+	strcpy(tmp, cache->path);
+	strcat(tmp, ".XXXXXX");
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		goto out;
+	fp = fdopen(fd, "wb");
+	if (fp == NULL) {
+		err = errno;
+		close(fd);
+		unlink(tmp);
+		errno = err;
+		goto out;
+	}
+	ret = write_records(cache, fp);
+	if (fclose(fp) == EOF)
+		ret = -1;
+	if (ret == 0)
+		ret = rename(tmp, cache->path);
+	if (ret == -1) {
+		err = errno;
+		unlink(tmp);
+		errno = err;
+	} else
+		cache->dirty = 0;
+out:
+	CACHE_UNLOCK(cache);
+	free(tmp);
+	return (ret);
+}
+
+/*
+ * Remove records of files that haven't been looked up or stored since
+ * the cache was opened and write the cache to its file.
+ */
+int
+mtree_cache_compact(struct mtree_cache *cache)
+{
+	struct cache_record	**table;
+	size_t			  size, i;
+
+	assert(cache != NULL);
+
+	CACHE_LOCK(cache);
+	table = cache->table;
+	size  = cache->size;
+	cache->table = calloc(size, sizeof(struct cache_record *));
+	if (cache->table == NULL) {
+		cache->table = table;
+		CACHE_UNLOCK(cache);
+		return (-1);
+	}
+	cache->count = 0;
+	for (i = 0; i < size; i++) {
+		if (table[i] == NULL)
+			continue;
+		if (table[i]->used) {
+			*find_slot(cache, &table[i]->key) = table[i];
+			cache->count++;
+		} else {
+			free(table[i]);
+			cache->dirty = 1;
+		}
+	}
+	free(table);
+	CACHE_UNLOCK(cache);
+	return (mtree_cache_flush(cache));
+}
+
+/*
+ * Write the cache to its file and free it.
+ */
+int
+mtree_cache_close(struct mtree_cache *cache)
+{
+	size_t	i;
+	int	ret;
+
+	assert(cache != NULL);
+
+	ret = mtree_cache_flush(cache);
+	for (i = 0; i < cache->size; i++)
+		free(cache->table[i]);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&cache->lock);
+#endif
+	free(cache->table);
+	free(cache->path);
+	free(cache);
+	return (ret);
+}
+
+/*
+ * Fill in the key from the stat structure of a file.
+ */
+void
+mtree_cache_key_from_stat(struct mtree_cache_key *key, const struct stat *st)
+{
+
+	assert(key != NULL);
+	assert(st != NULL);
+
+	key->dev  = st->st_dev;
+	key->ino  = st->st_ino;
+	key->size = st->st_size;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	key->mtime_sec  = st->st_mtim.tv_sec;
+	key->mtime_nsec = st->st_mtim.tv_nsec;
+#else
+	key->mtime_sec  = st->st_mtime;
+	key->mtime_nsec = 0;
+#endif
+#ifdef HAVE_STRUCT_STAT_ST_CTIM
+	key->ctime_sec  = st->st_ctim.tv_sec;
+	key->ctime_nsec = st->st_ctim.tv_nsec;
+#else
+	key->ctime_sec  = st->st_ctime;
+	key->ctime_nsec = 0;
+#endif
+}
+
+/*
+ * Set the cksum, if it is included in `keywords', and the given digests
+ * of the entry from the cache.
+ *
+ * Returns 1 if all of the values have been found, 0 otherwise, in which
+ * case the entry is not modified.
+ */
+int
+mtree_cache_get(struct mtree_cache *cache, const struct mtree_cache_key *key,
+    struct mtree_entry *entry, int digests, uint64_t keywords)
+{
+	struct cache_record	*rec;
+	size_t			 i;
+	int			 types;
+
+	assert(cache != NULL);
+	assert(key != NULL);
+	assert(entry != NULL);
+
+	types = digests;
+	if (keywords & MTREE_KEYWORD_CKSUM)
+		types |= CACHE_CKSUM;
+
+	CACHE_LOCK(cache);
+	rec = *find_slot(cache, key);
+	if (rec == NULL || !key_equal(&rec->key, key) ||
+	    (rec->types & types) != types || !record_trusted(cache, rec)) {
+		CACHE_UNLOCK(cache);
+		return (0);
+	}
+	rec->used = 1;
+	if (types & CACHE_CKSUM)
+		mtree_entry_set_cksum(entry, rec->cksum);
+	for (i = 0; i < CACHE_DIGESTS; i++) {
+		if ((types & cache_digests[i].type) == 0)
+			continue;
+		mtree_entry_set_digest(entry, cache_digests[i].type,
+		    record_digest(rec, cache_digests[i].type), keywords);
+	}
+	CACHE_UNLOCK(cache);
+	return (1);
+}
+
+/*
+ * Store the cksum, if it is included in `keywords', and the given digests
+ * of the entry in the cache. Values the entry doesn't have are skipped.
+ */
+void
+mtree_cache_put(struct mtree_cache *cache, const struct mtree_cache_key *key,
+    struct mtree_entry *entry, int digests, uint64_t keywords)
+{
+	struct cache_record	*rec, *old;
+	const unsigned char	*bytes[CACHE_DIGESTS];
+	size_t			 i;
+	int			 types;
+
+	assert(cache != NULL);
+	assert(key != NULL);
+	assert(entry != NULL);
+
+	types = 0;
+	if ((keywords & MTREE_KEYWORD_CKSUM) &&
+	    (entry->data.keywords & MTREE_KEYWORD_CKSUM))
+		types |= CACHE_CKSUM;
+	for (i = 0; i < CACHE_DIGESTS; i++) {
+		if ((digests & cache_digests[i].type) == 0)
+			continue;
+		if ((entry->data.keywords &
+		    mtree_entry_digest_keywords(cache_digests[i].type)) == 0)
+			continue;
+		bytes[i] = mtree_entry_data_get_digest(&entry->data,
+		    cache_digests[i].type);
+		if (bytes[i] != NULL)
+			types |= cache_digests[i].type;
+	}
+	if (types == 0)
+		return;
+
+	CACHE_LOCK(cache);
+	/* Values of other types stored for the same state are merged in. */
+	old = *find_slot(cache, key);
+	if (old != NULL && (!key_equal(&old->key, key) ||
+	    !record_trusted(cache, old) || (old->types & ~types) == 0))
+		old = NULL;
+	rec = malloc(sizeof(struct cache_record) +
+	    digests_size(types | (old != NULL ? old->types : 0)));
+	if (rec == NULL) {
+		/* The cache is only an optimization. */
+		CACHE_UNLOCK(cache);
+		return;
+	}
+	rec->key   = *key;
+	rec->stamp = time(NULL);
+	rec->cksum = entry->data.cksum;
+	rec->types = types;
+	rec->used  = 1;
+	if (old != NULL) {
+		/* Keep the older time, the values may have been stored then. */
+		rec->stamp  = old->stamp;
+		rec->types |= old->types;
+		if ((types & CACHE_CKSUM) == 0)
+			rec->cksum = old->cksum;
+	}
+	for (i = 0; i < CACHE_DIGESTS; i++) {
+		if (types & cache_digests[i].type)
+			memcpy(record_digest(rec, cache_digests[i].type),
+			    bytes[i], cache_digests[i].size);
+		else if (old != NULL && (old->types & cache_digests[i].type))
+			memcpy(record_digest(rec, cache_digests[i].type),
+			    record_digest(old, cache_digests[i].type),
+			    cache_digests[i].size);
+	}
+	if (insert_record(cache, rec) == -1)
+		free(rec);
+	else
+		cache->dirty = 1;
+	CACHE_UNLOCK(cache);
+}
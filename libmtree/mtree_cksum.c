@@ -24,6 +24,8 @@
  * SUCH DAMAGE.
  */
 
+#include "config.h"
+
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -34,6 +36,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "mtree.h"
 #include "mtree_file.h"
@@ -95,6 +100,186 @@ static const uint32_t crctab[] = {
 };
 #define	COMPUTE(var, ch)	(var) = ((var) << 8) ^ crctab[((var) >> 24) ^ (ch)]
 
+/*
+ * The checksum is a CRC with the polynomial 0x04c11db7, calculated from
+ * the most significant bit. Besides the byte-wise calculation above, data
+ * are processed 8 bytes at a time using tables derived from crctab, or
+ * 64 bytes at a time using carry-less multiplication on x86-64 processors
+ * that support it.
+ *
+ * crctab8[k][b] is the CRC of byte b followed by k zero bytes.
+ */
+static uint32_t crctab8[8][256];
+
+typedef uint32_t (*cksum_fn)(uint32_t, const unsigned char *, size_t);
+
+static cksum_fn cksum_update_fn;
+
+static uint32_t
+cksum_update_slice8(uint32_t crc, const unsigned char *p, size_t len)
+{
+
+	/* Align to make the loads below cheaper. */
+	while (len > 0 && ((uintptr_t)p & 3) != 0) {
+		COMPUTE(crc, *p++);
+		len--;
+	}
+	for (; len >= 8; len -= 8, p += 8) {
+		crc ^= (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+		    (uint32_t)p[2] << 8 | (uint32_t)p[3];
+		crc = crctab8[7][crc >> 24] ^
+		    crctab8[6][(crc >> 16) & 0xFF] ^
+		    crctab8[5][(crc >> 8) & 0xFF] ^
+		    crctab8[4][crc & 0xFF] ^
+		    crctab8[3][p[4]] ^
+		    crctab8[2][p[5]] ^
+		    crctab8[1][p[6]] ^
+		    crctab8[0][p[7]];
+	}
+	for (; len > 0; len--)
+		COMPUTE(crc, *p++);
+	return (crc);
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CKSUM_CLMUL
+#include <cpuid.h>
+#include <immintrin.h>
+
+/*
+ * Constants for folding, x^n mod P for the given n, and floor(x^64 / P)
+ * for the final Barrett reduction.
+ */
+#define CLMUL_X576	0x8833794cULL
+#define CLMUL_X512	0xe6228b11ULL
+#define CLMUL_X192	0xc5b9cd4cULL
+#define CLMUL_X128	0xe8a45605ULL
+#define CLMUL_X96	0xf200aa66ULL
+#define CLMUL_X64	0x490d678dULL
+#define CLMUL_MU	0x104d101dfULL
+#define CLMUL_P		0x104c11db7ULL
+
+/*
+ * Multiply x by the constant to move it forward by the number of bits
+ * which the constant was computed for and add the next block.
+ */
+#define CLMUL_FOLD(x, k, next)						\
+	_mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11),	\
+	    _mm_clmulepi64_si128(x, k, 0x00)), next)
+
+/*
+ * Fold the data into a 128-bit value congruent modulo P and reduce it to
+ * the resulting CRC. The data are loaded with bytes reversed, so that the
+ * bits of the polynomial match the bits of the vector.
+ *
+ * The length must be a multiple of 16 and at least 64.
+ */
+__attribute__((target("pclmul,ssse3")))
+static uint32_t
+cksum_update_clmul(uint32_t crc, const unsigned char *p, size_t len)
+{
+	const __m128i	 swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+			     8, 9, 10, 11, 12, 13, 14, 15);
+	const __m128i	 k512 = _mm_set_epi64x(CLMUL_X576, CLMUL_X512);
+	const __m128i	 k128 = _mm_set_epi64x(CLMUL_X192, CLMUL_X128);
+	__m128i		 x0, x1, x2, x3, t;
+	uint64_t	 u, q;
+
+#define LOAD(i)	_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p + (i)), swap)
+
+	x0 = _mm_xor_si128(LOAD(0), _mm_set_epi32(crc, 0, 0, 0));
+	x1 = LOAD(1);
+	x2 = LOAD(2);
+	x3 = LOAD(3);
+	for (p += 64, len -= 64; len >= 64; p += 64, len -= 64) {
+		x0 = CLMUL_FOLD(x0, k512, LOAD(0));
+		x1 = CLMUL_FOLD(x1, k512, LOAD(1));
+		x2 = CLMUL_FOLD(x2, k512, LOAD(2));
+		x3 = CLMUL_FOLD(x3, k512, LOAD(3));
+	}
+	x0 = CLMUL_FOLD(x0, k128, x1);
+	x0 = CLMUL_FOLD(x0, k128, x2);
+	x0 = CLMUL_FOLD(x0, k128, x3);
+	for (; len >= 16; p += 16, len -= 16)
+		x0 = CLMUL_FOLD(x0, k128, LOAD(0));
+#undef LOAD
+
+	/*
+	 * Multiply by x^32 and reduce to 64 bits: the upper half is
+	 * multiplied by x^96 mod P, the lower one is shifted.
+	 */
+	t = _mm_xor_si128(
+	    _mm_clmulepi64_si128(x0, _mm_set_epi64x(CLMUL_X96, 0), 0x11),
+	    _mm_slli_si128(_mm_move_epi64(x0), 4));
+	t = _mm_xor_si128(
+	    _mm_clmulepi64_si128(_mm_srli_si128(t, 8),
+	    _mm_cvtsi64_si128(CLMUL_X64), 0x00),
+	    _mm_move_epi64(t));
+	u = _mm_cvtsi128_si64(t);
+
+	/* Barrett reduction to 32 bits. */
+	q = _mm_cvtsi128_si64(_mm_clmulepi64_si128(_mm_cvtsi64_si128(u >> 32),
+	    _mm_cvtsi64_si128(CLMUL_MU), 0x00)) >> 32;
+	u ^= _mm_cvtsi128_si64(_mm_clmulepi64_si128(_mm_cvtsi64_si128(q),
+	    _mm_cvtsi64_si128(CLMUL_P), 0x00));
+	return ((uint32_t)u);
+}
+
+/*
+ * Use carry-less multiplication for larger blocks, the rest of the data
+ * is processed using tables.
+ */
+static uint32_t
+cksum_update_pclmul(uint32_t crc, const unsigned char *p, size_t len)
+{
+	size_t n;
+
+	if (len >= 256) {
+		n = len & ~(size_t)15;
+		crc = cksum_update_clmul(crc, p, n);
+		p   += n;
+		len -= n;
+	}
+	return (cksum_update_slice8(crc, p, len));
+}
+#endif /* __GNUC__ && __x86_64__ */
+
+/*
+ * Build the tables and select the implementation for the processor.
+ */
+static void
+cksum_init(void)
+{
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crctab8[0][i] = crctab[i];
+		for (k = 1; k < 8; k++)
+			crctab8[k][i] = (crctab8[k - 1][i] << 8) ^
+			    crctab[crctab8[k - 1][i] >> 24];
+	}
+	cksum_update_fn = cksum_update_slice8;
+#ifdef CKSUM_CLMUL
+	{
+		unsigned int eax, ebx, ecx, edx;
+
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) != 0 &&
+		    (ecx & bit_PCLMUL) != 0 && (ecx & bit_SSSE3) != 0)
+			cksum_update_fn = cksum_update_pclmul;
+	}
+#endif
+}
+
+#ifdef HAVE_PTHREAD
+static pthread_once_t cksum_once = PTHREAD_ONCE_INIT;
+#define CKSUM_INIT()	pthread_once(&cksum_once, cksum_init)
+#else
+#define CKSUM_INIT()	do {						\
+	if (cksum_update_fn == NULL)					\
+		cksum_init();						\
+} while (0)
+#endif
+
 /*
  * Create a new mtree_cksum.
  */
@@ -152,8 +337,13 @@ mtree_cksum_update(struct mtree_cksum *cksum, const unsigned char *data, size_t
 	assert(data != NULL);
 
 	cksum->len += len;
-	for (; len--; data++)
-		COMPUTE(cksum->crc, *data);
+	if (len < 16) {
+		for (; len--; data++)
+			COMPUTE(cksum->crc, *data);
+		return;
+	}
+	CKSUM_INIT();
+	cksum->crc = cksum_update_fn(cksum->crc, data, len);
 }
 
 /*
@@ -181,6 +371,237 @@ mtree_cksum_get_result(struct mtree_cksum *cksum)
 	return (cksum->crc);
 }
 
+/*
+ * Multiply polynomials a and b modulo the CRC polynomial.
+ */
+static uint32_t
+cksum_multiply(uint32_t a, uint32_t b)
+{
+	uint32_t	r;
+	int		i;
+
+	r = 0;
+	for (i = 31; i >= 0; i--) {
+		r = (r & 0x80000000) ? (r << 1) ^ 0x04c11db7 : r << 1;
+		if (a & (1U << i))
+			r ^= b;
+	}
+	return (r);
+}
+
+/*
+ * Combine the intermediate CRCs of two consecutive pieces of input, where
+ * `crc2' is calculated from zero over `len2' bytes. The result is the CRC
+ * `crc1' updated with the second piece.
+ */
+uint32_t
+mtree_cksum_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	uint32_t	x, xn;
+
+	/* Shifting crc1 over len2 zero bytes multiplies it by x^(8 * len2). */
+	xn = 1;
+	for (x = 0x100; len2 != 0; len2 >>= 1) {
+		if (len2 & 1)
+			xn = cksum_multiply(xn, x);
+		x = cksum_multiply(x, x);
+	}
+	return (cksum_multiply(crc1, xn) ^ crc2);
+}
+
+/*
+ * Update the checksum with `len' zero bytes without processing them one
+ * by one.
+ */
+void
+mtree_cksum_update_zeros(struct mtree_cksum *cksum, uint64_t len)
+{
+
+	assert(cksum != NULL);
+
+	if (cksum->done)
+		return;
+	cksum->crc  = mtree_cksum_combine(cksum->crc, 0, len);
+	cksum->len += len;
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * Splitting of large files into chunks, which are read and checksummed by
+ * separate threads. The CRCs of the chunks are then combined in order.
+ */
+#define CKSUM_MAX_THREADS	16
+#define CKSUM_BUFSIZE		(256 * 1024)
+
+struct cksum_chunk {
+	pthread_t	 thread;
+	int		 fd;
+	off_t		 off;
+	off_t		 len;
+	uint32_t	 crc;
+	int		 ret;		/* 0, 1 if truncated, -1 on error */
+	int		 err;
+};
+
+static void
+cksum_read_chunk(struct cksum_chunk *chunk)
+{
+	unsigned char	*buf;
+	off_t		 off, end;
+	ssize_t		 n;
+	size_t		 len;
+
+	buf = malloc(CKSUM_BUFSIZE);
+	if (buf == NULL) {
+		chunk->ret = -1;
+		chunk->err = errno;
+		return;
+	}
+	chunk->crc = 0;
+	chunk->ret = 0;
+	end = chunk->off + chunk->len;
+	for (off = chunk->off; off < end; off += n) {
+		len = CKSUM_BUFSIZE;
+		if ((off_t)len > end - off)
+			len = end - off;
+		n = pread(chunk->fd, buf, len, off);
+		if (n > 0)
+			chunk->crc = cksum_update_fn(chunk->crc, buf, n);
+		else if (n == 0) {
+			chunk->ret = 1;
+			break;
+		} else if (errno != EINTR) {
+			chunk->ret = -1;
+			chunk->err = errno;
+			break;
+		} else
+			n = 0;
+	}
+	free(buf);
+}
+
+static void *
+cksum_chunk_run(void *arg)
+{
+
+	cksum_read_chunk(arg);
+	return (NULL);
+}
+#endif
+
+/*
+ * Update the checksum with contents of a large regular file, which is read
+ * by up to `threads' threads at once in pieces of at least `chunk' bytes.
+ * Zero threads selects the number of online processors. The file position
+ * is moved to the end of the data read.
+ *
+ * Returns 0 on success, 1 if the file is not split, because it is too small
+ * or not read from the beginning, and -1 on error with errno set. If the file
+ * is truncated while being read, 1 is returned and the file may be read again.
+ */
+int
+mtree_cksum_update_fd(struct mtree_cksum *cksum, int fd, size_t chunk,
+    int threads)
+{
+#ifdef HAVE_PTHREAD
+	struct cksum_chunk	 chunks[CKSUM_MAX_THREADS];
+	struct stat		 st;
+	uint32_t		 crc;
+	off_t			 off, len;
+	int			 nthreads, started;
+	int			 i;
+	int			 ret;
+
+	assert(cksum != NULL);
+	assert(chunk > 0);
+
+	if (cksum->done)
+		return (1);
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    (uint64_t)st.st_size / chunk < 2)
+		return (1);
+	/* Holes of sparse files are skipped by sequential reading. */
+	if (st.st_blocks * 512 < st.st_size)
+		return (1);
+	if (lseek(fd, 0, SEEK_CUR) != 0)
+		return (1);
+	nthreads = threads;
+	if (nthreads < 1) {
+#ifdef _SC_NPROCESSORS_ONLN
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	}
+	if ((uint64_t)nthreads > (uint64_t)st.st_size / chunk)
+		nthreads = st.st_size / chunk;
+	if (nthreads > CKSUM_MAX_THREADS)
+		nthreads = CKSUM_MAX_THREADS;
+	if (nthreads < 2)
+		return (1);
+
+	CKSUM_INIT();
+	len = st.st_size / nthreads;
+	for (i = 0, off = 0; i < nthreads; i++, off += len) {
+		chunks[i].fd  = fd;
+		chunks[i].off = off;
+		chunks[i].len = (i < nthreads - 1) ? len : st.st_size - off;
+		chunks[i].ret = -1;
+		chunks[i].err = 0;
+	}
+	/*
+	 * The first chunk is read by the calling thread, as well as chunks
+	 * left without a thread.
+	 */
+	for (started = 1; started < nthreads; started++)
+		if (pthread_create(&chunks[started].thread, NULL,
+		    cksum_chunk_run, &chunks[started]) != 0)
+			break;
+	cksum_read_chunk(&chunks[0]);
+	for (i = started; i < nthreads; i++)
+		cksum_read_chunk(&chunks[i]);
+	for (i = 1; i < started; i++)
+		pthread_join(chunks[i].thread, NULL);
+
+	ret = 0;
+	crc = cksum->crc;
+	for (i = 0; i < nthreads; i++) {
+		if (chunks[i].ret == -1) {
+			errno = chunks[i].err;
+			return (-1);
+		}
+		if (chunks[i].ret == 1)
+			ret = 1;
+		crc = mtree_cksum_combine(crc, chunks[i].crc, chunks[i].len);
+	}
+	if (ret == 1)
+		return (1);
+	if (lseek(fd, st.st_size, SEEK_SET) == -1)
+		return (-1);
+	cksum->crc  = crc;
+	cksum->len += st.st_size;
+	return (0);
+#else
+	(void)cksum;
+	(void)fd;
+	(void)chunk;
+	(void)threads;
+	return (1);
+#endif
+}
+
+static void
+update_cksum(const unsigned char *buf, size_t len, void *user_data)
+{
+
+	mtree_cksum_update(user_data, buf, len);
+}
+
+static void
+update_cksum_zeros(uint64_t len, void *user_data)
+{
+
+	mtree_cksum_update_zeros(user_data, len);
+}
+
 /*
  * Calculate checksum of bytes read from the given file descriptor and store
  * the result in crc.
@@ -189,8 +610,6 @@ int
 mtree_cksum_fd(int fd, uint32_t *crc)
 {
 	struct mtree_cksum	*cksum;
-	unsigned char		 buf[16 * 1024];
-	ssize_t			 n;
 
 	assert(crc != NULL);
 
@@ -198,9 +617,10 @@ mtree_cksum_fd(int fd, uint32_t *crc)
 	if (cksum == NULL)
 		return (-1);
 
-	while ((n = read(fd, buf, sizeof(buf))) > 0)
-		mtree_cksum_update(cksum, buf, n);
-	if (n == -1) {
+	/* Large files are checksummed in parallel, the rest is read as usual. */
+	if (mtree_cksum_update_fd(cksum, fd, MTREE_CKSUM_CHUNK, 0) == -1 ||
+	    mtree_io_read_fd(fd, 0, NULL, update_cksum, update_cksum_zeros,
+	    cksum) == -1) {
 		mtree_cksum_free(cksum);
 		return (-1);
 	}
@@ -216,6 +636,17 @@ mtree_cksum_fd(int fd, uint32_t *crc)
  */
 int
 mtree_cksum_path(const char *path, uint32_t *crc)
+{
+
+	return (mtree_cksum_path_at(AT_FDCWD, path, crc));
+}
+
+/*
+ * Calculate checksum of bytes read from the given file path, which is
+ * relative to the directory `dirfd', and store the result in crc.
+ */
+int
+mtree_cksum_path_at(int dirfd, const char *path, uint32_t *crc)
 {
 	int fd;
 	int ret;
@@ -223,7 +654,7 @@ mtree_cksum_path(const char *path, uint32_t *crc)
 	assert(path != NULL);
 	assert(crc != NULL);
 
-	fd = open(path, O_RDONLY);
+	fd = mtree_open_at(dirfd, path, O_RDONLY);
 	if (fd != -1) {
 		ret = mtree_cksum_fd(fd, crc);
 		if (ret != 0) {
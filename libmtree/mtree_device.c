@@ -549,39 +549,92 @@ pack_bsdos(long numbers[], int n, struct mtree_device *dev)
 
 typedef	int (*pack_t)(long [], int, struct mtree_device *);
 /*
- * List of formats and pack functions.
- * The list must be lexically sorted and array indices match format constants.
+ * List of formats and pack functions, indexed by format constants.
  */
 static const struct format {
-	const char		*name;
-	mtree_device_format	 format;
-	pack_t			 pack;
+	const char	*name;
+	pack_t		 pack;
 } formats[] = {
-	{"386bsd",	MTREE_DEVICE_386BSD,	pack_8_8},
-	{"4bsd",	MTREE_DEVICE_4BSD,	pack_8_8},
-	{"bsdos",	MTREE_DEVICE_BSDOS,	pack_bsdos},
-	{"freebsd",	MTREE_DEVICE_FREEBSD,	pack_freebsd},
-	{"hpux",	MTREE_DEVICE_HPUX,	pack_8_24},
-	{"isc",		MTREE_DEVICE_ISC,	pack_8_8},
-	{"linux",	MTREE_DEVICE_LINUX,	pack_8_8},
-	{"native",	MTREE_DEVICE_NATIVE,	pack_native},
-	{"netbsd",	MTREE_DEVICE_NETBSD,	pack_netbsd},
-	{"osf1",	MTREE_DEVICE_OSF1,	pack_12_20},
-	{"sco",		MTREE_DEVICE_SCO,	pack_8_8},
-	{"solaris",	MTREE_DEVICE_SOLARIS,	pack_14_18},
-	{"sunos",	MTREE_DEVICE_SUNOS,	pack_8_8},
-	{"svr3",	MTREE_DEVICE_SVR3,	pack_8_8},
-	{"svr4",	MTREE_DEVICE_SVR4,	pack_14_18},
-	{"ultrix",	MTREE_DEVICE_ULTRIX,	pack_8_8},
+	[MTREE_DEVICE_386BSD]	= { "386bsd",	pack_8_8 },
+	[MTREE_DEVICE_4BSD]	= { "4bsd",	pack_8_8 },
+	[MTREE_DEVICE_BSDOS]	= { "bsdos",	pack_bsdos },
+	[MTREE_DEVICE_FREEBSD]	= { "freebsd",	pack_freebsd },
+	[MTREE_DEVICE_HPUX]	= { "hpux",	pack_8_24 },
+	[MTREE_DEVICE_ISC]	= { "isc",	pack_8_8 },
+	[MTREE_DEVICE_LINUX]	= { "linux",	pack_8_8 },
+	[MTREE_DEVICE_NATIVE]	= { "native",	pack_native },
+	[MTREE_DEVICE_NETBSD]	= { "netbsd",	pack_netbsd },
+	[MTREE_DEVICE_OSF1]	= { "osf1",	pack_12_20 },
+	[MTREE_DEVICE_SCO]	= { "sco",	pack_8_8 },
+	[MTREE_DEVICE_SOLARIS]	= { "solaris",	pack_14_18 },
+	[MTREE_DEVICE_SUNOS]	= { "sunos",	pack_8_8 },
+	[MTREE_DEVICE_SVR3]	= { "svr3",	pack_8_8 },
+	[MTREE_DEVICE_SVR4]	= { "svr4",	pack_14_18 },
+	[MTREE_DEVICE_ULTRIX]	= { "ultrix",	pack_8_8 },
 };
 
-static int
-compare_format(const void *key, const void *format)
+/*
+ * Find the format with the name given by `len' characters of `s'.
+ *
+ * The names are told apart by their first character and length, a single
+ * comparison then rejects unknown names. Add new names of formats[] here as
+ * well.
+ */
+#define FORMAT(name, format)						\
+	if (NAME_IS(s, len, name))					\
+		return (&formats[format])
+
+static const struct format *
+find_format(const char *s, size_t len)
 {
 
-	return (strcmp((const char *)key, ((struct format *)format)->name));
+	if (len == 0)
+		return (NULL);
+	switch (s[0]) {
+	case '3':
+		FORMAT("386bsd", MTREE_DEVICE_386BSD);
+		break;
+	case '4':
+		FORMAT("4bsd", MTREE_DEVICE_4BSD);
+		break;
+	case 'b':
+		FORMAT("bsdos", MTREE_DEVICE_BSDOS);
+		break;
+	case 'f':
+		FORMAT("freebsd", MTREE_DEVICE_FREEBSD);
+		break;
+	case 'h':
+		FORMAT("hpux", MTREE_DEVICE_HPUX);
+		break;
+	case 'i':
+		FORMAT("isc", MTREE_DEVICE_ISC);
+		break;
+	case 'l':
+		FORMAT("linux", MTREE_DEVICE_LINUX);
+		break;
+	case 'n':
+		FORMAT("native", MTREE_DEVICE_NATIVE);
+		FORMAT("netbsd", MTREE_DEVICE_NETBSD);
+		break;
+	case 'o':
+		FORMAT("osf1", MTREE_DEVICE_OSF1);
+		break;
+	case 's':
+		FORMAT("sco", MTREE_DEVICE_SCO);
+		FORMAT("solaris", MTREE_DEVICE_SOLARIS);
+		FORMAT("sunos", MTREE_DEVICE_SUNOS);
+		FORMAT("svr3", MTREE_DEVICE_SVR3);
+		FORMAT("svr4", MTREE_DEVICE_SVR4);
+		break;
+	case 'u':
+		FORMAT("ultrix", MTREE_DEVICE_ULTRIX);
+		break;
+	}
+	return (NULL);
 }
 
+#undef FORMAT
+
 /*
  * Convert mtree_device to a string that can be used with the "device" and
  * "resdevice" keywords.
@@ -646,13 +699,12 @@ mtree_device_string(struct mtree_device *dev)
 int
 mtree_device_parse(struct mtree_device *dev, const char *s)
 {
-	struct format	*format;
-	const char	*endptr;
-	char		*name;
-	char		*sep;
-	long		 numbers[3];
-	dev_t		 number;
-	int		 n;
+	const struct format	*format;
+	const char		*endptr;
+	char			*sep;
+	long			 numbers[3];
+	dev_t			 number;
+	int			 n;
 
 	assert(dev != NULL);
 	assert(s != NULL);
@@ -668,21 +720,12 @@ mtree_device_parse(struct mtree_device *dev, const char *s)
 		 * If there is a comma in the string, the first part must
 		 * include the name of the format.
 		 */
-		name = strndup(s, sep - s);
-		if (name == NULL) {
-			set_error(dev, errno, NULL);
-			return (-1);
-		}
-		format = bsearch(name, formats,
-		    __arraycount(formats),
-		    sizeof(formats[0]), compare_format);
+		format = find_format(s, sep - s);
 		if (format == NULL) {
-			set_error(dev, EINVAL, "Unsupported device format `%s'",
-			    name);
-			free(name);
+			set_error(dev, EINVAL, "Unsupported device format `%.*s'",
+			    (int)(sep - s), s);
 			return (-1);
 		}
-		free(name);
 		/*
 		 * The format name is followed by 2-3 numbers, consecutive
 		 * and trailing commas are ignored.
@@ -694,8 +737,10 @@ mtree_device_parse(struct mtree_device *dev, const char *s)
 			if (*s == '\0')
 				break;
 			numbers[n] = (long)mtree_atol(s, &endptr);
-			if (*endptr == '\0')
+			if (*endptr == '\0') {
+				n++;
 				break;
+			}
 			if (*endptr == ',') {
 				s = endptr;
 				continue;
@@ -734,7 +779,7 @@ mtree_device_parse(struct mtree_device *dev, const char *s)
 			}
 			return (-1);
 		}
-		dev->format = format->format;
+		dev->format = (mtree_device_format)(format - formats);
 	} else {
 		/*
 		 * No comma, use the value as device number.
@@ -39,6 +39,7 @@
 
 #include "mtree.h"
 #include "mtree_file.h"
+#include "mtree_private.h"
 
 /*
  * Sizes of resulting byte arrays for various digest types.
@@ -54,39 +55,54 @@
 /* =========================================================================
  * MD5
  * ========================================================================= */
-#if defined(HAVE_MD5_H)
+#if defined(HAVE_BUILTIN_DIGESTS)
+#  define MTREE_MD5_INIT(ctxp)			mtree_md5_init(ctxp)
+#  define MTREE_MD5_UPDATE(ctxp, data, len)	mtree_md_update(ctxp, data, len)
+#  define MTREE_MD5_FINAL(ctxp, out)		mtree_md5_final(ctxp, out)
+#  define MTREE_MD5_BACKEND			mtree_md_get_backend(MTREE_DIGEST_MD5)
+#elif defined(HAVE_MD5_H)
 #  include <md5.h>
 #  define MTREE_MD5_INIT(ctxp)			MD5Init(ctxp)
 #  define MTREE_MD5_FILE(path)			MD5File(path, NULL)
 #  define MTREE_MD5_UPDATE(ctxp, data, len)	MD5Update(ctxp, data, len)
 #  define MTREE_MD5_FINAL(ctxp, out)		MD5Final(out, ctxp)
+#  define MTREE_MD5_BACKEND			"system"
 #elif defined(HAVE_NETTLE)
 #  include <nettle/md5.h>
 #  define MTREE_MD5_INIT(ctxp)			md5_init(ctxp)
 #  define MTREE_MD5_UPDATE(ctxp, data, len)	md5_update(ctxp, len, data)
 #  define MTREE_MD5_FINAL(ctxp, out)		md5_digest(ctxp, DIGEST_SIZE_MD5, out)
+#  define MTREE_MD5_BACKEND			"nettle"
 #endif
 
 /* =========================================================================
  * SHA1
  * ========================================================================= */
-#if defined(HAVE_SHA_H)
+#if defined(HAVE_BUILTIN_DIGESTS)
+#  define MTREE_SHA1_INIT(ctxp)			mtree_sha1_init(ctxp)
+#  define MTREE_SHA1_UPDATE(ctxp, data, len)	mtree_md_update(ctxp, data, len)
+#  define MTREE_SHA1_FINAL(ctxp, out)		mtree_sha1_final(ctxp, out)
+#  define MTREE_SHA1_BACKEND			mtree_md_get_backend(MTREE_DIGEST_SHA1)
+#elif defined(HAVE_SHA_H)
 #  include <sha.h>
 #  define MTREE_SHA1_INIT(ctxp)			SHA_Init(ctxp)
 #  define MTREE_SHA1_FILE(path)			SHA_File(path, NULL)
 #  define MTREE_SHA1_UPDATE(ctxp, data, len)	SHA_Update(ctxp, data, len)
 #  define MTREE_SHA1_FINAL(ctxp, out)		SHA_Final(out, ctxp)
+#  define MTREE_SHA1_BACKEND			"system"
 #elif defined(HAVE_SHA1_H)
 #  include <sha1.h>
 #  define MTREE_SHA1_INIT(ctxp)			SHA1Init(ctxp)
 #  define MTREE_SHA1_FILE(path)			SHA1File(path, NULL)
 #  define MTREE_SHA1_UPDATE(ctxp, data, len)	SHA1Update(ctxp, data, len)
 #  define MTREE_SHA1_FINAL(ctxp, out)		SHA1Final(out, ctxp)
+#  define MTREE_SHA1_BACKEND			"system"
 #elif defined(HAVE_NETTLE)
 #  include <nettle/sha1.h>
 #  define MTREE_SHA1_INIT(ctxp)			sha1_init(ctxp)
 #  define MTREE_SHA1_UPDATE(ctxp, data, len)	sha1_update(ctxp, len, data)
 #  define MTREE_SHA1_FINAL(ctxp, out)		sha1_digest(ctxp, DIGEST_SIZE_SHA1, out)
+#  define MTREE_SHA1_BACKEND			"nettle"
 #endif
 
 /* =========================================================================
@@ -116,21 +132,30 @@
 #  define MTREE_SHA384_FILE(path)		SHA384_File(path, NULL)
 #  define MTREE_SHA384_UPDATE(ctxp, data, len)	SHA384_Update(ctxp, data, len)
 #  define MTREE_SHA384_FINAL(ctxp, out)		SHA384_Final(out, ctxp)
+#  define MTREE_SHA384_BACKEND			"system"
 #elif defined(HAVE_NETTLE)
 #  define MTREE_SHA384_INIT(ctxp)		sha384_init(ctxp)
 #  define MTREE_SHA384_UPDATE(ctxp, data, len)	sha384_update(ctxp, len, data)
 #  define MTREE_SHA384_FINAL(ctxp, out)		sha384_digest(ctxp, DIGEST_SIZE_SHA384, out)
+#  define MTREE_SHA384_BACKEND			"nettle"
 #endif
 
-#if defined(HAVE_SHA2_H) || defined(HAVE_SHA256_H)
+#if defined(HAVE_BUILTIN_DIGESTS)
+#  define MTREE_SHA256_INIT(ctxp)		mtree_sha256_init(ctxp)
+#  define MTREE_SHA256_UPDATE(ctxp, data, len)	mtree_md_update(ctxp, data, len)
+#  define MTREE_SHA256_FINAL(ctxp, out)		mtree_sha256_final(ctxp, out)
+#  define MTREE_SHA256_BACKEND			mtree_md_get_backend(MTREE_DIGEST_SHA256)
+#elif defined(HAVE_SHA2_H) || defined(HAVE_SHA256_H)
 #  define MTREE_SHA256_INIT(ctxp)		SHA256_Init(ctxp)
 #  define MTREE_SHA256_FILE(path)		SHA256_File(path, NULL)
 #  define MTREE_SHA256_UPDATE(ctxp, data, len)	SHA256_Update(ctxp, data, len)
 #  define MTREE_SHA256_FINAL(ctxp, out)		SHA256_Final(out, ctxp)
+#  define MTREE_SHA256_BACKEND			"system"
 #elif defined(HAVE_NETTLE)
 #  define MTREE_SHA256_INIT(ctxp)		sha256_init(ctxp)
 #  define MTREE_SHA256_UPDATE(ctxp, data, len)	sha256_update(ctxp, len, data)
 #  define MTREE_SHA256_FINAL(ctxp, out)		sha256_digest(ctxp, DIGEST_SIZE_SHA256, out)
+#  define MTREE_SHA256_BACKEND			"nettle"
 #endif
 
 #if defined(HAVE_SHA2_H) || defined(HAVE_SHA512_H)
@@ -138,10 +163,12 @@
 #  define MTREE_SHA512_FILE(path)		SHA512_File(path, NULL)
 #  define MTREE_SHA512_UPDATE(ctxp, data, len)	SHA512_Update(ctxp, data, len)
 #  define MTREE_SHA512_FINAL(ctxp, out)		SHA512_Final(out, ctxp)
+#  define MTREE_SHA512_BACKEND			"system"
 #elif defined(HAVE_NETTLE)
 #  define MTREE_SHA512_INIT(ctxp)		sha512_init(ctxp)
 #  define MTREE_SHA512_UPDATE(ctxp, data, len)	sha512_update(ctxp, len, data)
 #  define MTREE_SHA512_FINAL(ctxp, out)		sha512_digest(ctxp, DIGEST_SIZE_SHA512, out)
+#  define MTREE_SHA512_BACKEND			"nettle"
 #endif
 
 /* =========================================================================
@@ -153,17 +180,20 @@
 #  define MTREE_RMD160_FILE(path)		RIPEMD160_File(path, NULL)
 #  define MTREE_RMD160_UPDATE(ctxp, data, len)	RIPEMD160_Update(ctxp, data, len)
 #  define MTREE_RMD160_FINAL(ctxp, out)		RIPEMD160_Final(out, ctxp)
+#  define MTREE_RMD160_BACKEND			"system"
 #elif defined(HAVE_RMD160_H)
 #  include <rmd160.h>
 #  define MTREE_RMD160_INIT(ctxp)		RMD160Init(ctxp)
 #  define MTREE_RMD160_FILE(path)		RMD160File(path, NULL)
 #  define MTREE_RMD160_UPDATE(ctxp, data, len)	RMD160Update(ctxp, data, len)
 #  define MTREE_RMD160_FINAL(ctxp, out)		RMD160Final(out, ctxp)
+#  define MTREE_RMD160_BACKEND			"system"
 #elif defined(HAVE_NETTLE)
 #  include <nettle/ripemd160.h>
 #  define MTREE_RMD160_INIT(ctxp)		ripemd160_init(ctxp)
 #  define MTREE_RMD160_UPDATE(ctxp, data, len)	ripemd160_update(ctxp, len, data)
 #  define MTREE_RMD160_FINAL(ctxp, out)		ripemd160_digest(ctxp, DIGEST_SIZE_RMD160, out)
+#  define MTREE_RMD160_BACKEND			"nettle"
 #endif
 
 /*
@@ -171,30 +201,44 @@
  */
 struct mtree_digest {
 	int				 types;
-	int				 done;
+	int				 done;		/* finished types */
 	struct {
-		char			 *md5;
-		char			 *sha1;
-		char			 *sha256;
-		char			 *sha384;
-		char			 *sha512;
-		char			 *rmd160;
+		unsigned char		 md5[DIGEST_SIZE_MD5];
+		unsigned char		 sha1[DIGEST_SIZE_SHA1];
+		unsigned char		 sha256[DIGEST_SIZE_SHA256];
+		unsigned char		 sha384[DIGEST_SIZE_SHA384];
+		unsigned char		 sha512[DIGEST_SIZE_SHA512];
+		unsigned char		 rmd160[DIGEST_SIZE_RMD160];
 	} result;
+	struct {
+		char			 md5[2 * DIGEST_SIZE_MD5 + 1];
+		char			 sha1[2 * DIGEST_SIZE_SHA1 + 1];
+		char			 sha256[2 * DIGEST_SIZE_SHA256 + 1];
+		char			 sha384[2 * DIGEST_SIZE_SHA384 + 1];
+		char			 sha512[2 * DIGEST_SIZE_SHA512 + 1];
+		char			 rmd160[2 * DIGEST_SIZE_RMD160 + 1];
+	} hex;
 
 	struct {
-#if defined(HAVE_MD5_H)
+#if defined(HAVE_BUILTIN_DIGESTS)
+		struct mtree_md_ctx	 md5;
+#elif defined(HAVE_MD5_H)
 		MD5_CTX			 md5;
 #elif defined(HAVE_NETTLE)
 		struct md5_ctx		 md5;
 #endif
-#if defined(HAVE_SHA_H)
+#if defined(HAVE_BUILTIN_DIGESTS)
+		struct mtree_md_ctx	 sha1;
+#elif defined(HAVE_SHA_H)
 		SHA_CTX			 sha1;
 #elif defined(HAVE_SHA1_H)
 		SHA1_CTX		 sha1;
 #elif defined(HAVE_NETTLE)
 		struct sha1_ctx		 sha1;
 #endif
-#if defined(HAVE_SHA2_H) || defined(HAVE_SHA256_H)
+#if defined(HAVE_BUILTIN_DIGESTS)
+		struct mtree_md_ctx	 sha256;
+#elif defined(HAVE_SHA2_H) || defined(HAVE_SHA256_H)
 		SHA256_CTX		 sha256;
 #elif defined(HAVE_NETTLE)
 		struct sha256_ctx	 sha256;
@@ -282,24 +326,6 @@ mtree_digest_free(struct mtree_digest *digest)
 
 	assert(digest != NULL);
 
-#ifdef MTREE_MD5_INIT
-	free(digest->result.md5);
-#endif
-#ifdef MTREE_SHA1_INIT
-	free(digest->result.sha1);
-#endif
-#ifdef MTREE_SHA256_INIT
-	free(digest->result.sha256);
-#endif
-#ifdef MTREE_SHA384_INIT
-	free(digest->result.sha384);
-#endif
-#ifdef MTREE_SHA512_INIT
-	free(digest->result.sha512);
-#endif
-#ifdef MTREE_RMD160_INIT
-	free(digest->result.rmd160);
-#endif
 	free(digest);
 }
 
@@ -312,30 +338,7 @@ mtree_digest_reset(struct mtree_digest *digest)
 
 	assert(digest != NULL);
 
-#ifdef MTREE_MD5_INIT
-	free(digest->result.md5);
-	digest->result.md5 = NULL;
-#endif
-#ifdef MTREE_SHA1_INIT
-	free(digest->result.sha1);
-	digest->result.sha1 = NULL;
-#endif
-#ifdef MTREE_SHA256_INIT
-	free(digest->result.sha256);
-	digest->result.sha256 = NULL;
-#endif
-#ifdef MTREE_SHA384_INIT
-	free(digest->result.sha384);
-	digest->result.sha384 = NULL;
-#endif
-#ifdef MTREE_SHA512_INIT
-	free(digest->result.sha512);
-	digest->result.sha512 = NULL;
-#endif
-#ifdef MTREE_RMD160_INIT
-	free(digest->result.rmd160);
-	digest->result.rmd160 = NULL;
-#endif
+	digest->done = 0;
 	digest_init(digest);
 }
 
@@ -380,6 +383,44 @@ mtree_digest_get_available_types(void)
 	return (types);
 }
 
+/*
+ * Get the name of the implementation used to calculate the given digest type.
+ */
+const char *
+mtree_digest_get_backend(int type)
+{
+
+	switch (type) {
+#ifdef MTREE_MD5_BACKEND
+	case MTREE_DIGEST_MD5:
+		return (MTREE_MD5_BACKEND);
+#endif
+#ifdef MTREE_SHA1_BACKEND
+	case MTREE_DIGEST_SHA1:
+		return (MTREE_SHA1_BACKEND);
+#endif
+#ifdef MTREE_SHA256_BACKEND
+	case MTREE_DIGEST_SHA256:
+		return (MTREE_SHA256_BACKEND);
+#endif
+#ifdef MTREE_SHA384_BACKEND
+	case MTREE_DIGEST_SHA384:
+		return (MTREE_SHA384_BACKEND);
+#endif
+#ifdef MTREE_SHA512_BACKEND
+	case MTREE_DIGEST_SHA512:
+		return (MTREE_SHA512_BACKEND);
+#endif
+#ifdef MTREE_RMD160_BACKEND
+	case MTREE_DIGEST_RMD160:
+		return (MTREE_RMD160_BACKEND);
+#endif
+	default:
+		errno = EINVAL;
+		return (NULL);
+	}
+}
+
 /*
  * Update the digest with the given data.
  */
@@ -395,121 +436,172 @@ mtree_digest_update(struct mtree_digest *digest, const unsigned char *data,
 
 	assert(data != NULL);
 #ifdef MTREE_MD5_UPDATE
-	if (digest->types & MTREE_DIGEST_MD5 &&
-	    digest->result.md5 == NULL)
+	if ((digest->types & ~digest->done) & MTREE_DIGEST_MD5)
 		MTREE_MD5_UPDATE(&digest->ctx.md5, data, len);
 #endif
 #ifdef MTREE_SHA1_UPDATE
-	if (digest->types & MTREE_DIGEST_SHA1 &&
-	    digest->result.sha1 == NULL)
+	if ((digest->types & ~digest->done) & MTREE_DIGEST_SHA1)
 		MTREE_SHA1_UPDATE(&digest->ctx.sha1, data, len);
 #endif
 #ifdef MTREE_SHA256_UPDATE
-	if (digest->types & MTREE_DIGEST_SHA256 &&
-	    digest->result.sha256 == NULL)
+	if ((digest->types & ~digest->done) & MTREE_DIGEST_SHA256)
 		MTREE_SHA256_UPDATE(&digest->ctx.sha256, data, len);
 #endif
 #ifdef MTREE_SHA384_UPDATE
-	if (digest->types & MTREE_DIGEST_SHA384 &&
-	    digest->result.sha384 == NULL)
+	if ((digest->types & ~digest->done) & MTREE_DIGEST_SHA384)
 		MTREE_SHA384_UPDATE(&digest->ctx.sha384, data, len);
 #endif
 #ifdef MTREE_SHA512_UPDATE
-	if (digest->types & MTREE_DIGEST_SHA512 &&
-	    digest->result.sha512 == NULL)
+	if ((digest->types & ~digest->done) & MTREE_DIGEST_SHA512)
 		MTREE_SHA512_UPDATE(&digest->ctx.sha512, data, len);
 #endif
 #ifdef MTREE_RMD160_UPDATE
-	if (digest->types & MTREE_DIGEST_RMD160 &&
-	    digest->result.rmd160 == NULL)
+	if ((digest->types & ~digest->done) & MTREE_DIGEST_RMD160)
 		MTREE_RMD160_UPDATE(&digest->ctx.rmd160, data, len);
 #endif
 }
 
 /*
- * Convert the byte sequence to a string of hexadecimal numbers.
+ * Get the size in bytes of the given digest type, 0 for an unknown type.
+ */
+size_t
+mtree_digest_get_size(int type)
+{
+
+	switch (type) {
+	case MTREE_DIGEST_MD5:
+		return (DIGEST_SIZE_MD5);
+	case MTREE_DIGEST_SHA1:
+		return (DIGEST_SIZE_SHA1);
+	case MTREE_DIGEST_SHA256:
+		return (DIGEST_SIZE_SHA256);
+	case MTREE_DIGEST_SHA384:
+		return (DIGEST_SIZE_SHA384);
+	case MTREE_DIGEST_SHA512:
+		return (DIGEST_SIZE_SHA512);
+	case MTREE_DIGEST_RMD160:
+		return (DIGEST_SIZE_RMD160);
+	default:
+		return (0);
+	}
+}
+
+/*
+ * Convert the byte sequence to a string of hexadecimal numbers, `s' must
+ * have room for 2 * len + 1 characters.
  */
-static char *
-digest_result(unsigned char *digest, size_t len)
+void
+mtree_digest_to_hex(const unsigned char *bytes, size_t len, char *s)
 {
 	static const char hex[] = "0123456789abcdef";
-	char	*s;
-	size_t	 i;
-
-	s = malloc(2 * len + 1);
-	if (s != NULL) {
-		for (i = 0; i < len; i++) {
-			s[i + i] = hex[digest[i] >> 4];
-			s[i + i + 1] = hex[digest[i] & 0x0F];
-		}
-		s[i + i] = '\0';
+	size_t	i;
+
+	for (i = 0; i < len; i++) {
+		s[i + i] = hex[bytes[i] >> 4];
+		s[i + i + 1] = hex[bytes[i] & 0x0F];
 	}
-	return (s);
+	s[i + i] = '\0';
+}
+
+static int
+hex_value(char c)
+{
+
+	if (c >= '0' && c <= '9')
+		return (c - '0');
+	if (c >= 'a' && c <= 'f')
+		return (c - 'a' + 10);
+	if (c >= 'A' && c <= 'F')
+		return (c - 'A' + 10);
+	return (-1);
 }
 
 /*
- * Get the resulting digest of the given type.
+ * Convert a string of exactly 2 * len hexadecimal numbers to bytes.
+ *
+ * Returns -1 and sets errno to EINVAL if the string is not valid.
  */
-const char *
-mtree_digest_get_result(struct mtree_digest *digest, int type)
+int
+mtree_digest_from_hex(const char *s, unsigned char *bytes, size_t len)
+{
+	size_t	i;
+	int	hi, lo;
+
+	for (i = 0; i < len; i++) {
+		hi = hex_value(s[i + i]);
+		if (hi == -1)
+			break;
+		lo = hex_value(s[i + i + 1]);
+		if (lo == -1)
+			break;
+		bytes[i] = (unsigned char)(hi << 4 | lo);
+	}
+	if (i < len || s[i + i] != '\0') {
+		errno = EINVAL;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Get the resulting digest of the given type as an array of
+ * mtree_digest_get_size() bytes.
+ */
+const unsigned char *
+mtree_digest_get_bytes(struct mtree_digest *digest, int type)
 {
-	unsigned char bytes[DIGEST_SIZE_MAX];
 
 	assert(digest != NULL);
 
+	if ((digest->types & type) == 0 || (type & (type - 1)) != 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
 	switch (type) {
 #ifdef MTREE_MD5_FINAL
 	case MTREE_DIGEST_MD5:
-		if (digest->result.md5 == NULL) {
-			MTREE_MD5_FINAL(&digest->ctx.md5, bytes);
-			digest->result.md5 = digest_result(bytes,
-			    DIGEST_SIZE_MD5);
-		}
+		if ((digest->done & type) == 0)
+			MTREE_MD5_FINAL(&digest->ctx.md5, digest->result.md5);
+		digest->done |= type;
 		return (digest->result.md5);
 #endif
 #ifdef MTREE_SHA1_FINAL
 	case MTREE_DIGEST_SHA1:
-		if (digest->result.sha1 == NULL) {
-			MTREE_SHA1_FINAL(&digest->ctx.sha1, bytes);
-			digest->result.sha1 = digest_result(bytes,
-			    DIGEST_SIZE_SHA1);
-		}
+		if ((digest->done & type) == 0)
+			MTREE_SHA1_FINAL(&digest->ctx.sha1, digest->result.sha1);
+		digest->done |= type;
 		return (digest->result.sha1);
 #endif
 #ifdef MTREE_SHA256_FINAL
 	case MTREE_DIGEST_SHA256:
-		if (digest->result.sha256 == NULL) {
-			MTREE_SHA256_FINAL(&digest->ctx.sha256, bytes);
-			digest->result.sha256 = digest_result(bytes,
-			    DIGEST_SIZE_SHA256);
-		}
+		if ((digest->done & type) == 0)
+			MTREE_SHA256_FINAL(&digest->ctx.sha256,
+			    digest->result.sha256);
+		digest->done |= type;
 		return (digest->result.sha256);
 #endif
 #ifdef MTREE_SHA384_FINAL
 	case MTREE_DIGEST_SHA384:
-		if (digest->result.sha384 == NULL) {
-			MTREE_SHA384_FINAL(&digest->ctx.sha384, bytes);
-			digest->result.sha384 = digest_result(bytes,
-			    DIGEST_SIZE_SHA384);
-		}
+		if ((digest->done & type) == 0)
+			MTREE_SHA384_FINAL(&digest->ctx.sha384,
+			    digest->result.sha384);
+		digest->done |= type;
 		return (digest->result.sha384);
 #endif
 #ifdef MTREE_SHA512_FINAL
 	case MTREE_DIGEST_SHA512:
-		if (digest->result.sha512 == NULL) {
-			MTREE_SHA512_FINAL(&digest->ctx.sha512, bytes);
-			digest->result.sha512 = digest_result(bytes,
-			    DIGEST_SIZE_SHA512);
-		}
+		if ((digest->done & type) == 0)
+			MTREE_SHA512_FINAL(&digest->ctx.sha512,
+			    digest->result.sha512);
+		digest->done |= type;
 		return (digest->result.sha512);
 #endif
 #ifdef MTREE_RMD160_FINAL
 	case MTREE_DIGEST_RMD160:
-		if (digest->result.rmd160 == NULL) {
-			MTREE_RMD160_FINAL(&digest->ctx.rmd160, bytes);
-			digest->result.rmd160 = digest_result(bytes,
-			    DIGEST_SIZE_RMD160);
-		}
+		if ((digest->done & type) == 0)
+			MTREE_RMD160_FINAL(&digest->ctx.rmd160,
+			    digest->result.rmd160);
+		digest->done |= type;
 		return (digest->result.rmd160);
 #endif
 	default:
@@ -518,6 +610,51 @@ mtree_digest_get_result(struct mtree_digest *digest, int type)
 	}
 }
 
+/*
+ * Get the resulting digest of the given type.
+ */
+const char *
+mtree_digest_get_result(struct mtree_digest *digest, int type)
+{
+	const unsigned char	*bytes;
+	char			*s;
+
+	assert(digest != NULL);
+
+	bytes = mtree_digest_get_bytes(digest, type);
+	if (bytes == NULL)
+		return (NULL);
+	switch (type) {
+	case MTREE_DIGEST_MD5:
+		s = digest->hex.md5;
+		break;
+	case MTREE_DIGEST_SHA1:
+		s = digest->hex.sha1;
+		break;
+	case MTREE_DIGEST_SHA256:
+		s = digest->hex.sha256;
+		break;
+	case MTREE_DIGEST_SHA384:
+		s = digest->hex.sha384;
+		break;
+	case MTREE_DIGEST_SHA512:
+		s = digest->hex.sha512;
+		break;
+	default:
+		s = digest->hex.rmd160;
+		break;
+	}
+	mtree_digest_to_hex(bytes, mtree_digest_get_size(type), s);
+	return (s);
+}
+
+static void
+update_digest(const unsigned char *buf, size_t len, void *user_data)
+{
+
+	mtree_digest_update(user_data, buf, len);
+}
+
 /*
  * Calculate digest of bytes read from the given file descriptor.
  */
@@ -525,9 +662,7 @@ char *
 mtree_digest_fd(int type, int fd)
 {
 	struct mtree_digest	*digest;
-	unsigned char		 buf[16 * 1024];
 	char			*result;
-	int			 n;
 
 	/*
 	 * Make sure the requested type is available and that only one
@@ -543,11 +678,8 @@ mtree_digest_fd(int type, int fd)
 	if (digest == NULL)
 		return (NULL);
 
-	while ((n = read(fd, buf, sizeof(buf))) > 0)
-		mtree_digest_update(digest, buf, n);
-
 	result = NULL;
-	if (n == 0) {
+	if (mtree_io_read_fd(fd, 0, NULL, update_digest, NULL, digest) == 0) {
 		const char *r;
 
 		r = mtree_digest_get_result(digest, type);
@@ -638,3 +770,33 @@ mtree_digest_path(int type, const char *path)
 	}
 	return (result);
 }
+
+/*
+ * Calculate digest of bytes read from the given file path, which is relative
+ * to the directory `dirfd'.
+ */
+char *
+mtree_digest_path_at(int type, int dirfd, const char *path)
+{
+	char	*result;
+	int	 fd;
+
+	assert(path != NULL);
+
+	if (dirfd == AT_FDCWD)
+		return (mtree_digest_path(type, path));
+
+	result = NULL;
+	fd = mtree_open_at(dirfd, path, O_RDONLY);
+	if (fd != -1) {
+		result = mtree_digest_fd(type, fd);
+		if (result == NULL) {
+			int err = errno;
+
+			close(fd);
+			errno = err;
+		} else
+			close(fd);
+	}
+	return (result);
+}
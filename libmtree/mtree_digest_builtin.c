@@ -0,0 +1,705 @@
+/*-
+ * Copyright (c) 2015 Michal Ratajsky <michal@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "mtree.h"
+#include "mtree_private.h"
+
+#ifdef HAVE_BUILTIN_DIGESTS
+/*
+ * Built-in implementations of MD5, SHA1 and SHA256.
+ *
+ * SHA1 and SHA256 use the SHA extensions of x86 processors when they are
+ * available, which is checked once at run time. Otherwise portable code
+ * is used.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MD_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define ROTL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+typedef void (*md_block_fn)(uint32_t *, const unsigned char *, size_t);
+
+static const uint32_t md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+	0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+	0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+	0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+	0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+	0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+	0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+	0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+	0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t
+load_be32(const unsigned char *p)
+{
+
+	return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | (uint32_t)p[3]);
+}
+
+static inline uint32_t
+load_le32(const unsigned char *p)
+{
+
+	return ((uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 |
+	    (uint32_t)p[1] << 8 | (uint32_t)p[0]);
+}
+
+/* =========================================================================
+ * Portable code
+ * ========================================================================= */
+#define MD5_F(b, c, d)	((((c) ^ (d)) & (b)) ^ (d))
+#define MD5_G(b, c, d)	((((b) ^ (c)) & (d)) ^ (c))
+#define MD5_H(b, c, d)	((b) ^ (c) ^ (d))
+#define MD5_I(b, c, d)	((c) ^ ((b) | ~(d)))
+
+#define MD5_STEP(f, a, b, c, d, i, g, s) do {				\
+	a += f(b, c, d) + w[g] + md5_k[i];				\
+	a = ROTL(a, s) + b;						\
+} while (0)
+
+#define MD5_ROUND(f, i, g0, g1, g2, g3, s0, s1, s2, s3) do {		\
+	MD5_STEP(f, a, b, c, d, (i), g0, s0);				\
+	MD5_STEP(f, d, a, b, c, (i) + 1, g1, s1);			\
+	MD5_STEP(f, c, d, a, b, (i) + 2, g2, s2);			\
+	MD5_STEP(f, b, c, d, a, (i) + 3, g3, s3);			\
+} while (0)
+
+static void
+md5_block(uint32_t *state, const unsigned char *p, size_t blocks)
+{
+	uint32_t	w[16];
+	uint32_t	a, b, c, d;
+	int		i;
+
+	for (; blocks > 0; blocks--, p += 64) {
+		for (i = 0; i < 16; i++)
+			w[i] = load_le32(p + i * 4);
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+		MD5_ROUND(MD5_F,  0,  0,  1,  2,  3, 7, 12, 17, 22);
+		MD5_ROUND(MD5_F,  4,  4,  5,  6,  7, 7, 12, 17, 22);
+		MD5_ROUND(MD5_F,  8,  8,  9, 10, 11, 7, 12, 17, 22);
+		MD5_ROUND(MD5_F, 12, 12, 13, 14, 15, 7, 12, 17, 22);
+		MD5_ROUND(MD5_G, 16,  1,  6, 11,  0, 5,  9, 14, 20);
+		MD5_ROUND(MD5_G, 20,  5, 10, 15,  4, 5,  9, 14, 20);
+		MD5_ROUND(MD5_G, 24,  9, 14,  3,  8, 5,  9, 14, 20);
+		MD5_ROUND(MD5_G, 28, 13,  2,  7, 12, 5,  9, 14, 20);
+		MD5_ROUND(MD5_H, 32,  5,  8, 11, 14, 4, 11, 16, 23);
+		MD5_ROUND(MD5_H, 36,  1,  4,  7, 10, 4, 11, 16, 23);
+		MD5_ROUND(MD5_H, 40, 13,  0,  3,  6, 4, 11, 16, 23);
+		MD5_ROUND(MD5_H, 44,  9, 12, 15,  2, 4, 11, 16, 23);
+		MD5_ROUND(MD5_I, 48,  0,  7, 14,  5, 6, 10, 15, 21);
+		MD5_ROUND(MD5_I, 52, 12,  3, 10,  1, 6, 10, 15, 21);
+		MD5_ROUND(MD5_I, 56,  8, 15,  6, 13, 6, 10, 15, 21);
+		MD5_ROUND(MD5_I, 60,  4, 11,  2,  9, 6, 10, 15, 21);
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+	}
+}
+
+#define SHA1_STEP(f, k, a, b, c, d, e, i) do {				\
+	if ((i) >= 16)							\
+		w[(i) & 15] = ROTL(w[((i) + 13) & 15] ^		\
+		    w[((i) + 8) & 15] ^ w[((i) + 2) & 15] ^ w[(i) & 15], 1); \
+	e += ROTL(a, 5) + (f) + (k) + w[(i) & 15];			\
+	b = ROTL(b, 30);						\
+} while (0)
+
+#define SHA1_CH(b, c, d)	((((c) ^ (d)) & (b)) ^ (d))
+#define SHA1_PARITY(b, c, d)	((b) ^ (c) ^ (d))
+#define SHA1_MAJ(b, c, d)	(((b) & (c)) | (((b) | (c)) & (d)))
+
+#define SHA1_ROUNDS(f, k, i) do {					\
+	SHA1_STEP(f(b, c, d), k, a, b, c, d, e, (i));			\
+	SHA1_STEP(f(a, b, c), k, e, a, b, c, d, (i) + 1);		\
+	SHA1_STEP(f(e, a, b), k, d, e, a, b, c, (i) + 2);		\
+	SHA1_STEP(f(d, e, a), k, c, d, e, a, b, (i) + 3);		\
+	SHA1_STEP(f(c, d, e), k, b, c, d, e, a, (i) + 4);		\
+} while (0)
+
+static void
+sha1_block(uint32_t *state, const unsigned char *p, size_t blocks)
+{
+	uint32_t	w[16];
+	uint32_t	a, b, c, d, e;
+	int		i;
+
+	for (; blocks > 0; blocks--, p += 64) {
+		for (i = 0; i < 16; i++)
+			w[i] = load_be32(p + i * 4);
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+		e = state[4];
+		for (i = 0; i < 20; i += 5)
+			SHA1_ROUNDS(SHA1_CH, 0x5A827999, i);
+		for (i = 20; i < 40; i += 5)
+			SHA1_ROUNDS(SHA1_PARITY, 0x6ED9EBA1, i);
+		for (i = 40; i < 60; i += 5)
+			SHA1_ROUNDS(SHA1_MAJ, 0x8F1BBCDC, i);
+		for (i = 60; i < 80; i += 5)
+			SHA1_ROUNDS(SHA1_PARITY, 0xCA62C1D6, i);
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+	}
+}
+
+#define ROTR(x, n)	ROTL(x, 32 - (n))
+
+#define SHA256_STEP(a, b, c, d, e, f, g, h, i) do {			\
+	uint32_t t1, t2;						\
+									\
+	if ((i) >= 16) {						\
+		t1 = w[((i) + 1) & 15];					\
+		t2 = w[((i) + 14) & 15];				\
+		w[(i) & 15] += (ROTR(t1, 7) ^ ROTR(t1, 18) ^ (t1 >> 3)) + \
+		    w[((i) + 9) & 15] +					\
+		    (ROTR(t2, 17) ^ ROTR(t2, 19) ^ (t2 >> 10));		\
+	}								\
+	t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) +		\
+	    (((f ^ g) & e) ^ g) + sha256_k[i] + w[(i) & 15];		\
+	t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) +			\
+	    ((a & b) | ((a | b) & c));					\
+	d += t1;							\
+	h = t1 + t2;							\
+} while (0)
+
+static void
+sha256_block(uint32_t *state, const unsigned char *p, size_t blocks)
+{
+	uint32_t	w[16];
+	uint32_t	a, b, c, d, e, f, g, h;
+	int		i;
+
+	for (; blocks > 0; blocks--, p += 64) {
+		for (i = 0; i < 16; i++)
+			w[i] = load_be32(p + i * 4);
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+		e = state[4];
+		f = state[5];
+		g = state[6];
+		h = state[7];
+		for (i = 0; i < 64; i += 8) {
+			SHA256_STEP(a, b, c, d, e, f, g, h, i);
+			SHA256_STEP(h, a, b, c, d, e, f, g, i + 1);
+			SHA256_STEP(g, h, a, b, c, d, e, f, i + 2);
+			SHA256_STEP(f, g, h, a, b, c, d, e, i + 3);
+			SHA256_STEP(e, f, g, h, a, b, c, d, i + 4);
+			SHA256_STEP(d, e, f, g, h, a, b, c, i + 5);
+			SHA256_STEP(c, d, e, f, g, h, a, b, i + 6);
+			SHA256_STEP(b, c, d, e, f, g, h, a, i + 7);
+		}
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
+}
+
+#ifdef MD_X86
+/* =========================================================================
+ * SHA extensions
+ * ========================================================================= */
+#define SHA1NI_ROUNDS(e0, e1, m, f) do {				\
+	e0 = _mm_sha1nexte_epu32(e0, m);				\
+	e1 = abcd;							\
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, f);			\
+} while (0)
+
+/*
+ * Continue the message schedule, the words in `m0' are finished using `m3',
+ * which is also mixed into the words in `m1' and `m2'.
+ */
+#define SHA1NI_MSG(m0, m1, m2, m3) do {					\
+	m0 = _mm_sha1msg2_epu32(m0, m3);				\
+	m2 = _mm_sha1msg1_epu32(m2, m3);				\
+	m1 = _mm_xor_si128(m1, m3);					\
+} while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void
+sha1_block_shani(uint32_t *state, const unsigned char *p, size_t blocks)
+{
+	const __m128i	mask = _mm_set_epi64x(0x0001020304050607ULL,
+			    0x08090a0b0c0d0e0fULL);
+	__m128i		abcd, abcd_save, e0, e0_save, e1;
+	__m128i		m0, m1, m2, m3;
+
+	abcd = _mm_loadu_si128((const __m128i *)state);
+	abcd = _mm_shuffle_epi32(abcd, 0x1B);
+	e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+	for (; blocks > 0; blocks--, p += 64) {
+		abcd_save = abcd;
+		e0_save = e0;
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128(
+		    (const __m128i *)(p + 0)), mask);
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128(
+		    (const __m128i *)(p + 16)), mask);
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128(
+		    (const __m128i *)(p + 32)), mask);
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128(
+		    (const __m128i *)(p + 48)), mask);
+
+		/* Rounds 0-19 */
+		e0 = _mm_add_epi32(e0, m0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		SHA1NI_ROUNDS(e1, e0, m1, 0);
+		m0 = _mm_sha1msg1_epu32(m0, m1);
+		SHA1NI_ROUNDS(e0, e1, m2, 0);
+		m1 = _mm_sha1msg1_epu32(m1, m2);
+		m0 = _mm_xor_si128(m0, m2);
+		SHA1NI_ROUNDS(e1, e0, m3, 0);
+		SHA1NI_MSG(m0, m1, m2, m3);
+		SHA1NI_ROUNDS(e0, e1, m0, 0);
+		SHA1NI_MSG(m1, m2, m3, m0);
+		/* Rounds 20-39 */
+		SHA1NI_ROUNDS(e1, e0, m1, 1);
+		SHA1NI_MSG(m2, m3, m0, m1);
+		SHA1NI_ROUNDS(e0, e1, m2, 1);
+		SHA1NI_MSG(m3, m0, m1, m2);
+		SHA1NI_ROUNDS(e1, e0, m3, 1);
+		SHA1NI_MSG(m0, m1, m2, m3);
+		SHA1NI_ROUNDS(e0, e1, m0, 1);
+		SHA1NI_MSG(m1, m2, m3, m0);
+		SHA1NI_ROUNDS(e1, e0, m1, 1);
+		SHA1NI_MSG(m2, m3, m0, m1);
+		/* Rounds 40-59 */
+		SHA1NI_ROUNDS(e0, e1, m2, 2);
+		SHA1NI_MSG(m3, m0, m1, m2);
+		SHA1NI_ROUNDS(e1, e0, m3, 2);
+		SHA1NI_MSG(m0, m1, m2, m3);
+		SHA1NI_ROUNDS(e0, e1, m0, 2);
+		SHA1NI_MSG(m1, m2, m3, m0);
+		SHA1NI_ROUNDS(e1, e0, m1, 2);
+		SHA1NI_MSG(m2, m3, m0, m1);
+		SHA1NI_ROUNDS(e0, e1, m2, 2);
+		SHA1NI_MSG(m3, m0, m1, m2);
+		/* Rounds 60-79 */
+		SHA1NI_ROUNDS(e1, e0, m3, 3);
+		SHA1NI_MSG(m0, m1, m2, m3);
+		SHA1NI_ROUNDS(e0, e1, m0, 3);
+		SHA1NI_MSG(m1, m2, m3, m0);
+		SHA1NI_ROUNDS(e1, e0, m1, 3);
+		m2 = _mm_sha1msg2_epu32(m2, m1);
+		m3 = _mm_xor_si128(m3, m1);
+		SHA1NI_ROUNDS(e0, e1, m2, 3);
+		m3 = _mm_sha1msg2_epu32(m3, m2);
+		SHA1NI_ROUNDS(e1, e0, m3, 3);
+
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+	abcd = _mm_shuffle_epi32(abcd, 0x1B);
+	_mm_storeu_si128((__m128i *)state, abcd);
+	state[4] = _mm_extract_epi32(e0, 3);
+}
+
+#define SHA256NI_ROUNDS(m, i) do {					\
+	msg = _mm_add_epi32(m,						\
+	    _mm_loadu_si128((const __m128i *)&sha256_k[i]));		\
+	s1 = _mm_sha256rnds2_epu32(s1, s0, msg);			\
+	msg = _mm_shuffle_epi32(msg, 0x0E);				\
+	s0 = _mm_sha256rnds2_epu32(s0, s1, msg);			\
+} while (0)
+
+/*
+ * Continue the message schedule, the words in `m0' are finished using `m2'
+ * and `m3', which is also mixed into the words in `m2'.
+ */
+#define SHA256NI_MSG(m0, m1, m2, m3) do {				\
+	m0 = _mm_sha256msg2_epu32(_mm_add_epi32(m0,			\
+	    _mm_alignr_epi8(m3, m2, 4)), m3);				\
+	m2 = _mm_sha256msg1_epu32(m2, m3);				\
+} while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void
+sha256_block_shani(uint32_t *state, const unsigned char *p, size_t blocks)
+{
+	const __m128i	mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+			    0x0405060700010203ULL);
+	__m128i		s0, s1, s0_save, s1_save, msg, tmp;
+	__m128i		m0, m1, m2, m3;
+
+	tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+	s1 = _mm_loadu_si128((const __m128i *)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);		/* CDAB */
+	s1 = _mm_shuffle_epi32(s1, 0x1B);		/* EFGH */
+	s0 = _mm_alignr_epi8(tmp, s1, 8);		/* ABEF */
+	s1 = _mm_blend_epi16(s1, tmp, 0xF0);		/* CDGH */
+
+	for (; blocks > 0; blocks--, p += 64) {
+		s0_save = s0;
+		s1_save = s1;
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128(
+		    (const __m128i *)(p + 0)), mask);
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128(
+		    (const __m128i *)(p + 16)), mask);
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128(
+		    (const __m128i *)(p + 32)), mask);
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128(
+		    (const __m128i *)(p + 48)), mask);
+
+		SHA256NI_ROUNDS(m0, 0);
+		SHA256NI_ROUNDS(m1, 4);
+		m0 = _mm_sha256msg1_epu32(m0, m1);
+		SHA256NI_ROUNDS(m2, 8);
+		m1 = _mm_sha256msg1_epu32(m1, m2);
+		SHA256NI_ROUNDS(m3, 12);
+		SHA256NI_MSG(m0, m1, m2, m3);
+		SHA256NI_ROUNDS(m0, 16);
+		SHA256NI_MSG(m1, m2, m3, m0);
+		SHA256NI_ROUNDS(m1, 20);
+		SHA256NI_MSG(m2, m3, m0, m1);
+		SHA256NI_ROUNDS(m2, 24);
+		SHA256NI_MSG(m3, m0, m1, m2);
+		SHA256NI_ROUNDS(m3, 28);
+		SHA256NI_MSG(m0, m1, m2, m3);
+		SHA256NI_ROUNDS(m0, 32);
+		SHA256NI_MSG(m1, m2, m3, m0);
+		SHA256NI_ROUNDS(m1, 36);
+		SHA256NI_MSG(m2, m3, m0, m1);
+		SHA256NI_ROUNDS(m2, 40);
+		SHA256NI_MSG(m3, m0, m1, m2);
+		SHA256NI_ROUNDS(m3, 44);
+		SHA256NI_MSG(m0, m1, m2, m3);
+		SHA256NI_ROUNDS(m0, 48);
+		SHA256NI_MSG(m1, m2, m3, m0);
+		SHA256NI_ROUNDS(m1, 52);
+		m2 = _mm_sha256msg2_epu32(_mm_add_epi32(m2,
+		    _mm_alignr_epi8(m1, m0, 4)), m1);
+		SHA256NI_ROUNDS(m2, 56);
+		m3 = _mm_sha256msg2_epu32(_mm_add_epi32(m3,
+		    _mm_alignr_epi8(m2, m1, 4)), m2);
+		SHA256NI_ROUNDS(m3, 60);
+
+		s0 = _mm_add_epi32(s0, s0_save);
+		s1 = _mm_add_epi32(s1, s1_save);
+	}
+	tmp = _mm_shuffle_epi32(s0, 0x1B);		/* FEBA */
+	s1 = _mm_shuffle_epi32(s1, 0xB1);		/* DCHG */
+	s0 = _mm_blend_epi16(tmp, s1, 0xF0);		/* DCBA */
+	s1 = _mm_alignr_epi8(s1, tmp, 8);		/* HGFE */
+	_mm_storeu_si128((__m128i *)&state[0], s0);
+	_mm_storeu_si128((__m128i *)&state[4], s1);
+}
+
+/*
+ * Check whether the processor supports the SHA extensions and SSE4.1,
+ * which the code above relies on.
+ */
+static int
+have_shani(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0 ||
+	    (ecx & bit_SSE4_1) == 0 || (ecx & bit_SSSE3) == 0)
+		return (0);
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) == 0)
+		return (0);
+	return ((ebx & bit_SHA) != 0);
+}
+#endif /* MD_X86 */
+
+/*
+ * Implementations selected for the current processor.
+ */
+static struct {
+	md_block_fn	 sha1;
+	md_block_fn	 sha256;
+	const char	*sha_backend;
+} md_impl;
+
+static void
+md_impl_init(void)
+{
+
+	md_impl.sha1 = sha1_block;
+	md_impl.sha256 = sha256_block;
+	md_impl.sha_backend = "generic";
+#ifdef MD_X86
+	if (have_shani()) {
+		md_impl.sha1 = sha1_block_shani;
+		md_impl.sha256 = sha256_block_shani;
+		md_impl.sha_backend = "sha-ni";
+	}
+#endif
+}
+
+#ifdef HAVE_PTHREAD
+static pthread_once_t md_impl_once = PTHREAD_ONCE_INIT;
+#define MD_IMPL_INIT()	pthread_once(&md_impl_once, md_impl_init)
+#else
+#define MD_IMPL_INIT()	do {						\
+	if (md_impl.sha1 == NULL)					\
+		md_impl_init();						\
+} while (0)
+#endif
+
+/* =========================================================================
+ * Common code
+ * ========================================================================= */
+static void
+md_init(struct mtree_md_ctx *ctx, const uint32_t *state, int words,
+    md_block_fn block)
+{
+
+	memcpy(ctx->state, state, words * sizeof(uint32_t));
+	ctx->count = 0;
+	ctx->block = block;
+}
+
+/*
+ * Process the data in blocks of 64 bytes, incomplete block is kept in the
+ * context for the next call.
+ */
+void
+mtree_md_update(struct mtree_md_ctx *ctx, const unsigned char *data,
+    size_t len)
+{
+	size_t used, n;
+
+	assert(ctx != NULL);
+
+	used = ctx->count % 64;
+	ctx->count += len;
+	if (used > 0) {
+		n = 64 - used;
+		if (len < n) {
+			memcpy(ctx->buf + used, data, len);
+			return;
+		}
+		memcpy(ctx->buf + used, data, n);
+		ctx->block(ctx->state, ctx->buf, 1);
+		data += n;
+		len  -= n;
+	}
+	if (len >= 64) {
+		ctx->block(ctx->state, data, len / 64);
+		data += len & ~(size_t)63;
+		len  &= 63;
+	}
+	if (len > 0)
+		memcpy(ctx->buf, data, len);
+}
+
+/*
+ * Add the padding and the message length in bits, which is stored as
+ * a little endian number for MD5 and big endian for SHA.
+ */
+static void
+md_final(struct mtree_md_ctx *ctx, int le)
+{
+	uint64_t	bits;
+	size_t		used;
+	int		i;
+
+	bits = ctx->count * 8;
+	used = ctx->count % 64;
+	ctx->buf[used++] = 0x80;
+	if (used > 56) {
+		memset(ctx->buf + used, 0, 64 - used);
+		ctx->block(ctx->state, ctx->buf, 1);
+		used = 0;
+	}
+	memset(ctx->buf + used, 0, 56 - used);
+	for (i = 0; i < 8; i++)
+		ctx->buf[56 + i] = le ? bits >> (i * 8) : bits >> (56 - i * 8);
+	ctx->block(ctx->state, ctx->buf, 1);
+}
+
+static void
+md_result(const struct mtree_md_ctx *ctx, int words, int le,
+    unsigned char *out)
+{
+	int i;
+
+	for (i = 0; i < words; i++) {
+		uint32_t v = ctx->state[i];
+
+		if (le) {
+			out[i * 4]     = v;
+			out[i * 4 + 1] = v >> 8;
+			out[i * 4 + 2] = v >> 16;
+			out[i * 4 + 3] = v >> 24;
+		} else {
+			out[i * 4]     = v >> 24;
+			out[i * 4 + 1] = v >> 16;
+			out[i * 4 + 2] = v >> 8;
+			out[i * 4 + 3] = v;
+		}
+	}
+}
+
+void
+mtree_md5_init(struct mtree_md_ctx *ctx)
+{
+	static const uint32_t init[4] = {
+		0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476
+	};
+
+	assert(ctx != NULL);
+
+	md_init(ctx, init, 4, md5_block);
+}
+
+void
+mtree_md5_final(struct mtree_md_ctx *ctx, unsigned char *out)
+{
+
+	assert(ctx != NULL);
+
+	md_final(ctx, 1);
+	md_result(ctx, 4, 1, out);
+}
+
+void
+mtree_sha1_init(struct mtree_md_ctx *ctx)
+{
+	static const uint32_t init[5] = {
+		0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+	};
+
+	assert(ctx != NULL);
+
+	MD_IMPL_INIT();
+	md_init(ctx, init, 5, md_impl.sha1);
+}
+
+void
+mtree_sha1_final(struct mtree_md_ctx *ctx, unsigned char *out)
+{
+
+	assert(ctx != NULL);
+
+	md_final(ctx, 0);
+	md_result(ctx, 5, 0, out);
+}
+
+void
+mtree_sha256_init(struct mtree_md_ctx *ctx)
+{
+	static const uint32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	assert(ctx != NULL);
+
+	MD_IMPL_INIT();
+	md_init(ctx, init, 8, md_impl.sha256);
+}
+
+void
+mtree_sha256_final(struct mtree_md_ctx *ctx, unsigned char *out)
+{
+
+	assert(ctx != NULL);
+
+	md_final(ctx, 0);
+	md_result(ctx, 8, 0, out);
+}
+
+/*
+ * Get the name of the implementation used for the given digest type.
+ */
+const char *
+mtree_md_get_backend(int type)
+{
+
+	switch (type) {
+	case MTREE_DIGEST_MD5:
+		return ("generic");
+	case MTREE_DIGEST_SHA1:
+	case MTREE_DIGEST_SHA256:
+		MD_IMPL_INIT();
+		return (md_impl.sha_backend);
+	default:
+		return (NULL);
+	}
+}
+#endif /* HAVE_BUILTIN_DIGESTS */
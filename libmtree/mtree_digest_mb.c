@@ -0,0 +1,374 @@
+/*-
+ * Copyright (c) 2015 Michal Ratajsky <michal@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "mtree.h"
+#include "mtree_private.h"
+
+/*
+ * Multi-buffer hashing of small messages.
+ *
+ * Messages are hashed in vector lanes, one message per lane, which keeps
+ * all the lanes busy when there are many small files to be hashed. The
+ * implementation relies on GCC vector extensions and is compiled for 4, 8
+ * and 16 lanes. On x86 the wider variants are compiled for AVX2 and AVX-512
+ * and selected at run time when the processor supports them.
+ */
+#if defined(__GNUC__) && !defined(__clang__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define MB_X86
+#endif
+#if defined(__GNUC__)
+#define MB_ENABLED
+#endif
+
+#ifdef MB_ENABLED
+/*
+ * A message hashed in a single lane. Full blocks are read directly from
+ * the message, the remaining data and padding are stored in `tail'.
+ */
+struct mb_lane {
+	const unsigned char	*data;
+	size_t			 full;		/* number of full blocks */
+	size_t			 blocks;	/* number of all blocks */
+	unsigned char		 tail[128];
+};
+
+static const uint32_t md5_init[4] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476
+};
+
+static const uint32_t md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+	0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+	0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+	0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+	0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+	0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+	0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+	0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+	0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const int md5_r[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static const uint32_t sha1_init[5] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+static const uint32_t sha256_init[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t
+load_be32(const unsigned char *p)
+{
+
+	return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | (uint32_t)p[3]);
+}
+
+static inline uint32_t
+load_le32(const unsigned char *p)
+{
+
+	return ((uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 |
+	    (uint32_t)p[1] << 8 | (uint32_t)p[0]);
+}
+
+#define MB_LANES	4
+#define MB_NAME(n)	n##_4
+#include "mtree_digest_mb_impl.h"
+#undef MB_LANES
+#undef MB_NAME
+
+#ifdef MB_X86
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+#define MB_LANES	8
+#define MB_NAME(n)	n##_8
+#include "mtree_digest_mb_impl.h"
+#undef MB_LANES
+#undef MB_NAME
+#ifdef MB_X86
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#define MB_LANES	16
+#define MB_NAME(n)	n##_16
+#include "mtree_digest_mb_impl.h"
+#undef MB_LANES
+#undef MB_NAME
+#pragma GCC pop_options
+#endif
+
+typedef void (*mb_fn)(struct mb_lane *, size_t, uint32_t *);
+
+struct mb_impl {
+	int	lanes;
+	mb_fn	md5;
+	mb_fn	sha1;
+	mb_fn	sha256;
+};
+
+static const struct mb_impl mb_impls[] = {
+#ifdef MB_X86
+	{ 16, md5_16, sha1_16, sha256_16 },
+#endif
+	{ 8, md5_8, sha1_8, sha256_8 },
+	{ 4, md5_4, sha1_4, sha256_4 }
+};
+
+static const struct mb_impl *mb_impl;
+
+/*
+ * Select the widest implementation supported by the processor.
+ */
+static void
+mb_impl_init(void)
+{
+
+#ifdef MB_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		mb_impl = &mb_impls[0];
+	else if (__builtin_cpu_supports("avx2"))
+		mb_impl = &mb_impls[1];
+	else
+		mb_impl = &mb_impls[2];
+#else
+	/* Without x86 vector units, the 4 lane variant is used. */
+	mb_impl = &mb_impls[1];
+#endif
+}
+
+#ifdef HAVE_PTHREAD
+static pthread_once_t mb_impl_once = PTHREAD_ONCE_INIT;
+#define MB_IMPL_INIT()	pthread_once(&mb_impl_once, mb_impl_init)
+#else
+#define MB_IMPL_INIT()	do {						\
+	if (mb_impl == NULL)						\
+		mb_impl_init();						\
+} while (0)
+#endif
+
+static const struct mb_impl *
+get_impl(void)
+{
+
+	MB_IMPL_INIT();
+	return (mb_impl);
+}
+
+/*
+ * Split the message into full blocks and padded tail. The length is stored
+ * as big endian number of bits, unless `le' is set.
+ */
+static void
+init_lane(struct mb_lane *lane, const unsigned char *data, size_t len, int le)
+{
+	uint64_t	bits;
+	size_t		rest;
+	int		i;
+
+	lane->data = data;
+	lane->full = len / 64;
+	rest = len % 64;
+	lane->blocks = lane->full + ((rest + 9 > 64) ? 2 : 1);
+
+	memset(lane->tail, 0, sizeof(lane->tail));
+	memcpy(lane->tail, data + lane->full * 64, rest);
+	lane->tail[rest] = 0x80;
+
+	bits = (uint64_t)len * 8;
+	i = (lane->blocks - lane->full) * 64 - 8;
+	if (le) {
+		for (int j = 0; j < 8; j++)
+			lane->tail[i + j] = bits >> (j * 8);
+	} else {
+		for (int j = 0; j < 8; j++)
+			lane->tail[i + j] = bits >> (56 - j * 8);
+	}
+}
+#endif /* MB_ENABLED */
+
+/*
+ * Get the number of messages hashed at the same time, 0 if multi-buffer
+ * hashing is not available.
+ */
+int
+mtree_digest_mb_get_lanes(void)
+{
+
+#ifdef MB_ENABLED
+	return (get_impl()->lanes);
+#else
+	return (0);
+#endif
+}
+
+/*
+ * Get the digest types supported by multi-buffer hashing.
+ */
+int
+mtree_digest_mb_get_types(void)
+{
+
+#ifdef MB_ENABLED
+	return (MTREE_DIGEST_MD5 | MTREE_DIGEST_SHA1 | MTREE_DIGEST_SHA256);
+#else
+	return (0);
+#endif
+}
+
+/*
+ * Hash `n' messages using the given digest type and store the resulting
+ * digests as byte arrays in `result', which must have room for at least
+ * MTREE_DIGEST_MB_RESULT_SIZE bytes each.
+ *
+ * Any number of messages may be passed, they are hashed in groups of as many
+ * messages as there are lanes.
+ */
+void
+mtree_digest_mb(int type, int n, const unsigned char *const data[],
+    const size_t len[], unsigned char *result[])
+{
+#ifdef MB_ENABLED
+	const struct mb_impl	*impl;
+	struct mb_lane		 lanes[MTREE_DIGEST_MB_MAX_LANES];
+	uint32_t		 state[MTREE_DIGEST_MB_MAX_LANES * 8];
+	uint32_t		 v;
+	size_t			 blocks;
+	mb_fn			 fn;
+	int			 words;
+	int			 done;
+	int			 count;
+	int			 i, j, k;
+
+	assert(n >= 0);
+
+	impl = get_impl();
+	switch (type) {
+	case MTREE_DIGEST_MD5:
+		fn = impl->md5;
+		words = 4;
+		break;
+	case MTREE_DIGEST_SHA1:
+		fn = impl->sha1;
+		words = 5;
+		break;
+	case MTREE_DIGEST_SHA256:
+		fn = impl->sha256;
+		words = 8;
+		break;
+	default:
+		assert(0);
+		return;
+	}
+	for (done = 0; done < n; done += count) {
+		count = n - done;
+		if (count > impl->lanes)
+			count = impl->lanes;
+		blocks = 0;
+		for (i = 0; i < impl->lanes; i++) {
+			if (i < count) {
+				init_lane(&lanes[i], data[done + i],
+				    len[done + i], type == MTREE_DIGEST_MD5);
+				if (lanes[i].blocks > blocks)
+					blocks = lanes[i].blocks;
+			} else {
+				/* Unused lane. */
+				memset(&lanes[i], 0, sizeof(lanes[i]));
+			}
+		}
+		fn(lanes, blocks, state);
+
+		for (i = 0; i < count; i++) {
+			unsigned char *b = result[done + i];
+
+			for (j = 0; j < words; j++) {
+				v = state[i * words + j];
+				for (k = 0; k < 4; k++) {
+					/* MD5 is little endian. */
+					*b++ = (type == MTREE_DIGEST_MD5) ?
+					    v >> (k * 8) : v >> (24 - k * 8);
+				}
+			}
+		}
+	}
+#else
+	(void)type;
+	(void)n;
+	(void)data;
+	(void)len;
+	(void)result;
+	assert(0);
+#endif
+}
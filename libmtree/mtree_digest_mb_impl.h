@@ -0,0 +1,233 @@
+/*-
+ * Copyright (c) 2015 Michal Ratajsky <michal@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Multi-buffer implementation of MD5, SHA1 and SHA256, hashing MB_LANES
+ * independent messages at the same time in vector lanes.
+ *
+ * This file is included by mtree_digest_mb.c once for each vector width,
+ * with MB_LANES set to the number of 32-bit lanes and MB_NAME() adding
+ * a suffix to the names of functions.
+ */
+
+typedef uint32_t MB_NAME(vec) __attribute__((vector_size(MB_LANES * 4)));
+
+#define VEC		MB_NAME(vec)
+#define ROTL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+/*
+ * Set up pointers to the next block of each lane, lanes that have already
+ * processed all of their blocks are masked out.
+ */
+static VEC
+MB_NAME(next_blocks)(const struct mb_lane *lanes, size_t block,
+    const unsigned char *p[MB_LANES])
+{
+	VEC	mask;
+	int	i;
+
+	for (i = 0; i < MB_LANES; i++) {
+		if (block < lanes[i].full) {
+			p[i] = lanes[i].data + block * 64;
+			mask[i] = 0xFFFFFFFF;
+		} else if (block < lanes[i].blocks) {
+			p[i] = lanes[i].tail + (block - lanes[i].full) * 64;
+			mask[i] = 0xFFFFFFFF;
+		} else {
+			p[i] = lanes[i].tail;
+			mask[i] = 0;
+		}
+	}
+	return (mask);
+}
+
+static void
+MB_NAME(load_be)(VEC w[16], const unsigned char *const p[MB_LANES])
+{
+	int i, j;
+
+	for (i = 0; i < 16; i++)
+		for (j = 0; j < MB_LANES; j++)
+			w[i][j] = load_be32(p[j] + i * 4);
+}
+
+static void
+MB_NAME(load_le)(VEC w[16], const unsigned char *const p[MB_LANES])
+{
+	int i, j;
+
+	for (i = 0; i < 16; i++)
+		for (j = 0; j < MB_LANES; j++)
+			w[i][j] = load_le32(p[j] + i * 4);
+}
+
+static void
+MB_NAME(md5)(struct mb_lane *lanes, size_t blocks, uint32_t *state)
+{
+	const unsigned char	*p[MB_LANES];
+	VEC			 s[4], w[16];
+	VEC			 a, b, c, d, f, mask;
+	size_t			 block;
+	int			 i, g;
+
+	for (i = 0; i < 4; i++)
+		s[i] = (VEC){ 0 } + md5_init[i];
+	for (block = 0; block < blocks; block++) {
+		mask = MB_NAME(next_blocks)(lanes, block, p);
+		MB_NAME(load_le)(w, p);
+		a = s[0];
+		b = s[1];
+		c = s[2];
+		d = s[3];
+		for (i = 0; i < 64; i++) {
+			if (i < 16) {
+				f = (b & c) | (~b & d);
+				g = i;
+			} else if (i < 32) {
+				f = (d & b) | (~d & c);
+				g = (5 * i + 1) & 15;
+			} else if (i < 48) {
+				f = b ^ c ^ d;
+				g = (3 * i + 5) & 15;
+			} else {
+				f = c ^ (b | ~d);
+				g = (7 * i) & 15;
+			}
+			f = f + a + md5_k[i] + w[g];
+			a = d;
+			d = c;
+			c = b;
+			b = b + ((f << md5_r[i]) | (f >> (32 - md5_r[i])));
+		}
+		s[0] += a & mask;
+		s[1] += b & mask;
+		s[2] += c & mask;
+		s[3] += d & mask;
+	}
+	for (i = 0; i < 4; i++)
+		for (g = 0; g < MB_LANES; g++)
+			state[g * 4 + i] = s[i][g];
+}
+
+static void
+MB_NAME(sha1)(struct mb_lane *lanes, size_t blocks, uint32_t *state)
+{
+	const unsigned char	*p[MB_LANES];
+	VEC			 s[5], w[16];
+	VEC			 a, b, c, d, e, f, t, mask;
+	size_t			 block;
+	int			 i, j;
+
+	for (i = 0; i < 5; i++)
+		s[i] = (VEC){ 0 } + sha1_init[i];
+	for (block = 0; block < blocks; block++) {
+		mask = MB_NAME(next_blocks)(lanes, block, p);
+		MB_NAME(load_be)(w, p);
+		a = s[0];
+		b = s[1];
+		c = s[2];
+		d = s[3];
+		e = s[4];
+		for (i = 0; i < 80; i++) {
+			if (i >= 16) {
+				t = w[(i + 13) & 15] ^ w[(i + 8) & 15] ^
+				    w[(i + 2) & 15] ^ w[i & 15];
+				w[i & 15] = ROTL(t, 1);
+			}
+			if (i < 20)
+				f = ((b & c) | (~b & d)) + 0x5A827999;
+			else if (i < 40)
+				f = (b ^ c ^ d) + 0x6ED9EBA1;
+			else if (i < 60)
+				f = ((b & c) | (b & d) | (c & d)) + 0x8F1BBCDC;
+			else
+				f = (b ^ c ^ d) + 0xCA62C1D6;
+			t = ROTL(a, 5) + f + e + w[i & 15];
+			e = d;
+			d = c;
+			c = ROTL(b, 30);
+			b = a;
+			a = t;
+		}
+		s[0] += a & mask;
+		s[1] += b & mask;
+		s[2] += c & mask;
+		s[3] += d & mask;
+		s[4] += e & mask;
+	}
+	for (i = 0; i < 5; i++)
+		for (j = 0; j < MB_LANES; j++)
+			state[j * 5 + i] = s[i][j];
+}
+
+static void
+MB_NAME(sha256)(struct mb_lane *lanes, size_t blocks, uint32_t *state)
+{
+	const unsigned char	*p[MB_LANES];
+	VEC			 s[8], w[16], v[8];
+	VEC			 t1, t2, s0, s1, mask;
+	size_t			 block;
+	int			 i, j;
+
+	for (i = 0; i < 8; i++)
+		s[i] = (VEC){ 0 } + sha256_init[i];
+	for (block = 0; block < blocks; block++) {
+		mask = MB_NAME(next_blocks)(lanes, block, p);
+		MB_NAME(load_be)(w, p);
+		for (i = 0; i < 8; i++)
+			v[i] = s[i];
+		for (i = 0; i < 64; i++) {
+			if (i >= 16) {
+				t1 = w[(i + 1) & 15];
+				t2 = w[(i + 14) & 15];
+				s0 = ROTL(t1, 25) ^ ROTL(t1, 14) ^ (t1 >> 3);
+				s1 = ROTL(t2, 15) ^ ROTL(t2, 13) ^ (t2 >> 10);
+				w[i & 15] += s0 + w[(i + 9) & 15] + s1;
+			}
+			s1 = ROTL(v[4], 26) ^ ROTL(v[4], 21) ^ ROTL(v[4], 7);
+			t1 = v[7] + s1 + ((v[4] & v[5]) ^ (~v[4] & v[6])) +
+			    sha256_k[i] + w[i & 15];
+			s0 = ROTL(v[0], 30) ^ ROTL(v[0], 19) ^ ROTL(v[0], 10);
+			t2 = s0 + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+			v[7] = v[6];
+			v[6] = v[5];
+			v[5] = v[4];
+			v[4] = v[3] + t1;
+			v[3] = v[2];
+			v[2] = v[1];
+			v[1] = v[0];
+			v[0] = t1 + t2;
+		}
+		for (i = 0; i < 8; i++)
+			s[i] += v[i] & mask;
+	}
+	for (i = 0; i < 8; i++)
+		for (j = 0; j < MB_LANES; j++)
+			state[j * 8 + i] = s[i][j];
+}
+
+#undef VEC
+#undef ROTL
@@ -24,15 +24,21 @@
  * SUCH DAMAGE.
  */
 
+#include "config.h"
+
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
 #include "mtree.h"
@@ -75,6 +81,17 @@
 		}						\
 	} while (0)
 
+#define SET_KEYWORD_DIGEST(entry, type, bytes, keyword)			\
+	do {								\
+		if (mtree_entry_data_set_digest(&(entry)->data, type,	\
+		    bytes) == 0 && (bytes) != NULL)			\
+			SET_KEYWORD(entry, keyword);			\
+		else							\
+			CLR_KEYWORD(entry, keyword);			\
+	} while (0)
+#define CLR_KEYWORD_DIGEST(entry, type, keyword)			\
+	SET_KEYWORD_DIGEST(entry, type, NULL, keyword)
+
 /*
  * Create a new mtree_entry and initialize it with the given path.
  */
@@ -116,6 +133,28 @@ mtree_entry_create_empty(void)
 	return (entry);
 }
 
+/*
+ * Create a new empty mtree_entry in the arena.
+ *
+ * The path and name of the entry must be allocated from the same arena,
+ * they are freed together with the arena once all of its entries are freed.
+ */
+struct mtree_entry *
+mtree_entry_create_arena(struct mtree_arena *arena)
+{
+	struct mtree_entry *entry;
+
+	assert(arena != NULL);
+
+	entry = mtree_arena_alloc(arena, sizeof(struct mtree_entry));
+	if (entry == NULL)
+		return (NULL);
+	entry->data.type = MTREE_ENTRY_UNKNOWN;
+	entry->arena = arena;
+	mtree_arena_ref(arena, 1);
+	return (entry);
+}
+
 /*
  * Free the given mtree_entry.
  */
@@ -126,10 +165,14 @@ mtree_entry_free(struct mtree_entry *entry)
 	assert(entry != NULL);
 
 	mtree_entry_free_data_items(&entry->data);
+	free(entry->dirname);
+	if (entry->arena != NULL) {
+		mtree_arena_release(entry->arena, 1);
+		return;
+	}
 	free(entry->path);
 	free(entry->name);
 	free(entry->orig);
-	free(entry->dirname);
 	free(entry);
 }
 
@@ -141,13 +184,36 @@ mtree_entry_free(struct mtree_entry *entry)
 void
 mtree_entry_free_all(struct mtree_entry *start)
 {
-	struct mtree_entry *next;
+	struct mtree_entry	*next;
+	struct mtree_arena	*arena;
+	unsigned long		 n;
 
+	arena = NULL;
+	n = 0;
 	while (start != NULL) {
 		next = start->next;
-		mtree_entry_free(start);
+		if (start->arena == NULL) {
+			mtree_entry_free(start);
+			start = next;
+			continue;
+		}
+		/*
+		 * Entries from an arena usually come in long runs, release
+		 * them from the arena all at once.
+		 */
+		if (start->arena != arena) {
+			if (n > 0)
+				mtree_arena_release(arena, n);
+			arena = start->arena;
+			n = 0;
+		}
+		mtree_entry_free_data_items(&start->data);
+		free(start->dirname);
+		n++;
 		start = next;
 	}
+	if (n > 0)
+		mtree_arena_release(arena, n);
 }
 
 /*
@@ -156,6 +222,7 @@ mtree_entry_free_all(struct mtree_entry *start)
 void
 mtree_entry_free_data_items(struct mtree_entry_data *data)
 {
+	int i;
 
 	assert(data != NULL);
 
@@ -170,12 +237,111 @@ mtree_entry_free_data_items(struct mtree_entry_data *data)
 	free(data->link);
 	free(data->tags);
 	free(data->uname);
-	free(data->md5digest);
-	free(data->sha1digest);
-	free(data->sha256digest);
-	free(data->sha384digest);
-	free(data->sha512digest);
-	free(data->rmd160digest);
+	free(data->digests);
+	if (data->digests_hex != NULL) {
+		for (i = 0; i < MTREE_DIGEST_TYPES; i++)
+			free(data->digests_hex[i]);
+		free(data->digests_hex);
+	}
+}
+
+/*
+ * Get the offset of the digest `type' in the packed digests of `types',
+ * which are stored in the order of their mtree_digest types.
+ */
+static size_t
+digest_offset(int types, int type)
+{
+	size_t	off;
+	int	t;
+
+	off = 0;
+	for (t = 1; t < type; t <<= 1)
+		if (types & t)
+			off += mtree_digest_get_size(t);
+	return (off);
+}
+
+/*
+ * Get the digest of the given mtree_digest type as an array of
+ * mtree_digest_get_size() bytes, NULL if there is no such digest.
+ */
+const unsigned char *
+mtree_entry_data_get_digest(const struct mtree_entry_data *data, int type)
+{
+
+	assert(data != NULL);
+
+	if ((data->digest_types & type) == 0)
+		return (NULL);
+	return (data->digests + digest_offset(data->digest_types, type));
+}
+
+/*
+ * Set or, if `bytes' is NULL, remove the digest of the given mtree_digest
+ * type. Keywords are not changed.
+ *
+ * Returns -1 if memory allocation fails, the digest is then removed.
+ */
+int
+mtree_entry_data_set_digest(struct mtree_entry_data *data, int type,
+    const unsigned char *bytes)
+{
+	unsigned char	*digests;
+	size_t		 size, off, total;
+
+	assert(data != NULL);
+
+	/* The hexadecimal string is formatted again when requested. */
+	if (data->digests_hex != NULL) {
+		free(data->digests_hex[ffs(type) - 1]);
+		data->digests_hex[ffs(type) - 1] = NULL;
+	}
+
+	size  = mtree_digest_get_size(type);
+	off   = digest_offset(data->digest_types, type);
+	total = digest_offset(data->digest_types, MTREE_DIGEST_RMD160 << 1);
+	if (data->digest_types & type) {
+		if (bytes != NULL) {
+			memcpy(data->digests + off, bytes, size);
+			return (0);
+		}
+		memmove(data->digests + off, data->digests + off + size,
+		    total - off - size);
+		data->digest_types &= ~type;
+		if (data->digest_types == 0) {
+			free(data->digests);
+			data->digests = NULL;
+		}
+		return (0);
+	}
+	if (bytes == NULL)
+		return (0);
+
+	digests = realloc(data->digests, total + size);
+	if (digests == NULL)
+		return (-1);
+	memmove(digests + off + size, digests + off, total - off);
+	memcpy(digests + off, bytes, size);
+	data->digests = digests;
+	data->digest_types |= type;
+	return (0);
+}
+
+/*
+ * Compare digests of the given type, which may be missing in both entries.
+ */
+static int
+compare_digest(const struct mtree_entry_data *data1,
+    const struct mtree_entry_data *data2, int type)
+{
+	const unsigned char *d1, *d2;
+
+	d1 = mtree_entry_data_get_digest(data1, type);
+	d2 = mtree_entry_data_get_digest(data2, type);
+	if (d1 == NULL || d2 == NULL)
+		return (d1 != d2);
+	return (memcmp(d1, d2, mtree_digest_get_size(type)));
 }
 
 /*
@@ -214,7 +380,7 @@ mtree_entry_data_compare_keyword(const struct mtree_entry_data *data1,
 		return (CMP_STR(data1->link, data2->link));
 	case MTREE_KEYWORD_MD5:
 	case MTREE_KEYWORD_MD5DIGEST:
-		return (CMP_STR(data1->md5digest, data2->md5digest));
+		return (compare_digest(data1, data2, MTREE_DIGEST_MD5));
 	case MTREE_KEYWORD_MODE:
 		return (CMP_VAL(data1->st_mode, data2->st_mode));
 	case MTREE_KEYWORD_NLINK:
@@ -224,19 +390,19 @@ mtree_entry_data_compare_keyword(const struct mtree_entry_data *data1,
 	case MTREE_KEYWORD_RIPEMD160DIGEST:
 	case MTREE_KEYWORD_RMD160:
 	case MTREE_KEYWORD_RMD160DIGEST:
-		return (CMP_STR(data1->rmd160digest, data2->rmd160digest));
+		return (compare_digest(data1, data2, MTREE_DIGEST_RMD160));
 	case MTREE_KEYWORD_SHA1:
 	case MTREE_KEYWORD_SHA1DIGEST:
-		return (CMP_STR(data1->sha1digest, data2->sha1digest));
+		return (compare_digest(data1, data2, MTREE_DIGEST_SHA1));
 	case MTREE_KEYWORD_SHA256:
 	case MTREE_KEYWORD_SHA256DIGEST:
-		return (CMP_STR(data1->sha256digest, data2->sha256digest));
+		return (compare_digest(data1, data2, MTREE_DIGEST_SHA256));
 	case MTREE_KEYWORD_SHA384:
 	case MTREE_KEYWORD_SHA384DIGEST:
-		return (CMP_STR(data1->sha384digest, data2->sha384digest));
+		return (compare_digest(data1, data2, MTREE_DIGEST_SHA384));
 	case MTREE_KEYWORD_SHA512:
 	case MTREE_KEYWORD_SHA512DIGEST:
-		return (CMP_STR(data1->sha512digest, data2->sha512digest));
+		return (compare_digest(data1, data2, MTREE_DIGEST_SHA512));
 	case MTREE_KEYWORD_SIZE:
 		return (CMP_VAL(data1->st_size, data2->st_size));
 	case MTREE_KEYWORD_TAGS:
@@ -337,6 +503,100 @@ mtree_entry_compare_keywords(const struct mtree_entry *entry1,
 	return (0);
 }
 
+/*
+ * Compare the selected keywords, which are present in both entries, and add
+ * the mismatching ones to `differ'.
+ *
+ * Return non-zero if some keyword doesn't match.
+ */
+static int
+compare_present(const struct mtree_entry *entry, const struct mtree_entry *file,
+    uint64_t keywords, int first, uint64_t *differ)
+{
+	uint64_t	kw;
+	int		i;
+
+	keywords &= entry->data.keywords & file->data.keywords;
+	for (i = 0; mtree_keywords[i].keyword != 0; i++) {
+		kw = mtree_keywords[i].keyword;
+		if ((keywords & kw) == 0)
+			continue;
+#ifndef HAVE_STRUCT_STAT_ST_MTIM
+		/*
+		 * The file system only gives seconds, don't fail on the
+		 * nanoseconds stored in the spec.
+		 */
+		if (kw == MTREE_KEYWORD_TIME) {
+			if (entry->data.st_mtim.tv_sec ==
+			    file->data.st_mtim.tv_sec)
+				continue;
+		} else
+#endif
+		if (mtree_entry_data_compare_keyword(&entry->data,
+		    &file->data, kw) == 0)
+			continue;
+		*differ |= kw;
+		if (first)
+			break;
+	}
+	return (*differ != 0);
+}
+
+/*
+ * Read the selected keywords of a file into `file' and compare them with
+ * the values in `entry'.
+ *
+ * The comparison is done in stages, from the cheapest keywords to the most
+ * expensive ones: the type, size and modification time are compared first,
+ * followed by the other keywords read by lstat(2). The contents of the file
+ * are only read to calculate the cksum and digests when all of these match,
+ * a file that is known to differ isn't read at all. With the
+ * MTREE_ENTRY_FIRST_MISMATCH option, the comparison stops at the first
+ * mismatching keyword. MTREE_ENTRY_OVERWRITE and MTREE_ENTRY_DROP_CACHE
+ * are passed on to mtree_entry_set_keywords().
+ *
+ * Only keywords present in both entries are compared, keywords that cannot
+ * be read from the file are skipped.
+ *
+ * Return non-zero if some keyword doesn't match. If diff is non-NULL, set
+ * it to a mask of mismatching keywords.
+ */
+int
+mtree_entry_compare_file(const struct mtree_entry *entry,
+    struct mtree_entry *file, uint64_t keywords, int options, uint64_t *diff)
+{
+	uint64_t	cheap;
+	uint64_t	differ;
+	int		first;
+
+	assert(entry != NULL);
+	assert(file != NULL);
+
+	keywords &= entry->data.keywords;
+	cheap = MTREE_KEYWORD_TYPE | MTREE_KEYWORD_SIZE | MTREE_KEYWORD_TIME;
+	first = (options & MTREE_ENTRY_FIRST_MISMATCH) != 0;
+	/* Keywords are read in two steps, they must not remove each other. */
+	options &= MTREE_ENTRY_OVERWRITE | MTREE_ENTRY_DROP_CACHE;
+
+	differ = 0;
+	mtree_entry_set_keywords(file, keywords & MTREE_KEYWORD_MASK_STAT,
+	    options);
+	if (compare_present(entry, file, keywords & cheap, first, &differ) ||
+	    compare_present(entry, file,
+	    keywords & MTREE_KEYWORD_MASK_STAT & ~cheap, first, &differ))
+		goto out;
+
+	keywords &= MTREE_KEYWORD_CKSUM | MTREE_KEYWORD_MASK_DIGEST;
+	if (keywords != 0) {
+		mtree_entry_set_keywords(file, keywords, options);
+		compare_present(entry, file, keywords, first, &differ);
+	}
+out:
+	if (diff != NULL)
+		*diff = differ;
+	return (differ != 0);
+}
+
 /*
  * Compare paths of two entries, as strcmp(3) would, with the difference that
  * files are placed before directories.
@@ -494,22 +754,87 @@ mtree_entry_sort_path(struct mtree_entry *head)
 }
 
 /*
- * Calculate cksum and digests and store them in the given entry, setting
- * the selected keywords.
+ * Contexts of the last calculation finished by a thread, which are reused
+ * for the next entry instead of allocating new ones for every file.
+ */
+struct checksums_ctx {
+	struct mtree_cksum	*cksum;
+	struct mtree_digest	*digest;
+};
+
+static void
+free_ctx(void *p)
+{
+	struct checksums_ctx *ctx = p;
+
+	if (ctx->cksum != NULL)
+		mtree_cksum_free(ctx->cksum);
+	if (ctx->digest != NULL)
+		mtree_digest_free(ctx->digest);
+	free(ctx);
+}
+
+#ifdef HAVE_PTHREAD
+static pthread_key_t	ctx_key;
+static pthread_once_t	ctx_once = PTHREAD_ONCE_INIT;
+static int		ctx_key_ok;
+
+static void
+init_ctx_key(void)
+{
+
+	ctx_key_ok = (pthread_key_create(&ctx_key, free_ctx) == 0);
+}
+#else
+static struct checksums_ctx *ctx_static;
+#endif
+
+/*
+ * Get the contexts of the calling thread, NULL if they cannot be allocated.
+ */
+static struct checksums_ctx *
+get_ctx(void)
+{
+	struct checksums_ctx *ctx;
+
+#ifdef HAVE_PTHREAD
+	pthread_once(&ctx_once, init_ctx_key);
+	if (!ctx_key_ok)
+		return (NULL);
+	ctx = pthread_getspecific(ctx_key);
+	if (ctx == NULL) {
+		ctx = calloc(1, sizeof(struct checksums_ctx));
+		if (ctx != NULL && pthread_setspecific(ctx_key, ctx) != 0) {
+			free(ctx);
+			ctx = NULL;
+		}
+	}
+#else
+	if (ctx_static == NULL)
+		ctx_static = calloc(1, sizeof(struct checksums_ctx));
+	ctx = ctx_static;
+#endif
+	return (ctx);
+}
+
+/*
+ * Prepare calculation of cksum and digests of the given entry.
  *
- * Digests are the wanted mtree_digest types.
+ * Digests are the wanted mtree_digest types, keywords include the cksum and
+ * digest keywords to be set. The keywords are unset in the entry until the
+ * calculation finishes.
  *
- * If some digest type is unavailable or the calculation fails, the
- * respective keywords are unset.
+ * Returns 1 if there is something to calculate, 0 if there is nothing to
+ * calculate and -1 on error.
  */
-static void
-set_checksums(struct mtree_entry *entry, int digests, uint64_t keywords)
+int
+mtree_entry_checksums_init(struct mtree_entry_checksums *c,
+    struct mtree_entry *entry, int digests, uint64_t keywords)
 {
-	struct mtree_cksum	*cksum;
-	struct mtree_digest	*digest;
-	unsigned char		 buf[16 * 1024];
-	int			 fd;
-	int			 n;
+	struct checksums_ctx *ctx;
+
+	assert(c != NULL);
+	assert(entry != NULL);
 
 	/*
 	 * Unset everything first to simplify error handling. The keywords
@@ -518,94 +843,471 @@ set_checksums(struct mtree_entry *entry, int digests, uint64_t keywords)
 	if (keywords & MTREE_KEYWORD_CKSUM)
 		CLR_KEYWORD(entry, MTREE_KEYWORD_CKSUM);
 	if (digests & MTREE_DIGEST_MD5)
-		SET_KEYWORD_STR(entry, entry->data.md5digest,
-		    NULL,
+		CLR_KEYWORD_DIGEST(entry, MTREE_DIGEST_MD5,
 		    MTREE_KEYWORD_MASK_MD5);
 	if (digests & MTREE_DIGEST_SHA1)
-		SET_KEYWORD_STR(entry, entry->data.sha1digest,
-		    NULL,
+		CLR_KEYWORD_DIGEST(entry, MTREE_DIGEST_SHA1,
 		    MTREE_KEYWORD_MASK_SHA1);
 	if (digests & MTREE_DIGEST_SHA256)
-		SET_KEYWORD_STR(entry, entry->data.sha256digest,
-		    NULL,
+		CLR_KEYWORD_DIGEST(entry, MTREE_DIGEST_SHA256,
 		    MTREE_KEYWORD_MASK_SHA256);
 	if (digests & MTREE_DIGEST_SHA384)
-		SET_KEYWORD_STR(entry, entry->data.sha384digest,
-		    NULL,
+		CLR_KEYWORD_DIGEST(entry, MTREE_DIGEST_SHA384,
 		    MTREE_KEYWORD_MASK_SHA384);
 	if (digests & MTREE_DIGEST_SHA512)
-		SET_KEYWORD_STR(entry, entry->data.sha512digest,
-		    NULL,
+		CLR_KEYWORD_DIGEST(entry, MTREE_DIGEST_SHA512,
 		    MTREE_KEYWORD_MASK_SHA512);
+	if (digests & MTREE_DIGEST_RMD160)
+		CLR_KEYWORD_DIGEST(entry, MTREE_DIGEST_RMD160,
+		    MTREE_KEYWORD_MASK_RMD160);
+
+	c->entry    = entry;
+	c->cksum    = NULL;
+	c->digest   = NULL;
+	c->keywords = keywords;
 
 	/* Remove unavailable digests. */
-	digests &= mtree_digest_get_available_types();
-	if ((keywords & MTREE_KEYWORD_CKSUM) == 0 && digests == 0)
-		return;
+	c->digests = digests & mtree_digest_get_available_types();
+	if ((keywords & MTREE_KEYWORD_CKSUM) == 0 && c->digests == 0)
+		return (0);
 
-	if (entry->orig != NULL)
-		fd = open(entry->orig, O_RDONLY);
-	else
-		fd = open(entry->path, O_RDONLY);
-	if (fd == -1)
-		return;
-	cksum  = NULL;
-	digest = NULL;
+	/*
+	 * Take the contexts of the thread if there are any. More than one
+	 * calculation may be in progress, those started later allocate
+	 * their own contexts.
+	 */
+	ctx = get_ctx();
 	if (keywords & MTREE_KEYWORD_CKSUM) {
-		cksum = mtree_cksum_create(MTREE_CKSUM_DEFAULT_INIT);
-		if (cksum == NULL)
-			goto end;
+		if (ctx != NULL && ctx->cksum != NULL) {
+			c->cksum = ctx->cksum;
+			ctx->cksum = NULL;
+			mtree_cksum_reset(c->cksum, MTREE_CKSUM_DEFAULT_INIT);
+		} else {
+			c->cksum = mtree_cksum_create(MTREE_CKSUM_DEFAULT_INIT);
+			if (c->cksum == NULL)
+				return (-1);
+		}
 	}
-	if (digests != 0) {
-		digest = mtree_digest_create(digests);
-		if (digest == NULL)
-			goto end;
+	if (c->digests != 0) {
+		if (ctx != NULL && ctx->digest != NULL &&
+		    mtree_digest_get_types(ctx->digest) == c->digests) {
+			c->digest = ctx->digest;
+			ctx->digest = NULL;
+			mtree_digest_reset(c->digest);
+		} else
+			c->digest = mtree_digest_create(c->digests);
+		if (c->digest == NULL) {
+			if (c->cksum != NULL) {
+				mtree_cksum_free(c->cksum);
+				c->cksum = NULL;
+			}
+			return (-1);
+		}
 	}
+	return (1);
+}
 
-	while ((n = read(fd, buf, sizeof(buf))) > 0) {
-		if (cksum != NULL)
-			mtree_cksum_update(cksum, buf, n);
-		if (digest != NULL)
-			mtree_digest_update(digest, buf, n);
-	}
-	if (n == 0) {
+/*
+ * Feed the next block of file contents into the calculation.
+ */
+void
+mtree_entry_checksums_update(struct mtree_entry_checksums *c,
+    const void *buf, size_t len)
+{
+
+	assert(c != NULL);
+
+	if (c->cksum != NULL)
+		mtree_cksum_update(c->cksum, buf, len);
+	if (c->digest != NULL)
+		mtree_digest_update(c->digest, buf, len);
+}
+
+static void
+update_digest(const unsigned char *buf, size_t len, void *user_data)
+{
+
+	mtree_digest_update(user_data, buf, len);
+}
+
+/*
+ * Feed `len' zero bytes of a hole into the calculation. The cksum skips
+ * them at once, digests need to process them.
+ */
+void
+mtree_entry_checksums_update_zeros(struct mtree_entry_checksums *c,
+    uint64_t len)
+{
+
+	assert(c != NULL);
+
+	if (c->cksum != NULL)
+		mtree_cksum_update_zeros(c->cksum, len);
+	if (c->digest != NULL)
+		mtree_io_zeros(len, update_digest, c->digest);
+}
+
+/*
+ * Finish the calculation. If it has succeeded, the results are stored in
+ * the entry and the keywords are set.
+ */
+void
+mtree_entry_checksums_finish(struct mtree_entry_checksums *c, int success)
+{
+	struct checksums_ctx	*ctx;
+	struct mtree_entry	*entry;
+	int			 digests;
+	int			 type;
+
+	assert(c != NULL);
+
+	entry   = c->entry;
+	digests = c->digests;
+	if (success) {
 		/*
 		 * Set the keywords and their values once the calculation
 		 * has succeeded.
 		 */
-		if (keywords & MTREE_KEYWORD_CKSUM)
+		if (c->keywords & MTREE_KEYWORD_CKSUM)
 			mtree_entry_set_cksum(entry,
-			    mtree_cksum_get_result(cksum));
-		if (digests & MTREE_DIGEST_MD5)
-			mtree_entry_set_md5digest(entry,
-			    mtree_digest_get_result(digest, MTREE_DIGEST_MD5),
-			    keywords);
-		if (digests & MTREE_DIGEST_SHA1)
-			mtree_entry_set_sha1digest(entry,
-			    mtree_digest_get_result(digest, MTREE_DIGEST_SHA1),
-			    keywords);
-		if (digests & MTREE_DIGEST_SHA256)
-			mtree_entry_set_sha256digest(entry,
-			    mtree_digest_get_result(digest, MTREE_DIGEST_SHA256),
-			    keywords);
-		if (digests & MTREE_DIGEST_SHA384)
-			mtree_entry_set_sha384digest(entry,
-			    mtree_digest_get_result(digest, MTREE_DIGEST_SHA384),
-			    keywords);
-		if (digests & MTREE_DIGEST_SHA512)
-			mtree_entry_set_sha512digest(entry,
-			    mtree_digest_get_result(digest, MTREE_DIGEST_SHA512),
-			    keywords);
-		if (digests & MTREE_DIGEST_RMD160)
-			mtree_entry_set_rmd160digest(entry,
-			    mtree_digest_get_result(digest, MTREE_DIGEST_RMD160),
+			    mtree_cksum_get_result(c->cksum));
+		for (type = 1; type <= MTREE_DIGEST_RMD160; type <<= 1) {
+			if (digests & type)
+				mtree_entry_set_digest(entry, type,
+				    mtree_digest_get_bytes(c->digest, type),
+				    c->keywords);
+		}
+	}
+
+	/* Keep the contexts for the next entry. */
+	ctx = get_ctx();
+	if (c->cksum != NULL) {
+		if (ctx != NULL && ctx->cksum == NULL)
+			ctx->cksum = c->cksum;
+		else
+			mtree_cksum_free(c->cksum);
+		c->cksum = NULL;
+	}
+	if (c->digest != NULL) {
+		if (ctx != NULL) {
+			if (ctx->digest != NULL)
+				mtree_digest_free(ctx->digest);
+			ctx->digest = c->digest;
+		} else
+			mtree_digest_free(c->digest);
+		c->digest = NULL;
+	}
+}
+
+/*
+ * Get the keywords of the given mtree_digest type.
+ */
+uint64_t
+mtree_entry_digest_keywords(int type)
+{
+
+	switch (type) {
+	case MTREE_DIGEST_MD5:
+		return (MTREE_KEYWORD_MASK_MD5);
+	case MTREE_DIGEST_SHA1:
+		return (MTREE_KEYWORD_MASK_SHA1);
+	case MTREE_DIGEST_SHA256:
+		return (MTREE_KEYWORD_MASK_SHA256);
+	case MTREE_DIGEST_SHA384:
+		return (MTREE_KEYWORD_MASK_SHA384);
+	case MTREE_DIGEST_SHA512:
+		return (MTREE_KEYWORD_MASK_SHA512);
+	case MTREE_DIGEST_RMD160:
+		return (MTREE_KEYWORD_MASK_RMD160);
+	default:
+		return (0);
+	}
+}
+
+/*
+ * Set the digest of the given mtree_digest type from an array of bytes and
+ * set those of the `keywords' which belong to the type. If `bytes' is NULL,
+ * the digest is unset.
+ */
+void
+mtree_entry_set_digest(struct mtree_entry *entry, int type,
+    const unsigned char *bytes, uint64_t keywords)
+{
+	uint64_t mask;
+
+	assert(entry != NULL);
+
+	mask = mtree_entry_digest_keywords(type);
+	CLR_KEYWORD(entry, mask);
+	SET_KEYWORD_DIGEST(entry, type, bytes, keywords & mask);
+}
+
+/*
+ * Set the digest of the given mtree_digest type from a hexadecimal string,
+ * the digest is unset if the string is not valid.
+ */
+static void
+set_digest_hex(struct mtree_entry *entry, int type, const char *digest,
+    uint64_t keywords)
+{
+	unsigned char bytes[MTREE_DIGEST_MAX_SIZE];
+
+	if (digest == NULL ||
+	    mtree_digest_from_hex(digest, bytes,
+	    mtree_digest_get_size(type)) == -1)
+		mtree_entry_set_digest(entry, type, NULL, 0);
+	else
+		mtree_entry_set_digest(entry, type, bytes, keywords);
+}
+
+#ifdef HAVE_PTHREAD
+/* Serializes getters formatting hexadecimal strings of digests. */
+static pthread_mutex_t digests_hex_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Get the digest of the given mtree_digest type as a hexadecimal string.
+ *
+ * The string is formatted on the first call and kept until the digest of
+ * the same type changes. Getters may run concurrently, so the strings are
+ * only looked up and formatted under a lock.
+ */
+static const char *
+get_digest_hex(struct mtree_entry *entry, int type)
+{
+	struct mtree_entry_data	*data;
+	char			*hex;
+	size_t			 size;
+	int			 i;
+
+	data = &entry->data;
+	if ((data->digest_types & type) == 0)
+		return (NULL);
+	i = ffs(type) - 1;
+	hex = NULL;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&digests_hex_lock);
+#endif
+	if (data->digests_hex == NULL)
+		data->digests_hex = calloc(MTREE_DIGEST_TYPES,
+		    sizeof(*data->digests_hex));
+	if (data->digests_hex != NULL) {
+		hex = data->digests_hex[i];
+		if (hex == NULL) {
+			size = mtree_digest_get_size(type);
+			hex = malloc(2 * size + 1);
+			if (hex != NULL)
+				mtree_digest_to_hex(
+				    mtree_entry_data_get_digest(data, type),
+				    size, hex);
+			data->digests_hex[i] = hex;
+		}
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&digests_hex_lock);
+#endif
+	return (hex);
+}
+
+/*
+ * Convert cksum and digest keywords to the mtree_digest types.
+ */
+int
+mtree_entry_checksums_digests(uint64_t keywords)
+{
+	int digests;
+
+	digests = 0;
+	if (keywords & MTREE_KEYWORD_MASK_MD5)
+		digests |= MTREE_DIGEST_MD5;
+	if (keywords & MTREE_KEYWORD_MASK_SHA1)
+		digests |= MTREE_DIGEST_SHA1;
+	if (keywords & MTREE_KEYWORD_MASK_SHA256)
+		digests |= MTREE_DIGEST_SHA256;
+	if (keywords & MTREE_KEYWORD_MASK_SHA384)
+		digests |= MTREE_DIGEST_SHA384;
+	if (keywords & MTREE_KEYWORD_MASK_SHA512)
+		digests |= MTREE_DIGEST_SHA512;
+	if (keywords & MTREE_KEYWORD_MASK_RMD160)
+		digests |= MTREE_DIGEST_RMD160;
+	return (digests);
+}
+
+/*
+ * Calculate cksum and digests of `n' entries, whose file contents have
+ * already been read into memory.
+ *
+ * Digests supported by multi-buffer hashing are calculated for all the
+ * entries at once, the rest is calculated separately for each entry.
+ *
+ * Returns -1 if memory allocation fails, in that case the checksum keywords
+ * of some of the entries may be unset.
+ */
+int
+mtree_entry_checksums_batch(struct mtree_entry **entries, int n,
+    const unsigned char *const data[], const size_t len[], uint64_t keywords)
+{
+	static const int		 types[] = {
+		MTREE_DIGEST_MD5,
+		MTREE_DIGEST_SHA1,
+		MTREE_DIGEST_SHA256
+	};
+	struct mtree_entry_checksums	 c;
+	unsigned char			 buf[MTREE_DIGEST_MB_MAX_LANES]
+					    [MTREE_DIGEST_MB_RESULT_SIZE];
+	unsigned char			*result[MTREE_DIGEST_MB_MAX_LANES];
+	int				 digests, mb;
+	int				 i, j, ret;
+
+	assert(entries != NULL);
+	assert(n >= 0 && n <= MTREE_DIGEST_MB_MAX_LANES);
+
+	digests = mtree_entry_checksums_digests(keywords);
+	mb = 0;
+	if (n > 1)
+		mb = digests & mtree_digest_mb_get_types();
+
+	for (i = 0; i < n; i++) {
+		ret = mtree_entry_checksums_init(&c, entries[i], digests & ~mb,
+		    keywords);
+		if (ret == -1)
+			return (-1);
+		if (ret == 1) {
+			mtree_entry_checksums_update(&c, data[i], len[i]);
+			mtree_entry_checksums_finish(&c, 1);
+		}
+	}
+	if (mb == 0)
+		return (0);
+
+	for (i = 0; i < n; i++)
+		result[i] = buf[i];
+	for (j = 0; j < (int)(sizeof(types) / sizeof(types[0])); j++) {
+		if ((mb & types[j]) == 0)
+			continue;
+		mtree_digest_mb(types[j], n, data, len, result);
+		for (i = 0; i < n; i++)
+			mtree_entry_set_digest(entries[i], types[j], result[i],
 			    keywords);
 	}
-end:
-	if (cksum != NULL)
-		mtree_cksum_free(cksum);
-	if (digest != NULL)
-		mtree_digest_free(digest);
+	return (0);
+}
+
+static void
+update_checksums(const unsigned char *buf, size_t len, void *user_data)
+{
+
+	mtree_entry_checksums_update(user_data, buf, len);
+}
+
+static void
+update_checksums_zeros(uint64_t len, void *user_data)
+{
+
+	mtree_entry_checksums_update_zeros(user_data, len);
+}
+
+/*
+ * Feed the remaining contents of the open file into the calculation, reads
+ * are limited by the governor `g' unless it is NULL.
+ *
+ * Returns 0 on success, -1 on error with errno set.
+ */
+int
+mtree_entry_checksums_read_fd(struct mtree_entry_checksums *c, int fd,
+    int options, struct mtree_governor *g)
+{
+	int ret;
+
+	assert(c != NULL);
+
+	/*
+	 * Large files are split into chunks checksummed in parallel, which
+	 * is only possible for cksum, digests are calculated sequentially.
+	 * Limited reading is always sequential.
+	 */
+	ret = 0;
+	if (c->cksum != NULL && c->digest == NULL && g == NULL)
+		ret = mtree_cksum_update_fd(c->cksum, fd, MTREE_CKSUM_CHUNK,
+		    0);
+	if (ret != -1)
+		ret = mtree_io_read_fd(fd,
+		    (options & MTREE_ENTRY_DROP_CACHE) ? MTREE_IO_DONTNEED : 0,
+		    g, update_checksums, update_checksums_zeros, c);
+	return (ret);
+}
+
+/*
+ * Check whether the file is better read by mtree_entry_checksums_read_fd()
+ * than in pieces of the caller's choice, which is the case for sparse files
+ * with holes to be skipped, and for large files with cksum calculated in
+ * parallel.
+ */
+int
+mtree_entry_checksums_read_whole(const struct mtree_entry_checksums *c,
+    const struct stat *st)
+{
+
+	assert(c != NULL);
+	assert(st != NULL);
+
+	if (!S_ISREG(st->st_mode))
+		return (0);
+	if (st->st_blocks * 512 < st->st_size)
+		return (1);
+	return (c->cksum != NULL && c->digest == NULL &&
+	    (uint64_t)st->st_size >= 2 * (uint64_t)MTREE_CKSUM_CHUNK);
+}
+
+/*
+ * Calculate cksum and digests and store them in the given entry, setting
+ * the selected keywords.
+ *
+ * Digests are the wanted mtree_digest types.
+ *
+ * If some digest type is unavailable or the calculation fails, the
+ * respective keywords are unset.
+ *
+ * With a cache, the values are taken from it if the file hasn't changed,
+ * otherwise the calculated values are stored in it.
+ */
+static void
+set_checksums(struct mtree_entry *entry, const struct mtree_entry_fs *fs,
+    int digests, uint64_t keywords, int options)
+{
+	struct mtree_entry_checksums	 c;
+	struct mtree_cache_key		 key;
+	struct stat			 st;
+	int				 cached;
+	int				 fd;
+	int				 ret;
+
+	if (mtree_entry_checksums_init(&c, entry, digests, keywords) != 1)
+		return;
+
+	mtree_governor_file(fs->governor);
+	fd = mtree_open_at(fs->dirfd, fs->name, O_RDONLY);
+	if (fd == -1) {
+		mtree_entry_checksums_finish(&c, 0);
+		return;
+	}
+	cached = 0;
+	if (fs->cache != NULL && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		mtree_cache_key_from_stat(&key, &st);
+		if (mtree_cache_get(fs->cache, &key, entry, c.digests,
+		    keywords) == 1) {
+			mtree_entry_checksums_finish(&c, 0);
+			close(fd);
+			return;
+		}
+		cached = 1;
+	}
+	ret = mtree_entry_checksums_read_fd(&c, fd, options, fs->governor);
+
+	mtree_entry_checksums_finish(&c, ret == 0);
+	if (ret == 0 && cached)
+		mtree_cache_put(fs->cache, &key, entry, c.digests,
+		    keywords);
 	close(fd);
 }
 
@@ -613,17 +1315,21 @@ end:
  * Add or remove the requested keywords.
  *
  * Keyword values are read from the supplied stat or from the file system.
- * The overwrite argument indicates whether to overwrite digests.
+ * With MTREE_ENTRY_OVERWRITE in options, digests are overwritten.
  */
 static void
-set_keywords(struct mtree_entry *entry, const struct stat *st, uint64_t kset,
-    uint64_t kclr, int overwrite)
+set_keywords(struct mtree_entry *entry, const struct mtree_entry_fs *fs,
+    const struct stat *st, uint64_t kset, uint64_t kclr, int options)
 {
 	char	*s;
 	int	 digests;
+	int	 overwrite;
+
+	overwrite = options & MTREE_ENTRY_OVERWRITE;
 
 #define TRY_CLR_KEYWORD(k)	  if ((kclr & (k)) == (k)) CLR_KEYWORD(entry, k)
 #define TRY_CLR_KEYWORD_STR(p, k) if ((kclr & (k)) == (k)) CLR_KEYWORD_STR(entry, p, k)
+#define TRY_CLR_KEYWORD_DIGEST(t, k) if ((kclr & (k)) == (k)) CLR_KEYWORD_DIGEST(entry, t, k)
 
 	/*
 	 * Set/unset keywords that don't take a value.
@@ -773,10 +1479,7 @@ set_keywords(struct mtree_entry *entry, const struct stat *st, uint64_t kset,
 	 * Set/unset non-stat keywords.
 	 */
 	if (kset & MTREE_KEYWORD_LINK) {
-		if (entry->orig != NULL)
-			s = mtree_readlink(entry->orig);
-		else
-			s = mtree_readlink(entry->path);
+		s = mtree_readlink_at(fs->dirfd, fs->name);
 		if (s != NULL)
 			SET_KEYWORD_STR(entry, entry->data.link, s,
 			    MTREE_KEYWORD_LINK);
@@ -801,7 +1504,7 @@ set_keywords(struct mtree_entry *entry, const struct stat *st, uint64_t kset,
 		else
 			digests |= MTREE_DIGEST_MD5;
 	} else
-		TRY_CLR_KEYWORD_STR(entry->data.md5digest,
+		TRY_CLR_KEYWORD_DIGEST(MTREE_DIGEST_MD5,
 		    MTREE_KEYWORD_MASK_MD5);
 	if (kset & MTREE_KEYWORD_MASK_SHA1) {
 		CLR_KEYWORD(entry, kclr & MTREE_KEYWORD_MASK_SHA1);
@@ -810,7 +1513,7 @@ set_keywords(struct mtree_entry *entry, const struct stat *st, uint64_t kset,
 		else
 			digests |= MTREE_DIGEST_SHA1;
 	} else
-		TRY_CLR_KEYWORD_STR(entry->data.sha1digest,
+		TRY_CLR_KEYWORD_DIGEST(MTREE_DIGEST_SHA1,
 		    MTREE_KEYWORD_MASK_SHA1);
 	if (kset & MTREE_KEYWORD_MASK_SHA256) {
 		CLR_KEYWORD(entry, kclr & MTREE_KEYWORD_MASK_SHA256);
@@ -819,7 +1522,7 @@ set_keywords(struct mtree_entry *entry, const struct stat *st, uint64_t kset,
 		else
 			digests |= MTREE_DIGEST_SHA256;
 	} else
-		TRY_CLR_KEYWORD_STR(entry->data.sha256digest,
+		TRY_CLR_KEYWORD_DIGEST(MTREE_DIGEST_SHA256,
 		    MTREE_KEYWORD_MASK_SHA256);
 	if (kset & MTREE_KEYWORD_MASK_SHA384) {
 		CLR_KEYWORD(entry, kclr & MTREE_KEYWORD_MASK_SHA384);
@@ -828,7 +1531,7 @@ set_keywords(struct mtree_entry *entry, const struct stat *st, uint64_t kset,
 		else
 			digests |= MTREE_DIGEST_SHA384;
 	} else
-		TRY_CLR_KEYWORD_STR(entry->data.sha384digest,
+		TRY_CLR_KEYWORD_DIGEST(MTREE_DIGEST_SHA384,
 		    MTREE_KEYWORD_MASK_SHA384);
 	if (kset & MTREE_KEYWORD_MASK_SHA512) {
 		CLR_KEYWORD(entry, kclr & MTREE_KEYWORD_MASK_SHA512);
@@ -837,7 +1540,7 @@ set_keywords(struct mtree_entry *entry, const struct stat *st, uint64_t kset,
 		else
 			digests |= MTREE_DIGEST_SHA512;
 	} else
-		TRY_CLR_KEYWORD_STR(entry->data.sha512digest,
+		TRY_CLR_KEYWORD_DIGEST(MTREE_DIGEST_SHA512,
 		    MTREE_KEYWORD_MASK_SHA512);
 	if (kset & MTREE_KEYWORD_MASK_RMD160) {
 		CLR_KEYWORD(entry, kclr & MTREE_KEYWORD_MASK_RMD160);
@@ -846,36 +1549,38 @@ set_keywords(struct mtree_entry *entry, const struct stat *st, uint64_t kset,
 		else
 			digests |= MTREE_DIGEST_RMD160;
 	} else
-		TRY_CLR_KEYWORD_STR(entry->data.rmd160digest,
+		TRY_CLR_KEYWORD_DIGEST(MTREE_DIGEST_RMD160,
 		    MTREE_KEYWORD_MASK_RMD160);
 
 	if ((kset & MTREE_KEYWORD_CKSUM) || digests != 0) {
 		uint64_t mask = MTREE_KEYWORD_CKSUM | MTREE_KEYWORD_MASK_DIGEST;
-		set_checksums(entry, digests,
+		set_checksums(entry, fs, digests,
 		    (kset & mask) |
-		    (entry->data.keywords & mask));
+		    (entry->data.keywords & mask), options);
 	}
 #undef TRY_CLR_KEYWORD
 #undef TRY_CLR_KEYWORD_STR
+#undef TRY_CLR_KEYWORD_DIGEST
 }
 
 /*
  * Add, remove keywords, or change the entry to include the given set
  * of keywords.
  *
- * Keyword values are read from the file system. This doesn't set
- * keywords that take arbitrary values, such as "contents" or "tags".
+ * Keyword values are read from the file at the given location. Stat
+ * keywords are taken from the supplied stat structure, if there is one.
  */
 void
-mtree_entry_set_keywords(struct mtree_entry *entry, uint64_t keywords, int options)
+mtree_entry_set_keywords_fs(struct mtree_entry *entry,
+    const struct mtree_entry_fs *fs, uint64_t keywords, int options)
 {
-	struct stat	st;
-	uint64_t	kstat;
-	uint64_t	kset;
-	uint64_t	kclr;
-	int		ret;
+	struct stat		 st;
+	const struct stat	*stp;
+	uint64_t		 kset;
+	uint64_t		 kclr;
 
 	assert(entry != NULL);
+	assert(fs != NULL);
 
 	if (options & MTREE_ENTRY_REMOVE_EXCLUDED)
 		kclr = entry->data.keywords & ~keywords;
@@ -886,27 +1591,65 @@ mtree_entry_set_keywords(struct mtree_entry *entry, uint64_t keywords, int optio
 	else
 		kset = keywords & ~entry->data.keywords;
 
-	kstat = keywords & MTREE_KEYWORD_MASK_STAT;
-	if ((options & MTREE_ENTRY_OVERWRITE) == 0)
-		kstat &= ~entry->data.keywords;
-
-	if (kset & MTREE_KEYWORD_MASK_STAT) {
+	stp = fs->st;
+	if (stp == NULL && (kset & MTREE_KEYWORD_MASK_STAT) != 0) {
 		/*
 		 * There is some stat field that should be updated.
 		 *
 		 * If lstat(2) fails, make sure to unset all stat keywords that
 		 * should have been updated.
 		 */
-		if (entry->orig != NULL)
-			ret = lstat(entry->orig, &st);
-		else
-			ret = lstat(entry->path, &st);
-		if (ret == -1) {
+		if (mtree_stat_at(fs->dirfd, fs->name, &st,
+		    AT_SYMLINK_NOFOLLOW, kset & MTREE_KEYWORD_MASK_STAT) == -1) {
 			kclr |= kset & MTREE_KEYWORD_MASK_STAT;
 			kset &= ~MTREE_KEYWORD_MASK_STAT;
 		}
+		stp = &st;
 	}
-	set_keywords(entry, &st, kset, kclr, options & MTREE_ENTRY_OVERWRITE);
+	set_keywords(entry, fs, stp, kset, kclr, options);
+}
+
+/*
+ * Add, remove keywords, or change the entry to include the given set
+ * of keywords.
+ *
+ * Keyword values are read from the file system. This doesn't set
+ * keywords that take arbitrary values, such as "contents" or "tags".
+ */
+void
+mtree_entry_set_keywords(struct mtree_entry *entry, uint64_t keywords, int options)
+{
+	struct mtree_entry_fs fs;
+
+	assert(entry != NULL);
+
+	fs.dirfd    = AT_FDCWD;
+	fs.name     = (entry->orig != NULL) ? entry->orig : entry->path;
+	fs.st       = NULL;
+	fs.cache    = NULL;
+	fs.governor = NULL;
+	mtree_entry_set_keywords_fs(entry, &fs, keywords, options);
+}
+
+/*
+ * As mtree_entry_set_keywords(), but read keyword values from `path', which
+ * is relative to the directory `dirfd'.
+ */
+void
+mtree_entry_set_keywords_at(struct mtree_entry *entry, int dirfd,
+    const char *path, uint64_t keywords, int options)
+{
+	struct mtree_entry_fs fs;
+
+	assert(entry != NULL);
+	assert(path != NULL);
+
+	fs.dirfd    = dirfd;
+	fs.name     = path;
+	fs.st       = NULL;
+	fs.cache    = NULL;
+	fs.governor = NULL;
+	mtree_entry_set_keywords_fs(entry, &fs, keywords, options);
 }
 
 /*
@@ -920,8 +1663,9 @@ void
 mtree_entry_set_keywords_stat(struct mtree_entry *entry, const struct stat *st,
     uint64_t keywords, int options)
 {
-	uint64_t kset;
-	uint64_t kclr;
+	struct mtree_entry_fs	fs;
+	uint64_t		kset;
+	uint64_t		kclr;
 
 	assert(entry != NULL);
 	assert(st != NULL);
@@ -937,8 +1681,14 @@ mtree_entry_set_keywords_stat(struct mtree_entry *entry, const struct stat *st,
 	else
 		kset = keywords & ~entry->data.keywords;
 
+	fs.dirfd    = AT_FDCWD;
+	fs.name     = (entry->orig != NULL) ? entry->orig : entry->path;
+	fs.st       = st;
+	fs.cache    = NULL;
+	fs.governor = NULL;
+
 	/* Overwrite is unused here. */
-	set_keywords(entry, st, kset, kclr, 0);
+	set_keywords(entry, &fs, st, kset, kclr, 0);
 }
 
 /*
@@ -982,7 +1732,8 @@ copy_keyword(struct mtree_entry_data *data, const struct mtree_entry_data *from,
 		break;
 	case MTREE_KEYWORD_MD5:
 	case MTREE_KEYWORD_MD5DIGEST:
-		mtree_copy_string(&data->md5digest, from->md5digest);
+		mtree_entry_data_set_digest(data, MTREE_DIGEST_MD5,
+		    mtree_entry_data_get_digest(from, MTREE_DIGEST_MD5));
 		break;
 	case MTREE_KEYWORD_MODE:
 		data->st_mode = from->st_mode & MODE_MASK;
@@ -1003,23 +1754,28 @@ copy_keyword(struct mtree_entry_data *data, const struct mtree_entry_data *from,
 	case MTREE_KEYWORD_RIPEMD160DIGEST:
 	case MTREE_KEYWORD_RMD160:
 	case MTREE_KEYWORD_RMD160DIGEST:
-		mtree_copy_string(&data->rmd160digest, from->rmd160digest);
+		mtree_entry_data_set_digest(data, MTREE_DIGEST_RMD160,
+		    mtree_entry_data_get_digest(from, MTREE_DIGEST_RMD160));
 		break;
 	case MTREE_KEYWORD_SHA1:
 	case MTREE_KEYWORD_SHA1DIGEST:
-		mtree_copy_string(&data->sha1digest, from->sha1digest);
+		mtree_entry_data_set_digest(data, MTREE_DIGEST_SHA1,
+		    mtree_entry_data_get_digest(from, MTREE_DIGEST_SHA1));
 		break;
 	case MTREE_KEYWORD_SHA256:
 	case MTREE_KEYWORD_SHA256DIGEST:
-		mtree_copy_string(&data->sha256digest, from->sha256digest);
+		mtree_entry_data_set_digest(data, MTREE_DIGEST_SHA256,
+		    mtree_entry_data_get_digest(from, MTREE_DIGEST_SHA256));
 		break;
 	case MTREE_KEYWORD_SHA384:
 	case MTREE_KEYWORD_SHA384DIGEST:
-		mtree_copy_string(&data->sha384digest, from->sha384digest);
+		mtree_entry_data_set_digest(data, MTREE_DIGEST_SHA384,
+		    mtree_entry_data_get_digest(from, MTREE_DIGEST_SHA384));
 		break;
 	case MTREE_KEYWORD_SHA512:
 	case MTREE_KEYWORD_SHA512DIGEST:
-		mtree_copy_string(&data->sha512digest, from->sha512digest);
+		mtree_entry_data_set_digest(data, MTREE_DIGEST_SHA512,
+		    mtree_entry_data_get_digest(from, MTREE_DIGEST_SHA512));
 		break;
 	case MTREE_KEYWORD_SIZE:
 		data->st_size = from->st_size;
@@ -1635,7 +2391,7 @@ mtree_entry_get_md5digest(struct mtree_entry *entry)
 
 	assert(entry != NULL);
 
-	return (entry->data.md5digest);
+	return (get_digest_hex(entry, MTREE_DIGEST_MD5));
 }
 
 int
@@ -1675,7 +2431,7 @@ mtree_entry_get_rmd160digest(struct mtree_entry *entry)
 
 	assert(entry != NULL);
 
-	return (entry->data.rmd160digest);
+	return (get_digest_hex(entry, MTREE_DIGEST_RMD160));
 }
 
 const char *
@@ -1684,7 +2440,7 @@ mtree_entry_get_sha1digest(struct mtree_entry *entry)
 
 	assert(entry != NULL);
 
-	return (entry->data.sha1digest);
+	return (get_digest_hex(entry, MTREE_DIGEST_SHA1));
 }
 
 const char *
@@ -1693,7 +2449,7 @@ mtree_entry_get_sha256digest(struct mtree_entry *entry)
 
 	assert(entry != NULL);
 
-	return (entry->data.sha256digest);
+	return (get_digest_hex(entry, MTREE_DIGEST_SHA256));
 }
 
 
@@ -1703,7 +2459,7 @@ mtree_entry_get_sha384digest(struct mtree_entry *entry)
 
 	assert(entry != NULL);
 
-	return (entry->data.sha384digest);
+	return (get_digest_hex(entry, MTREE_DIGEST_SHA384));
 }
 
 const char *
@@ -1712,7 +2468,7 @@ mtree_entry_get_sha512digest(struct mtree_entry *entry)
 
 	assert(entry != NULL);
 
-	return (entry->data.sha512digest);
+	return (get_digest_hex(entry, MTREE_DIGEST_SHA512));
 }
 
 int64_t
@@ -1906,10 +2662,7 @@ mtree_entry_set_md5digest(struct mtree_entry *entry, const char *digest,
 
 	assert(entry != NULL);
 
-	CLR_KEYWORD(entry, MTREE_KEYWORD_MASK_MD5);
-	SET_KEYWORD_DUP(entry, entry->data.md5digest,
-	    digest,
-	    keywords & MTREE_KEYWORD_MASK_MD5);
+	set_digest_hex(entry, MTREE_DIGEST_MD5, digest, keywords);
 }
 
 void
@@ -1983,10 +2736,7 @@ mtree_entry_set_rmd160digest(struct mtree_entry *entry, const char *digest,
 
 	assert(entry != NULL);
 
-	CLR_KEYWORD(entry, MTREE_KEYWORD_MASK_RMD160);
-	SET_KEYWORD_DUP(entry, entry->data.rmd160digest,
-	    digest,
-	    keywords & MTREE_KEYWORD_MASK_RMD160);
+	set_digest_hex(entry, MTREE_DIGEST_RMD160, digest, keywords);
 }
 
 void
@@ -1996,10 +2746,7 @@ mtree_entry_set_sha1digest(struct mtree_entry *entry, const char *digest,
 
 	assert(entry != NULL);
 
-	CLR_KEYWORD(entry, MTREE_KEYWORD_MASK_SHA1);
-	SET_KEYWORD_DUP(entry, entry->data.sha1digest,
-	    digest,
-	    keywords & MTREE_KEYWORD_MASK_SHA1);
+	set_digest_hex(entry, MTREE_DIGEST_SHA1, digest, keywords);
 }
 
 void
@@ -2009,10 +2756,7 @@ mtree_entry_set_sha256digest(struct mtree_entry *entry, const char *digest,
 
 	assert(entry != NULL);
 
-	CLR_KEYWORD(entry, MTREE_KEYWORD_MASK_SHA256);
-	SET_KEYWORD_DUP(entry, entry->data.sha256digest,
-	    digest,
-	    keywords & MTREE_KEYWORD_MASK_SHA256);
+	set_digest_hex(entry, MTREE_DIGEST_SHA256, digest, keywords);
 }
 
 void
@@ -2022,10 +2766,7 @@ mtree_entry_set_sha384digest(struct mtree_entry *entry, const char *digest,
 
 	assert(entry != NULL);
 
-	CLR_KEYWORD(entry, MTREE_KEYWORD_MASK_SHA384);
-	SET_KEYWORD_DUP(entry, entry->data.sha384digest,
-	    digest,
-	    keywords & MTREE_KEYWORD_MASK_SHA384);
+	set_digest_hex(entry, MTREE_DIGEST_SHA384, digest, keywords);
 }
 
 void
@@ -2035,10 +2776,7 @@ mtree_entry_set_sha512digest(struct mtree_entry *entry, const char *digest,
 
 	assert(entry != NULL);
 
-	CLR_KEYWORD(entry, MTREE_KEYWORD_MASK_SHA512);
-	SET_KEYWORD_DUP(entry, entry->data.sha512digest,
-	    digest,
-	    keywords & MTREE_KEYWORD_MASK_SHA512);
+	set_digest_hex(entry, MTREE_DIGEST_SHA512, digest, keywords);
 }
 
 void
@@ -32,9 +32,11 @@
 
 int	 mtree_cksum_fd(int fd, uint32_t *crc);
 int	 mtree_cksum_path(const char *path, uint32_t *crc);
+int	 mtree_cksum_path_at(int dirfd, const char *path, uint32_t *crc);
 
 char	*mtree_digest_fd(int types, int fd);
 char	*mtree_digest_path(int types, const char *path);
+char	*mtree_digest_path_at(int types, int dirfd, const char *path);
 
 int	 mtree_spec_read_spec_file(struct mtree_spec *spec, FILE *fp);
 int	 mtree_spec_read_spec_fd(struct mtree_spec *spec, int fd);
@@ -0,0 +1,293 @@
+/*-
+ * Copyright (c) 2015 Michal Ratajsky <michal@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <assert.h>
+#include <errno.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(HAVE_DECL_SYS_IOPRIO_SET) && HAVE_DECL_SYS_IOPRIO_SET && \
+    defined(HAVE_DECL_SYS_IOPRIO_GET) && HAVE_DECL_SYS_IOPRIO_GET
+#define USE_IOPRIO
+#include <sys/syscall.h>
+#endif
+
+#include "compat.h"
+#include "mtree.h"
+#include "mtree_private.h"
+
+/*
+ * Limits on reading of file contents.
+ *
+ * The rates of bytes and files are limited by pacing: every read moves the
+ * time when the next one may start by its share of a second, and readers
+ * sleep until then. Reading may run ahead of the rate by GOVERNOR_BURST, so
+ * that short pauses of the reader do not lower the resulting rate.
+ *
+ * With a latency target, the average latency of reads is tracked. Once it
+ * exceeds the target, the window of reads in flight is halved, and it grows
+ * back by one with every read faster than the target. A reader which has
+ * only a single read in flight waits for as long as the average latency
+ * instead.
+ */
+#define GOVERNOR_BURST		(100 * 1000 * 1000)	/* ns */
+#define GOVERNOR_MAX_WINDOW	64
+#define NSEC_PER_SEC		1000000000ULL
+
+struct mtree_governor {
+	uint64_t		 byte_rate;	/* bytes per second */
+	uint64_t		 file_rate;	/* files per second */
+	uint64_t		 latency;	/* target in ns */
+	uint64_t		 byte_next;	/* when the next byte may be read */
+	uint64_t		 file_next;	/* when the next file may be read */
+	uint64_t		 avg_latency;
+	int			 window;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t		 lock;
+#endif
+};
+
+#ifdef HAVE_PTHREAD
+#define GOVERNOR_LOCK(g)	pthread_mutex_lock(&(g)->lock)
+#define GOVERNOR_UNLOCK(g)	pthread_mutex_unlock(&(g)->lock)
+#else
+#define GOVERNOR_LOCK(g)	do { } while (0)
+#define GOVERNOR_UNLOCK(g)	do { } while (0)
+#endif
+
+/*
+ * Get the current time in nanoseconds, which only goes forward.
+ */
+uint64_t
+mtree_governor_now(void)
+{
+	struct timeval	tv;
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return ((uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec);
+#endif
+	gettimeofday(&tv, NULL);
+	return ((uint64_t)tv.tv_sec * NSEC_PER_SEC + tv.tv_usec * 1000);
+}
+
+static void
+governor_sleep(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec  = ns / NSEC_PER_SEC;
+	ts.tv_nsec = ns % NSEC_PER_SEC;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		continue;
+}
+
+/*
+ * Reserve time for `amount' units read at the given rate, return how long
+ * the reader has to wait.
+ */
+static uint64_t
+governor_pace(uint64_t *next, uint64_t now, uint64_t amount, uint64_t rate)
+{
+
+	if (*next + GOVERNOR_BURST < now)
+		*next = now - GOVERNOR_BURST;
+	*next += amount / rate * NSEC_PER_SEC +
+	    amount % rate * NSEC_PER_SEC / rate;
+	return (*next > now ? *next - now : 0);
+}
+
+/*
+ * Create a new governor, the rates are in units per second and the latency
+ * in nanoseconds. Zero means no limit.
+ */
+struct mtree_governor *
+mtree_governor_create(uint64_t byte_rate, uint64_t file_rate,
+    uint64_t latency)
+{
+	struct mtree_governor *g;
+
+	g = calloc(1, sizeof(struct mtree_governor));
+	if (g == NULL)
+		return (NULL);
+	g->byte_rate = byte_rate;
+	g->file_rate = file_rate;
+	g->latency   = latency;
+	g->window    = GOVERNOR_MAX_WINDOW;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&g->lock, NULL);
+#endif
+	return (g);
+}
+
+/*
+ * Free the given governor.
+ */
+void
+mtree_governor_free(struct mtree_governor *g)
+{
+
+	assert(g != NULL);
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&g->lock);
+#endif
+	free(g);
+}
+
+/*
+ * Wait until the next file may be read. The governor may be NULL.
+ */
+void
+mtree_governor_file(struct mtree_governor *g)
+{
+	uint64_t wait;
+
+	if (g == NULL || g->file_rate == 0)
+		return;
+	GOVERNOR_LOCK(g);
+	wait = governor_pace(&g->file_next, mtree_governor_now(), 1,
+	    g->file_rate);
+	GOVERNOR_UNLOCK(g);
+	if (wait > 0)
+		governor_sleep(wait);
+}
+
+/*
+ * Account for `len' bytes that took `latency' nanoseconds to read, with
+ * `inflight' reads being in progress at once, and wait until reading may
+ * continue. The governor may be NULL.
+ */
+void
+mtree_governor_read(struct mtree_governor *g, size_t len, uint64_t latency,
+    int inflight)
+{
+	uint64_t wait;
+
+	if (g == NULL)
+		return;
+	wait = 0;
+	GOVERNOR_LOCK(g);
+	if (g->byte_rate != 0)
+		wait = governor_pace(&g->byte_next, mtree_governor_now(), len,
+		    g->byte_rate);
+	if (g->latency != 0) {
+		g->avg_latency = (g->avg_latency * 7 + latency) / 8;
+		if (g->avg_latency > g->latency) {
+			if (inflight > 1) {
+				if (g->window > inflight / 2)
+					g->window = inflight / 2;
+			} else if (wait < g->avg_latency)
+				wait = g->avg_latency;
+		} else if (latency <= g->latency &&
+		    g->window < GOVERNOR_MAX_WINDOW)
+			g->window++;
+	}
+	GOVERNOR_UNLOCK(g);
+	if (wait > 0)
+		governor_sleep(wait);
+}
+
+/*
+ * Get the number of reads which may be in flight at once, at most `max'.
+ * The governor may be NULL.
+ */
+int
+mtree_governor_get_window(struct mtree_governor *g, int max)
+{
+	int window;
+
+	if (g == NULL || g->latency == 0)
+		return (max);
+	GOVERNOR_LOCK(g);
+	window = g->window;
+	GOVERNOR_UNLOCK(g);
+	return (window < max ? window : max);
+}
+
+/*
+ * Set the I/O priority of the calling thread to one of the MTREE_IO_PRIORITY
+ * classes. If `saved' is not NULL, the previous priority is stored there for
+ * mtree_governor_restore_io_priority().
+ *
+ * This is supported only on Linux, elsewhere nothing is done.
+ */
+void
+mtree_governor_set_io_priority(int priority, int *saved)
+{
+#ifdef USE_IOPRIO
+	int value;
+	int err = errno;
+
+	/* See ioprio_set(2), the calling thread is selected by zero. */
+	if (saved != NULL)
+		*saved = syscall(SYS_ioprio_get, 1, 0);
+	switch (priority) {
+	case MTREE_IO_PRIORITY_LOW:
+		value = 2 << 13 | 7;		/* lowest of best effort */
+		break;
+	case MTREE_IO_PRIORITY_IDLE:
+		value = 3 << 13;		/* idle */
+		break;
+	default:
+		value = 0;			/* derived from CPU nice */
+		break;
+	}
+	(void)syscall(SYS_ioprio_set, 1, 0, value);
+	errno = err;
+#else
+	(void)priority;
+	if (saved != NULL)
+		*saved = -1;
+#endif
+}
+
+/*
+ * Restore the I/O priority saved by mtree_governor_set_io_priority().
+ */
+void
+mtree_governor_restore_io_priority(int saved)
+{
+#ifdef USE_IOPRIO
+	int err = errno;
+
+	if (saved != -1)
+		(void)syscall(SYS_ioprio_set, 1, 0, saved);
+	errno = err;
+#else
+	(void)saved;
+#endif
+}
@@ -0,0 +1,331 @@
+/*-
+ * Copyright (c) 2015 Michal Ratajsky <michal@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* Needed for SEEK_DATA and SEEK_HOLE. */
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compat.h"
+#include "mtree.h"
+#include "mtree_private.h"
+
+#ifndef POSIX_FADV_SEQUENTIAL
+#define POSIX_FADV_SEQUENTIAL	2
+#endif
+#ifndef POSIX_FADV_DONTNEED
+#define POSIX_FADV_DONTNEED	4
+#endif
+
+/*
+ * Reading of file contents for calculating checksums.
+ *
+ * The buffer size is chosen from the preferred block size and the size of
+ * the file. Files are not mapped to memory, a file truncated while being
+ * read would raise SIGBUS. The kernel is told that the file is going to be
+ * read sequentially, and optionally that the cached data are no longer
+ * needed once the file is read. Holes of sparse files are found with
+ * SEEK_DATA and SEEK_HOLE and skipped instead of being read.
+ */
+#define IO_MIN_BUFSIZE		(16 * 1024)
+#define IO_MAX_BUFSIZE		(256 * 1024)
+#define IO_ZEROS_SIZE		(64 * 1024)	/* shared page of zeros */
+
+static void
+io_advise(int fd, int advice)
+{
+#ifdef HAVE_POSIX_FADVISE
+	int err = errno;
+
+	/* This is only a hint, errors are ignored. */
+	(void)posix_fadvise(fd, 0, 0, advice);
+	errno = err;
+#else
+	(void)fd;
+	(void)advice;
+#endif
+}
+
+/*
+ * Choose the size of the read buffer, `st' is NULL if unknown.
+ */
+static size_t
+io_bufsize(const struct stat *st)
+{
+	size_t blksize, size;
+
+	if (st == NULL || !S_ISREG(st->st_mode))
+		return (IO_MIN_BUFSIZE);
+	blksize = (st->st_blksize > 0) ? (size_t)st->st_blksize : 4096;
+	if (st->st_size <= IO_MIN_BUFSIZE)
+		return (IO_MIN_BUFSIZE);
+	if (st->st_size >= IO_MAX_BUFSIZE)
+		size = IO_MAX_BUFSIZE;
+	else
+		size = st->st_size;
+	/* Whole blocks, one more to see the end of file in a single read. */
+	size = (size / blksize + 1) * blksize;
+	if (size > IO_MAX_BUFSIZE)
+		size = IO_MAX_BUFSIZE;
+	return (size);
+}
+
+/*
+ * Read at most `limit' bytes of the file into the buffer, or until the end
+ * of file if `limit' is -1.
+ */
+static int
+io_read(int fd, unsigned char *buf, size_t bufsize, off_t limit,
+    struct mtree_governor *g, mtree_io_fn f, void *user_data)
+{
+	uint64_t	start;
+	off_t		total;
+	size_t		len;
+	ssize_t		n;
+
+	for (total = 0;; total += n) {
+		len = bufsize;
+		if (limit != -1) {
+			if (total >= limit)
+				return (0);
+			if ((off_t)len > limit - total)
+				len = limit - total;
+		}
+		start = (g != NULL) ? mtree_governor_now() : 0;
+		n = read(fd, buf, len);
+		if (n > 0) {
+			if (g != NULL)
+				mtree_governor_read(g, n,
+				    mtree_governor_now() - start, 1);
+			f(buf, n, user_data);
+		} else if (n == 0)
+			return (0);
+		else if (errno != EINTR)
+			return (-1);
+		else
+			n = 0;
+	}
+}
+
+/*
+ * Pass `len' zero bytes to `f' from the shared page of zeros.
+ */
+void
+mtree_io_zeros(uint64_t len, mtree_io_fn f, void *user_data)
+{
+	static const unsigned char zeros[IO_ZEROS_SIZE];
+	size_t n;
+
+	for (; len > 0; len -= n) {
+		n = IO_ZEROS_SIZE;
+		if (len < n)
+			n = len;
+		f(zeros, n, user_data);
+	}
+}
+
+#ifdef SEEK_HOLE
+/*
+ * Check whether the file has holes after the current position. Files which
+ * occupy all of their blocks are not checked.
+ */
+static int
+io_is_sparse(int fd, const struct stat *st)
+{
+	off_t	pos, hole;
+	int	err;
+
+	if (!S_ISREG(st->st_mode) || st->st_blocks * 512 >= st->st_size)
+		return (0);
+	err = errno;
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos == -1 || pos >= st->st_size)
+		return (0);
+	hole = lseek(fd, pos, SEEK_HOLE);
+	if (lseek(fd, pos, SEEK_SET) == -1 || hole == -1) {
+		/* Holes may not be supported by the file system. */
+		errno = err;
+		return (0);
+	}
+	return (hole < st->st_size);
+}
+
+/*
+ * Read a sparse file, holes are passed to `hole' without reading them.
+ */
+static int
+io_read_sparse(int fd, unsigned char *buf, size_t bufsize,
+    struct mtree_governor *g, mtree_io_fn f, mtree_io_hole_fn hole,
+    void *user_data)
+{
+	off_t	pos, data, end;
+
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos == -1)
+		return (-1);
+	for (;;) {
+		data = lseek(fd, pos, SEEK_DATA);
+		if (data == -1) {
+			if (errno != ENXIO)
+				return (-1);
+			/* There are no data left, only a hole at the end. */
+			data = lseek(fd, 0, SEEK_END);
+			if (data == -1)
+				return (-1);
+		}
+		if (data > pos)
+			hole(data - pos, user_data);
+		pos = data;
+		end = lseek(fd, pos, SEEK_HOLE);
+		if (end == -1) {
+			if (errno != ENXIO)
+				return (-1);
+			/* The file was truncated, there is nothing more. */
+			return (0);
+		}
+		if (end == pos)
+			return (0);
+		if (lseek(fd, pos, SEEK_SET) == -1)
+			return (-1);
+		if (io_read(fd, buf, bufsize, end - pos, g, f,
+		    user_data) == -1)
+			return (-1);
+		pos = end;
+	}
+}
+
+struct io_zeros_data {
+	mtree_io_fn	 f;
+	void		*user_data;
+};
+
+static void
+io_hole_zeros(uint64_t len, void *user_data)
+{
+	struct io_zeros_data *z = user_data;
+
+	mtree_io_zeros(len, z->f, z->user_data);
+}
+#endif
+
+/*
+ * Read the remaining contents of the file and pass them to `f' piece
+ * by piece.
+ *
+ * Holes of sparse files are not read, they are passed to `hole' as their
+ * length, or to `f' as zeros if `hole' is NULL.
+ *
+ * With MTREE_IO_DONTNEED, the data are removed from the page cache once
+ * the file is read.
+ *
+ * Reads are limited by the governor `g' unless it is NULL.
+ *
+ * Returns 0 on success, -1 on error with errno set.
+ */
+int
+mtree_io_read_fd(int fd, int options, struct mtree_governor *g,
+    mtree_io_fn f, mtree_io_hole_fn hole, void *user_data)
+{
+	unsigned char		 stackbuf[IO_MIN_BUFSIZE];
+	unsigned char		*buf;
+#ifdef SEEK_HOLE
+	struct io_zeros_data	 z;
+#endif
+	struct stat		 st;
+	struct stat		*stp;
+	size_t			 bufsize;
+	int			 sparse;
+	int			 ret;
+
+	assert(f != NULL);
+#ifndef SEEK_HOLE
+	(void)hole;
+#endif
+
+	stp = NULL;
+	if (fstat(fd, &st) == 0)
+		stp = &st;
+	sparse = 0;
+#ifdef SEEK_HOLE
+	if (stp != NULL)
+		sparse = io_is_sparse(fd, stp);
+#endif
+	if (stp != NULL && S_ISREG(stp->st_mode))
+		io_advise(fd, POSIX_FADV_SEQUENTIAL);
+	/* Without memory for the larger buffer, use the smallest one. */
+	bufsize = io_bufsize(stp);
+	buf = NULL;
+	if (bufsize > sizeof(stackbuf))
+		buf = malloc(bufsize);
+	if (buf == NULL) {
+		buf = stackbuf;
+		bufsize = sizeof(stackbuf);
+	}
+#ifdef SEEK_HOLE
+	if (sparse) {
+		if (hole == NULL) {
+			z.f = f;
+			z.user_data = user_data;
+			ret = io_read_sparse(fd, buf, bufsize, g, f,
+			    io_hole_zeros, &z);
+		} else
+			ret = io_read_sparse(fd, buf, bufsize, g, f, hole,
+			    user_data);
+	} else
+#endif
+		ret = io_read(fd, buf, bufsize, -1, g, f, user_data);
+	if (buf != stackbuf) {
+		int err = errno;
+
+		free(buf);
+		errno = err;
+	}
+	if (options & MTREE_IO_DONTNEED)
+		io_advise(fd, POSIX_FADV_DONTNEED);
+	return (ret);
+}
+
+/*
+ * Drop cached contents of the file, see mtree_io_read_fd().
+ */
+void
+mtree_io_dontneed(int fd)
+{
+
+	io_advise(fd, POSIX_FADV_DONTNEED);
+}
@@ -30,6 +30,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <fcntl.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -38,11 +39,32 @@
 
 #define	IS_DOT(nm)		((nm)[0] == '.' && (nm)[1] == '\0')
 #define	IS_DOTDOT(nm)		((nm)[0] == '.' && (nm)[1] == '.' && (nm)[2] == '\0')
+/* Are the `len' characters at `s' the string literal `name'? */
+#define	NAME_IS(s, len, name)						\
+	((len) == sizeof(name) - 1 && memcmp((s), (name), (len)) == 0)
 
 #define MAX_ERRSTR_LENGTH	1024
 #define MAX_LINE_LENGTH		4096
 #define MODE_MASK		(S_ISUID|S_ISGID|S_ISVTX|S_IRWXU|S_IRWXG|S_IRWXO)
 
+/*
+ * Files are accessed relative to open directories when all of the *at()
+ * functions are available, otherwise full paths are used with AT_FDCWD.
+ */
+#if defined(HAVE_OPENAT) && defined(HAVE_FSTATAT) && \
+    defined(HAVE_READLINKAT) && defined(HAVE_FDOPENDIR) && defined(HAVE_DIRFD)
+#define MTREE_USE_AT
+#endif
+#ifndef AT_FDCWD
+#define AT_FDCWD		-100
+#endif
+#ifndef AT_SYMLINK_NOFOLLOW
+#define AT_SYMLINK_NOFOLLOW	0x100
+#endif
+#ifndef AT_STATX_DONT_SYNC
+#define AT_STATX_DONT_SYNC	0x4000
+#endif
+
 /*
  * Universal trie item, used when only the presence of a key matters.
  */
@@ -57,7 +79,9 @@
 #define WARN(...) do { } while (0)
 #endif
 
+struct mtree_arena;
 struct mtree_cksum;
+struct mtree_governor;
 struct mtree_device;
 struct mtree_entry;
 struct mtree_entry_data;
@@ -96,7 +120,14 @@ struct mtree_device {
 
 /*
  * struct mtree_entry_data
+ *
+ * Digests are kept in binary, one after another in the order of their
+ * mtree_digest types, see mtree_entry_data_get_digest(). The array of their
+ * hexadecimal strings is only allocated by the public getters and indexed
+ * by the bit number of the type.
  */
+#define MTREE_DIGEST_TYPES	6	/* MD5 to RMD160 */
+
 struct mtree_entry_data {
 	uint64_t		 keywords;
 	mtree_entry_type	 type;		/* keyword values */
@@ -109,12 +140,9 @@ struct mtree_entry_data {
 	char			*link;
 	char			*tags;
 	char			*uname;
-	char			*md5digest;
-	char			*rmd160digest;
-	char			*sha1digest;
-	char			*sha256digest;
-	char			*sha384digest;
-	char			*sha512digest;
+	unsigned char		*digests;	/* packed digest values */
+	char			**digests_hex;	/* formatted by getters */
+	int			 digest_types;	/* digests in `digests' */
 	int64_t			 st_gid;	/* stat(2) values */
 	uint64_t		 st_ino;
 	int			 st_mode;
@@ -130,6 +158,7 @@ struct mtree_entry_data {
 #define __MTREE_ENTRY_VIRTUAL		0x01	/* artificially created entry */
 #define __MTREE_ENTRY_SKIP		0x02	/* skip the entry */
 #define __MTREE_ENTRY_SKIP_CHILDREN	0x04	/* skip children of the entry */
+#define __MTREE_ENTRY_LINKED		0x08	/* checksums come from another link */
 
 /*
  * struct mtree_entry
@@ -144,6 +173,83 @@ struct mtree_entry {
 	char			*orig;
 	char			*dirname;
 	int			 flags;
+	struct mtree_arena	*arena;		/* of the entry, path and name */
+};
+
+/*
+ * struct mtree_entry_fs
+ * Location of an entry in the file system, used for reading keyword values.
+ */
+struct mtree_entry_fs {
+	int			 dirfd;		/* directory `name' is relative to */
+	const char		*name;
+	const struct stat	*st;		/* result of stat(2), if known */
+	struct mtree_cache	*cache;		/* of checksums, may be NULL */
+	struct mtree_governor	*governor;	/* limits of reading, may be NULL */
+};
+
+/*
+ * struct mtree_cache_key
+ * State of a file the cached checksums are valid for.
+ */
+struct mtree_cache_key {
+	uint64_t		 dev;
+	uint64_t		 ino;
+	int64_t			 size;
+	int64_t			 mtime_sec;
+	int64_t			 ctime_sec;
+	int32_t			 mtime_nsec;
+	int32_t			 ctime_nsec;
+};
+
+/*
+ * Reading of file contents, see mtree_io_read_fd().
+ */
+#define MTREE_IO_DONTNEED	0x01	/* drop the data from the page cache */
+
+typedef void (*mtree_io_fn)(const unsigned char *buf, size_t len,
+    void *user_data);
+typedef void (*mtree_io_hole_fn)(uint64_t len, void *user_data);
+
+/*
+ * Keywords calculated from file contents.
+ */
+#define MTREE_KEYWORD_MASK_CHECKSUMS	(MTREE_KEYWORD_CKSUM |		\
+					 MTREE_KEYWORD_MASK_DIGEST)
+
+/*
+ * struct mtree_md_ctx
+ * Context of the built-in MD5, SHA1 and SHA256.
+ */
+struct mtree_md_ctx {
+	uint32_t		 state[8];
+	uint64_t		 count;		/* bytes processed */
+	unsigned char		 buf[64];	/* incomplete block */
+	void			(*block)(uint32_t *, const unsigned char *,
+				    size_t);
+};
+
+/*
+ * Size in bytes of the largest digest.
+ */
+#define MTREE_DIGEST_MAX_SIZE		64	/* SHA512 */
+
+/*
+ * Multi-buffer hashing of small messages.
+ */
+#define MTREE_DIGEST_MB_MAX_LANES	16
+#define MTREE_DIGEST_MB_RESULT_SIZE	32	/* SHA256 */
+
+/*
+ * struct mtree_entry_checksums
+ * Calculation of cksum and digests of an entry.
+ */
+struct mtree_entry_checksums {
+	struct mtree_entry	*entry;
+	struct mtree_cksum	*cksum;
+	struct mtree_digest	*digest;
+	uint64_t		 keywords;
+	int			 digests;
 };
 
 /*
@@ -156,7 +262,9 @@ struct mtree_reader {
 	struct mtree_entry_data  defaults;
 	char			*buf;
 	int			 buflen;
+	char			*dirbuf;
 	int			 path_last;
+	int			 relative;	/* entries using the parent */
 	dev_t			 base_dev;
 	char			*error;
 	uint64_t		 path_keywords;
@@ -165,6 +273,18 @@ struct mtree_reader {
 	mtree_entry_filter_fn	 filter;
 	void			*filter_data;
 	struct mtree_trie	*skip_trie;
+	struct mtree_trie	*previous;	/* entries reused by path */
+	struct link_table	*links;		/* hard links being read */
+	int			 threads;
+	int			 checksum_threads;
+	struct checksum_pool	*pool;
+	struct mtree_cache	*cache;
+	uint64_t		 byte_rate;	/* limits of reading contents */
+	uint64_t		 file_rate;
+	uint64_t		 latency;
+	int			 io_priority;
+	struct mtree_governor	*governor;	/* while reading a path */
+	struct mtree_arena	*arena;		/* of entries read from specs */
 };
 
 typedef int (*writer_fn)(struct mtree_writer *, const char *);
@@ -233,14 +353,80 @@ struct mtree_keyword_map {
 
 extern const struct mtree_keyword_map mtree_keywords[];
 
+/* mtree_arena.c */
+struct mtree_arena	*mtree_arena_create(void);
+void			 mtree_arena_ref(struct mtree_arena *arena,
+			    unsigned long n);
+void			 mtree_arena_release(struct mtree_arena *arena,
+			    unsigned long n);
+void			*mtree_arena_alloc(struct mtree_arena *arena,
+			    size_t size);
+char			*mtree_arena_alloc_string(struct mtree_arena *arena,
+			    size_t len);
+char			*mtree_arena_strndup(struct mtree_arena *arena,
+			    const char *s, size_t len);
+
+/* mtree_cache.c */
+void			 mtree_cache_key_from_stat(struct mtree_cache_key *key,
+			    const struct stat *st);
+int			 mtree_cache_get(struct mtree_cache *cache,
+			    const struct mtree_cache_key *key,
+			    struct mtree_entry *entry, int digests,
+			    uint64_t keywords);
+void			 mtree_cache_put(struct mtree_cache *cache,
+			    const struct mtree_cache_key *key,
+			    struct mtree_entry *entry, int digests,
+			    uint64_t keywords);
+
+/* mtree_cksum.c */
+#define MTREE_CKSUM_CHUNK	(64 * 1024 * 1024)	/* of parallel reading */
+
+uint32_t		 mtree_cksum_combine(uint32_t crc1, uint32_t crc2,
+			    uint64_t len2);
+int			 mtree_cksum_update_fd(struct mtree_cksum *cksum,
+			    int fd, size_t chunk, int threads);
+void			 mtree_cksum_update_zeros(struct mtree_cksum *cksum,
+			    uint64_t len);
+
 /* mtree_device.c */
 int			 mtree_device_compare(const struct mtree_device *dev1,
 			    const struct mtree_device *dev2);
 void			 mtree_device_copy_data(struct mtree_device *dev,
 			    const struct mtree_device *from);
 
+/* mtree_digest.c */
+size_t			 mtree_digest_get_size(int type);
+const unsigned char	*mtree_digest_get_bytes(struct mtree_digest *digest,
+			    int type);
+void			 mtree_digest_to_hex(const unsigned char *bytes,
+			    size_t len, char *s);
+int			 mtree_digest_from_hex(const char *s,
+			    unsigned char *bytes, size_t len);
+
+/* mtree_digest_builtin.c */
+void			 mtree_md_update(struct mtree_md_ctx *ctx,
+			    const unsigned char *data, size_t len);
+const char		*mtree_md_get_backend(int type);
+void			 mtree_md5_init(struct mtree_md_ctx *ctx);
+void			 mtree_md5_final(struct mtree_md_ctx *ctx,
+			    unsigned char *out);
+void			 mtree_sha1_init(struct mtree_md_ctx *ctx);
+void			 mtree_sha1_final(struct mtree_md_ctx *ctx,
+			    unsigned char *out);
+void			 mtree_sha256_init(struct mtree_md_ctx *ctx);
+void			 mtree_sha256_final(struct mtree_md_ctx *ctx,
+			    unsigned char *out);
+
+/* mtree_digest_mb.c */
+int			 mtree_digest_mb_get_lanes(void);
+int			 mtree_digest_mb_get_types(void);
+void			 mtree_digest_mb(int type, int n,
+			    const unsigned char *const data[], const size_t len[],
+			    unsigned char *result[]);
+
 /* mtree_entry.c */
 struct mtree_entry	*mtree_entry_create_empty(void);
+struct mtree_entry	*mtree_entry_create_arena(struct mtree_arena *arena);
 int			 mtree_entry_data_compare_keyword(
 			    const struct mtree_entry_data *data1,
 			    const struct mtree_entry_data *data2,
@@ -250,6 +436,61 @@ void			 mtree_entry_data_copy_keywords(
 			    const struct mtree_entry_data *from,
 			    uint64_t keywords, int overwrite);
 void			 mtree_entry_free_data_items(struct mtree_entry_data *data);
+const unsigned char	*mtree_entry_data_get_digest(
+			    const struct mtree_entry_data *data, int type);
+int			 mtree_entry_data_set_digest(
+			    struct mtree_entry_data *data, int type,
+			    const unsigned char *bytes);
+uint64_t		 mtree_entry_digest_keywords(int type);
+void			 mtree_entry_set_digest(struct mtree_entry *entry,
+			    int type, const unsigned char *bytes,
+			    uint64_t keywords);
+void			 mtree_entry_set_keywords_fs(struct mtree_entry *entry,
+			    const struct mtree_entry_fs *fs, uint64_t keywords,
+			    int options);
+int			 mtree_entry_checksums_init(
+			    struct mtree_entry_checksums *c,
+			    struct mtree_entry *entry, int digests,
+			    uint64_t keywords);
+void			 mtree_entry_checksums_update(
+			    struct mtree_entry_checksums *c, const void *buf,
+			    size_t len);
+void			 mtree_entry_checksums_update_zeros(
+			    struct mtree_entry_checksums *c, uint64_t len);
+int			 mtree_entry_checksums_read_fd(
+			    struct mtree_entry_checksums *c, int fd,
+			    int options, struct mtree_governor *g);
+int			 mtree_entry_checksums_read_whole(
+			    const struct mtree_entry_checksums *c,
+			    const struct stat *st);
+void			 mtree_entry_checksums_finish(
+			    struct mtree_entry_checksums *c, int success);
+int			 mtree_entry_checksums_digests(uint64_t keywords);
+int			 mtree_entry_checksums_batch(struct mtree_entry **entries,
+			    int n, const unsigned char *const data[],
+			    const size_t len[], uint64_t keywords);
+
+/* mtree_governor.c */
+struct mtree_governor	*mtree_governor_create(uint64_t byte_rate,
+			    uint64_t file_rate, uint64_t latency);
+void			 mtree_governor_free(struct mtree_governor *g);
+uint64_t		 mtree_governor_now(void);
+void			 mtree_governor_file(struct mtree_governor *g);
+void			 mtree_governor_read(struct mtree_governor *g,
+			    size_t len, uint64_t latency, int inflight);
+int			 mtree_governor_get_window(struct mtree_governor *g,
+			    int max);
+void			 mtree_governor_set_io_priority(int priority,
+			    int *saved);
+void			 mtree_governor_restore_io_priority(int saved);
+
+/* mtree_io.c */
+int			 mtree_io_read_fd(int fd, int options,
+			    struct mtree_governor *g, mtree_io_fn f,
+			    mtree_io_hole_fn hole, void *user_data);
+void			 mtree_io_zeros(uint64_t len, mtree_io_fn f,
+			    void *user_data);
+void			 mtree_io_dontneed(int fd);
 
 /* mtree_reader.c */
 struct mtree_reader	*mtree_reader_create(void);
@@ -257,10 +498,15 @@ void			 mtree_reader_free(struct mtree_reader *r);
 void			 mtree_reader_reset(struct mtree_reader *r);
 int			 mtree_reader_read_path(struct mtree_reader *r, const char *path,
 			    struct mtree_entry **entries);
+int			 mtree_reader_read_path_incremental(
+			    struct mtree_reader *r, const char *path,
+			    struct mtree_entry *previous,
+			    struct mtree_entry **entries);
 int			 mtree_reader_add(struct mtree_reader *r, const char *s,
 			    ssize_t len);
 int			 mtree_reader_add_from_file(struct mtree_reader *r, FILE *fp);
 int			 mtree_reader_add_from_fd(struct mtree_reader *r, int fd);
+int			 mtree_reader_add_mapped(struct mtree_reader *r, int fd);
 int			 mtree_reader_finish(struct mtree_reader *r,
 			    struct mtree_entry **entries);
 
@@ -275,6 +521,27 @@ void			 mtree_reader_set_spec_keywords(struct mtree_reader *r,
 uint64_t		 mtree_reader_get_path_keywords(struct mtree_reader *r);
 void			 mtree_reader_set_path_keywords(struct mtree_reader *r,
 			    uint64_t keywords);
+int			 mtree_reader_get_threads(struct mtree_reader *r);
+void			 mtree_reader_set_threads(struct mtree_reader *r,
+			    int threads);
+int			 mtree_reader_get_checksum_threads(struct mtree_reader *r);
+void			 mtree_reader_set_checksum_threads(struct mtree_reader *r,
+			    int threads);
+struct mtree_cache	*mtree_reader_get_cache(struct mtree_reader *r);
+void			 mtree_reader_set_cache(struct mtree_reader *r,
+			    struct mtree_cache *cache);
+uint64_t		 mtree_reader_get_byte_rate(struct mtree_reader *r);
+void			 mtree_reader_set_byte_rate(struct mtree_reader *r,
+			    uint64_t rate);
+uint64_t		 mtree_reader_get_file_rate(struct mtree_reader *r);
+void			 mtree_reader_set_file_rate(struct mtree_reader *r,
+			    uint64_t rate);
+uint64_t		 mtree_reader_get_latency(struct mtree_reader *r);
+void			 mtree_reader_set_latency(struct mtree_reader *r,
+			    uint64_t usec);
+int			 mtree_reader_get_io_priority(struct mtree_reader *r);
+void			 mtree_reader_set_io_priority(struct mtree_reader *r,
+			    int priority);
 
 const char		*mtree_reader_get_error(struct mtree_reader *r);
 void			 mtree_reader_set_errno_error(struct mtree_reader *r,
@@ -282,6 +549,9 @@ void			 mtree_reader_set_errno_error(struct mtree_reader *r,
 void			 mtree_reader_set_errno_prefix(struct mtree_reader *r,
 			    int err, const char *prefix, ...);
 
+/* mtree_scan.c */
+size_t			 mtree_scan_line(const char *s, size_t len);
+
 /* mtree_writer.c */
 struct mtree_writer	*mtree_writer_create(void);
 void			 mtree_writer_free(struct mtree_writer *w);
@@ -306,6 +576,11 @@ int			 mtree_trie_insert(struct mtree_trie *trie, const char *key,
 void			*mtree_trie_find(struct mtree_trie *trie, const char *key);
 size_t			 mtree_trie_count(struct mtree_trie *trie);
 
+/* mtree_uring.c */
+int			 mtree_uring_checksums(struct mtree_entry **entries,
+			    size_t count, uint64_t keywords, int options,
+			    struct mtree_governor *g, size_t *left);
+
 /* mtree_utils.c */
 int64_t			 mtree_atol(const char *p, const char **endptr);
 int64_t			 mtree_atol8(const char *p, const char **endptr);
@@ -313,11 +588,16 @@ int64_t			 mtree_atol10(const char *p, const char **endptr);
 int64_t			 mtree_atol16(const char *p, const char **endptr);
 int			 mtree_cleanup_path(const char *path, char **ppart,
 			    char **npart);
+int			 mtree_cleanup_path_arena(const char *path,
+			    struct mtree_arena *arena, char **ppart, char **npart);
 char			*mtree_concat_path(const char *d, const char *f);
 int			 mtree_copy_string(char **dst, const char *src);
 char			*mtree_gname_from_gid(gid_t gid);
 char			*mtree_uname_from_uid(uid_t uid);
-char			*mtree_readlink(const char *path);
+int			 mtree_open_at(int dirfd, const char *path, int flags);
+int			 mtree_stat_at(int dirfd, const char *path, struct stat *st,
+			    int flags, uint64_t keywords);
+char			*mtree_readlink_at(int dirfd, const char *path);
 char			*mtree_vispath(const char *path, int style);
 
 #endif /* !_LIBMTREE_MTREE_PRIVATE_H_ */
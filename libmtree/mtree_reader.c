@@ -28,6 +28,9 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 #include <assert.h>
 #include <dirent.h>
@@ -42,10 +45,53 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #include "compat.h"
 #include "mtree.h"
 #include "mtree_private.h"
 
+/*
+ * On Linux, directories are read in large batches using getdents64(2)
+ * instead of one entry at a time with readdir(3).
+ */
+#if defined(__linux__) && defined(MTREE_USE_AT) && \
+    defined(HAVE_STRUCT_DIRENT_D_TYPE) && \
+    defined(HAVE_DECL_SYS_GETDENTS64) && HAVE_DECL_SYS_GETDENTS64
+#define USE_GETDENTS64
+#include <sys/syscall.h>
+
+#define DIR_BUFFER_SIZE	(64 * 1024)
+
+struct linux_dirent64 {
+	uint64_t	 d_ino;
+	int64_t		 d_off;
+	unsigned short	 d_reclen;
+	unsigned char	 d_type;
+	char		 d_name[];
+};
+#endif
+
+/*
+ * Directory opened for reading.
+ */
+struct dir {
+	int		 fd;	/* used with the *at() functions */
+#ifdef USE_GETDENTS64
+	size_t		 pos;
+	size_t		 len;
+#else
+	DIR		*dirp;
+	struct dirent	*dp;
+#endif
+};
+
+/*
+ * Number of directory levels kept open while reading a directory structure.
+ */
+#define MAX_DIR_FDS	32
 
 #ifndef TIME_T_MIN
 #define TIME_T_MIN	(0 < (time_t)-1 ? (time_t)0 \
@@ -55,9 +101,6 @@
 #define TIME_T_MAX	(~ (time_t)0 - TIME_T_MIN)
 #endif
 
-#define INVALID_CHAR(c)	((c) > 0x7E || \
-			((c) < 0x20 && (c) != '\n' && (c) != '\t' && (c) != '\r'))
-
 #define SKIP_TYPE(o, t)	((o & MTREE_READ_SKIP_BLOCK   && t == MTREE_ENTRY_BLOCK) ||  \
 			 (o & MTREE_READ_SKIP_CHAR    && t == MTREE_ENTRY_CHAR) ||   \
 			 (o & MTREE_READ_SKIP_DIR     && t == MTREE_ENTRY_DIR) ||    \
@@ -92,6 +135,7 @@ mtree_reader_free(struct mtree_reader *r)
 
 	mtree_reader_reset(r);
 	free(r->buf);
+	free(r->dirbuf);
 	free(r);
 }
 
@@ -116,9 +160,15 @@ mtree_reader_reset(struct mtree_reader *r)
 		mtree_entry_free_all(r->loose);
 		r->loose = NULL;
 	}
+	if (r->arena != NULL) {
+		/* Entries that are still around keep the arena. */
+		mtree_arena_release(r->arena, 1);
+		r->arena = NULL;
+	}
 	r->parent = NULL;
 	r->buflen = 0;
 	r->path_last = -1;
+	r->relative = 0;
 
 	mtree_copy_string(&r->error, NULL);
 	mtree_entry_free_data_items(&r->defaults);
@@ -126,6 +176,19 @@ mtree_reader_reset(struct mtree_reader *r)
 	memset(&r->defaults, 0, sizeof(r->defaults));
 }
 
+/*
+ * Read a digest given as a hexadecimal string, errno is set on error.
+ */
+static void
+read_digest(struct mtree_entry_data *data, int type, const char *value)
+{
+	unsigned char bytes[MTREE_DIGEST_MAX_SIZE];
+
+	if (mtree_digest_from_hex(value, bytes,
+	    mtree_digest_get_size(type)) == 0)
+		mtree_entry_data_set_digest(data, type, bytes);
+}
+
 /*
  * Read a single mtree keyword and either set or unset it in `data'.
  */
@@ -257,7 +320,7 @@ read_keyword(struct mtree_reader *r, char *s, struct mtree_entry_data *data, int
 			errno = ENOENT;
 			break;
 		}
-		mtree_copy_string(&data->md5digest, value);
+		read_digest(data, MTREE_DIGEST_MD5, value);
 		break;
 	case MTREE_KEYWORD_MODE:
 		if (value == NULL) {
@@ -311,7 +374,7 @@ read_keyword(struct mtree_reader *r, char *s, struct mtree_entry_data *data, int
 			errno = ENOENT;
 			break;
 		}
-		mtree_copy_string(&data->rmd160digest, value);
+		read_digest(data, MTREE_DIGEST_RMD160, value);
 		break;
 	case MTREE_KEYWORD_SHA1:
 	case MTREE_KEYWORD_SHA1DIGEST:
@@ -319,7 +382,7 @@ read_keyword(struct mtree_reader *r, char *s, struct mtree_entry_data *data, int
 			errno = ENOENT;
 			break;
 		}
-		mtree_copy_string(&data->sha1digest, value);
+		read_digest(data, MTREE_DIGEST_SHA1, value);
 		break;
 	case MTREE_KEYWORD_SHA256:
 	case MTREE_KEYWORD_SHA256DIGEST:
@@ -327,7 +390,7 @@ read_keyword(struct mtree_reader *r, char *s, struct mtree_entry_data *data, int
 			errno = ENOENT;
 			break;
 		}
-		mtree_copy_string(&data->sha256digest, value);
+		read_digest(data, MTREE_DIGEST_SHA256, value);
 		break;
 	case MTREE_KEYWORD_SHA384:
 	case MTREE_KEYWORD_SHA384DIGEST:
@@ -335,7 +398,7 @@ read_keyword(struct mtree_reader *r, char *s, struct mtree_entry_data *data, int
 			errno = ENOENT;
 			break;
 		}
-		mtree_copy_string(&data->sha384digest, value);
+		read_digest(data, MTREE_DIGEST_SHA384, value);
 		break;
 	case MTREE_KEYWORD_SHA512:
 	case MTREE_KEYWORD_SHA512DIGEST:
@@ -343,7 +406,7 @@ read_keyword(struct mtree_reader *r, char *s, struct mtree_entry_data *data, int
 			errno = ENOENT;
 			break;
 		}
-		mtree_copy_string(&data->sha512digest, value);
+		read_digest(data, MTREE_DIGEST_SHA512, value);
 		break;
 	case MTREE_KEYWORD_SIZE:
 		if (value == NULL) {
@@ -539,7 +602,10 @@ create_v1_path(struct mtree_entry *entry)
 		len += strlen(entry->parent->path) + 1;
 
 	len += strlen(prefix);
-	path = malloc(len + 1);
+	if (entry->arena != NULL)
+		path = mtree_arena_alloc_string(entry->arena, len);
+	else
+		path = malloc(len + 1);
 	if (path != NULL)
 		snprintf(path, len + 1, "%s%s%s%s",
 		    prefix,
@@ -615,6 +681,24 @@ detect_format(struct mtree_reader *r, char *s)
 	return (0);
 }
 
+/*
+ * Create an entry for a spec line, in the arena of the reader with
+ * MTREE_READ_SPEC_ARENA.
+ */
+static struct mtree_entry *
+create_spec_entry(struct mtree_reader *r)
+{
+
+	if ((r->options & MTREE_READ_SPEC_ARENA) == 0)
+		return (mtree_entry_create_empty());
+	if (r->arena == NULL) {
+		r->arena = mtree_arena_create();
+		if (r->arena == NULL)
+			return (NULL);
+	}
+	return (mtree_entry_create_arena(r->arena));
+}
+
 static int
 read_spec(struct mtree_reader *r, char *s)
 {
@@ -636,6 +720,7 @@ read_spec(struct mtree_reader *r, char *s)
 		assert(file != NULL);
 
 		if (IS_DOTDOT(file)) {
+			r->relative++;
 			/* Only change the parent, keywords are ignored. */
 			if (r->parent == NULL) {
 				mtree_reader_set_errno_error(r, EINVAL,
@@ -646,7 +731,7 @@ read_spec(struct mtree_reader *r, char *s)
 			return (0);
 		}
 	}
-	entry = mtree_entry_create_empty();
+	entry = create_spec_entry(r);
 	if (entry == NULL) {
 		mtree_reader_set_errno_error(r, errno, NULL);
 		return (-1);
@@ -719,14 +804,24 @@ read_spec(struct mtree_reader *r, char *s)
 		 */
 		if (skip)
 			goto skip;
-		ret = mtree_cleanup_path(name, &entry->path, &entry->name);
+		if (entry->arena != NULL)
+			ret = mtree_cleanup_path_arena(name, entry->arena,
+			    &entry->path, &entry->name);
+		else
+			ret = mtree_cleanup_path(name, &entry->path,
+			    &entry->name);
 		if (ret == -1) {
 			mtree_reader_set_errno_error(r, errno, NULL);
 			mtree_entry_free(entry);
 			return (-1);
 		}
 	} else {
-		entry->name = strdup(name);
+		r->relative++;
+		if (entry->arena != NULL)
+			entry->name = mtree_arena_strndup(entry->arena, name,
+			    strlen(name));
+		else
+			entry->name = strdup(name);
 		if (entry->name == NULL) {
 			mtree_reader_set_errno_error(r, errno, NULL);
 			mtree_entry_free(entry);
@@ -835,13 +930,15 @@ skip:
 	return (0);
 }
 
-static int
-parse_line(struct mtree_reader *r, char *s)
+/*
+ * Remove the comment part of the line.
+ */
+static void
+strip_comment(char *s)
 {
 	char	*p, *ep;
-	int	 ret, esc;
+	int	 esc;
 
-	/* First get rid of comment part and blanks at the end of the line. */
 	for (p = s; (p = strchr(p, '#')) != NULL; p++) {
 		esc = 0;
 		/* Make sure the comment char is not escaped. */
@@ -858,6 +955,15 @@ parse_line(struct mtree_reader *r, char *s)
 			break;
 		}
 	}
+}
+
+static int
+parse_line(struct mtree_reader *r, char *s)
+{
+	int ret;
+
+	/* First get rid of comment part and blanks at the end of the line. */
+	strip_comment(s);
 
 	switch (*s) {
 	case '\0':              /* empty line */
@@ -919,35 +1025,337 @@ finish_entries(struct mtree_reader *r, struct mtree_entry **entries)
 	return (0);
 }
 
+/*
+ * Get options of mtree_entry_set_keywords() used for reading entries.
+ */
+static int
+entry_options(struct mtree_reader *r)
+{
+
+	if (r->options & MTREE_READ_PATH_DROP_CACHE)
+		return (MTREE_ENTRY_DROP_CACHE);
+	return (0);
+}
+
+/*
+ * Files with more than one hard link are hashed only once per reading.
+ *
+ * The first link kept by the reader becomes the source, checksums of later
+ * links are copied from it once all checksums have been calculated, see
+ * links_copy(). At most LINKS_MAX files are tracked, further files are
+ * hashed for each of their links.
+ */
+#define LINKS_MAX		65536
+#define LINKS_INITIAL_SIZE	256
+
+struct link {
+	dev_t			 dev;
+	ino_t			 ino;
+	struct mtree_entry	*entry;		/* first link */
+};
+
+struct link_copy {
+	struct mtree_entry	*entry;
+	struct mtree_entry	*from;
+};
+
+struct link_table {
+	struct link		*links;
+	size_t			 size;		/* power of two */
+	size_t			 count;
+	struct link_copy	*copies;
+	size_t			 ncopies;
+	size_t			 copies_size;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t		 lock;
+#endif
+};
+
+static struct link_table *
+links_create(void)
+{
+	struct link_table *t;
+
+	t = calloc(1, sizeof(struct link_table));
+	if (t == NULL)
+		return (NULL);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&t->lock, NULL);
+#endif
+	return (t);
+}
+
+static void
+links_free(struct link_table *t)
+{
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&t->lock);
+#endif
+	free(t->links);
+	free(t->copies);
+	free(t);
+}
+
+static void
+links_lock(struct link_table *t)
+{
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&t->lock);
+#else
+	(void)t;
+#endif
+}
+
+static void
+links_unlock(struct link_table *t)
+{
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&t->lock);
+#else
+	(void)t;
+#endif
+}
+
+/*
+ * Find the slot of the file, the table must not be empty.
+ */
+static struct link *
+links_slot(struct link_table *t, dev_t dev, ino_t ino)
+{
+	uint64_t	h;
+	size_t		i;
+
+	h = ((uint64_t)dev * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)ino;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	i = (size_t)(h ^ (h >> 31)) & (t->size - 1);
+	while (t->links[i].entry != NULL &&
+	    (t->links[i].dev != dev || t->links[i].ino != ino))
+		i = (i + 1) & (t->size - 1);
+	return (&t->links[i]);
+}
+
+/*
+ * Get the first link of the file, NULL if there is none.
+ */
+static struct mtree_entry *
+links_find(struct link_table *t, const struct stat *st)
+{
+	struct mtree_entry *entry;
+
+	entry = NULL;
+	links_lock(t);
+	if (t->count > 0)
+		entry = links_slot(t, st->st_dev, st->st_ino)->entry;
+	links_unlock(t);
+	return (entry);
+}
+
+/*
+ * Add a link of the file. If `from' is not NULL, it is the first link
+ * returned by links_find() and the checksums are to be copied from it.
+ *
+ * Returns -1 if memory allocation fails.
+ */
+static int
+links_add(struct link_table *t, struct mtree_entry *entry,
+    const struct stat *st, struct mtree_entry *from)
+{
+	struct link_copy	*copies;
+	struct link		*old;
+	struct link		*slot;
+	size_t			 size, i;
+	int			 ret;
+
+	ret = 0;
+	links_lock(t);
+	if (from != NULL) {
+		if (t->ncopies == t->copies_size) {
+			size = (t->copies_size > 0) ? t->copies_size * 2 :
+			    LINKS_INITIAL_SIZE;
+			copies = realloc(t->copies,
+			    size * sizeof(struct link_copy));
+			if (copies == NULL) {
+				ret = -1;
+				goto out;
+			}
+			t->copies = copies;
+			t->copies_size = size;
+		}
+		t->copies[t->ncopies].entry = entry;
+		t->copies[t->ncopies].from  = from;
+		t->ncopies++;
+		entry->flags |= __MTREE_ENTRY_LINKED;
+		goto out;
+	}
+	if (t->count == LINKS_MAX)
+		goto out;
+	if ((t->count + 1) * 2 > t->size) {
+		/* Errors are ignored, the file is then hashed again. */
+		size = (t->size > 0) ? t->size * 2 : LINKS_INITIAL_SIZE;
+		old = t->links;
+		t->links = calloc(size, sizeof(struct link));
+		if (t->links == NULL) {
+			t->links = old;
+			goto out;
+		}
+		for (i = 0; i < t->size; i++) {
+			if (old[i].entry != NULL)
+				*links_slot(t, old[i].dev, old[i].ino) =
+				    old[i];
+		}
+		free(old);
+		t->size = size;
+	}
+	slot = links_slot(t, st->st_dev, st->st_ino);
+	if (slot->entry == NULL) {
+		slot->dev   = st->st_dev;
+		slot->ino   = st->st_ino;
+		slot->entry = entry;
+		t->count++;
+	}
+out:
+	links_unlock(t);
+	return (ret);
+}
+
+/*
+ * Forget all the links, used when the entries are freed.
+ */
+static void
+links_reset(struct link_table *t)
+{
+
+	links_lock(t);
+	if (t->links != NULL)
+		memset(t->links, 0, t->size * sizeof(struct link));
+	t->count   = 0;
+	t->ncopies = 0;
+	links_unlock(t);
+}
+
+/*
+ * Copy the checksum keywords to the later links.
+ */
+static void
+links_copy(struct link_table *t, uint64_t keywords)
+{
+	size_t i;
+
+	for (i = 0; i < t->ncopies; i++) {
+		mtree_entry_copy_keywords(t->copies[i].entry,
+		    t->copies[i].from, keywords, 1);
+		t->copies[i].entry->flags &= ~__MTREE_ENTRY_LINKED;
+	}
+}
+
+/*
+ * Take checksums and digests of a regular file from the previous spec if
+ * the file has the same size, modification time and, when the previous
+ * spec includes it, inode number.
+ *
+ * Returns the keywords that have been set.
+ */
+static uint64_t
+reuse_checksums(struct mtree_reader *r, struct mtree_entry *entry,
+    const struct stat *st)
+{
+	struct mtree_entry	*prev;
+	const unsigned char	*digest;
+	uint64_t		 keywords;
+	uint64_t		 reused;
+	uint64_t		 mask;
+	int			 type;
+
+	keywords = r->path_keywords & MTREE_KEYWORD_MASK_CHECKSUMS;
+	if (keywords == 0 || entry->data.type != MTREE_ENTRY_FILE)
+		return (0);
+	prev = mtree_trie_find(r->previous, entry->path);
+	if (prev == NULL || prev->data.type != MTREE_ENTRY_FILE ||
+	    (prev->data.keywords & MTREE_KEYWORD_SIZE) == 0 ||
+	    (prev->data.keywords & MTREE_KEYWORD_TIME) == 0 ||
+	    prev->data.st_size != st->st_size)
+		return (0);
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	if (prev->data.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+	    prev->data.st_mtim.tv_nsec != st->st_mtim.tv_nsec)
+		return (0);
+#else
+	if (prev->data.st_mtim.tv_sec != st->st_mtime)
+		return (0);
+#endif
+	if ((prev->data.keywords & MTREE_KEYWORD_INODE) != 0 &&
+	    prev->data.st_ino != (uint64_t)st->st_ino)
+		return (0);
+
+	reused = 0;
+	if ((keywords & MTREE_KEYWORD_CKSUM) &&
+	    (prev->data.keywords & MTREE_KEYWORD_CKSUM)) {
+		mtree_entry_set_cksum(entry, prev->data.cksum);
+		reused |= MTREE_KEYWORD_CKSUM;
+	}
+	for (type = 1; type <= MTREE_DIGEST_RMD160; type <<= 1) {
+		mask = keywords & mtree_entry_digest_keywords(type);
+		if (mask == 0 || (prev->data.keywords & mask) == 0)
+			continue;
+		digest = mtree_entry_data_get_digest(&prev->data, type);
+		if (digest != NULL) {
+			mtree_entry_set_digest(entry, type, digest, keywords);
+			reused |= mask;
+		}
+	}
+	return (reused);
+}
+
+/*
+ * Read keywords of a single entry from the file `name', which is relative
+ * to the directory `dirfd'.
+ */
 static int
-read_path_file(struct mtree_reader *r, struct mtree_entry *entry, int *skip,
-    int *skip_children)
+read_path_file(struct mtree_reader *r, struct mtree_entry *entry, int dirfd,
+    const char *name, int *skip, int *skip_children)
 {
-	struct stat	st, *stp;
-	int		ret;
+	struct mtree_entry_fs	fs;
+	struct mtree_entry	*link;
+	struct stat		st, *stp;
+	uint64_t		keywords;
+	int			flags;
+	int			hardlink;
 
 	*skip = 0;
 	*skip_children = 0;
+	keywords = r->path_keywords & MTREE_KEYWORD_MASK_STAT;
+	/* Fields compared with the previous spec, see reuse_checksums(). */
+	if (r->previous != NULL &&
+	    (r->path_keywords & MTREE_KEYWORD_MASK_CHECKSUMS) != 0)
+		keywords |= MTREE_KEYWORD_SIZE | MTREE_KEYWORD_TIME |
+		    MTREE_KEYWORD_INODE;
+	/* Fields needed to recognize hard links, see links_find(). */
+	if (r->links != NULL)
+		keywords |= MTREE_KEYWORD_NLINK | MTREE_KEYWORD_INODE;
 	if (entry->data.type == MTREE_ENTRY_UNKNOWN ||
+	    (entry->data.type == MTREE_ENTRY_LINK &&
+	    (r->options & MTREE_READ_PATH_FOLLOW_SYMLINKS) != 0) ||
 	    (entry->data.type == MTREE_ENTRY_DIR &&
-	    (r->options & MTREE_READ_PATH_DONT_CROSS_MOUNT) != 0)) {
+	    (r->options & MTREE_READ_PATH_DONT_CROSS_MOUNT) != 0) ||
+	    (keywords & ~MTREE_KEYWORD_TYPE) != 0) {
 		/*
 		 * We need to stat() to determine the type, even when the user
-		 * hasn't requested any stat keywords.
+		 * hasn't requested any stat keywords. The type reported by
+		 * the directory is not enough when following symlinks.
+		 *
+		 * Only the fields needed by the keywords are requested.
 		 */
 		stp = &st;
-		if (r->options & MTREE_READ_PATH_FOLLOW_SYMLINKS) {
-			if (entry->orig != NULL)
-				ret = stat(entry->orig, stp);
-			else
-				ret = stat(entry->path, stp);
-		} else {
-			if (entry->orig != NULL)
-				ret = lstat(entry->orig, stp);
-			else
-				ret = lstat(entry->path, stp);
-		}
-		if (ret == -1) {
+		if (r->options & MTREE_READ_PATH_FOLLOW_SYMLINKS)
+			flags = 0;
+		else
+			flags = AT_SYMLINK_NOFOLLOW;
+		if (r->options & MTREE_READ_PATH_DONT_SYNC)
+			flags |= AT_STATX_DONT_SYNC;
+		if (mtree_stat_at(dirfd, name, stp, flags, keywords) == -1) {
 			if ((r->options & MTREE_READ_PATH_SKIP_ON_ERROR) == 0) {
 				mtree_reader_set_errno_prefix(r, errno, "`%s'",
 				    entry->orig);
@@ -979,18 +1387,34 @@ read_path_file(struct mtree_reader *r, struct mtree_entry *entry, int *skip,
 		/* Already have the type, no need to convert again. */
 		entry->data.keywords |= MTREE_KEYWORD_TYPE;
 	}
-	if (stp != NULL) {
-		/* Set stat keywords. */
-		mtree_entry_set_keywords_stat(entry, stp, r->path_keywords, 0);
-		/*
-		 * Set remaining keywords. Force skipping stat here
-		 * in case some stat field failed to be set. Entry
-		 * would pointlessly call stat() again in such case.
-		 */
-		mtree_entry_set_keywords(entry,
-		    r->path_keywords & ~MTREE_KEYWORD_MASK_STAT, 0);
-	} else
-		mtree_entry_set_keywords(entry, r->path_keywords, 0);
+	/*
+	 * Set keywords, stat keywords are taken from the stat structure
+	 * if we have already called stat().
+	 *
+	 * Checksums may be deferred until the whole structure is read,
+	 * see read_path_checksums(), or calculated by a pool of threads.
+	 */
+	keywords = r->path_keywords;
+	if (r->previous != NULL && stp != NULL)
+		keywords &= ~reuse_checksums(r, entry, stp);
+	hardlink = (r->links != NULL && stp != NULL &&
+	    entry->data.type == MTREE_ENTRY_FILE && stp->st_nlink > 1 &&
+	    (keywords & MTREE_KEYWORD_MASK_CHECKSUMS) != 0);
+	link = NULL;
+	if (hardlink) {
+		link = links_find(r->links, stp);
+		if (link != NULL)
+			keywords &= ~MTREE_KEYWORD_MASK_CHECKSUMS;
+	}
+	if (r->options & (MTREE_READ_PATH_DEFER_CHECKSUMS |
+	    MTREE_READ_PATH_PIPELINE))
+		keywords &= ~MTREE_KEYWORD_MASK_CHECKSUMS;
+	fs.dirfd    = dirfd;
+	fs.name     = name;
+	fs.st       = stp;
+	fs.cache    = r->cache;
+	fs.governor = r->governor;
+	mtree_entry_set_keywords_fs(entry, &fs, keywords, entry_options(r));
 
 	if (r->filter != NULL) {
 		int result;
@@ -1001,110 +1425,704 @@ read_path_file(struct mtree_reader *r, struct mtree_entry *entry, int *skip,
 		if ((result & MTREE_ENTRY_SKIP) != 0)
 			*skip = 1;
 	}
+	if (hardlink && *skip == 0) {
+		if (links_add(r->links, entry, stp, link) == -1) {
+			mtree_reader_set_errno_error(r, errno, NULL);
+			return (-1);
+		}
+	}
 	return (0);
 }
 
 /*
- * Read directory structure and store entries in `entries', which must initially
- * point to an empty list.
+ * Check whether checksums of an entry read with deferred checksums are yet
+ * to be calculated. Checksums of directories are never available, those
+ * taken from a previous spec are kept and those of later hard links are
+ * copied from the first link.
  */
 static int
-read_path(struct mtree_reader *r, const char *path, struct mtree_entry **entries,
-    struct mtree_entry *parent)
+needs_checksums(struct mtree_entry *entry, uint64_t keywords)
 {
-	DIR			*dirp;
-	struct dirent		*dp;
-	struct dirent		*result;
-	struct mtree_entry	*entry;
-	struct mtree_entry	*dirs;
-	struct mtree_entry	*dot;
-	int			 err;
-	int			 len;
-	int			 ret;
-	int			 skip;
-	int			 skip_children;
 
-	if (parent == NULL && (r->options & MTREE_READ_PATH_DONT_CROSS_MOUNT) != 0) {
-		struct stat st;
+	return (entry->data.type != MTREE_ENTRY_DIR &&
+	    (entry->flags & __MTREE_ENTRY_LINKED) == 0 &&
+	    (entry->data.keywords & keywords) != keywords);
+}
+
+/*
+ * Calculate checksums of an entry whose other keywords have been read,
+ * options are those of mtree_entry_set_keywords().
+ */
+static void
+read_entry_checksums(struct mtree_entry *entry, uint64_t keywords,
+    int options, struct mtree_cache *cache, struct mtree_governor *g)
+{
+	struct mtree_entry_fs fs;
+
+	fs.dirfd    = AT_FDCWD;
+	fs.name     = entry->orig;
+	fs.st       = NULL;
+	fs.cache    = cache;
+	fs.governor = g;
+	mtree_entry_set_keywords_fs(entry, &fs, keywords, options);
+}
+
+/*
+ * Entry whose checksums were not found in the cache, see
+ * read_cached_checksums().
+ */
+struct cache_miss {
+	struct mtree_entry	*entry;
+	struct mtree_cache_key	 key;
+};
 
-		if ((r->options & MTREE_READ_PATH_FOLLOW_SYMLINKS) != 0)
-			ret = stat(path, &st);
+/*
+ * Take checksums of the listed entries from the cache.
+ *
+ * Entries which were not found are moved to the beginning of the list and
+ * their count is returned. Those of them that can be stored in the cache
+ * once their checksums are calculated are put in `misses'.
+ */
+static size_t
+read_cached_checksums(struct mtree_cache *cache, struct mtree_entry **list,
+    size_t count, uint64_t keywords, struct cache_miss *misses,
+    size_t *nmisses)
+{
+	struct stat	st;
+	size_t		i, rest;
+	int		digests;
+
+	digests = mtree_entry_checksums_digests(keywords) &
+	    mtree_digest_get_available_types();
+	rest = 0;
+	*nmisses = 0;
+	for (i = 0; i < count; i++) {
+		list[rest++] = list[i];
+		/* Same as open(2), which follows symbolic links. */
+		if (stat(list[i]->orig, &st) == -1 || !S_ISREG(st.st_mode))
+			continue;
+		misses[*nmisses].entry = list[i];
+		mtree_cache_key_from_stat(&misses[*nmisses].key, &st);
+		if (mtree_cache_get(cache, &misses[*nmisses].key, list[i],
+		    digests, keywords) == 1)
+			rest--;
 		else
-			ret = lstat(path, &st);
-		if (ret == -1) {
-			mtree_reader_set_errno_prefix(r, errno, "`%s'", path);
-			return (-1);
-		}
-		r->base_dev = st.st_dev;
+			(*nmisses)++;
 	}
+	return (rest);
+}
 
-	dirs = dot = NULL;
-	dp = NULL;
+/*
+ * Store the calculated checksums of entries missing in the cache.
+ */
+static void
+write_cached_checksums(struct mtree_cache *cache,
+    const struct cache_miss *misses, size_t nmisses, uint64_t keywords)
+{
+	size_t	i;
+	int	digests;
+
+	digests = mtree_entry_checksums_digests(keywords) &
+	    mtree_digest_get_available_types();
+	for (i = 0; i < nmisses; i++)
+		mtree_cache_put(cache, &misses[i].key, misses[i].entry,
+		    digests, keywords);
+}
 
-	/*
-	 * Read the directory structure.
-	 */
-	ret = 0;
-	if ((dirp = opendir(path)) == NULL) {
-		if ((r->options & MTREE_READ_PATH_SKIP_ON_ERROR) == 0) {
-			mtree_reader_set_errno_prefix(r, errno, "`%s'", path);
-			ret = -1;
-			goto end;
-		}
-		return (0);
-	}
-#if defined(HAVE_FPATHCONF) && defined(HAVE_DIRFD) && defined(_PC_NAME_MAX)
-	len = fpathconf(dirfd(dirp), _PC_NAME_MAX);
-#else
-	len = -1;
-#endif
-	if (len == -1) {
-#if defined(NAME_MAX)
-		len = (NAME_MAX > 255) ? NAME_MAX : 255;
-#else
-		len = 255;
-#endif
+/*
+ * Files up to this size are hashed in batches, see read_small_checksums().
+ */
+#define SMALL_FILE_SIZE		(16 * 1024)
+#define SMALL_BUFFER_SIZE	(MTREE_DIGEST_MB_MAX_LANES * SMALL_FILE_SIZE)
+
+/*
+ * Read the whole file into `buf' if it is a small regular file.
+ */
+static ssize_t
+read_small_file(struct mtree_entry *entry, unsigned char *buf, int options,
+    struct mtree_governor *g)
+{
+	struct stat	 st;
+	uint64_t	 start;
+	ssize_t		 len, n;
+	int		 fd;
+
+	mtree_governor_file(g);
+	fd = open(entry->orig, O_RDONLY | O_NONBLOCK);
+	if (fd == -1)
+		return (-1);
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    st.st_size > SMALL_FILE_SIZE) {
+		close(fd);
+		return (-1);
 	}
-	/* POSIX.1 requires that d_name is the last field in a struct dirent. */
-	dp = malloc(offsetof(struct dirent, d_name) + len + 1);
-	if (dp == NULL) {
-		mtree_reader_set_errno_error(r, errno, NULL);
-		ret = -1;
-		goto end;
+	len = 0;
+	start = (g != NULL) ? mtree_governor_now() : 0;
+	/* Ask for an extra byte to detect files that have grown. */
+	while (len <= SMALL_FILE_SIZE) {
+		n = read(fd, buf + len, SMALL_FILE_SIZE + 1 - len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		len += n;
 	}
+	if (g != NULL && len > 0)
+		mtree_governor_read(g, len, mtree_governor_now() - start, 1);
+	if (options & MTREE_ENTRY_DROP_CACHE)
+		mtree_io_dontneed(fd);
+	close(fd);
+	if (n == -1 || len > SMALL_FILE_SIZE)
+		return (-1);
+	return (len);
+}
+
+/*
+ * Get the number of small files hashed at once, 1 if the given keywords
+ * cannot be calculated by multi-buffer hashing.
+ */
+static int
+get_small_lanes(uint64_t keywords)
+{
+	int lanes;
+
+	lanes = mtree_digest_mb_get_lanes();
+	if (lanes < 2 || (mtree_entry_checksums_digests(keywords) &
+	    mtree_digest_mb_get_types()) == 0)
+		return (1);
+	return (lanes);
+}
 
-	while ((err = readdir_r(dirp, dp, &result)) == 0 && result != NULL) {
-		if (IS_DOTDOT(dp->d_name))
+/*
+ * Calculate checksums of small files in batches, so that the digests of
+ * several files can be calculated at once by multi-buffer hashing.
+ *
+ * The buffer must have room for SMALL_BUFFER_SIZE + 1 bytes. Entries which
+ * were not handled are moved to the beginning of the list and their count
+ * is returned.
+ */
+static size_t
+read_small_checksums(struct mtree_entry **list, size_t count,
+    uint64_t keywords, int options, struct mtree_governor *g,
+    unsigned char *buf)
+{
+	struct mtree_entry	*batch[MTREE_DIGEST_MB_MAX_LANES];
+	const unsigned char	*data[MTREE_DIGEST_MB_MAX_LANES];
+	size_t			 len[MTREE_DIGEST_MB_MAX_LANES];
+	size_t			 i, rest;
+	ssize_t			 n;
+	int			 lanes;
+	int			 nbatch;
+
+	lanes = get_small_lanes(keywords);
+	if (lanes < 2)
+		return (count);
+
+	rest = 0;
+	nbatch = 0;
+	for (i = 0; i < count; i++) {
+		data[nbatch] = buf + nbatch * SMALL_FILE_SIZE;
+		n = read_small_file(list[i], buf + nbatch * SMALL_FILE_SIZE,
+		    options, g);
+		if (n == -1) {
+			list[rest++] = list[i];
 			continue;
-		/*
-		 * Dot is read only in the initial directory.
-		 */
-		if (parent != NULL && IS_DOT(dp->d_name))
+		}
+		batch[nbatch] = list[i];
+		len[nbatch]   = n;
+		if (++nbatch < lanes && i < count - 1)
 			continue;
-
-		entry = mtree_entry_create_empty();
-		if (entry == NULL) {
-			mtree_reader_set_errno_error(r, errno, NULL);
-			ret = -1;
-			break;
+		if (mtree_entry_checksums_batch(batch, nbatch, data, len,
+		    keywords) == -1) {
+			/* Leave the whole batch to the caller. */
+			while (nbatch > 0)
+				list[rest++] = batch[--nbatch];
 		}
-		entry->name = strdup(dp->d_name);
-		if (entry->name == NULL) {
+		nbatch = 0;
+	}
+	if (nbatch > 0 && mtree_entry_checksums_batch(batch, nbatch, data,
+	    len, keywords) == -1) {
+		while (nbatch > 0)
+			list[rest++] = batch[--nbatch];
+	}
+	return (rest);
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * Get the number of threads to use, zero selects the number of online
+ * processors.
+ */
+static int
+get_threads(int threads)
+{
+
+	if (threads < 1) {
+#ifdef _SC_NPROCESSORS_ONLN
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		if (threads < 1)
+			threads = 1;
+	}
+	return (threads);
+}
+
+/*
+ * Pool of threads calculating checksums while the directory structure is
+ * being read.
+ *
+ * Entries are queued once it is certain that they are not going to be freed
+ * while reading the rest of the structure. The queue is bounded, reading of
+ * the structure waits when hashing cannot keep up.
+ */
+#define POOL_QUEUE_SIZE	1024
+
+struct checksum_pool {
+	struct mtree_entry	*queue[POOL_QUEUE_SIZE];
+	size_t			 head;
+	size_t			 count;
+	int			 active;	/* entries being processed */
+	int			 done;
+	uint64_t		 keywords;
+	int			 options;	/* of mtree_entry_set_keywords() */
+	struct mtree_cache	*cache;
+	struct mtree_governor	*governor;
+	int			 io_priority;
+	int			 lanes;		/* entries taken at once */
+	pthread_t		*threads;
+	int			 nthreads;
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 cond;
+};
+
+static void *
+pool_run(void *arg)
+{
+	struct checksum_pool	*pool = arg;
+	struct mtree_entry	*batch[MTREE_DIGEST_MB_MAX_LANES];
+	struct cache_miss	 misses[MTREE_DIGEST_MB_MAX_LANES];
+	unsigned char		*buf;
+	size_t			 i, n, rest;
+	size_t			 nmisses;
+
+	if (pool->io_priority != MTREE_IO_PRIORITY_NORMAL)
+		mtree_governor_set_io_priority(pool->io_priority, NULL);
+	/* Without the buffer, small files are not hashed in batches. */
+	buf = NULL;
+	if (pool->lanes > 1)
+		buf = malloc(SMALL_BUFFER_SIZE + 1);
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->count == 0 && !pool->done)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		if (pool->count == 0)
+			break;
+		n = 0;
+		while (pool->count > 0 && n < (size_t)pool->lanes) {
+			batch[n++] = pool->queue[pool->head];
+			pool->head = (pool->head + 1) % POOL_QUEUE_SIZE;
+			pool->count--;
+		}
+		pool->active += n;
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+
+		rest = n;
+		nmisses = 0;
+		if (pool->cache != NULL)
+			rest = read_cached_checksums(pool->cache, batch, rest,
+			    pool->keywords, misses, &nmisses);
+		if (buf != NULL)
+			rest = read_small_checksums(batch, rest, pool->keywords,
+			    pool->options, pool->governor, buf);
+		for (i = 0; i < rest; i++)
+			read_entry_checksums(batch[i], pool->keywords,
+			    pool->options, NULL, pool->governor);
+		if (nmisses > 0)
+			write_cached_checksums(pool->cache, misses, nmisses,
+			    pool->keywords);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->active -= n;
+		if (pool->count == 0 && pool->active == 0)
+			pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	free(buf);
+	return (NULL);
+}
+
+/*
+ * Start the pool, the checksum keywords are taken from the reader.
+ */
+static struct checksum_pool *
+pool_start(struct mtree_reader *r)
+{
+	struct checksum_pool	*pool;
+	int			 nthreads;
+	int			 i;
+
+	pool = calloc(1, sizeof(struct checksum_pool));
+	if (pool == NULL)
+		return (NULL);
+	nthreads = get_threads(r->checksum_threads);
+	pool->threads = calloc(nthreads, sizeof(pthread_t));
+	if (pool->threads == NULL) {
+		free(pool);
+		return (NULL);
+	}
+	pool->keywords = r->path_keywords & MTREE_KEYWORD_MASK_CHECKSUMS;
+	pool->options  = entry_options(r);
+	pool->cache    = r->cache;
+	pool->governor = r->governor;
+	pool->io_priority = r->io_priority;
+	pool->lanes    = get_small_lanes(pool->keywords);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&pool->threads[i], NULL, pool_run,
+		    pool) != 0)
+			break;
+	/* Without any threads, checksums are calculated when queued. */
+	pool->nthreads = i;
+	return (pool);
+}
+
+/*
+ * Queue entries of the given list which need their checksums calculated.
+ */
+static void
+pool_push(struct checksum_pool *pool, struct mtree_entry *entries)
+{
+	struct mtree_entry *entry;
+
+	for (entry = entries; entry != NULL; entry = entry->next) {
+		if (!needs_checksums(entry, pool->keywords))
+			continue;
+		if (pool->nthreads == 0) {
+			read_entry_checksums(entry, pool->keywords,
+			    pool->options, pool->cache, pool->governor);
+			continue;
+		}
+		pthread_mutex_lock(&pool->lock);
+		while (pool->count == POOL_QUEUE_SIZE)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		pool->queue[(pool->head + pool->count) % POOL_QUEUE_SIZE] =
+		    entry;
+		pool->count++;
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+/*
+ * Wait until all the queued entries are processed. This must be done
+ * before freeing any of the entries.
+ */
+static void
+pool_wait(struct checksum_pool *pool)
+{
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->count > 0 || pool->active > 0)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Process the remaining entries and free the pool.
+ */
+static void
+pool_finish(struct checksum_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->done = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->cond);
+	free(pool->threads);
+	free(pool);
+}
+#endif /* HAVE_PTHREAD */
+
+/*
+ * Open directory `path' for reading. When supported, the directory is opened
+ * as `name' relative to the directory `parentfd'.
+ *
+ * Returns 1 if the directory has been opened, 0 if it could not be opened
+ * and errors are being skipped, -1 on error.
+ */
+static int
+open_dir(struct mtree_reader *r, int parentfd, const char *name,
+    const char *path, struct dir *d)
+{
+#ifdef MTREE_USE_AT
+	int flags;
+
+	flags = O_RDONLY;
+#ifdef O_DIRECTORY
+	flags |= O_DIRECTORY;
+#endif
+#ifdef O_CLOEXEC
+	flags |= O_CLOEXEC;
+#endif
+	d->fd = openat(parentfd, name, flags);
+#ifdef USE_GETDENTS64
+	d->pos = 0;
+	d->len = 0;
+	if (d->fd != -1)
+		return (1);
+#else
+	d->dirp = NULL;
+	d->dp = NULL;
+	if (d->fd != -1) {
+		d->dirp = fdopendir(d->fd);
+		if (d->dirp == NULL) {
+			int err = errno;
+
+			close(d->fd);
+			errno = err;
+		} else
+			return (1);
+	}
+#endif
+#else
+	(void)parentfd;
+	(void)name;
+
+	d->fd = AT_FDCWD;
+	d->dp = NULL;
+	d->dirp = opendir(path);
+	if (d->dirp != NULL)
+		return (1);
+#endif
+	if ((r->options & MTREE_READ_PATH_SKIP_ON_ERROR) == 0) {
+		mtree_reader_set_errno_prefix(r, errno, "`%s'", path);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Close directory opened by open_dir(), errno is preserved.
+ */
+static void
+close_dir(struct dir *d)
+{
+	int err;
+
+	err = errno;
+#ifdef USE_GETDENTS64
+	close(d->fd);
+#else
+	free(d->dp);
+	closedir(d->dirp);
+#endif
+	errno = err;
+}
+
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+/*
+ * Convert the d_type field of a directory entry to entry type.
+ */
+static mtree_entry_type
+entry_type_from_dirent(unsigned char type)
+{
+
+	switch (type) {
+	case DT_BLK:
+		return (MTREE_ENTRY_BLOCK);
+	case DT_CHR:
+		return (MTREE_ENTRY_CHAR);
+	case DT_DIR:
+		return (MTREE_ENTRY_DIR);
+	case DT_FIFO:
+		return (MTREE_ENTRY_FIFO);
+	case DT_LNK:
+		return (MTREE_ENTRY_LINK);
+	case DT_REG:
+		return (MTREE_ENTRY_FILE);
+	case DT_SOCK:
+		return (MTREE_ENTRY_SOCKET);
+	default:
+		return (MTREE_ENTRY_UNKNOWN);
+	}
+}
+#endif
+
+/*
+ * Read the next entry of the directory.
+ *
+ * Returns 1 and stores the name, type and inode number of the entry in
+ * `name', `type' and `ino', 0 at the end of the directory or -1 on error.
+ * The name is only valid until the next call.
+ */
+static int
+next_dir_entry(struct mtree_reader *r, struct dir *d, const char **name,
+    mtree_entry_type *type, uint64_t *ino)
+{
+#ifdef USE_GETDENTS64
+	struct linux_dirent64	*de;
+	long			 n;
+
+	if (d->pos >= d->len) {
+		/*
+		 * The buffer is shared by all directories read by the reader,
+		 * which is fine as each directory is read in full before
+		 * moving on to the next one.
+		 */
+		if (r->dirbuf == NULL) {
+			r->dirbuf = malloc(DIR_BUFFER_SIZE);
+			if (r->dirbuf == NULL)
+				return (-1);
+		}
+		do {
+			n = syscall(SYS_getdents64, d->fd, r->dirbuf,
+			    DIR_BUFFER_SIZE);
+		} while (n == -1 && errno == EINTR);
+		if (n <= 0)
+			return (n == 0 ? 0 : -1);
+		d->pos = 0;
+		d->len = (size_t)n;
+	}
+	de = (struct linux_dirent64 *)(r->dirbuf + d->pos);
+	d->pos += de->d_reclen;
+
+	*name = de->d_name;
+	*type = entry_type_from_dirent(de->d_type);
+	*ino  = de->d_ino;
+	return (1);
+#else
+	struct dirent	*result;
+	int		 err;
+
+	(void)r;
+
+	if (d->dp == NULL) {
+		long len;
+
+#if defined(HAVE_FPATHCONF) && defined(HAVE_DIRFD) && defined(_PC_NAME_MAX)
+		len = fpathconf(dirfd(d->dirp), _PC_NAME_MAX);
+#else
+		len = -1;
+#endif
+		if (len == -1) {
+#if defined(NAME_MAX)
+			len = (NAME_MAX > 255) ? NAME_MAX : 255;
+#else
+			len = 255;
+#endif
+		}
+		/*
+		 * POSIX.1 requires that d_name is the last field in
+		 * a struct dirent.
+		 */
+		d->dp = malloc(offsetof(struct dirent, d_name) + len + 1);
+		if (d->dp == NULL)
+			return (-1);
+	}
+	err = readdir_r(d->dirp, d->dp, &result);
+	if (err != 0) {
+		errno = err;
+		return (-1);
+	}
+	if (result == NULL)
+		return (0);
+
+	*name = d->dp->d_name;
+	*ino  = d->dp->d_ino;
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+	*type = entry_type_from_dirent(d->dp->d_type);
+#else
+	*type = MTREE_ENTRY_UNKNOWN;
+#endif
+	return (1);
+#endif /* USE_GETDENTS64 */
+}
+
+/*
+ * Read entries of the directory `path' opened as `d'.
+ *
+ * Subdirectories are stored in `dirs' in the reverse order of reading, all
+ * other entries are stored in `files' in the same manner. The initial dot
+ * is placed at the end of `files'. Both lists must initially be empty.
+ */
+static int
+read_dir(struct mtree_reader *r, struct dir *d, const char *path,
+    struct mtree_entry *parent, struct mtree_entry **files,
+    struct mtree_entry **dirs)
+{
+	struct mtree_entry	*entry;
+	struct mtree_entry	*dot;
+	const char		*name;
+	mtree_entry_type	 type;
+	uint64_t		 ino;
+	int			 ret;
+	int			 skip;
+	int			 skip_children;
+
+	dot = NULL;
+	for (;;) {
+		ret = next_dir_entry(r, d, &name, &type, &ino);
+		if (ret == 0)
+			break;
+		if (ret == -1) {
+			if ((r->options & MTREE_READ_PATH_SKIP_ON_ERROR) == 0) {
+				mtree_reader_set_errno_prefix(r, errno, "`%s'",
+				    path);
+				break;
+			}
+			/* Keep what has been read so far. */
+			ret = 0;
+			break;
+		}
+		ret = 0;
+		if (IS_DOTDOT(name))
+			continue;
+		/*
+		 * Dot is read only in the initial directory.
+		 */
+		if (parent != NULL && IS_DOT(name))
+			continue;
+
+		entry = mtree_entry_create_empty();
+		if (entry == NULL) {
+			mtree_reader_set_errno_error(r, errno, NULL);
+			ret = -1;
+			break;
+		}
+		entry->name = strdup(name);
+		if (entry->name == NULL) {
 			mtree_reader_set_errno_error(r, errno, NULL);
 			ret = -1;
 			mtree_entry_free(entry);
 			break;
 		}
-		if (IS_DOT(dp->d_name)) {
+		if (IS_DOT(name)) {
 			entry->orig = strdup(path);
 			/*
 			 * Enforce directory type as this is the initial path
-			 * and readdir_r() succeeded on it. Allowing anything
-			 * else, such as link, would confuse the reader.
+			 * and reading it succeeded. Allowing anything else,
+			 * such as link, would confuse the reader.
 			 */
 			entry->data.type = MTREE_ENTRY_DIR;
-		} else
-			entry->orig = mtree_concat_path(path, dp->d_name);
+		} else {
+			entry->orig = mtree_concat_path(path, name);
+			entry->data.type = type;
+			/*
+			 * Kept without the keyword for sort_by_layout(), stat
+			 * may replace it.
+			 */
+			if (r->options & MTREE_READ_PATH_LAYOUT_ORDER)
+				entry->data.st_ino = ino;
+		}
 		if (entry->orig == NULL) {
 			mtree_reader_set_errno_error(r, errno, NULL);
 			ret = -1;
@@ -1120,38 +2138,21 @@ read_path(struct mtree_reader *r, const char *path, struct mtree_entry **entries
 			break;
 		}
 
-#ifdef HAVE_STRUCT_DIRENT_D_TYPE
-		if (!IS_DOT(dp->d_name))
-			switch (dp->d_type) {
-			case DT_BLK:
-				entry->data.type = MTREE_ENTRY_BLOCK;
-				break;
-			case DT_CHR:
-				entry->data.type = MTREE_ENTRY_CHAR;
-				break;
-			case DT_DIR:
-				entry->data.type = MTREE_ENTRY_DIR;
-				break;
-			case DT_FIFO:
-				entry->data.type = MTREE_ENTRY_FIFO;
-				break;
-			case DT_LNK:
-				entry->data.type = MTREE_ENTRY_LINK;
-				break;
-			case DT_REG:
-				entry->data.type = MTREE_ENTRY_FILE;
-				break;
-			case DT_SOCK:
-				entry->data.type = MTREE_ENTRY_SOCKET;
-				break;
-			default:
-				break;
-			}
-#endif
-		ret = read_path_file(r, entry, &skip, &skip_children);
-		if (ret == -1)
+		/*
+		 * Files are read relative to the directory, except for the
+		 * initial dot which is read using the path as given.
+		 */
+		if (IS_DOT(name) || d->fd == AT_FDCWD)
+			ret = read_path_file(r, entry, AT_FDCWD, entry->orig,
+			    &skip, &skip_children);
+		else
+			ret = read_path_file(r, entry, d->fd, entry->name,
+			    &skip, &skip_children);
+		if (ret == -1) {
+			mtree_entry_free(entry);
 			break;
-		if (IS_DOT(dp->d_name)) {
+		}
+		if (IS_DOT(name)) {
 			if (skip)
 				mtree_entry_free(entry);
 			else
@@ -1163,10 +2164,12 @@ read_path(struct mtree_reader *r, const char *path, struct mtree_entry **entries
 				 * all the entries, except for the dot itself
 				 * (unless the dot is skipped as well).
 				 */
-				mtree_entry_free_all(*entries);
-				mtree_entry_free_all(dirs);
-				*entries = NULL;
-				dirs = NULL;
+				mtree_entry_free_all(*files);
+				mtree_entry_free_all(*dirs);
+				*files = NULL;
+				*dirs = NULL;
+				if (r->links != NULL)
+					links_reset(r->links);
 				break;
 			}
 			continue;
@@ -1180,70 +2183,730 @@ read_path(struct mtree_reader *r, const char *path, struct mtree_entry **entries
 				entry->flags |= __MTREE_ENTRY_SKIP;
 			if (skip_children)
 				entry->flags |= __MTREE_ENTRY_SKIP_CHILDREN;
-			dirs = mtree_entry_prepend(dirs, entry);
+			*dirs = mtree_entry_prepend(*dirs, entry);
 		} else if (!skip)
-			*entries = mtree_entry_prepend(*entries, entry);
+			*files = mtree_entry_prepend(*files, entry);
 	}
-	if (err > 0)
-		errno = ret = err;
-end:
-	if (dp != NULL)
-		free(dp);
 
 	if (ret == 0) {
 		if (dot != NULL) {
 			/* Put the initial dot at the (reversed) start. */
-			*entries = mtree_entry_append(*entries, dot);
+			*files = mtree_entry_append(*files, dot);
+		}
+	} else {
+		mtree_entry_free_all(*files);
+		mtree_entry_free_all(*dirs);
+		if (dot != NULL)
+			mtree_entry_free(dot);
+		*files = NULL;
+		*dirs = NULL;
+	}
+	return (ret);
+}
+
+/*
+ * Read directory structure and store entries in `entries', which must initially
+ * point to an empty list.
+ *
+ * The directory is opened as `name' relative to the directory `parentfd'. It
+ * is kept open while reading its subdirectories, unless it is at least
+ * MAX_DIR_FDS levels deep. Deeper directories are closed once read and their
+ * subdirectories are opened by path, so deep trees do not run out of file
+ * descriptors.
+ */
+static int
+read_path(struct mtree_reader *r, int parentfd, const char *name, const char *path,
+    struct mtree_entry **entries, struct mtree_entry *parent, int depth)
+{
+	struct dir		 d;
+	struct mtree_entry	*entry;
+	struct mtree_entry	*files;
+	struct mtree_entry	*dirs;
+	int			 ret;
+
+	files = dirs = NULL;
+	ret = open_dir(r, parentfd, name, path, &d);
+	if (ret == 0)
+		return (0);
+	if (ret == 1) {
+		ret = read_dir(r, &d, path, parent, &files, &dirs);
+		if (ret == -1 || depth >= MAX_DIR_FDS)
+			close_dir(&d);
+	}
+	if (ret == -1) {
+		/* Fatal error, clean up and make our way back to the caller. */
+#ifdef HAVE_PTHREAD
+		if (r->pool != NULL)
+			pool_wait(r->pool);
+#endif
+		mtree_entry_free_all(*entries);
+		*entries = NULL;
+		return (-1);
+	}
+#ifdef HAVE_PTHREAD
+	if (r->pool != NULL)
+		pool_push(r->pool, files);
+#endif
+	*entries = mtree_entry_append(files, *entries);
+
+	/* Directories are processed after files. */
+	entry = dirs;
+	while (entry != NULL) {
+		struct mtree_entry *next = entry->next;
+
+		if ((entry->flags & __MTREE_ENTRY_SKIP) == 0) {
+			dirs = mtree_entry_unlink(dirs, entry);
+			*entries = mtree_entry_prepend(*entries, entry);
+		}
+		if ((entry->flags & __MTREE_ENTRY_SKIP_CHILDREN) == 0) {
+			if (depth < MAX_DIR_FDS)
+				ret = read_path(r, d.fd, entry->name,
+				    entry->orig, entries, entry, depth + 1);
+			else
+				ret = read_path(r, AT_FDCWD, entry->orig,
+				    entry->orig, entries, entry, depth + 1);
+			if (ret == -1)
+				break;
+		}
+		entry = next;
+	}
+	mtree_entry_free_all(dirs);
+
+	if (depth < MAX_DIR_FDS)
+		close_dir(&d);
+	return (ret);
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * Parallel reading of directory structures.
+ *
+ * Each directory is read by one of the worker threads, subdirectories found
+ * in it are queued as new work items. Every worker owns a queue, it takes
+ * work from the bottom of its own queue and, when it runs out of work,
+ * steals from the top of the queues of other workers.
+ *
+ * Entries of the directories are kept in a tree of walk_dir items and only
+ * linked together when the whole structure has been read, which gives the
+ * same order of entries as read_path().
+ */
+struct walk_dir {
+	struct walk_dir		*next;
+	struct walk_dir		*children;
+	struct mtree_entry	*entry;
+	struct mtree_entry	*files;
+	struct mtree_entry	*dirs;
+};
+
+struct walk;
+
+struct walk_worker {
+	struct walk		*walk;
+	struct mtree_reader	 reader;
+	pthread_t		 thread;
+	pthread_mutex_t		 lock;
+	struct walk_dir		**queue;
+	size_t			 queue_size;
+	size_t			 top;
+	size_t			 bottom;
+};
+
+struct walk {
+	struct mtree_reader	*r;
+	const char		*path;
+	struct walk_worker	*workers;
+	int			 nworkers;
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 cond;
+	pthread_mutex_t		 filter_lock;
+	size_t			 pending;
+	size_t			 queued;
+	int			 failed;
+	int			 err;
+};
+
+/*
+ * Filter used by worker threads, user filters are never called concurrently.
+ */
+static int
+walk_filter(struct mtree_entry *entry, void *user_data)
+{
+	struct walk	*walk = user_data;
+	int		 ret;
+
+	pthread_mutex_lock(&walk->filter_lock);
+	ret = walk->r->filter(entry, walk->r->filter_data);
+	pthread_mutex_unlock(&walk->filter_lock);
+	return (ret);
+}
+
+/*
+ * Record failure of a worker, only the first error is reported.
+ */
+static void
+walk_fail(struct walk_worker *w)
+{
+	struct walk	*walk = w->walk;
+	int		 err = errno;
+
+	pthread_mutex_lock(&walk->lock);
+	if (walk->failed == 0) {
+		walk->failed = 1;
+		walk->err = err;
+		free(walk->r->error);
+		walk->r->error = w->reader.error;
+		w->reader.error = NULL;
+	}
+	pthread_cond_broadcast(&walk->cond);
+	pthread_mutex_unlock(&walk->lock);
+}
+
+static int
+walk_push(struct walk_worker *w, struct walk_dir *d)
+{
+	struct walk *walk = w->walk;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->bottom == w->queue_size) {
+		struct walk_dir	**queue;
+		size_t		  size;
+
+		size = w->queue_size ? w->queue_size * 2 : 64;
+		queue = realloc(w->queue, size * sizeof(struct walk_dir *));
+		if (queue == NULL) {
+			pthread_mutex_unlock(&w->lock);
+			return (-1);
+		}
+		w->queue = queue;
+		w->queue_size = size;
+	}
+	w->queue[w->bottom++] = d;
+	pthread_mutex_unlock(&w->lock);
+
+	pthread_mutex_lock(&walk->lock);
+	walk->pending++;
+	walk->queued++;
+	pthread_cond_signal(&walk->cond);
+	pthread_mutex_unlock(&walk->lock);
+	return (0);
+}
+
+/*
+ * Take a directory from the bottom of the worker's own queue or, if `steal'
+ * is set, from the top of another worker's queue.
+ */
+static struct walk_dir *
+walk_take(struct walk_worker *w, int steal)
+{
+	struct walk_dir *d = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->top < w->bottom) {
+		if (steal)
+			d = w->queue[w->top++];
+		else
+			d = w->queue[--w->bottom];
+		if (w->top == w->bottom)
+			w->top = w->bottom = 0;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return (d);
+}
+
+static struct walk_dir *
+walk_next(struct walk_worker *w)
+{
+	struct walk	*walk = w->walk;
+	struct walk_dir	*d;
+	int		 i, n;
+
+	d = walk_take(w, 0);
+	if (d == NULL) {
+		n = w - walk->workers;
+		for (i = 1; i < walk->nworkers && d == NULL; i++)
+			d = walk_take(&walk->workers[(n + i) % walk->nworkers], 1);
+	}
+	if (d != NULL) {
+		pthread_mutex_lock(&walk->lock);
+		walk->queued--;
+		pthread_mutex_unlock(&walk->lock);
+	}
+	return (d);
+}
+
+static void
+walk_read_dir(struct walk_worker *w, struct walk_dir *d)
+{
+	struct walk		 *walk = w->walk;
+	struct walk_dir		 *child;
+	struct walk_dir		**tail;
+	struct mtree_entry	 *entry;
+	const char		 *path;
+	struct dir		  dir;
+	int			  ret;
+
+	/*
+	 * Directories may be read by any thread, so they are opened
+	 * using the full path.
+	 */
+	path = (d->entry != NULL) ? d->entry->orig : walk->path;
+	ret = open_dir(&w->reader, AT_FDCWD, path, path, &dir);
+	if (ret == 1) {
+		ret = read_dir(&w->reader, &dir, path, d->entry, &d->files,
+		    &d->dirs);
+		close_dir(&dir);
+	}
+	if (ret == -1) {
+		walk_fail(w);
+		return;
+	}
+	if (w->reader.pool != NULL)
+		pool_push(w->reader.pool, d->files);
+	tail = &d->children;
+	for (entry = d->dirs; entry != NULL; entry = entry->next) {
+		if ((entry->flags & __MTREE_ENTRY_SKIP_CHILDREN) != 0)
+			continue;
+		child = calloc(1, sizeof(struct walk_dir));
+		if (child == NULL) {
+			mtree_reader_set_errno_error(&w->reader, errno, NULL);
+			walk_fail(w);
+			return;
+		}
+		child->entry = entry;
+		*tail = child;
+		tail = &child->next;
+		if (walk_push(w, child) == -1) {
+			mtree_reader_set_errno_error(&w->reader, errno, NULL);
+			walk_fail(w);
+			return;
+		}
+	}
+}
+
+static void *
+walk_run(void *arg)
+{
+	struct walk_worker	*w = arg;
+	struct walk		*walk = w->walk;
+	struct walk_dir		*d;
+	int			 done;
+	int			 failed;
+
+	/* Checksums may be calculated while reading directories. */
+	if (walk->r->io_priority != MTREE_IO_PRIORITY_NORMAL)
+		mtree_governor_set_io_priority(walk->r->io_priority, NULL);
+	for (;;) {
+		d = walk_next(w);
+		if (d == NULL) {
+			pthread_mutex_lock(&walk->lock);
+			while (walk->failed == 0 && walk->pending > 0 &&
+			    walk->queued == 0)
+				pthread_cond_wait(&walk->cond, &walk->lock);
+			done = walk->failed || walk->pending == 0;
+			pthread_mutex_unlock(&walk->lock);
+			if (done)
+				break;
+			continue;
+		}
+		pthread_mutex_lock(&walk->lock);
+		failed = walk->failed;
+		pthread_mutex_unlock(&walk->lock);
+		if (failed == 0)
+			walk_read_dir(w, d);
+
+		pthread_mutex_lock(&walk->lock);
+		if (--walk->pending == 0)
+			pthread_cond_broadcast(&walk->cond);
+		pthread_mutex_unlock(&walk->lock);
+	}
+	return (NULL);
+}
+
+/*
+ * Link entries of the directory tree together in the order of read_path().
+ */
+static void
+walk_collect(struct walk_dir *d, struct mtree_entry **entries)
+{
+	struct mtree_entry	*entry;
+	struct walk_dir		*child;
+
+	*entries = mtree_entry_append(d->files, *entries);
+	d->files = NULL;
+
+	child = d->children;
+	entry = d->dirs;
+	while (entry != NULL) {
+		struct mtree_entry *next = entry->next;
+
+		if ((entry->flags & __MTREE_ENTRY_SKIP) == 0) {
+			d->dirs = mtree_entry_unlink(d->dirs, entry);
+			*entries = mtree_entry_prepend(*entries, entry);
+		}
+		if ((entry->flags & __MTREE_ENTRY_SKIP_CHILDREN) == 0) {
+			assert(child != NULL && child->entry == entry);
+			walk_collect(child, entries);
+			child = child->next;
+		}
+		entry = next;
+	}
+}
+
+static void
+walk_free_dir(struct walk_dir *d)
+{
+	struct walk_dir *child;
+
+	while (d->children != NULL) {
+		child = d->children;
+		d->children = child->next;
+		walk_free_dir(child);
+	}
+	mtree_entry_free_all(d->files);
+	mtree_entry_free_all(d->dirs);
+	free(d);
+}
+
+/*
+ * Read directory structure using multiple threads and store entries in
+ * `entries', which must initially point to an empty list.
+ */
+static int
+read_path_parallel(struct mtree_reader *r, const char *path,
+    struct mtree_entry **entries)
+{
+	struct walk		 walk;
+	struct walk_worker	*w;
+	struct walk_dir		*root;
+	int			 nthreads;
+	int			 i;
+
+	nthreads = get_threads(r->threads);
+	root = calloc(1, sizeof(struct walk_dir));
+	if (root == NULL) {
+		mtree_reader_set_errno_error(r, errno, NULL);
+		return (-1);
+	}
+	memset(&walk, 0, sizeof(walk));
+	walk.workers = calloc(nthreads, sizeof(struct walk_worker));
+	if (walk.workers == NULL) {
+		mtree_reader_set_errno_error(r, errno, NULL);
+		free(root);
+		return (-1);
+	}
+	walk.r = r;
+	walk.path = path;
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_mutex_init(&walk.filter_lock, NULL);
+	pthread_cond_init(&walk.cond, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		w = &walk.workers[i];
+		w->walk = &walk;
+		pthread_mutex_init(&w->lock, NULL);
+		/*
+		 * Each worker reads with a private copy of the reader, which
+		 * keeps its own error message.
+		 */
+		w->reader = *r;
+		w->reader.entries = NULL;
+		w->reader.parent = NULL;
+		w->reader.loose = NULL;
+		w->reader.buf = NULL;
+		w->reader.buflen = 0;
+		w->reader.dirbuf = NULL;
+		w->reader.error = NULL;
+		w->reader.skip_trie = NULL;
+		memset(&w->reader.defaults, 0, sizeof(w->reader.defaults));
+		if (r->filter != NULL) {
+			w->reader.filter = walk_filter;
+			w->reader.filter_data = &walk;
 		}
-		closedir(dirp);
-
-		/* Directories are processed after files. */
-		entry = dirs;
-		while (entry != NULL) {
-			struct mtree_entry *next = entry->next;
+	}
+	walk.nworkers = nthreads;
 
-			if ((entry->flags & __MTREE_ENTRY_SKIP) == 0) {
-				dirs = mtree_entry_unlink(dirs, entry);
-				*entries = mtree_entry_prepend(*entries, entry);
-			}
-			if ((entry->flags & __MTREE_ENTRY_SKIP_CHILDREN) == 0) {
-				ret = read_path(r, entry->orig, entries, entry);
-				if (ret == -1)
-					break;
-			}
-			entry = next;
+	if (walk_push(&walk.workers[0], root) == -1) {
+		mtree_reader_set_errno_error(&walk.workers[0].reader, errno, NULL);
+		walk_fail(&walk.workers[0]);
+	}
+	if (walk.failed == 0) {
+		/* The calling thread acts as the first worker. */
+		for (i = 1; i < nthreads; i++) {
+			w = &walk.workers[i];
+			if (pthread_create(&w->thread, NULL, walk_run, w) != 0)
+				break;
 		}
-	} else {
-		/* Fatal error, clean up and make our way back to the caller. */
-		mtree_entry_free_all(*entries);
-		*entries = NULL;
+		nthreads = i;
+		walk_run(&walk.workers[0]);
+		for (i = 1; i < nthreads; i++)
+			pthread_join(walk.workers[i].thread, NULL);
+	}
+	if (walk.failed == 0)
+		walk_collect(root, entries);
+	else if (r->pool != NULL) {
+		/* Entries of the walk are about to be freed. */
+		pool_wait(r->pool);
+	}
+	walk_free_dir(root);
+	for (i = 0; i < walk.nworkers; i++) {
+		w = &walk.workers[i];
+		free(w->queue);
+		free(w->reader.dirbuf);
+		free(w->reader.error);
+		pthread_mutex_destroy(&w->lock);
+	}
+	free(walk.workers);
+	pthread_mutex_destroy(&walk.lock);
+	pthread_mutex_destroy(&walk.filter_lock);
+	pthread_cond_destroy(&walk.cond);
 
-		err = errno;
-		closedir(dirp);
-		errno = err;
+	if (walk.failed) {
+		errno = walk.err;
+		return (-1);
 	}
-	mtree_entry_free_all(dirs);
+	return (0);
+}
+#endif /* HAVE_PTHREAD */
 
-	return (ret);
+static int
+compare_layout(const void *a, const void *b)
+{
+	const struct mtree_entry *ea = *(struct mtree_entry * const *)a;
+	const struct mtree_entry *eb = *(struct mtree_entry * const *)b;
+
+	if (ea->data.st_ino != eb->data.st_ino)
+		return (ea->data.st_ino < eb->data.st_ino ? -1 : 1);
+	/* Hard links of a file in any fixed order. */
+	return (ea < eb ? -1 : ea > eb);
+}
+
+/*
+ * Sort the listed entries by the inode numbers of their files, which the
+ * usual file systems allocate close to the contents of the files, so that
+ * the files are read with fewer seeks. The inode numbers are taken from the
+ * directory entries, no file is opened for sorting.
+ *
+ * The entries themselves stay in their order, only the list is sorted.
+ */
+static void
+sort_by_layout(struct mtree_entry **list, size_t count)
+{
+
+	if (count > 1)
+		qsort(list, count, sizeof(struct mtree_entry *),
+		    compare_layout);
+}
+
+/*
+ * Calculate deferred checksums of the entries read from the file system.
+ *
+ * Checksums found in the cache are used first. The remaining files may be
+ * sorted by their location, see sort_by_layout(). Small files are hashed in
+ * batches, see read_small_checksums(). Other files are read at the same
+ * time using io_uring if possible, otherwise the files are read one by one.
+ */
+static int
+read_path_checksums(struct mtree_reader *r, struct mtree_entry *entries)
+{
+	struct mtree_entry	**list;
+	struct mtree_entry	 *entry;
+	struct cache_miss	 *misses;
+	unsigned char		 *buf;
+	uint64_t		  keywords;
+	size_t			  count;
+	size_t			  i;
+	size_t			  left;
+	size_t			  nmisses;
+	int			  options;
+
+	keywords = r->path_keywords & MTREE_KEYWORD_MASK_CHECKSUMS;
+	if (keywords == 0 || entries == NULL)
+		return (0);
+	options = entry_options(r);
+
+	list = malloc(mtree_entry_count(entries) * sizeof(struct mtree_entry *));
+	if (list == NULL) {
+		mtree_reader_set_errno_error(r, errno, NULL);
+		return (-1);
+	}
+	count = 0;
+	for (entry = entries; entry != NULL; entry = entry->next)
+		if (needs_checksums(entry, keywords))
+			list[count++] = entry;
+
+	misses  = NULL;
+	nmisses = 0;
+	if (r->cache != NULL && count > 0) {
+		misses = malloc(count * sizeof(struct cache_miss));
+		if (misses == NULL) {
+			mtree_reader_set_errno_error(r, errno, NULL);
+			free(list);
+			return (-1);
+		}
+		count = read_cached_checksums(r->cache, list, count, keywords,
+		    misses, &nmisses);
+	}
+	if (r->options & MTREE_READ_PATH_LAYOUT_ORDER)
+		sort_by_layout(list, count);
+	/* Without the buffer, all files are read the usual way. */
+	buf = malloc(SMALL_BUFFER_SIZE + 1);
+	if (buf != NULL) {
+		count = read_small_checksums(list, count, keywords, options,
+		    r->governor, buf);
+		free(buf);
+	}
+	/* Entries left by the ring are read the usual way. */
+	if (mtree_uring_checksums(list, count, keywords, options,
+	    r->governor, &left) == -1) {
+		for (i = 0; i < left; i++)
+			read_entry_checksums(list[i], keywords, options,
+			    NULL, r->governor);
+	}
+	if (nmisses > 0)
+		write_cached_checksums(r->cache, misses, nmisses, keywords);
+	free(misses);
+	free(list);
+	return (0);
 }
 
 int
 mtree_reader_read_path(struct mtree_reader *r, const char *path,
     struct mtree_entry **entries)
 {
+	int deferred;
+	int priority;
 	int ret;
 
 	assert(r != NULL);
 	assert(r->entries == NULL);
 
+	priority = -1;
+	if (r->options & MTREE_READ_PATH_DONT_CROSS_MOUNT) {
+		struct stat	st;
+		int		flags;
+
+		if (r->options & MTREE_READ_PATH_FOLLOW_SYMLINKS)
+			flags = 0;
+		else
+			flags = AT_SYMLINK_NOFOLLOW;
+		if (mtree_stat_at(AT_FDCWD, path, &st, flags, 0) == -1) {
+			mtree_reader_set_errno_prefix(r, errno, "`%s'", path);
+			return (-1);
+		}
+		r->base_dev = st.st_dev;
+	}
+
+	if (r->path_keywords & MTREE_KEYWORD_MASK_CHECKSUMS) {
+		r->links = links_create();
+		if (r->links == NULL) {
+			mtree_reader_set_errno_error(r, errno, NULL);
+			return (-1);
+		}
+		if (r->byte_rate != 0 || r->file_rate != 0 ||
+		    r->latency != 0) {
+			r->governor = mtree_governor_create(r->byte_rate,
+			    r->file_rate, r->latency * 1000);
+			if (r->governor == NULL) {
+				mtree_reader_set_errno_error(r, errno, NULL);
+				ret = -1;
+				goto out;
+			}
+		}
+	}
+	/* The priority is set for this thread and those started later. */
+	if (r->io_priority != MTREE_IO_PRIORITY_NORMAL)
+		mtree_governor_set_io_priority(r->io_priority, &priority);
+	deferred = (r->options & (MTREE_READ_PATH_DEFER_CHECKSUMS |
+	    MTREE_READ_PATH_PIPELINE)) != 0;
+#ifdef HAVE_PTHREAD
+	if ((r->options & MTREE_READ_PATH_PIPELINE) != 0 &&
+	    (r->path_keywords & MTREE_KEYWORD_MASK_CHECKSUMS) != 0) {
+		r->pool = pool_start(r);
+		if (r->pool == NULL) {
+			mtree_reader_set_errno_error(r, errno, NULL);
+			ret = -1;
+			goto out;
+		}
+		/* Checksums are calculated by the pool. */
+		deferred = 0;
+	}
+#endif
+
 	/* Sets reader error. */
-	ret = read_path(r, path, &r->entries, NULL);
+#ifdef HAVE_PTHREAD
+	if (r->options & MTREE_READ_PATH_PARALLEL)
+		ret = read_path_parallel(r, path, &r->entries);
+	else
+#endif
+		ret = read_path(r, AT_FDCWD, path, path, &r->entries, NULL, 0);
+#ifdef HAVE_PTHREAD
+	if (r->pool != NULL) {
+		pool_finish(r->pool);
+		r->pool = NULL;
+	}
+#endif
 	if (ret == -1)
-		return (-1);
+		goto out;
+	if (deferred) {
+		ret = read_path_checksums(r, r->entries);
+		if (ret == -1) {
+			mtree_entry_free_all(r->entries);
+			r->entries = NULL;
+			goto out;
+		}
+	}
+	if (r->links != NULL)
+		links_copy(r->links, r->path_keywords &
+		    MTREE_KEYWORD_MASK_CHECKSUMS);
 
 	ret = finish_entries(r, entries);
 
 	mtree_reader_reset(r);
+out:
+	if (r->io_priority != MTREE_IO_PRIORITY_NORMAL)
+		mtree_governor_restore_io_priority(priority);
+	if (r->links != NULL) {
+		links_free(r->links);
+		r->links = NULL;
+	}
+	if (r->governor != NULL) {
+		mtree_governor_free(r->governor);
+		r->governor = NULL;
+	}
+	return (ret);
+}
+
+/*
+ * As mtree_reader_read_path(), but take checksums and digests of files that
+ * appear to be unchanged from the `previous' entries.
+ */
+int
+mtree_reader_read_path_incremental(struct mtree_reader *r, const char *path,
+    struct mtree_entry *previous, struct mtree_entry **entries)
+{
+	struct mtree_entry	*entry;
+	int			 ret;
+
+	assert(r != NULL);
+	assert(r->previous == NULL);
+
+	r->previous = mtree_trie_create(NULL);
+	if (r->previous == NULL) {
+		mtree_reader_set_errno_error(r, errno, NULL);
+		return (-1);
+	}
+	for (entry = previous; entry != NULL; entry = entry->next) {
+		if (mtree_trie_insert(r->previous, entry->path, entry) == -1) {
+			mtree_reader_set_errno_error(r, errno, NULL);
+			mtree_trie_free(r->previous);
+			r->previous = NULL;
+			return (-1);
+		}
+	}
+	ret = mtree_reader_read_path(r, path, entries);
+
+	mtree_trie_free(r->previous);
+	r->previous = NULL;
 	return (ret);
 }
 
@@ -1251,6 +2914,7 @@ int
 mtree_reader_add(struct mtree_reader *r, const char *s, ssize_t len)
 {
 	char	buf[MAX_LINE_LENGTH];
+	size_t	n;
 	int	ret;
 	int	esc;
 	int	sidx, bidx, lines;
@@ -1282,10 +2946,23 @@ mtree_reader_add(struct mtree_reader *r, const char *s, ssize_t len)
 		done = 0;
 		lines = 0;
 		while (sidx < len) {
-			if (INVALID_CHAR((unsigned char)s[sidx])) {
-				// mtree_reader_set_error(r, EINVAL,
-				    // "Invalid character in input '%d'",s[sidx]);
-				// return (-1);
+			/*
+			 * Copy the characters up to the next newline or
+			 * backslash at once.
+			 */
+			n = mtree_scan_line(s + sidx, len - sidx);
+			if (n > 0) {
+				if (bidx + n >= MAX_LINE_LENGTH) {
+					mtree_reader_set_errno_error(r,
+					    ENOBUFS, NULL);
+					return (-1);
+				}
+				memcpy(buf + bidx, s + sidx, n);
+				bidx += n;
+				sidx += n;
+				esc = 0;
+				if (sidx == len)
+					break;
 			}
 
 			switch (s[sidx]) {
@@ -1293,7 +2970,14 @@ mtree_reader_add(struct mtree_reader *r, const char *s, ssize_t len)
 				/* Eat newlines as well as escaped newlines, keep
 				 * reading after an escaped one. */
 				if (esc) {
-					bidx--;
+					/*
+					 * The backslash may have ended the
+					 * previous piece of data.
+					 */
+					if (bidx > 0)
+						bidx--;
+					else
+						r->buflen--;
 					esc = 0;
 				} else
 					done = 1;
@@ -1356,83 +3040,590 @@ mtree_reader_add(struct mtree_reader *r, const char *s, ssize_t len)
 					break;
 			}
 		}
-
-		s   += sidx;
-		len -= sidx;
+
+		s   += sidx;
+		len -= sidx;
+	}
+
+	return (ret);
+}
+
+int
+mtree_reader_add_from_file(struct mtree_reader *r, FILE *fp)
+{
+	char	 buf[MAX_LINE_LENGTH];
+	char	*s;
+	int	 ret = 0;
+
+	assert(r != NULL);
+	assert(fp != NULL);
+
+	for (;;) {
+		errno = 0;
+		s = fgets(buf, sizeof(buf), fp);
+		if (s == NULL) {
+			if (ferror(fp)) {
+				mtree_reader_set_errno_error(r, errno, NULL);
+				ret = -1;
+			}
+			break;
+		}
+		/* Sets reader error. */
+		ret = mtree_reader_add(r, buf, -1);
+		if (ret == -1)
+			break;
+	}
+	if (ret == -1)
+		mtree_reader_reset(r);
+
+	return (ret);
+}
+
+/*
+ * Read bytes from the given file descriptor and process them with the
+ * spec parser.
+ */
+int
+mtree_reader_add_from_fd(struct mtree_reader *r, int fd)
+{
+	char	 buf[MAX_LINE_LENGTH];
+	ssize_t  n;
+	int	 ret = 0;
+
+	assert(r != NULL);
+	assert(fd != -1);
+
+	for (;;) {
+		n = read(fd, buf, sizeof(buf));
+		if (n == 0)
+			break;
+		if (n > 0) {
+			/* Sets reader error. */
+			ret = mtree_reader_add(r, buf, n);
+		} else {
+			if (errno == EINTR ||
+#ifdef EWOULDBLOCK
+			    errno == EWOULDBLOCK ||
+#endif
+			    errno == EAGAIN)
+				continue;
+			mtree_reader_set_errno_error(r, errno, NULL);
+			ret = -1;
+		}
+		if (ret == -1)
+			break;
+	}
+	if (ret == -1)
+		mtree_reader_reset(r);
+
+	return (ret);
+}
+
+#ifdef HAVE_MMAP
+/*
+ * Private pages of the mapping are released after every MAP_RELEASE_SIZE
+ * bytes parsed, so that parsing a large spec doesn't keep a copy of it.
+ */
+#define MAP_RELEASE_SIZE	(64 * 1024 * 1024)
+
+/*
+ * Check whether the newline at `nl' is escaped by an odd number of
+ * backslashes.
+ */
+static int
+is_escaped(const char *s, const char *nl)
+{
+	const char	*p;
+
+	for (p = nl; p > s && p[-1] == '\\'; p--)
+		continue;
+	return ((nl - p) % 2);
+}
+
+/*
+ * Get the start of the line following the line at `s', or `end' if it is
+ * the last line.
+ */
+static char *
+next_line(char *s, char *end)
+{
+	char *nl;
+
+	for (nl = s; nl < end; nl++) {
+		nl = memchr(nl, '\n', end - nl);
+		if (nl == NULL)
+			break;
+		if (!is_escaped(s, nl))
+			return (nl + 1);
+	}
+	return (end);
+}
+
+/*
+ * Parse the lines of a writable buffer in place.
+ *
+ * Each line is terminated by replacing its newline and passed to the parser
+ * directly. Only lines continued with escaped newlines and an unterminated
+ * final line go through mtree_reader_add(), which copies them.
+ *
+ * If `release' is set, the buffer is a private mapping and its pages are
+ * released once parsed.
+ */
+static int
+add_lines(struct mtree_reader *r, char *s, size_t len, int release)
+{
+	char	*end, *nl, *next;
+	char	*done;
+	int	 ret;
+
+	end = s + len;
+	/* Only whole pages inside the buffer can be released. */
+	done = NULL;
+	if (release) {
+		uintptr_t page;
+
+		page = sysconf(_SC_PAGESIZE);
+		done = (char *)(((uintptr_t)s + page - 1) & ~(page - 1));
+	}
+	ret = 0;
+	while (s < end && ret == 0) {
+		/* Eat blank characters at the start of the line. */
+		while (s < end && (*s == ' ' || *s == '\t'))
+			s++;
+		if (s == end)
+			break;
+		nl = memchr(s, '\n', end - s);
+		if (nl == NULL) {
+			ret = mtree_reader_add(r, s, end - s);
+			break;
+		}
+		if (is_escaped(s, nl)) {
+			/*
+			 * Find the end of the continued line, then let the
+			 * copying parser join it.
+			 */
+			next = next_line(s, end);
+			ret = mtree_reader_add(r, s, next - s);
+			nl = next - 1;
+		} else if (nl - s >= MAX_LINE_LENGTH) {
+			mtree_reader_set_errno_error(r, ENOBUFS, NULL);
+			ret = -1;
+		} else if (nl > s) {
+			*nl = '\0';
+			/* Sets reader error. */
+			ret = parse_line(r, s);
+		}
+		s = nl + 1;
+#ifdef MADV_DONTNEED
+		if (done != NULL && s > done &&
+		    (size_t)(s - done) >= MAP_RELEASE_SIZE) {
+			(void)madvise(done, MAP_RELEASE_SIZE, MADV_DONTNEED);
+			done += MAP_RELEASE_SIZE;
+		}
+#endif
+	}
+	return (ret);
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * Parallel parsing of specs in the 2.0 format.
+ *
+ * Every entry of such a spec includes its full path and lines depend on
+ * each other only through the /set and /unset commands. The mapped spec is
+ * split into chunks at unescaped newlines and the commands of each chunk
+ * are collected first, which gives the defaults at the start of every
+ * chunk. The chunks are then parsed by separate readers and their entries
+ * are joined in order.
+ *
+ * Specs with entries relative to the current directory, that is the 1.0
+ * format, are parsed sequentially. The first entry of every chunk is
+ * checked in advance, skipping entries continued with escaped newlines.
+ * If such an entry is only found while parsing, the rest of the spec is
+ * parsed again sequentially.
+ */
+#define PARSE_MIN_CHUNK		(4 * 1024 * 1024)
+#define PARSE_MAX_THREADS	64
+
+struct parse_chunk {
+	struct mtree_reader	*r;
+	char			*start;
+	char			*end;
+	char			**commands;	/* /set and /unset lines */
+	size_t			 ncommands;
+	size_t			 size;
+	int			 ret;
+	int			 err;
+};
+
+/*
+ * Copy the first spec entry line between `s' and `end' into `buf' and
+ * remove its comment.
+ *
+ * Lines continued with escaped newlines and lines too long for `buf' are
+ * skipped. Their entries are only checked while parsing, see above.
+ *
+ * Return 1 if a line was found, 0 if there is no such entry line.
+ */
+static int
+first_spec_line(char *s, char *end, char *buf, size_t size)
+{
+	char	*next, *nl;
+	size_t	 len;
+
+	for (; s < end; s = next) {
+		while (s < end && (*s == ' ' || *s == '\t'))
+			s++;
+		next = next_line(s, end);
+		if (s == end || *s == '\n' || *s == '#' || *s == '/')
+			continue;
+		len = next - s;
+		nl = memchr(s, '\n', len);
+		if (len >= size || (nl != NULL && nl + 1 < next))
+			continue;
+		memcpy(buf, s, len);
+		buf[len] = '\0';
+		if (len > 0 && buf[len - 1] == '\n')
+			buf[len - 1] = '\0';
+		strip_comment(buf);
+		return (buf[0] != '\0');
+	}
+	return (0);
+}
+
+/*
+ * Check that the path of the given entry line is not relative to the current
+ * directory.
+ */
+static int
+is_full_path(struct mtree_reader *r, char *s)
+{
+	char *word, *next, *p;
+
+	read_word(s, &word, &next);
+	if (r->path_last == 1) {
+		while (next != NULL)
+			read_word(next, &word, &next);
+		p = strchr(word, '=');
+		if (p != NULL)
+			*p = '\0';
+	}
+	return (word != NULL && strchr(word, '/') != NULL);
+}
+
+static void *
+parse_chunk_commands(void *arg)
+{
+	struct parse_chunk	 *c = arg;
+	char			**commands;
+	char			 *s;
+	size_t			  size;
+
+	for (s = c->start; s < c->end; s = next_line(s, c->end)) {
+		while (s < c->end && (*s == ' ' || *s == '\t'))
+			s++;
+		if (s == c->end || *s != '/')
+			continue;
+		if (c->ncommands == c->size) {
+			size = c->size > 0 ? c->size * 2 : 16;
+			commands = realloc(c->commands,
+			    size * sizeof(*commands));
+			if (commands == NULL) {
+				c->ret = -1;
+				c->err = errno;
+				break;
+			}
+			c->commands = commands;
+			c->size     = size;
+		}
+		c->commands[c->ncommands++] = s;
 	}
+	return (NULL);
+}
 
-	return (ret);
+static void *
+parse_chunk_lines(void *arg)
+{
+	struct parse_chunk *c = arg;
+
+	c->ret = add_lines(c->r, c->start, c->end - c->start, 1);
+	if (c->ret == -1)
+		c->err = errno;
+	return (NULL);
 }
 
-int
-mtree_reader_add_from_file(struct mtree_reader *r, FILE *fp)
+/*
+ * Replace the defaults of the reader with the defaults of another reader.
+ */
+static void
+set_defaults(struct mtree_reader *r, struct mtree_reader *from)
 {
-	char	 buf[MAX_LINE_LENGTH];
-	char	*s;
-	int	 ret = 0;
 
-	assert(r != NULL);
-	assert(fp != NULL);
+	mtree_entry_free_data_items(&r->defaults);
+	memset(&r->defaults, 0, sizeof(r->defaults));
+	mtree_entry_data_copy_keywords(&r->defaults, &from->defaults,
+	    from->defaults.keywords, 1);
+}
 
-	for (;;) {
-		errno = 0;
-		s = fgets(buf, sizeof(buf), fp);
-		if (s == NULL) {
-			if (ferror(fp)) {
-				mtree_reader_set_errno_error(r, errno, NULL);
-				ret = -1;
-			}
+/*
+ * Run the function for all chunks, the first one in the calling thread.
+ */
+static int
+parse_chunks_run(struct parse_chunk *chunks, int nchunks,
+    void *(*fn)(void *))
+{
+	pthread_t	threads[PARSE_MAX_THREADS];
+	int		started;
+	int		i;
+
+	for (started = 1; started < nchunks; started++)
+		if (pthread_create(&threads[started], NULL, fn,
+		    &chunks[started]) != 0)
 			break;
+	fn(&chunks[0]);
+	/* Chunks without a thread are processed here. */
+	for (i = started; i < nchunks; i++)
+		fn(&chunks[i]);
+	for (i = 1; i < started; i++)
+		pthread_join(threads[i], NULL);
+	return (0);
+}
+
+/*
+ * Parse the mapped spec in parallel.
+ *
+ * Return 0 on success and -1 on error. Return 1 if the spec can't be parsed
+ * in parallel, in that case `*parsed' is set to the number of bytes parsed,
+ * the rest must be parsed from a fresh mapping.
+ */
+static int
+add_lines_parallel(struct mtree_reader *r, char *p, size_t size,
+    size_t *parsed)
+{
+	struct parse_chunk	 chunks[PARSE_MAX_THREADS];
+	struct mtree_reader	*t;
+	char			 line[MAX_LINE_LENGTH];
+	char			*s;
+	size_t			 i;
+	int			 nchunks;
+	int			 ret;
+	int			 k;
+
+	*parsed = 0;
+	if (r->filter != NULL || r->parent != NULL)
+		return (1);
+	nchunks = get_threads(r->threads);
+	if (nchunks > PARSE_MAX_THREADS)
+		nchunks = PARSE_MAX_THREADS;
+	if ((size_t)nchunks > size / PARSE_MIN_CHUNK)
+		nchunks = size / PARSE_MIN_CHUNK;
+	if (nchunks < 2)
+		return (1);
+
+	/* Find out the format from the first entry. */
+	if (!first_spec_line(p, p + size, line, sizeof(line)))
+		return (1);
+	if (r->path_last == -1 && detect_format(r, line) == -1)
+		return (-1);
+
+	memset(chunks, 0, sizeof(chunks));
+	s = p;
+	for (k = 0; k < nchunks && s < p + size; k++) {
+		chunks[k].start = s;
+		if (k == nchunks - 1)
+			s = p + size;
+		else {
+			s = p + size / nchunks * (k + 1);
+			if (s < chunks[k].start)
+				s = chunks[k].start;
+			/*
+			 * The backslashes before the cut may escape the next
+			 * newline.
+			 */
+			while (s > chunks[k].start && s[-1] == '\\')
+				s--;
+			s = next_line(s, p + size);
 		}
-		/* Sets reader error. */
-		ret = mtree_reader_add(r, buf, -1);
-		if (ret == -1)
+		chunks[k].end = s;
+	}
+	nchunks = k;
+	for (k = 1; k < nchunks; k++) {
+		if (!first_spec_line(chunks[k].start, chunks[k].end, line,
+		    sizeof(line)) || !is_full_path(r, line))
+			return (1);
+	}
+
+	/*
+	 * Find the commands, then replay them in order to get the defaults
+	 * at the start of each chunk.
+	 */
+	ret = 0;
+	parse_chunks_run(chunks, nchunks, parse_chunk_commands);
+	t = mtree_reader_create();
+	if (t == NULL) {
+		mtree_reader_set_errno_error(r, errno, NULL);
+		ret = -1;
+		goto out;
+	}
+	t->options       = r->options;
+	t->spec_keywords = r->spec_keywords;
+	mtree_entry_data_copy_keywords(&t->defaults, &r->defaults,
+	    r->defaults.keywords, 1);
+	chunks[0].r = r;
+	for (k = 1; k < nchunks && ret == 0; k++) {
+		struct parse_chunk *c = &chunks[k - 1];
+
+		if (c->ret == -1) {
+			mtree_reader_set_errno_error(r, c->err, NULL);
+			ret = -1;
 			break;
+		}
+		for (i = 0; i < c->ncommands && ret == 0; i++)
+			ret = mtree_reader_add(t, c->commands[i],
+			    next_line(c->commands[i], c->end) -
+			    c->commands[i]);
+		if (ret == -1) {
+			mtree_reader_set_errno_error(r, errno, "%s",
+			    mtree_reader_get_error(t));
+			break;
+		}
+		chunks[k].r = mtree_reader_create();
+		if (chunks[k].r == NULL) {
+			mtree_reader_set_errno_error(r, errno, NULL);
+			ret = -1;
+			break;
+		}
+		chunks[k].r->options       = r->options;
+		chunks[k].r->spec_keywords = r->spec_keywords;
+		chunks[k].r->path_last     = r->path_last;
+		mtree_entry_data_copy_keywords(&chunks[k].r->defaults,
+		    &t->defaults, t->defaults.keywords, 1);
 	}
+	mtree_reader_free(t);
 	if (ret == -1)
-		mtree_reader_reset(r);
+		goto out;
 
+	parse_chunks_run(chunks, nchunks, parse_chunk_lines);
+	if (chunks[0].ret == -1) {
+		ret = -1;
+		goto out;
+	}
+	/*
+	 * Join the entries, which are kept in reverse order, stop at the
+	 * first chunk with an error or with entries the chunk's reader
+	 * couldn't place.
+	 */
+	for (k = 1; k < nchunks; k++) {
+		struct mtree_reader *cr = chunks[k].r;
+
+		if (cr->relative > 0) {
+			/* Continue with the defaults after the last chunk. */
+			if (k > 1)
+				set_defaults(r, chunks[k - 1].r);
+			*parsed = chunks[k].start - p;
+			ret = 1;
+			break;
+		}
+		if (chunks[k].ret == -1) {
+			mtree_reader_set_errno_error(r, chunks[k].err, "%s",
+			    mtree_reader_get_error(cr));
+			ret = -1;
+			break;
+		}
+		r->entries = mtree_entry_append(cr->entries, r->entries);
+		cr->entries = NULL;
+	}
+	if (ret == 0)
+		set_defaults(r, chunks[nchunks - 1].r);
+out:
+	for (k = 0; k < nchunks; k++) {
+		free(chunks[k].commands);
+		if (k > 0 && chunks[k].r != NULL)
+			mtree_reader_free(chunks[k].r);
+	}
 	return (ret);
 }
+#endif /* HAVE_PTHREAD */
+#endif /* HAVE_MMAP */
 
 /*
- * Read bytes from the given file descriptor and process them with the
- * spec parser.
+ * With MTREE_READ_SPEC_MMAP, map the spec in the given file descriptor to
+ * memory and parse it in place, without copying the lines.
+ *
+ * The mapping is private, the parser may write to it without changing the
+ * file. Without the option, or if the file cannot be mapped, it is read with
+ * mtree_reader_add_from_fd() instead. With MTREE_READ_SPEC_PARALLEL, mapped
+ * specs in the 2.0 format are parsed by multiple threads.
  */
 int
-mtree_reader_add_from_fd(struct mtree_reader *r, int fd)
+mtree_reader_add_mapped(struct mtree_reader *r, int fd)
 {
-	char	 buf[MAX_LINE_LENGTH];
-	ssize_t  n;
-	int	 ret = 0;
+#ifdef HAVE_MMAP
+	struct stat	 st;
+	char		*p;
+	size_t		 size;
+	size_t		 parsed;
+	int		 ret;
 
 	assert(r != NULL);
 	assert(fd != -1);
 
-	for (;;) {
-		n = read(fd, buf, sizeof(buf));
-		if (n == 0)
-			break;
-		if (n > 0) {
-			/* Sets reader error. */
-			ret = mtree_reader_add(r, buf, n);
-		} else {
-			if (errno == EINTR ||
-#ifdef EWOULDBLOCK
-			    errno == EWOULDBLOCK ||
+	/*
+	 * Only complete regular files are mapped, and the parser must not be
+	 * in the middle of a line. A file truncated while it is mapped raises
+	 * SIGBUS, so mapping must be asked for.
+	 */
+	if ((r->options & MTREE_READ_SPEC_MMAP) == 0 ||
+	    r->buflen > 0 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    st.st_size == 0 || (uint64_t)st.st_size > SIZE_MAX ||
+	    lseek(fd, 0, SEEK_CUR) != 0)
+		return (mtree_reader_add_from_fd(r, fd));
+
+	size = st.st_size;
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		return (mtree_reader_add_from_fd(r, fd));
+#ifdef MADV_SEQUENTIAL
+	(void)madvise(p, size, MADV_SEQUENTIAL);
 #endif
-			    errno == EAGAIN)
-				continue;
-			mtree_reader_set_errno_error(r, errno, NULL);
-			ret = -1;
+	ret = 1;
+	parsed = 0;
+#ifdef HAVE_PTHREAD
+	if (r->options & MTREE_READ_SPEC_PARALLEL) {
+		/* Sets reader error. */
+		ret = add_lines_parallel(r, p, size, &parsed);
+		if (ret == 1 && parsed > 0) {
+			/* The parsed part of the mapping has been changed. */
+			munmap(p, size);
+			p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE, fd, 0);
+			if (p == MAP_FAILED) {
+				mtree_reader_set_errno_error(r, errno, NULL);
+				mtree_reader_reset(r);
+				return (-1);
+			}
 		}
-		if (ret == -1)
-			break;
 	}
+#endif
+	if (ret == 1) {
+		/* Sets reader error. */
+		ret = add_lines(r, p + parsed, size - parsed, 1);
+	}
+	munmap(p, size);
 	if (ret == -1)
 		mtree_reader_reset(r);
+	else if (lseek(fd, size, SEEK_SET) == -1) {
+		/* Continue after the mapped part in case the file has grown. */
+		mtree_reader_set_errno_error(r, errno, NULL);
+		mtree_reader_reset(r);
+		ret = -1;
+	} else
+		ret = mtree_reader_add_from_fd(r, fd);
 
 	return (ret);
+#else
+	return (mtree_reader_add_from_fd(r, fd));
+#endif
 }
 
 int
@@ -1628,3 +3819,174 @@ mtree_reader_set_path_keywords(struct mtree_reader *r, uint64_t keywords)
 
 	r->path_keywords = keywords;
 }
+
+/*
+ * Get the number of threads used for reading paths in parallel.
+ */
+int
+mtree_reader_get_threads(struct mtree_reader *r)
+{
+
+	assert(r != NULL);
+
+	return (r->threads);
+}
+
+/*
+ * Set the number of threads used for reading paths in parallel, zero
+ * selects the number of online processors.
+ */
+void
+mtree_reader_set_threads(struct mtree_reader *r, int threads)
+{
+
+	assert(r != NULL);
+
+	r->threads = threads;
+}
+
+/*
+ * Get the number of threads used for calculating checksums with
+ * MTREE_READ_PATH_PIPELINE.
+ */
+int
+mtree_reader_get_checksum_threads(struct mtree_reader *r)
+{
+
+	assert(r != NULL);
+
+	return (r->checksum_threads);
+}
+
+/*
+ * Set the number of threads used for calculating checksums with
+ * MTREE_READ_PATH_PIPELINE, zero selects the number of online processors.
+ */
+void
+mtree_reader_set_checksum_threads(struct mtree_reader *r, int threads)
+{
+
+	assert(r != NULL);
+
+	r->checksum_threads = threads;
+}
+
+/*
+ * Get the cache of checksums.
+ */
+struct mtree_cache *
+mtree_reader_get_cache(struct mtree_reader *r)
+{
+
+	assert(r != NULL);
+
+	return (r->cache);
+}
+
+/*
+ * Set the cache of checksums, NULL disables the cache.
+ */
+void
+mtree_reader_set_cache(struct mtree_reader *r, struct mtree_cache *cache)
+{
+
+	assert(r != NULL);
+
+	r->cache = cache;
+}
+
+/*
+ * Get the limit of bytes of file contents read per second.
+ */
+uint64_t
+mtree_reader_get_byte_rate(struct mtree_reader *r)
+{
+
+	assert(r != NULL);
+
+	return (r->byte_rate);
+}
+
+/*
+ * Set the limit of bytes of file contents read per second.
+ */
+void
+mtree_reader_set_byte_rate(struct mtree_reader *r, uint64_t rate)
+{
+
+	assert(r != NULL);
+
+	r->byte_rate = rate;
+}
+
+/*
+ * Get the limit of files whose contents are read per second.
+ */
+uint64_t
+mtree_reader_get_file_rate(struct mtree_reader *r)
+{
+
+	assert(r != NULL);
+
+	return (r->file_rate);
+}
+
+/*
+ * Set the limit of files whose contents are read per second.
+ */
+void
+mtree_reader_set_file_rate(struct mtree_reader *r, uint64_t rate)
+{
+
+	assert(r != NULL);
+
+	r->file_rate = rate;
+}
+
+/*
+ * Get the target latency of reads of file contents in microseconds.
+ */
+uint64_t
+mtree_reader_get_latency(struct mtree_reader *r)
+{
+
+	assert(r != NULL);
+
+	return (r->latency);
+}
+
+/*
+ * Set the target latency of reads of file contents in microseconds.
+ */
+void
+mtree_reader_set_latency(struct mtree_reader *r, uint64_t usec)
+{
+
+	assert(r != NULL);
+
+	r->latency = usec;
+}
+
+/*
+ * Get the I/O priority of threads reading file contents.
+ */
+int
+mtree_reader_get_io_priority(struct mtree_reader *r)
+{
+
+	assert(r != NULL);
+
+	return (r->io_priority);
+}
+
+/*
+ * Set the I/O priority of threads reading file contents.
+ */
+void
+mtree_reader_set_io_priority(struct mtree_reader *r, int priority)
+{
+
+	assert(r != NULL);
+
+	r->io_priority = priority;
+}
@@ -0,0 +1,161 @@
+/*-
+ * Copyright (c) 2015 Michal Ratajsky <michal@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "mtree.h"
+#include "mtree_private.h"
+
+/*
+ * Scanning of spec lines for the characters that need attention of the
+ * parser.
+ *
+ * On x86 the input is compared 16 bytes at a time with SSE2, or 32 bytes
+ * at a time with AVX2 when the processor supports it, other platforms
+ * compare one byte at a time. Only whole blocks inside the given length
+ * are loaded, the rest is compared one byte at a time.
+ */
+#if defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SCAN_SSE2
+#include <immintrin.h>
+#if !defined(__clang__)
+#define SCAN_AVX2
+#endif
+#endif
+
+#define IS_LINE_CHAR(c)		((c) == '\n' || (c) == '\\')
+
+static size_t
+scan_line_scalar(const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (IS_LINE_CHAR(s[i]))
+			break;
+	return (i);
+}
+
+#ifdef SCAN_SSE2
+static size_t
+scan_line_sse2(const char *s, size_t len)
+{
+	const __m128i	nl = _mm_set1_epi8('\n');
+	const __m128i	bs = _mm_set1_epi8('\\');
+	__m128i		v;
+	size_t		i;
+	int		m;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, nl),
+		    _mm_cmpeq_epi8(v, bs)));
+		if (m != 0)
+			return (i + __builtin_ctz(m));
+	}
+	return (i + scan_line_scalar(s + i, len - i));
+}
+
+#endif /* SCAN_SSE2 */
+
+#ifdef SCAN_AVX2
+#pragma GCC push_options
+#pragma GCC target("avx2")
+static size_t
+scan_line_avx2(const char *s, size_t len)
+{
+	const __m256i	nl = _mm256_set1_epi8('\n');
+	const __m256i	bs = _mm256_set1_epi8('\\');
+	__m256i		v;
+	size_t		i;
+	unsigned int	m;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(s + i));
+		m = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(
+		    _mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, bs)));
+		if (m != 0)
+			return (i + __builtin_ctz(m));
+	}
+	return (i + scan_line_sse2(s + i, len - i));
+}
+#pragma GCC pop_options
+#endif /* SCAN_AVX2 */
+
+typedef size_t (*scan_line_fn)(const char *, size_t);
+
+static scan_line_fn scan_line_impl;
+
+/*
+ * Select the widest implementation supported by the processor.
+ */
+static void
+scan_line_init(void)
+{
+
+#ifdef SCAN_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		scan_line_impl = scan_line_avx2;
+	else
+		scan_line_impl = scan_line_sse2;
+#elif defined(SCAN_SSE2)
+	scan_line_impl = scan_line_sse2;
+#else
+	scan_line_impl = scan_line_scalar;
+#endif
+}
+
+#ifdef HAVE_PTHREAD
+static pthread_once_t scan_line_once = PTHREAD_ONCE_INIT;
+#define SCAN_LINE_INIT()	pthread_once(&scan_line_once, scan_line_init)
+#else
+#define SCAN_LINE_INIT()	do {					\
+	if (scan_line_impl == NULL)					\
+		scan_line_init();					\
+} while (0)
+#endif
+
+/*
+ * Get the number of bytes at the start of `s' before the first newline or
+ * backslash, `len' if there is none.
+ */
+size_t
+mtree_scan_line(const char *s, size_t len)
+{
+
+	SCAN_LINE_INIT();
+	return (scan_line_impl(s, len));
+}
+
@@ -26,6 +26,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -112,6 +113,9 @@ mtree_spec_read_spec_file(struct mtree_spec *spec, FILE *fp)
 
 /*
  * Read spec data from the given file descriptor.
+ *
+ * With MTREE_READ_SPEC_MMAP, regular files are mapped to memory and parsed
+ * in place if possible.
  */
 int
 mtree_spec_read_spec_fd(struct mtree_spec *spec, int fd)
@@ -125,7 +129,41 @@ mtree_spec_read_spec_fd(struct mtree_spec *spec, int fd)
 		    "Reading not finalized, call mtree_spec_read_spec_data_finish()");
 		return (-1);
 	}
-	if (mtree_reader_add_from_fd(spec->reader, fd) == -1)
+	if (mtree_reader_add_mapped(spec->reader, fd) == -1)
+		return (-1);
+
+	return (mtree_reader_finish(spec->reader, &spec->entries));
+}
+
+/*
+ * Read spec data from the file at the given path.
+ *
+ * With MTREE_READ_SPEC_MMAP, the file is mapped to memory and parsed in place
+ * if possible.
+ */
+int
+mtree_spec_read_spec_path(struct mtree_spec *spec, const char *path)
+{
+	int fd;
+	int ret;
+
+	assert(spec != NULL);
+	assert(path != NULL);
+
+	if (spec->reading) {
+		mtree_reader_set_errno_error(spec->reader, EPERM,
+		    "Reading not finalized, call mtree_spec_read_spec_data_finish()");
+		return (-1);
+	}
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		mtree_reader_set_errno_prefix(spec->reader, errno, "`%s'",
+		    path);
+		return (-1);
+	}
+	ret = mtree_reader_add_mapped(spec->reader, fd);
+	close(fd);
+	if (ret == -1)
 		return (-1);
 
 	return (mtree_reader_finish(spec->reader, &spec->entries));
@@ -177,6 +215,23 @@ mtree_spec_read_path(struct mtree_spec *spec, const char *path)
 	return (mtree_reader_read_path(spec->reader, path, &spec->entries));
 }
 
+/*
+ * Read the directory structure at `path' as mtree_spec_read_path() does,
+ * taking checksums and digests of unchanged files from `previous'.
+ */
+int
+mtree_spec_read_path_incremental(struct mtree_spec *spec, const char *path,
+    struct mtree_spec *previous)
+{
+
+	assert(spec != NULL);
+	assert(path != NULL);
+	assert(previous != NULL);
+
+	return (mtree_reader_read_path_incremental(spec->reader, path,
+	    previous->entries, &spec->entries));
+}
+
 /*
  * Write the spec to the given FILE.
  */
@@ -384,6 +439,179 @@ mtree_spec_set_read_spec_keywords(struct mtree_spec *spec, uint64_t keywords)
 	mtree_reader_set_spec_keywords(spec->reader, keywords);
 }
 
+/*
+ * Get the number of threads used for reading paths in parallel.
+ */
+int
+mtree_spec_get_read_threads(struct mtree_spec *spec)
+{
+
+	assert(spec != NULL);
+
+	return (mtree_reader_get_threads(spec->reader));
+}
+
+/*
+ * Set the number of threads used for reading paths in parallel.
+ */
+void
+mtree_spec_set_read_threads(struct mtree_spec *spec, int threads)
+{
+
+	assert(spec != NULL);
+
+	mtree_reader_set_threads(spec->reader, threads);
+}
+
+/*
+ * Get the number of threads used for calculating checksums while reading
+ * paths.
+ */
+int
+mtree_spec_get_read_checksum_threads(struct mtree_spec *spec)
+{
+
+	assert(spec != NULL);
+
+	return (mtree_reader_get_checksum_threads(spec->reader));
+}
+
+/*
+ * Set the number of threads used for calculating checksums while reading
+ * paths.
+ */
+void
+mtree_spec_set_read_checksum_threads(struct mtree_spec *spec, int threads)
+{
+
+	assert(spec != NULL);
+
+	mtree_reader_set_checksum_threads(spec->reader, threads);
+}
+
+/*
+ * Get the cache of checksums used when reading paths.
+ */
+struct mtree_cache *
+mtree_spec_get_read_cache(struct mtree_spec *spec)
+{
+
+	assert(spec != NULL);
+
+	return (mtree_reader_get_cache(spec->reader));
+}
+
+/*
+ * Set the cache of checksums used when reading paths, NULL disables it.
+ * The cache is not owned by the spec.
+ */
+void
+mtree_spec_set_read_cache(struct mtree_spec *spec, struct mtree_cache *cache)
+{
+
+	assert(spec != NULL);
+
+	mtree_reader_set_cache(spec->reader, cache);
+}
+
+/*
+ * Get the limit of bytes of file contents read per second, 0 if none.
+ */
+uint64_t
+mtree_spec_get_read_byte_rate(struct mtree_spec *spec)
+{
+
+	assert(spec != NULL);
+
+	return (mtree_reader_get_byte_rate(spec->reader));
+}
+
+/*
+ * Set the limit of bytes of file contents read per second, 0 disables it.
+ */
+void
+mtree_spec_set_read_byte_rate(struct mtree_spec *spec, uint64_t rate)
+{
+
+	assert(spec != NULL);
+
+	mtree_reader_set_byte_rate(spec->reader, rate);
+}
+
+/*
+ * Get the limit of files whose contents are read per second, 0 if none.
+ */
+uint64_t
+mtree_spec_get_read_file_rate(struct mtree_spec *spec)
+{
+
+	assert(spec != NULL);
+
+	return (mtree_reader_get_file_rate(spec->reader));
+}
+
+/*
+ * Set the limit of files whose contents are read per second, 0 disables it.
+ */
+void
+mtree_spec_set_read_file_rate(struct mtree_spec *spec, uint64_t rate)
+{
+
+	assert(spec != NULL);
+
+	mtree_reader_set_file_rate(spec->reader, rate);
+}
+
+/*
+ * Get the target latency of reads of file contents in microseconds, 0 if
+ * none.
+ */
+uint64_t
+mtree_spec_get_read_latency(struct mtree_spec *spec)
+{
+
+	assert(spec != NULL);
+
+	return (mtree_reader_get_latency(spec->reader));
+}
+
+/*
+ * Set the target latency of reads of file contents in microseconds, 0
+ * disables it.
+ */
+void
+mtree_spec_set_read_latency(struct mtree_spec *spec, uint64_t usec)
+{
+
+	assert(spec != NULL);
+
+	mtree_reader_set_latency(spec->reader, usec);
+}
+
+/*
+ * Get the I/O priority of threads reading file contents.
+ */
+int
+mtree_spec_get_read_io_priority(struct mtree_spec *spec)
+{
+
+	assert(spec != NULL);
+
+	return (mtree_reader_get_io_priority(spec->reader));
+}
+
+/*
+ * Set the I/O priority of threads reading file contents.
+ */
+void
+mtree_spec_set_read_io_priority(struct mtree_spec *spec, int priority)
+{
+
+	assert(spec != NULL);
+
+	mtree_reader_set_io_priority(spec->reader, priority);
+}
+
 /*
  * Get writing format.
  */
@@ -0,0 +1,509 @@
+/*-
+ * Copyright (c) 2015 Michal Ratajsky <michal@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "compat.h"
+#include "mtree.h"
+#include "mtree_private.h"
+
+#ifdef HAVE_IO_URING
+/*
+ * Reading of file contents using io_uring.
+ *
+ * Many files are opened and read at the same time from a single thread,
+ * each of them with one request in flight. Completed reads are passed
+ * to the checksum calculation and the next read of the file is queued.
+ */
+
+#define URING_FILES	32		/* files read at the same time */
+#define URING_BUFSIZE	(64 * 1024)	/* read buffer of each file */
+#define URING_CANCEL	URING_FILES	/* user data of cancel requests */
+
+struct uring {
+	int			 fd;
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	unsigned int		 sq_pending;
+	struct io_uring_sqe	*sqes;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+	void			*sq_ring;
+	size_t			 sq_ring_size;
+	void			*cq_ring;
+	size_t			 cq_ring_size;
+	size_t			 sqes_size;
+};
+
+enum {
+	SLOT_OPEN,
+	SLOT_READ,
+	SLOT_CLOSE
+};
+
+struct uring_slot {
+	struct mtree_entry_checksums	 c;
+	unsigned char			*buf;
+	uint64_t			 offset;
+	uint64_t			 submitted;	/* time of the read */
+	int				 fd;
+	int				 state;
+	int				 success;
+	int				 busy;		/* request in flight */
+};
+
+static void
+uring_free(struct uring *u)
+{
+
+	if (u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring != MAP_FAILED)
+		munmap(u->sq_ring, u->sq_ring_size);
+	close(u->fd);
+}
+
+/*
+ * Set up the ring. Fails with ENOSYS if the kernel doesn't support all
+ * of the operations used.
+ */
+static int
+uring_init(struct uring *u, unsigned int entries)
+{
+	struct io_uring_params	 p;
+	char			*sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	u->fd = (int)syscall(SYS_io_uring_setup, entries, &p);
+	if (u->fd == -1)
+		return (-1);
+	u->sq_ring = MAP_FAILED;
+	u->cq_ring = MAP_FAILED;
+	u->sqes    = MAP_FAILED;
+	/*
+	 * Reading at the current file position was added together with
+	 * the open, read and close operations.
+	 */
+	if ((p.features & IORING_FEAT_RW_CUR_POS) == 0) {
+		uring_free(u);
+		errno = ENOSYS;
+		return (-1);
+	}
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_ring_size = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_size > u->sq_ring_size)
+			u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = u->sq_ring_size;
+	}
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ring = u->sq_ring;
+	else {
+		u->cq_ring = mmap(NULL, u->cq_ring_size,
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+		    IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED)
+			goto fail;
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = u->sq_ring;
+	cq = u->cq_ring;
+	u->sq_head    = (unsigned int *)(sq + p.sq_off.head);
+	u->sq_tail    = (unsigned int *)(sq + p.sq_off.tail);
+	u->sq_mask    = (unsigned int *)(sq + p.sq_off.ring_mask);
+	u->sq_array   = (unsigned int *)(sq + p.sq_off.array);
+	u->sq_pending = 0;
+	u->cq_head    = (unsigned int *)(cq + p.cq_off.head);
+	u->cq_tail    = (unsigned int *)(cq + p.cq_off.tail);
+	u->cq_mask    = (unsigned int *)(cq + p.cq_off.ring_mask);
+	u->cqes       = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return (0);
+fail:
+	{
+		int err = errno;
+
+		uring_free(u);
+		errno = err;
+	}
+	return (-1);
+}
+
+/*
+ * Get the next submission queue entry. The caller makes sure that there
+ * is never more requests in flight than the queue size.
+ */
+static struct io_uring_sqe *
+uring_get_sqe(struct uring *u, unsigned int slot)
+{
+	struct io_uring_sqe	*sqe;
+	unsigned int		 tail;
+	unsigned int		 index;
+
+	tail  = *u->sq_tail;
+	index = tail & *u->sq_mask;
+	sqe = &u->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = slot;
+
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->sq_pending++;
+	return (sqe);
+}
+
+/*
+ * Submit the queued requests and wait for at least one completion.
+ */
+static int
+uring_submit_and_wait(struct uring *u)
+{
+	int ret;
+
+	for (;;) {
+		ret = (int)syscall(SYS_io_uring_enter, u->fd, u->sq_pending, 1,
+		    IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret >= 0)
+			break;
+		if (errno != EINTR && errno != EAGAIN)
+			return (-1);
+	}
+	u->sq_pending -= ret;
+	return (0);
+}
+
+static void
+queue_read(struct uring *u, struct uring_slot *slots, unsigned int i)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(u, i);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd     = slots[i].fd;
+	sqe->addr   = (uint64_t)(uintptr_t)slots[i].buf;
+	sqe->len    = URING_BUFSIZE;
+	sqe->off    = slots[i].offset;
+	slots[i].state = SLOT_READ;
+	slots[i].submitted = mtree_governor_now();
+}
+
+static void
+queue_close(struct uring *u, struct uring_slot *slots, unsigned int i,
+    int options)
+{
+	struct io_uring_sqe *sqe;
+
+	if (options & MTREE_ENTRY_DROP_CACHE)
+		mtree_io_dontneed(slots[i].fd);
+	sqe = uring_get_sqe(u, i);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd     = slots[i].fd;
+	slots[i].state = SLOT_CLOSE;
+}
+
+/*
+ * Cancel the requests of the busy slots and wait until all of them have
+ * completed, so that the kernel no longer uses the buffers and descriptors
+ * of the slots. Descriptors still open are left in the slots.
+ */
+static int
+uring_cancel(struct uring *u, struct uring_slot *slots)
+{
+	struct io_uring_sqe	*sqe;
+	struct io_uring_cqe	*cqe;
+	unsigned int		 head;
+	unsigned int		 i;
+	unsigned int		 n;
+	int			 res;
+
+	n = 0;
+	for (i = 0; i < URING_FILES; i++) {
+		if (!slots[i].busy)
+			continue;
+		sqe = uring_get_sqe(u, URING_CANCEL);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr   = i;
+		n++;
+	}
+	while (n > 0) {
+		if (uring_submit_and_wait(u) == -1)
+			return (-1);
+		head = *u->cq_head;
+		while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &u->cqes[head & *u->cq_mask];
+			i   = (unsigned int)cqe->user_data;
+			res = cqe->res;
+			head++;
+			if (i == URING_CANCEL)
+				continue;
+			if (slots[i].state == SLOT_OPEN && res >= 0)
+				slots[i].fd = res;
+			else if (slots[i].state == SLOT_CLOSE &&
+			    res != -ECANCELED)
+				slots[i].fd = -1;
+			slots[i].busy = 0;
+			n--;
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return (0);
+}
+
+/*
+ * Calculate checksums of the entries.
+ *
+ * If the ring fails, the entries whose checksums have not been calculated
+ * are moved to the start of `entries', their number is stored in `left'
+ * and -1 is returned.
+ */
+int
+mtree_uring_checksums(struct mtree_entry **entries, size_t count,
+    uint64_t keywords, int options, struct mtree_governor *g, size_t *left)
+{
+	struct uring		 u;
+	struct uring_slot	*slots;
+	struct io_uring_sqe	*sqe;
+	struct io_uring_cqe	*cqe;
+	struct stat		 st;
+	unsigned char		*bufs;
+	unsigned int		 free_slots[URING_FILES];
+	unsigned int		 nfree;
+	unsigned int		 head;
+	unsigned int		 i;
+	size_t			 next;
+	int			 digests;
+	int			 res;
+	int			 ret;
+
+	assert(entries != NULL || count == 0);
+	assert(left != NULL);
+
+	*left = count;
+	/*
+	 * Leave room for a cancel request of every file.
+	 */
+	if (uring_init(&u, URING_FILES * 2) == -1)
+		return (-1);
+	slots = calloc(URING_FILES, sizeof(struct uring_slot));
+	bufs  = malloc((size_t)URING_FILES * URING_BUFSIZE);
+	if (slots == NULL || bufs == NULL) {
+		free(slots);
+		free(bufs);
+		uring_free(&u);
+		errno = ENOMEM;
+		return (-1);
+	}
+	for (i = 0; i < URING_FILES; i++) {
+		slots[i].buf = bufs + (size_t)i * URING_BUFSIZE;
+		slots[i].fd  = -1;
+		free_slots[i] = URING_FILES - 1 - i;
+	}
+	nfree   = URING_FILES;
+	digests = mtree_entry_checksums_digests(keywords);
+	next    = 0;
+	ret     = 0;
+	for (;;) {
+		/*
+		 * Start reading more files while there are free slots, the
+		 * governor may allow fewer files to be read at once.
+		 */
+		while (nfree > 0 && next < count &&
+		    URING_FILES - nfree < (unsigned int)
+		    mtree_governor_get_window(g, URING_FILES)) {
+			i = free_slots[nfree - 1];
+			if (mtree_entry_checksums_init(&slots[i].c,
+			    entries[next++], digests, keywords) != 1)
+				continue;
+			mtree_governor_file(g);
+			nfree--;
+			slots[i].fd      = -1;
+			slots[i].offset  = 0;
+			slots[i].success = 0;
+			slots[i].state   = SLOT_OPEN;
+			slots[i].busy    = 1;
+
+			sqe = uring_get_sqe(&u, i);
+			sqe->opcode     = IORING_OP_OPENAT;
+			sqe->fd         = AT_FDCWD;
+			sqe->addr       =
+			    (uint64_t)(uintptr_t)slots[i].c.entry->orig;
+			sqe->open_flags = O_RDONLY | O_CLOEXEC;
+		}
+		if (nfree == URING_FILES)
+			break;
+		if (uring_submit_and_wait(&u) == -1) {
+			ret = -1;
+			break;
+		}
+
+		head = *u.cq_head;
+		while (head != __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &u.cqes[head & *u.cq_mask];
+			i   = (unsigned int)cqe->user_data;
+			res = cqe->res;
+			head++;
+
+			switch (slots[i].state) {
+			case SLOT_OPEN:
+				if (res < 0) {
+					mtree_entry_checksums_finish(
+					    &slots[i].c, 0);
+					slots[i].busy = 0;
+					free_slots[nfree++] = i;
+					break;
+				}
+				slots[i].fd = res;
+				/*
+				 * Sparse and large files are read here at
+				 * once, see mtree_entry_checksums_read_fd().
+				 */
+				if (fstat(res, &st) == 0 &&
+				    mtree_entry_checksums_read_whole(
+				    &slots[i].c, &st)) {
+					slots[i].success =
+					    mtree_entry_checksums_read_fd(
+					    &slots[i].c, res, options, g) == 0;
+					queue_close(&u, slots, i, options);
+				} else
+					queue_read(&u, slots, i);
+				break;
+			case SLOT_READ:
+				if (res == -EINTR || res == -EAGAIN)
+					queue_read(&u, slots, i);
+				else if (res > 0) {
+					mtree_governor_read(g, res,
+					    mtree_governor_now() -
+					    slots[i].submitted,
+					    URING_FILES - nfree);
+					mtree_entry_checksums_update(
+					    &slots[i].c, slots[i].buf, res);
+					slots[i].offset += res;
+					queue_read(&u, slots, i);
+				} else {
+					slots[i].success = (res == 0);
+					queue_close(&u, slots, i, options);
+				}
+				break;
+			case SLOT_CLOSE:
+				mtree_entry_checksums_finish(&slots[i].c,
+				    slots[i].success);
+				slots[i].fd   = -1;
+				slots[i].busy = 0;
+				free_slots[nfree++] = i;
+				break;
+			}
+		}
+		__atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+	}
+	if (ret == -1) {
+		int	err = errno;
+		size_t	n;
+
+		/*
+		 * The ring has failed, calculations still in progress are
+		 * abandoned and left to the caller together with the files
+		 * not started yet.
+		 */
+		n = 0;
+		for (i = 0; i < URING_FILES; i++) {
+			if (!slots[i].busy)
+				continue;
+			entries[n++] = slots[i].c.entry;
+			mtree_entry_checksums_finish(&slots[i].c, 0);
+		}
+		memmove(entries + n, entries + next,
+		    (count - next) * sizeof(*entries));
+		*left = n + count - next;
+
+		/*
+		 * The requests must complete before their buffers are freed
+		 * and their descriptors closed. If even that fails, both are
+		 * leaked rather than reused under the kernel.
+		 */
+		if (uring_cancel(&u, slots) == -1) {
+			uring_free(&u);
+			errno = err;
+			return (-1);
+		}
+		for (i = 0; i < URING_FILES; i++)
+			if (slots[i].fd != -1)
+				close(slots[i].fd);
+		errno = err;
+	}
+	uring_free(&u);
+	free(bufs);
+	free(slots);
+	return (ret);
+}
+#else
+int
+mtree_uring_checksums(struct mtree_entry **entries, size_t count,
+    uint64_t keywords, int options, struct mtree_governor *g, size_t *left)
+{
+
+	(void)entries;
+	(void)keywords;
+	(void)options;
+	(void)g;
+
+	*left = count;
+	errno = ENOSYS;
+	return (-1);
+}
+#endif /* HAVE_IO_URING */
@@ -24,7 +24,20 @@
  * SUCH DAMAGE.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* Needed for statx(2). */
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
 #include <sys/types.h>
+#include <sys/stat.h>
+#if MAJOR_IN_MKDEV
+#include <sys/mkdev.h>
+#elif MAJOR_IN_SYSMACROS
+#include <sys/sysmacros.h>
+#endif
 
 #include <assert.h>
 #include <errno.h>
@@ -186,19 +199,23 @@ mtree_atol(const char *p, const char **endptr)
 	return (mtree_atol8(p, endptr));
 }
 
-int
-mtree_cleanup_path(const char *path, char **ppart, char **npart)
+/*
+ * Clean up the path in `buf', which must have room for MAXPATHLEN + 2
+ * characters. Returns the path within `buf'.
+ */
+static char *
+cleanup_path(const char *path, char *buf)
 {
-	char	*p, *n, *dirname;
-	char	 buf[MAXPATHLEN];
+	char	*p, *dirname;
 	size_t	 len;
 
 	len = strlen(path);
-	if (len >= sizeof(buf)) {
+	if (len >= MAXPATHLEN) {
 		errno = ENOBUFS;
-		return (-1);
+		return (NULL);
 	}
-	p = dirname = strcpy(buf, path);
+	/* Leave room for the "./" prefix. */
+	p = dirname = strcpy(buf + 2, path);
 
 	/* Remove leading '/' and '../' elements. */
 	while (*p != '\0') {
@@ -238,14 +255,14 @@ mtree_cleanup_path(const char *path, char **ppart, char **npart)
 	}
 	while (*p != '\0') {
 		if (p[0] == '.' && p[1] == '.' && p[2] == '/') {
-			strcpy(p, p+3);
+			memmove(p, p+3, strlen(p+3) + 1);
 		} else if (p[0] == '/') {
 			if (p[1] == '/') {
 				/* Convert '//' --> '/' */
-				strcpy(p, p+1);
+				memmove(p, p+1, strlen(p+1) + 1);
 			} else if (p[1] == '.' && p[2] == '/') {
 				/* Convert '/./' --> '/' */
-				strcpy(p, p+2);
+				memmove(p, p+2, strlen(p+2) + 1);
 			} else if (p[1] == '.' && p[2] == '.' && p[3] == '/') {
 				/* Convert 'dir/dir1/../dir2/'
 				 *     --> 'dir/dir2/'
@@ -257,10 +274,10 @@ mtree_cleanup_path(const char *path, char **ppart, char **npart)
 					--rp;
 				}
 				if (rp > dirname) {
-					strcpy(rp, p+3);
+					memmove(rp, p+3, strlen(p+3) + 1);
 					p = rp;
 				} else {
-					strcpy(dirname, p+4);
+					memmove(dirname, p+4, strlen(p+4) + 1);
 					p = dirname;
 				}
 			} else
@@ -268,34 +285,77 @@ mtree_cleanup_path(const char *path, char **ppart, char **npart)
 		} else
 			p++;
 	}
-	p = dirname;
-	len = strlen(p);
 
 	/*
 	 * Prefix the path with "./" if it isn't prefix already, empty path
 	 * is converted to ".".
 	 */
+	p = dirname;
 	if (strcmp(dirname, ".") != 0 && strncmp(dirname, "./", 2) != 0) {
-		len += 2;
-		if (*dirname != '\0')
-			len++;
-		p = malloc(len);
-		p[0] = '.';
 		if (*dirname != '\0') {
+			p -= 2;
+			p[0] = '.';
 			p[1] = '/';
-			strcpy(p + 2, dirname);
-		} else
-			strcpy(p + 1, dirname);
-	} else
-		p = strdup(dirname);
+		} else {
+			p -= 1;
+			p[0] = '.';
+		}
+	}
+	return (p);
+}
+
+/*
+ * Get the name part of a clean path.
+ */
+static char *
+path_name(char *path)
+{
+	char *n;
 
-	*ppart = p;
+	n = strrchr(path, '/');
+	if (n == NULL || n[1] == '\0')
+		return (path);
+	return (n + 1);
+}
 
-	if ((n = strrchr(p, '/')) != NULL)
-		n++;
-	if (n == NULL || *n == '\0')
-		n = p;
-	*npart = strdup(n);
+int
+mtree_cleanup_path(const char *path, char **ppart, char **npart)
+{
+	char	 buf[MAXPATHLEN + 2];
+	char	*p;
+
+	p = cleanup_path(path, buf);
+	if (p == NULL)
+		return (-1);
+	*ppart = strdup(p);
+	if (*ppart == NULL)
+		return (-1);
+	*npart = strdup(path_name(p));
+	if (*npart == NULL) {
+		free(*ppart);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * As above, but allocate the path from the arena. The name is a part of the
+ * path.
+ */
+int
+mtree_cleanup_path_arena(const char *path, struct mtree_arena *arena,
+    char **ppart, char **npart)
+{
+	char	 buf[MAXPATHLEN + 2];
+	char	*p;
+
+	p = cleanup_path(path, buf);
+	if (p == NULL)
+		return (-1);
+	*ppart = mtree_arena_strndup(arena, p, strlen(p));
+	if (*ppart == NULL)
+		return (-1);
+	*npart = *ppart + (path_name(p) - p);
 	return (0);
 }
 
@@ -377,14 +437,165 @@ mtree_gname_from_gid(gid_t gid)
 	return (gname);
 }
 
+/*
+ * Open file `path', which is relative to the directory `dirfd'.
+ *
+ * Without openat(2), `dirfd' must be AT_FDCWD.
+ */
+int
+mtree_open_at(int dirfd, const char *path, int flags)
+{
+
+	assert(path != NULL);
+
+#ifdef MTREE_USE_AT
+	return (openat(dirfd, path, flags));
+#else
+	assert(dirfd == AT_FDCWD);
+	(void)dirfd;
+
+	return (open(path, flags));
+#endif
+}
+
+#if defined(HAVE_STATX) && defined(STATX_BASIC_STATS)
+/*
+ * Convert stat keywords to the mask of statx(2) fields.
+ */
+static unsigned int
+statx_mask(uint64_t keywords)
+{
+	unsigned int mask;
+
+	/* The type is always needed. */
+	mask = STATX_TYPE;
+	if (keywords & MTREE_KEYWORD_MODE)
+		mask |= STATX_MODE;
+	if (keywords & (MTREE_KEYWORD_GID | MTREE_KEYWORD_GNAME))
+		mask |= STATX_GID;
+	if (keywords & (MTREE_KEYWORD_UID | MTREE_KEYWORD_UNAME))
+		mask |= STATX_UID;
+	if (keywords & MTREE_KEYWORD_INODE)
+		mask |= STATX_INO;
+	if (keywords & MTREE_KEYWORD_NLINK)
+		mask |= STATX_NLINK;
+	if (keywords & (MTREE_KEYWORD_SIZE | MTREE_KEYWORD_LINK))
+		mask |= STATX_SIZE;
+	if (keywords & MTREE_KEYWORD_TIME)
+		mask |= STATX_MTIME;
+	return (mask);
+}
+
+static int
+stat_statx(int dirfd, const char *path, struct stat *st, int flags,
+    uint64_t keywords)
+{
+	struct statx stx;
+
+	if (statx(dirfd, path, flags, statx_mask(keywords), &stx) == -1)
+		return (-1);
+
+	/* Device numbers and the block size are always returned. */
+	memset(st, 0, sizeof(*st));
+	st->st_mode    = stx.stx_mode;
+	st->st_ino     = stx.stx_ino;
+	st->st_nlink   = stx.stx_nlink;
+	st->st_uid     = stx.stx_uid;
+	st->st_gid     = stx.stx_gid;
+	st->st_size    = stx.stx_size;
+	st->st_blocks  = stx.stx_blocks;
+	st->st_blksize = stx.stx_blksize;
+	st->st_dev     = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	st->st_rdev    = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+	st->st_mtim.tv_sec  = stx.stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec  = stx.stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+	st->st_atim.tv_sec  = stx.stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+	return (0);
+}
+#endif
+
+/*
+ * Get status of file `path', which is relative to the directory `dirfd'.
+ *
+ * Symbolic links are not followed if AT_SYMLINK_NOFOLLOW is included in
+ * `flags'. With AT_STATX_DONT_SYNC, attributes of files on network file
+ * systems may be taken from cache. Without fstatat(2), `dirfd' must be
+ * AT_FDCWD.
+ *
+ * The file type and device numbers are always retrieved, other fields only
+ * when needed by the given stat keywords. When supported, fields that are
+ * not needed may be left unset.
+ */
+int
+mtree_stat_at(int dirfd, const char *path, struct stat *st, int flags,
+    uint64_t keywords)
+{
+
+	assert(path != NULL);
+	assert(st != NULL);
+
+#if defined(HAVE_STATX) && defined(STATX_BASIC_STATS)
+	if (stat_statx(dirfd, path, st, flags, keywords) == 0)
+		return (0);
+	/* Fall back to stat when statx(2) is not supported by the kernel. */
+	if (errno != ENOSYS)
+		return (-1);
+#else
+	(void)keywords;
+#endif
+	flags &= ~AT_STATX_DONT_SYNC;
+#ifdef MTREE_USE_AT
+	return (fstatat(dirfd, path, st, flags));
+#else
+	assert(dirfd == AT_FDCWD);
+	(void)dirfd;
+
+	if (flags & AT_SYMLINK_NOFOLLOW)
+		return (lstat(path, st));
+	return (stat(path, st));
+#endif
+}
+
+/*
+ * Read the contents of symbolic link `path', which is relative to the
+ * directory `dirfd'.
+ */
 char *
-mtree_readlink(const char *path)
+mtree_readlink_at(int dirfd, const char *path)
 {
 	struct stat	 st;
+	char		 buf[1024];
 	char		*link;
 	ssize_t		 n;
 
-	if (lstat(path, &st) == -1)
+	assert(path != NULL);
+
+	/*
+	 * Try to read the link into a buffer first, which avoids calling
+	 * lstat(2) for the usual short links.
+	 */
+#ifdef MTREE_USE_AT
+	n = readlinkat(dirfd, path, buf, sizeof(buf));
+#else
+	assert(dirfd == AT_FDCWD);
+	n = readlink(path, buf, sizeof(buf));
+#endif
+	if (n == -1)
+		return (NULL);
+	if ((size_t)n < sizeof(buf)) {
+		link = malloc(n + 1);
+		if (link == NULL)
+			return (NULL);
+		memcpy(link, buf, n);
+		link[n] = '\0';
+		return (link);
+	}
+
+	if (mtree_stat_at(dirfd, path, &st, AT_SYMLINK_NOFOLLOW,
+	    MTREE_KEYWORD_SIZE) == -1)
 		return (NULL);
 	if (!S_ISLNK(st.st_mode)) {
 		errno = EINVAL;
@@ -394,7 +605,11 @@ mtree_readlink(const char *path)
 	if (link == NULL)
 		return (NULL);
 
-	n = readlink(path, link, st.st_size + 1);
+#ifdef MTREE_USE_AT
+	n = readlinkat(dirfd, path, link, st.st_size);
+#else
+	n = readlink(path, link, st.st_size);
+#endif
 	if (n == -1) {
 		free(link);
 		return (NULL);
@@ -219,6 +219,22 @@ write_part(struct mtree_writer *w, int *offset, const char *format, ...)
 	return (len);
 }
 
+/*
+ * Format the digest of the given type as a hexadecimal string in `hex'.
+ */
+static const char *
+digest_hex(const struct mtree_entry_data *data, int type, char *hex)
+{
+	const unsigned char *bytes;
+
+	bytes = mtree_entry_data_get_digest(data, type);
+	if (bytes != NULL)
+		mtree_digest_to_hex(bytes, mtree_digest_get_size(type), hex);
+	else
+		hex[0] = '\0';
+	return (hex);
+}
+
 #define WRITE_KW_PREFIX		0x01
 #define WRITE_KW_POSTFIX	0x02
 
@@ -229,6 +245,7 @@ static int
 write_keyword(struct mtree_writer *w, struct mtree_entry_data *data, int *offset,
     long keyword, int options)
 {
+	char	 hex[2 * MTREE_DIGEST_MAX_SIZE + 1];
 	char	*s;
 	int	 ret;
 
@@ -297,12 +314,12 @@ write_keyword(struct mtree_writer *w, struct mtree_entry_data *data, int *offset
 		/* Types: file */
 		if (data->type != MTREE_ENTRY_FILE)
 			return (0);
-		return WRITE("md5=%s", data->md5digest);
+		return WRITE("md5=%s", digest_hex(data, MTREE_DIGEST_MD5, hex));
 	case MTREE_KEYWORD_MD5DIGEST:
 		/* Types: file */
 		if (data->type != MTREE_ENTRY_FILE)
 			return (0);
-		return WRITE("md5digest=%s", data->md5digest);
+		return WRITE("md5digest=%s", digest_hex(data, MTREE_DIGEST_MD5, hex));
 	case MTREE_KEYWORD_MODE:
 		return WRITE("mode=%#o", data->st_mode);
 	case MTREE_KEYWORD_NLINK:
@@ -315,57 +332,57 @@ write_keyword(struct mtree_writer *w, struct mtree_entry_data *data, int *offset
 		/* Types: file */
 		if (data->type != MTREE_ENTRY_FILE)
 			return (0);
-		return WRITE("ripemd160digest=%s", data->rmd160digest);
+		return WRITE("ripemd160digest=%s", digest_hex(data, MTREE_DIGEST_RMD160, hex));
 	case MTREE_KEYWORD_RMD160:
 		/* Types: file */
 		if (data->type != MTREE_ENTRY_FILE)
 			return (0);
-		return WRITE("rmd160=%s", data->rmd160digest);
+		return WRITE("rmd160=%s", digest_hex(data, MTREE_DIGEST_RMD160, hex));
 	case MTREE_KEYWORD_RMD160DIGEST:
 		/* Types: file */
 		if (data->type != MTREE_ENTRY_FILE)
 			return (0);
-		return WRITE("rmd160digest=%s", data->rmd160digest);
+		return WRITE("rmd160digest=%s", digest_hex(data, MTREE_DIGEST_RMD160, hex));
 	case MTREE_KEYWORD_SHA1:
 		/* Types: file */
 		if (data->type != MTREE_ENTRY_FILE)
 			return (0);
-		return WRITE("sha1=%s", data->sha1digest);
+		return WRITE("sha1=%s", digest_hex(data, MTREE_DIGEST_SHA1, hex));
 	case MTREE_KEYWORD_SHA1DIGEST:
 		/* Types: file */
 		if (data->type != MTREE_ENTRY_FILE)
 			return (0);
-		return WRITE("sha1digest=%s", data->sha1digest);
+		return WRITE("sha1digest=%s", digest_hex(data, MTREE_DIGEST_SHA1, hex));
 	case MTREE_KEYWORD_SHA256:
 		/* Types: file */
 		if (data->type != MTREE_ENTRY_FILE)
 			return (0);
-		return WRITE("sha256=%s", data->sha256digest);
+		return WRITE("sha256=%s", digest_hex(data, MTREE_DIGEST_SHA256, hex));
 	case MTREE_KEYWORD_SHA256DIGEST:
 		/* Types: file */
 		if (data->type != MTREE_ENTRY_FILE)
 			return (0);
-		return WRITE("sha256digest=%s", data->sha256digest);
+		return WRITE("sha256digest=%s", digest_hex(data, MTREE_DIGEST_SHA256, hex));
 	case MTREE_KEYWORD_SHA384:
 		/* Types: file */
 		if (data->type != MTREE_ENTRY_FILE)
 			return (0);
-		return WRITE("sha384=%s", data->sha384digest);
+		return WRITE("sha384=%s", digest_hex(data, MTREE_DIGEST_SHA384, hex));
 	case MTREE_KEYWORD_SHA384DIGEST:
 		/* Types: file */
 		if (data->type != MTREE_ENTRY_FILE)
 			return (0);
-		return WRITE("sha384digest=%s", data->sha384digest);
+		return WRITE("sha384digest=%s", digest_hex(data, MTREE_DIGEST_SHA384, hex));
 	case MTREE_KEYWORD_SHA512:
 		/* Types: file */
 		if (data->type != MTREE_ENTRY_FILE)
 			return (0);
-		return WRITE("sha512=%s", data->sha512digest);
+		return WRITE("sha512=%s", digest_hex(data, MTREE_DIGEST_SHA512, hex));
 	case MTREE_KEYWORD_SHA512DIGEST:
 		/* Types: file */
 		if (data->type != MTREE_ENTRY_FILE)
 			return (0);
-		return WRITE("sha512digest=%s", data->sha512digest);
+		return WRITE("sha512digest=%s", digest_hex(data, MTREE_DIGEST_SHA512, hex));
 	case MTREE_KEYWORD_SIZE:
 		/* Types: file */
 		if (data->type != MTREE_ENTRY_FILE)
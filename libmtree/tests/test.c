@@ -45,9 +45,11 @@ main(void)
 	 */
 	test_mtree_misc();
 	test_mtree_cksum();
+	test_mtree_cache();
 	test_mtree_digest();
 	test_mtree_trie();
 	test_mtree_entry();
+	test_mtree_spec();
 	test_mtree_spec_diff();
 
 	if (tests_failed == 0)
@@ -41,10 +41,12 @@ extern int tests_current_skipped;
 /*
  * Test functions.
  */
+void test_mtree_cache(void);
 void test_mtree_cksum(void);
 void test_mtree_digest(void);
 void test_mtree_entry(void);
 void test_mtree_misc(void);
+void test_mtree_spec(void);
 void test_mtree_spec_diff(void);
 void test_mtree_trie(void);
 
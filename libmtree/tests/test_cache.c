@@ -0,0 +1,287 @@
+/*-
+ * Copyright (c) 2015 Michal Ratajsky <michal@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#include "libmtree/mtree.h"
+#include "libmtree/mtree_file.h"
+#include "libmtree/mtree_private.h"
+
+#define CACHE_DIR	"/tmp/mtree-test-cache"
+#define CACHE_DATA	CACHE_DIR "/data"
+#define CACHE_FILE	"/tmp/mtree-test-cache.db"
+
+#define FAKE_MD5	"0123456789abcdef0123456789abcdef"
+
+static int
+write_data(const char *s)
+{
+	int	fd;
+	int	ret;
+
+	fd = open(CACHE_DATA, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	TEST_ASSERT_ERRNO(fd != -1);
+	if (fd == -1)
+		return (-1);
+	ret = write(fd, s, strlen(s)) == (ssize_t)strlen(s) ? 0 : -1;
+	TEST_ASSERT_ERRNO(ret == 0);
+	close(fd);
+	return (ret);
+}
+
+/*
+ * Store a fake digest of the data file, so that it can be told whether
+ * the digest comes from the cache.
+ */
+static void
+put_fake_md5(struct mtree_cache *cache)
+{
+	struct mtree_cache_key	 key;
+	struct mtree_entry	*entry;
+	struct stat		 st;
+
+	TEST_ASSERT_ERRNO(stat(CACHE_DATA, &st) == 0);
+	entry = mtree_entry_create(CACHE_DATA);
+	TEST_ASSERT_ERRNO(entry != NULL);
+	if (entry == NULL)
+		return;
+	mtree_entry_set_md5digest(entry, FAKE_MD5, MTREE_KEYWORD_MD5);
+	mtree_cache_key_from_stat(&key, &st);
+	mtree_cache_put(cache, &key, entry, MTREE_DIGEST_MD5,
+	    MTREE_KEYWORD_MD5);
+	mtree_entry_free(entry);
+}
+
+/*
+ * Read the MD5 digest of the data file by reading its directory.
+ */
+static char *
+read_md5(struct mtree_cache *cache, int options)
+{
+	struct mtree_spec	*spec;
+	struct mtree_entry	*entry;
+	char			*md5;
+	int			 ret;
+
+	spec = mtree_spec_create();
+	TEST_ASSERT_ERRNO(spec != NULL);
+	if (spec == NULL)
+		return (NULL);
+	mtree_spec_set_read_path_keywords(spec, MTREE_KEYWORD_TYPE |
+	    MTREE_KEYWORD_MD5);
+	mtree_spec_set_read_options(spec, options);
+	mtree_spec_set_read_cache(spec, cache);
+	TEST_ASSERT(mtree_spec_get_read_cache(spec) == cache);
+
+	md5 = NULL;
+	ret = mtree_spec_read_path(spec, CACHE_DIR);
+	TEST_ASSERT_ERRNO(ret == 0);
+	if (ret == 0) {
+		entry = mtree_entry_find(mtree_spec_get_entries(spec), "./data");
+		TEST_ASSERT(entry != NULL);
+		if (entry != NULL && mtree_entry_get_md5digest(entry) != NULL)
+			md5 = strdup(mtree_entry_get_md5digest(entry));
+	}
+	mtree_spec_free(spec);
+	TEST_ASSERT(md5 != NULL);
+	return (md5);
+}
+
+static void
+check_md5(struct mtree_cache *cache, const char *expected)
+{
+	static const int options[] = {
+		0,
+		MTREE_READ_PATH_DEFER_CHECKSUMS,
+		MTREE_READ_PATH_PIPELINE
+	};
+	char	*md5;
+	size_t	 i;
+
+	for (i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+		md5 = read_md5(cache, options[i]);
+		if (md5 != NULL) {
+			TEST_ASSERT_STRCMP(md5, expected);
+			free(md5);
+		}
+	}
+}
+
+static void
+test_cache_read_path(void)
+{
+	struct mtree_cache	*cache;
+	char			*md5;
+
+	unlink(CACHE_FILE);
+	unlink(CACHE_DATA);
+	rmdir(CACHE_DIR);
+	TEST_ASSERT_ERRNO(mkdir(CACHE_DIR, 0755) == 0);
+	if (write_data("cached data\n") != 0)
+		return;
+	md5 = mtree_digest_path(MTREE_DIGEST_MD5, CACHE_DATA);
+	TEST_ASSERT_ERRNO(md5 != NULL);
+	if (md5 == NULL)
+		goto out;
+
+	/* A missing file is an empty cache. */
+	cache = mtree_cache_open(CACHE_FILE, 0);
+	TEST_ASSERT_ERRNO(cache != NULL);
+	if (cache == NULL)
+		goto out;
+	check_md5(cache, md5);
+	put_fake_md5(cache);
+	check_md5(cache, FAKE_MD5);
+	TEST_ASSERT_ERRNO(mtree_cache_close(cache) == 0);
+
+	/* The file has just been changed, which is too recent to trust. */
+	cache = mtree_cache_open(CACHE_FILE, MTREE_CACHE_STRICT);
+	TEST_ASSERT_ERRNO(cache != NULL);
+	if (cache != NULL) {
+		check_md5(cache, md5);
+		mtree_cache_close(cache);
+	}
+	/* The record has been replaced by the correct value. */
+	cache = mtree_cache_open(CACHE_FILE, 0);
+	TEST_ASSERT_ERRNO(cache != NULL);
+	if (cache == NULL)
+		goto out;
+	check_md5(cache, md5);
+	put_fake_md5(cache);
+	mtree_cache_close(cache);
+
+	/* Changing the file invalidates the record. */
+	cache = mtree_cache_open(CACHE_FILE, 0);
+	TEST_ASSERT_ERRNO(cache != NULL);
+	if (cache == NULL)
+		goto out;
+	check_md5(cache, FAKE_MD5);
+	mtree_cache_close(cache);
+	if (write_data("more data\n") == 0) {
+		free(md5);
+		md5 = mtree_digest_path(MTREE_DIGEST_MD5, CACHE_DATA);
+		TEST_ASSERT_ERRNO(md5 != NULL);
+		cache = mtree_cache_open(CACHE_FILE, 0);
+		TEST_ASSERT_ERRNO(cache != NULL);
+		if (cache != NULL && md5 != NULL)
+			check_md5(cache, md5);
+		if (cache != NULL)
+			mtree_cache_close(cache);
+	}
+out:
+	free(md5);
+	unlink(CACHE_FILE);
+	unlink(CACHE_DATA);
+	rmdir(CACHE_DIR);
+}
+
+static void
+test_cache_compact(void)
+{
+	struct mtree_cache	*cache;
+	struct mtree_cache_key	 key;
+	struct mtree_entry	*entry;
+	struct stat		 st;
+
+	unlink(CACHE_FILE);
+	unlink(CACHE_DATA);
+	rmdir(CACHE_DIR);
+	TEST_ASSERT_ERRNO(mkdir(CACHE_DIR, 0755) == 0);
+	if (write_data("data\n") != 0)
+		goto out;
+	cache = mtree_cache_open(CACHE_FILE, 0);
+	TEST_ASSERT_ERRNO(cache != NULL);
+	if (cache == NULL)
+		goto out;
+	put_fake_md5(cache);
+	TEST_ASSERT_ERRNO(mtree_cache_flush(cache) == 0);
+	mtree_cache_close(cache);
+
+	/* Without looking up the record, it is removed. */
+	cache = mtree_cache_open(CACHE_FILE, 0);
+	TEST_ASSERT_ERRNO(cache != NULL);
+	if (cache == NULL)
+		goto out;
+	TEST_ASSERT_ERRNO(mtree_cache_compact(cache) == 0);
+	mtree_cache_close(cache);
+
+	cache = mtree_cache_open(CACHE_FILE, 0);
+	TEST_ASSERT_ERRNO(cache != NULL);
+	if (cache == NULL)
+		goto out;
+	entry = mtree_entry_create(CACHE_DATA);
+	TEST_ASSERT_ERRNO(entry != NULL);
+	if (entry != NULL) {
+		TEST_ASSERT_ERRNO(stat(CACHE_DATA, &st) == 0);
+		mtree_cache_key_from_stat(&key, &st);
+		TEST_ASSERT(mtree_cache_get(cache, &key, entry,
+		    MTREE_DIGEST_MD5, MTREE_KEYWORD_MD5) == 0);
+		TEST_ASSERT((mtree_entry_get_keywords(entry) &
+		    MTREE_KEYWORD_MD5) == 0);
+		mtree_entry_free(entry);
+	}
+	mtree_cache_close(cache);
+out:
+	unlink(CACHE_FILE);
+	unlink(CACHE_DATA);
+	rmdir(CACHE_DIR);
+}
+
+static void
+test_cache_invalid(void)
+{
+	struct mtree_cache	*cache;
+	FILE			*fp;
+
+	fp = fopen(CACHE_FILE, "w");
+	TEST_ASSERT_ERRNO(fp != NULL);
+	if (fp == NULL)
+		return;
+	fputs("this is not a cache\n", fp);
+	fclose(fp);
+
+	errno = 0;
+	cache = mtree_cache_open(CACHE_FILE, 0);
+	TEST_ASSERT(cache == NULL);
+	TEST_ASSERT_VALCMP(errno, EINVAL, "%d");
+	if (cache != NULL)
+		mtree_cache_close(cache);
+	unlink(CACHE_FILE);
+}
+
+void
+test_mtree_cache(void)
+{
+	TEST_RUN(test_cache_read_path, "mtree_cache_read_path");
+	TEST_RUN(test_cache_compact, "mtree_cache_compact");
+	TEST_RUN(test_cache_invalid, "mtree_cache_invalid");
+}
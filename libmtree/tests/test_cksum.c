@@ -24,7 +24,9 @@
  * SUCH DAMAGE.
  */
 
+#include <fcntl.h>
 #include <inttypes.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "test.h"
@@ -75,6 +77,83 @@ test_cksum_memory(void)
 	mtree_cksum_free(cksum);
 }
 
+/*
+ * Compute the checksum bit by bit.
+ */
+static uint32_t
+cksum_bitwise(const unsigned char *p, size_t len)
+{
+	uint32_t	crc;
+	size_t		i, n;
+	int		b;
+
+	crc = 0;
+	for (i = 0, n = len; i < len || n != 0; i++) {
+		if (i < len)
+			crc ^= (uint32_t)p[i] << 24;
+		else {
+			crc ^= (uint32_t)(n & 0xFF) << 24;
+			n >>= 8;
+		}
+		for (b = 0; b < 8; b++)
+			crc = (crc & 0x80000000) ?
+			    (crc << 1) ^ 0x04c11db7 : crc << 1;
+	}
+	return (~crc);
+}
+
+static void
+test_cksum_large(void)
+{
+	static const size_t	 lengths[] = {
+		15, 16, 17, 63, 64, 65, 255, 256, 257, 1000, 4099, 70000
+	};
+	struct mtree_cksum	*cksum;
+	unsigned char		*buf;
+	uint32_t		 crc, expected;
+	size_t			 i, off, done, n;
+
+	buf = malloc(70000 + 8);
+	TEST_ASSERT_ERRNO(buf != NULL);
+	if (buf == NULL)
+		return;
+	for (i = 0; i < 70000 + 8; i++)
+		buf[i] = (i * 7919 + (i >> 7)) & 0xFF;
+
+	cksum = mtree_cksum_create(MTREE_CKSUM_DEFAULT_INIT);
+	TEST_ASSERT_ERRNO(cksum != NULL);
+	if (cksum == NULL) {
+		free(buf);
+		return;
+	}
+	for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		/* Unaligned data in one piece. */
+		for (off = 0; off < 8; off += 3) {
+			expected = cksum_bitwise(buf + off, lengths[i]);
+			mtree_cksum_reset(cksum, MTREE_CKSUM_DEFAULT_INIT);
+			mtree_cksum_update(cksum, buf + off, lengths[i]);
+			crc = mtree_cksum_get_result(cksum);
+			TEST_ASSERT_MSG(crc == expected,
+			    "%zu bytes at offset %zu: %u != %u",
+			    lengths[i], off, crc, expected);
+		}
+		/* Data in pieces of varying sizes. */
+		expected = cksum_bitwise(buf, lengths[i]);
+		mtree_cksum_reset(cksum, MTREE_CKSUM_DEFAULT_INIT);
+		for (done = 0, n = 1; done < lengths[i]; done += n) {
+			n = (n * 13 + 5) % 600;
+			if (n > lengths[i] - done)
+				n = lengths[i] - done;
+			mtree_cksum_update(cksum, buf + done, n);
+		}
+		crc = mtree_cksum_get_result(cksum);
+		TEST_ASSERT_MSG(crc == expected, "%zu bytes in pieces: %u != %u",
+		    lengths[i], crc, expected);
+	}
+	mtree_cksum_free(cksum);
+	free(buf);
+}
+
 static int
 write_file(const char *path, const char *str)
 {
@@ -107,6 +186,7 @@ static void
 test_cksum_file(void)
 {
 	uint32_t	crc;
+	int		dirfd;
 	int		ret;
 
 	if (write_file(CKSUM_FILE, cksums[0].str) != 0)
@@ -117,12 +197,223 @@ test_cksum_file(void)
 	if (ret == 0)
 		TEST_ASSERT_VALCMP(crc, cksums[0].cksum, "%u");
 
+	/* Read the file relative to its directory. */
+	dirfd = open("/tmp", O_RDONLY);
+	TEST_ASSERT_ERRNO(dirfd != -1);
+	if (dirfd != -1) {
+		ret = mtree_cksum_path_at(dirfd, strrchr(CKSUM_FILE, '/') + 1,
+		    &crc);
+		TEST_ASSERT_ERRNO(ret == 0);
+		if (ret == 0)
+			TEST_ASSERT_VALCMP(crc, cksums[0].cksum, "%u");
+		close(dirfd);
+	}
+	unlink(CKSUM_FILE);
+}
+
+static void
+test_cksum_file_large(void)
+{
+	struct mtree_cksum	*cksum;
+	unsigned char		*buf;
+	uint32_t		 crc, expected;
+	size_t			 i, len;
+	ssize_t			 n;
+	int			 fd;
+	int			 ret;
+
+	/* Many times larger than the largest read buffer. */
+	len = 5 * 1024 * 1024 + 123;
+	buf = malloc(len);
+	TEST_ASSERT_ERRNO(buf != NULL);
+	if (buf == NULL)
+		return;
+	for (i = 0; i < len; i++)
+		buf[i] = (i * 31 + (i >> 11)) & 0xFF;
+
+	fd = open(CKSUM_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	TEST_ASSERT_ERRNO(fd != -1);
+	if (fd == -1) {
+		free(buf);
+		return;
+	}
+	n = write(fd, buf, len);
+	TEST_ASSERT_ERRNO(n == (ssize_t)len);
+	close(fd);
+	if (n == (ssize_t)len) {
+		cksum = mtree_cksum_create(MTREE_CKSUM_DEFAULT_INIT);
+		TEST_ASSERT_ERRNO(cksum != NULL);
+		if (cksum != NULL) {
+			mtree_cksum_update(cksum, buf, len);
+			expected = mtree_cksum_get_result(cksum);
+			mtree_cksum_free(cksum);
+
+			ret = mtree_cksum_path(CKSUM_FILE, &crc);
+			TEST_ASSERT_ERRNO(ret == 0);
+			if (ret == 0)
+				TEST_ASSERT_VALCMP(crc, expected, "%u");
+		}
+	}
+	unlink(CKSUM_FILE);
+	free(buf);
+}
+
+static void
+test_cksum_file_sparse(void)
+{
+	struct mtree_cksum	*cksum;
+	unsigned char		*buf;
+	uint32_t		 crc, expected;
+	size_t			 i, len;
+	int			 fd;
+	int			 ret;
+
+	/* Data surrounded by holes, which are not read. */
+	len = 6 * 1024 * 1024;
+	buf = calloc(1, len);
+	TEST_ASSERT_ERRNO(buf != NULL);
+	if (buf == NULL)
+		return;
+	for (i = 0; i < 1000; i++)
+		buf[1024 * 1024 + i] = i & 0xFF;
+	for (i = 0; i < 500; i++)
+		buf[3 * 1024 * 1024 + 5 + i] = (i * 3) & 0xFF;
+
+	fd = open(CKSUM_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	TEST_ASSERT_ERRNO(fd != -1);
+	if (fd == -1) {
+		free(buf);
+		return;
+	}
+	ret = 0;
+	if (pwrite(fd, buf + 1024 * 1024, 1000, 1024 * 1024) != 1000 ||
+	    pwrite(fd, buf + 3 * 1024 * 1024 + 5, 500,
+	    3 * 1024 * 1024 + 5) != 500 ||
+	    ftruncate(fd, len) != 0)
+		ret = -1;
+	TEST_ASSERT_ERRNO(ret == 0);
+	close(fd);
+	if (ret == 0) {
+		cksum = mtree_cksum_create(MTREE_CKSUM_DEFAULT_INIT);
+		TEST_ASSERT_ERRNO(cksum != NULL);
+		if (cksum != NULL) {
+			mtree_cksum_update(cksum, buf, len);
+			expected = mtree_cksum_get_result(cksum);
+
+			/* Zeros are skipped at once. */
+			mtree_cksum_reset(cksum, MTREE_CKSUM_DEFAULT_INIT);
+			mtree_cksum_update_zeros(cksum, 1024 * 1024);
+			mtree_cksum_update(cksum, buf + 1024 * 1024,
+			    len - 1024 * 1024);
+			TEST_ASSERT_VALCMP(mtree_cksum_get_result(cksum),
+			    expected, "%u");
+			mtree_cksum_free(cksum);
+
+			ret = mtree_cksum_path(CKSUM_FILE, &crc);
+			TEST_ASSERT_ERRNO(ret == 0);
+			if (ret == 0)
+				TEST_ASSERT_VALCMP(crc, expected, "%u");
+		}
+	}
+	unlink(CKSUM_FILE);
+	free(buf);
+}
+
+static void
+test_cksum_combine(void)
+{
+	struct mtree_cksum	*cksum;
+	unsigned char		 buf[1000];
+	uint32_t		 crc1, crc2, expected;
+	size_t			 i, split;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = (i * 7 + (i >> 3)) & 0xFF;
+
+	cksum = mtree_cksum_create(MTREE_CKSUM_DEFAULT_INIT);
+	TEST_ASSERT_ERRNO(cksum != NULL);
+	if (cksum == NULL)
+		return;
+	mtree_cksum_update(cksum, buf, sizeof(buf));
+	expected = cksum->crc;
+
+	for (split = 0; split <= sizeof(buf); split += 111) {
+		mtree_cksum_reset(cksum, MTREE_CKSUM_DEFAULT_INIT);
+		mtree_cksum_update(cksum, buf, split);
+		crc1 = cksum->crc;
+		mtree_cksum_reset(cksum, 0);
+		mtree_cksum_update(cksum, buf + split, sizeof(buf) - split);
+		crc2 = cksum->crc;
+		TEST_ASSERT_VALCMP(mtree_cksum_combine(crc1, crc2,
+		    sizeof(buf) - split), expected, "%u");
+	}
+	mtree_cksum_free(cksum);
+}
+
+static void
+test_cksum_file_parallel(void)
+{
+	struct mtree_cksum	*cksum;
+	unsigned char		*buf;
+	uint32_t		 crc, expected;
+	size_t			 i, len;
+	ssize_t			 n;
+	int			 fd;
+	int			 ret;
+
+	len = 5 * 1024 * 1024 + 77;
+	buf = malloc(len);
+	TEST_ASSERT_ERRNO(buf != NULL);
+	if (buf == NULL)
+		return;
+	for (i = 0; i < len; i++)
+		buf[i] = (i * 13 + (i >> 9)) & 0xFF;
+
+	fd = open(CKSUM_FILE, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	TEST_ASSERT_ERRNO(fd != -1);
+	if (fd == -1) {
+		free(buf);
+		return;
+	}
+	n = write(fd, buf, len);
+	TEST_ASSERT_ERRNO(n == (ssize_t)len);
+	if (n == (ssize_t)len && lseek(fd, 0, SEEK_SET) == 0) {
+		cksum = mtree_cksum_create(MTREE_CKSUM_DEFAULT_INIT);
+		TEST_ASSERT_ERRNO(cksum != NULL);
+		if (cksum != NULL) {
+			mtree_cksum_update(cksum, buf, len);
+			expected = mtree_cksum_get_result(cksum);
+
+			/* Split into 4 chunks if threads are available. */
+			mtree_cksum_reset(cksum, MTREE_CKSUM_DEFAULT_INIT);
+			ret = mtree_cksum_update_fd(cksum, fd, 1024 * 1024, 4);
+			TEST_ASSERT_ERRNO(ret != -1);
+			if (ret == 0) {
+				TEST_ASSERT(lseek(fd, 0, SEEK_CUR) ==
+				    (off_t)len);
+				crc = mtree_cksum_get_result(cksum);
+				TEST_ASSERT_VALCMP(crc, expected, "%u");
+			}
+			/* Too small to be split. */
+			mtree_cksum_reset(cksum, MTREE_CKSUM_DEFAULT_INIT);
+			TEST_ASSERT(mtree_cksum_update_fd(cksum, fd, len,
+			    4) == 1);
+			mtree_cksum_free(cksum);
+		}
+	}
+	close(fd);
 	unlink(CKSUM_FILE);
+	free(buf);
 }
 
 void
 test_mtree_cksum()
 {
 	TEST_RUN(test_cksum_memory, "mtree_cksum_memory");
+	TEST_RUN(test_cksum_large, "mtree_cksum_large");
 	TEST_RUN(test_cksum_file, "mtree_cksum_file");
+	TEST_RUN(test_cksum_file_large, "mtree_cksum_file_large");
+	TEST_RUN(test_cksum_file_sparse, "mtree_cksum_file_sparse");
+	TEST_RUN(test_cksum_combine, "mtree_cksum_combine");
+	TEST_RUN(test_cksum_file_parallel, "mtree_cksum_file_parallel");
 }
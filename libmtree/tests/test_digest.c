@@ -86,6 +86,16 @@ digest_memory(int d)
 	}
 	mtree_digest_update(digest, (unsigned char *)DIGEST_STR, strlen(DIGEST_STR));
 
+	result = mtree_digest_get_result(digest, digest_types[d]);
+	TEST_ASSERT_ERRNO(result != NULL);
+	if (result != NULL)
+		TEST_ASSERT_STRCMP(result, digest_results[d]);
+
+	/* The digest is reused after a reset, partial input is dropped. */
+	mtree_digest_reset(digest);
+	mtree_digest_update(digest, (unsigned char *)"x", 1);
+	mtree_digest_reset(digest);
+	mtree_digest_update(digest, (unsigned char *)DIGEST_STR, strlen(DIGEST_STR));
 	result = mtree_digest_get_result(digest, digest_types[d]);
 	TEST_ASSERT_ERRNO(result != NULL);
 	if (result != NULL)
@@ -105,6 +115,82 @@ test_digest_memory(void)
 	digest_memory(DIGEST_SHA512);
 }
 
+/*
+ * Million of 'a' characters, updated in chunks of varying sizes.
+ */
+static const char *digest_results_long[] = {
+	[DIGEST_MD5]	= "7707d6ae4e027c70eea2a935c2296f21",
+	[DIGEST_RMD160]	= "52783243c1697bdbe16d37f97f68f08325dc1528",
+	[DIGEST_SHA1]	= "34aa973cd4c4daa4f61eeb2bdbad27316534016f",
+	[DIGEST_SHA256]	= "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0",
+	[DIGEST_SHA384]	= "9d0e1809716474cb086e834e310a4a1ced149e9c00f248527972cec5704c2a5b07b8b3dc38ecc4ebae97ddd87f3d8985",
+	[DIGEST_SHA512]	= "e718483d0ce769644e2e42c7bc15b4638e1f98b13b2044285632a803afa973ebde0ff244877ea60a4cb0432ce577c31beb009c5c2c49aa2e4eadb217ad8cc09b"
+};
+
+static void
+digest_long(int d)
+{
+	struct mtree_digest	*digest;
+	const char		*result;
+	unsigned char		 buf[1000];
+	size_t			 done, n;
+
+	digest = mtree_digest_create(digest_types[d]);
+	if (digest == NULL) {
+		TEST_ASSERT_ERRNO(digest != NULL);
+		return;
+	}
+	if (mtree_digest_get_types(digest) == 0) {
+		TEST_SKIP("%s not supported", digest_names[d]);
+		mtree_digest_free(digest);
+		return;
+	}
+	memset(buf, 'a', sizeof(buf));
+	for (done = 0, n = 0; done < 1000000; done += n) {
+		n = (n * 7 + 13) % sizeof(buf);
+		if (n > 1000000 - done)
+			n = 1000000 - done;
+		mtree_digest_update(digest, buf, n);
+	}
+	result = mtree_digest_get_result(digest, digest_types[d]);
+	TEST_ASSERT_ERRNO(result != NULL);
+	if (result != NULL)
+		TEST_ASSERT_STRCMP(result, digest_results_long[d]);
+
+	mtree_digest_free(digest);
+}
+
+static void
+test_digest_long(void)
+{
+	digest_long(DIGEST_MD5);
+	digest_long(DIGEST_RMD160);
+	digest_long(DIGEST_SHA1);
+	digest_long(DIGEST_SHA256);
+	digest_long(DIGEST_SHA384);
+	digest_long(DIGEST_SHA512);
+}
+
+static void
+test_digest_backend(void)
+{
+	const char	*backend;
+	int		 available;
+	int		 d;
+
+	available = mtree_digest_get_available_types();
+	for (d = DIGEST_MD5; d <= DIGEST_SHA512; d++) {
+		backend = mtree_digest_get_backend(digest_types[d]);
+		if (available & digest_types[d])
+			TEST_ASSERT_MSG(backend != NULL && *backend != '\0',
+			    "%s has no backend", digest_names[d]);
+		else
+			TEST_ASSERT(backend == NULL && errno == EINVAL);
+	}
+	backend = mtree_digest_get_backend(0);
+	TEST_ASSERT(backend == NULL && errno == EINVAL);
+}
+
 static int
 write_file(const char *path, const char *str)
 {
@@ -166,9 +252,99 @@ test_digest_file(void)
 	unlink(DIGEST_FILE);
 }
 
+static void
+digest_mb(int d, const unsigned char *const data[], const size_t len[], int n)
+{
+	struct mtree_digest	*digest;
+	const char		*result;
+	unsigned char		 buf[64][MTREE_DIGEST_MB_RESULT_SIZE];
+	unsigned char		*mb[64];
+	char			 hex[2 * MTREE_DIGEST_MB_RESULT_SIZE + 1];
+	int			 i;
+
+	if ((mtree_digest_mb_get_types() & digest_types[d]) == 0) {
+		TEST_SKIP("%s not supported", digest_names[d]);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		mb[i] = buf[i];
+	mtree_digest_mb(digest_types[d], n, data, len, mb);
+
+	for (i = 0; i < n; i++) {
+		digest = mtree_digest_create(digest_types[d]);
+		if (digest == NULL) {
+			if (errno == EINVAL) {
+				TEST_SKIP("%s not supported", digest_names[d]);
+				return;
+			}
+			TEST_ASSERT_ERRNO(digest != NULL);
+			return;
+		}
+		mtree_digest_update(digest, data[i], len[i]);
+		result = mtree_digest_get_result(digest, digest_types[d]);
+		TEST_ASSERT_ERRNO(result != NULL);
+		mtree_digest_to_hex(mb[i],
+		    mtree_digest_get_size(digest_types[d]), hex);
+		if (result != NULL)
+			TEST_ASSERT_MSG(strcmp(hex, result) == 0,
+			    "%s of %zu bytes: \"%s\" != \"%s\"",
+			    digest_names[d], len[i], hex, result);
+		mtree_digest_free(digest);
+	}
+}
+
+static void
+test_digest_mb(void)
+{
+	static const size_t	 lengths[] = {
+		0, 1, 3, 9, 55, 56, 57, 63, 64, 65, 119, 120, 121, 127,
+		128, 129, 1000, 4095, 4096, 16383, 16384
+	};
+	const unsigned char	*data[64];
+	unsigned char		*buf;
+	size_t			 len[64];
+	int			 i, n;
+
+	if (mtree_digest_mb_get_lanes() == 0) {
+		TEST_SKIP("%s", "multi-buffer hashing not supported");
+		return;
+	}
+	/* Messages start at different offsets, make room for them. */
+	buf = malloc(16384 + 64);
+	TEST_ASSERT_ERRNO(buf != NULL);
+	if (buf == NULL)
+		return;
+	for (i = 0; i < 16384 + 64; i++)
+		buf[i] = (i * 131 + (i >> 8)) & 0xFF;
+
+	/* Messages of different lengths hashed together. */
+	n = 0;
+	for (i = 0; i < (int)(sizeof(lengths) / sizeof(lengths[0])); i++) {
+		data[n] = buf + i;
+		len[n]  = lengths[i];
+		n++;
+	}
+	/* Messages of the same length in all the lanes. */
+	for (i = 0; i < mtree_digest_mb_get_lanes(); i++) {
+		data[n] = buf + i;
+		len[n]  = 200;
+		n++;
+	}
+	digest_mb(DIGEST_MD5, data, len, n);
+	digest_mb(DIGEST_SHA1, data, len, n);
+	digest_mb(DIGEST_SHA256, data, len, n);
+
+	/* A single message. */
+	digest_mb(DIGEST_SHA256, data + 4, len + 4, 1);
+	free(buf);
+}
+
 void
 test_mtree_digest()
 {
 	TEST_RUN(test_digest_memory, "mtree_digest_memory");
 	TEST_RUN(test_digest_file, "mtree_digest_file");
+	TEST_RUN(test_digest_long, "mtree_digest_long");
+	TEST_RUN(test_digest_backend, "mtree_digest_get_backend");
+	TEST_RUN(test_digest_mb, "mtree_digest_mb");
 }
@@ -23,6 +23,11 @@
  * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
  * SUCH DAMAGE.
  */
+#include <sys/time.h>
+
+#include <inttypes.h>
+#include <unistd.h>
+
 #include "test.h"
 
 #include "libmtree/mtree.h"
@@ -52,8 +57,191 @@ test_entry(void)
 	mtree_entry_free(e);
 }
 
+#define ENTRY_MD5	"0123456789abcdef0123456789abcdef"
+#define ENTRY_SHA1	"00112233445566778899aabbccddeeff00112233"
+
+static void
+test_entry_digests(void)
+{
+	struct mtree_entry	*e1, *e2;
+	const char		*md5;
+	uint64_t		 diff;
+
+	e1 = mtree_entry_create(ENTRY_ORIGPATH);
+	TEST_ASSERT_ERRNO(e1 != NULL);
+	e2 = mtree_entry_create(ENTRY_ORIGPATH);
+	TEST_ASSERT_ERRNO(e2 != NULL);
+	if (e1 == NULL || e2 == NULL)
+		goto out;
+
+	/* Digests are kept in binary, the case of the string is lost. */
+	mtree_entry_set_sha1digest(e1, ENTRY_SHA1, MTREE_KEYWORD_SHA1DIGEST);
+	mtree_entry_set_md5digest(e1, "0123456789ABCDEF0123456789abcdef",
+	    MTREE_KEYWORD_MD5);
+	TEST_ASSERT_VALCMP(mtree_entry_get_keywords(e1),
+	    (uint64_t)(MTREE_KEYWORD_SHA1DIGEST | MTREE_KEYWORD_MD5),
+	    "0x%" PRIx64);
+	/* The strings are only allocated by the getters. */
+	TEST_ASSERT(e1->data.digests_hex == NULL);
+	TEST_ASSERT_STRCMP(mtree_entry_get_md5digest(e1), ENTRY_MD5);
+	TEST_ASSERT_STRCMP(mtree_entry_get_sha1digest(e1), ENTRY_SHA1);
+	TEST_ASSERT(mtree_entry_get_sha256digest(e1) == NULL);
+
+	/* Setting a digest keeps the strings of the others. */
+	md5 = mtree_entry_get_md5digest(e1);
+	mtree_entry_set_sha1digest(e1,
+	    "00112233445566778899aabbccddeeff00112234",
+	    MTREE_KEYWORD_SHA1DIGEST);
+	TEST_ASSERT(mtree_entry_get_md5digest(e1) == md5);
+	TEST_ASSERT_STRCMP(md5, ENTRY_MD5);
+	mtree_entry_set_sha1digest(e1, ENTRY_SHA1, MTREE_KEYWORD_SHA1DIGEST);
+	TEST_ASSERT_STRCMP(mtree_entry_get_sha1digest(e1), ENTRY_SHA1);
+
+	mtree_entry_set_md5digest(e2, ENTRY_MD5, MTREE_KEYWORD_MD5);
+	mtree_entry_set_sha1digest(e2, ENTRY_SHA1, MTREE_KEYWORD_SHA1DIGEST);
+	TEST_ASSERT(mtree_entry_compare(e1, e2, MTREE_KEYWORD_MASK_ALL,
+	    &diff) == 0);
+	mtree_entry_set_sha1digest(e2,
+	    "00112233445566778899aabbccddeeff00112234",
+	    MTREE_KEYWORD_SHA1DIGEST);
+	TEST_ASSERT(mtree_entry_compare(e1, e2, MTREE_KEYWORD_MASK_ALL,
+	    &diff) != 0);
+	TEST_ASSERT_VALCMP(diff, (uint64_t)MTREE_KEYWORD_SHA1DIGEST,
+	    "0x%" PRIx64);
+
+	/* Removing a digest keeps the others. */
+	mtree_entry_set_md5digest(e1, NULL, 0);
+	TEST_ASSERT(mtree_entry_get_md5digest(e1) == NULL);
+	TEST_ASSERT_STRCMP(mtree_entry_get_sha1digest(e1), ENTRY_SHA1);
+	TEST_ASSERT_VALCMP(mtree_entry_get_keywords(e1),
+	    (uint64_t)MTREE_KEYWORD_SHA1DIGEST, "0x%" PRIx64);
+
+	/* Invalid strings unset the digest. */
+	mtree_entry_set_sha1digest(e1, "0011", MTREE_KEYWORD_SHA1DIGEST);
+	TEST_ASSERT(mtree_entry_get_sha1digest(e1) == NULL);
+	mtree_entry_set_md5digest(e1, ENTRY_SHA1, MTREE_KEYWORD_MD5);
+	TEST_ASSERT(mtree_entry_get_md5digest(e1) == NULL);
+	mtree_entry_set_md5digest(e1, "0123456789abcdef0123456789abcdeg",
+	    MTREE_KEYWORD_MD5);
+	TEST_ASSERT(mtree_entry_get_md5digest(e1) == NULL);
+	TEST_ASSERT_VALCMP(mtree_entry_get_keywords(e1), (uint64_t)0,
+	    "0x%" PRIx64);
+
+	mtree_entry_copy_keywords(e1, e2, MTREE_KEYWORD_MASK_DIGEST, 1);
+	TEST_ASSERT_STRCMP(mtree_entry_get_md5digest(e1), ENTRY_MD5);
+	TEST_ASSERT_STRCMP(mtree_entry_get_sha1digest(e1),
+	    mtree_entry_get_sha1digest(e2));
+out:
+	if (e1 != NULL)
+		mtree_entry_free(e1);
+	if (e2 != NULL)
+		mtree_entry_free(e2);
+}
+
+/*
+ * Write the string to the file and set its modification time.
+ */
+static int
+write_entry_file(const char *str, time_t mtime)
+{
+	struct timeval	 tv[2];
+	FILE		*fp;
+	int		 ret;
+
+	fp = fopen(ENTRY_ORIGPATH, "w");
+	TEST_ASSERT_ERRNO(fp != NULL);
+	if (fp == NULL)
+		return (-1);
+	ret = fputs(str, fp);
+	TEST_ASSERT_ERRNO(ret != EOF);
+	if (fclose(fp) == EOF || ret == EOF)
+		return (-1);
+
+	tv[0].tv_sec  = mtime;
+	tv[0].tv_usec = 0;
+	tv[1] = tv[0];
+	ret = utimes(ENTRY_ORIGPATH, tv);
+	TEST_ASSERT_ERRNO(ret == 0);
+	return (ret);
+}
+
+#define ENTRY_COMPARE_KEYWORDS	(MTREE_KEYWORD_TYPE |		\
+				 MTREE_KEYWORD_SIZE |		\
+				 MTREE_KEYWORD_TIME |		\
+				 MTREE_KEYWORD_MODE |		\
+				 MTREE_KEYWORD_MD5DIGEST)
+
+static void
+test_entry_compare_file(void)
+{
+	struct mtree_entry	*e, *f;
+	uint64_t		 diff;
+	int			 ret;
+
+	e = NULL;
+	f = NULL;
+	if (write_entry_file("contents\n", 1000000000) != 0)
+		goto out;
+	e = mtree_entry_create(ENTRY_ORIGPATH);
+	TEST_ASSERT_ERRNO(e != NULL);
+	if (e == NULL)
+		goto out;
+	mtree_entry_set_keywords(e, ENTRY_COMPARE_KEYWORDS, 0);
+	TEST_ASSERT_VALCMP(mtree_entry_get_keywords(e),
+	    (uint64_t)ENTRY_COMPARE_KEYWORDS, "0x%" PRIx64);
+
+#define COMPARE_FILE(options) do {					\
+	if (f != NULL)							\
+		mtree_entry_free(f);					\
+	f = mtree_entry_create(ENTRY_ORIGPATH);				\
+	TEST_ASSERT_ERRNO(f != NULL);					\
+	if (f == NULL)							\
+		goto out;						\
+	ret = mtree_entry_compare_file(e, f, MTREE_KEYWORD_MASK_ALL,	\
+	    options, &diff);						\
+} while (0)
+
+	COMPARE_FILE(0);
+	TEST_ASSERT(ret == 0);
+	TEST_ASSERT_VALCMP(diff, (uint64_t)0, "0x%" PRIx64);
+	TEST_ASSERT_VALCMP(mtree_entry_get_keywords(f),
+	    (uint64_t)ENTRY_COMPARE_KEYWORDS, "0x%" PRIx64);
+
+	/* Same size and time, only the digest can tell the difference. */
+	if (write_entry_file("Contents\n", 1000000000) != 0)
+		goto out;
+	COMPARE_FILE(0);
+	TEST_ASSERT(ret != 0);
+	TEST_ASSERT_VALCMP(diff, (uint64_t)MTREE_KEYWORD_MD5DIGEST,
+	    "0x%" PRIx64);
+
+	/* The contents aren't read when the cheap keywords differ. */
+	if (write_entry_file("other contents\n", 1000000001) != 0)
+		goto out;
+	COMPARE_FILE(0);
+	TEST_ASSERT(ret != 0);
+	TEST_ASSERT_VALCMP(diff,
+	    (uint64_t)(MTREE_KEYWORD_SIZE | MTREE_KEYWORD_TIME),
+	    "0x%" PRIx64);
+	TEST_ASSERT((mtree_entry_get_keywords(f) &
+	    MTREE_KEYWORD_MD5DIGEST) == 0);
+
+	COMPARE_FILE(MTREE_ENTRY_FIRST_MISMATCH);
+	TEST_ASSERT(ret != 0);
+	TEST_ASSERT_VALCMP(diff, (uint64_t)MTREE_KEYWORD_SIZE, "0x%" PRIx64);
+#undef COMPARE_FILE
+out:
+	if (e != NULL)
+		mtree_entry_free(e);
+	if (f != NULL)
+		mtree_entry_free(f);
+	unlink(ENTRY_ORIGPATH);
+}
+
 void
 test_mtree_entry()
 {
 	TEST_RUN(test_entry, "mtree_entry");
+	TEST_RUN(test_entry_digests, "mtree_entry (digests)");
+	TEST_RUN(test_entry_compare_file, "mtree_entry_compare_file");
 }
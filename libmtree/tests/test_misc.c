@@ -82,6 +82,95 @@ test_basic(void)
 	TEST_ASSERT_VALCMP(mtree_keyword_string(0xF), NULL, "%p");
 }
 
+static void
+test_parse_names(void)
+{
+	struct mtree_device	*dev;
+	char			*s;
+	int			 i;
+
+	/*
+	 * The names are looked up by their first character and length,
+	 * every name of the tables must be found.
+	 */
+	for (i = 0; mtree_keywords[i].name != NULL; i++)
+		TEST_ASSERT_MSG(mtree_keyword_parse(mtree_keywords[i].name) ==
+		    mtree_keywords[i].keyword, "%s", mtree_keywords[i].name);
+	TEST_ASSERT_VALCMP(mtree_keyword_parse(""), (uint64_t)0, "0x%" PRIx64);
+	TEST_ASSERT_VALCMP(mtree_keyword_parse("md"), (uint64_t)0, "0x%" PRIx64);
+	TEST_ASSERT_VALCMP(mtree_keyword_parse("tyme"), (uint64_t)0, "0x%" PRIx64);
+	TEST_ASSERT_VALCMP(mtree_keyword_parse("sha512digestx"), (uint64_t)0,
+	    "0x%" PRIx64);
+
+	for (i = MTREE_ENTRY_BLOCK; i < MTREE_ENTRY_UNKNOWN; i++)
+		TEST_ASSERT_MSG(mtree_entry_type_parse(
+		    mtree_entry_type_string(i)) == (mtree_entry_type)i,
+		    "%s", mtree_entry_type_string(i));
+	TEST_ASSERT_VALCMP(mtree_entry_type_parse(""),
+	    MTREE_ENTRY_UNKNOWN, "0x%08x");
+	TEST_ASSERT_VALCMP(mtree_entry_type_parse("dirs"),
+	    MTREE_ENTRY_UNKNOWN, "0x%08x");
+
+	dev = mtree_device_create();
+	TEST_ASSERT_ERRNO(dev != NULL);
+	if (dev == NULL)
+		return;
+	for (i = MTREE_DEVICE_386BSD; i <= MTREE_DEVICE_ULTRIX; i++) {
+		mtree_device_set_format(dev, i);
+		mtree_device_set_value(dev, MTREE_DEVICE_FIELD_MAJOR, 1);
+		mtree_device_set_value(dev, MTREE_DEVICE_FIELD_MINOR, 2);
+		s = mtree_device_string(dev);
+		TEST_ASSERT_ERRNO(s != NULL);
+		if (s == NULL)
+			continue;
+		/*
+		 * Leave a single number, the format is found if parsing then
+		 * fails on the numbers.
+		 */
+		*strrchr(s, ',') = '\0';
+		TEST_ASSERT(mtree_device_parse(dev, s) == -1);
+		TEST_ASSERT_STRCMP(mtree_device_get_error(dev),
+		    "Device format must be followed by at least 2 numbers");
+		free(s);
+	}
+	TEST_ASSERT(mtree_device_parse(dev, "linu,1,2") == -1);
+	TEST_ASSERT(mtree_device_parse(dev, "linuxx,1,2") == -1);
+	TEST_ASSERT_STRCMP(mtree_device_get_error(dev),
+	    "Unsupported device format `linuxx'");
+	mtree_device_free(dev);
+}
+
+static void
+test_device_parse(void)
+{
+	struct mtree_device *dev;
+
+	dev = mtree_device_create();
+	TEST_ASSERT_ERRNO(dev != NULL);
+	if (dev == NULL)
+		return;
+	/*
+	 * The last number ends the string, it must be counted as well.
+	 */
+	TEST_ASSERT(mtree_device_parse(dev, "linux,8,1") == 0);
+	TEST_ASSERT_VALCMP(mtree_device_get_format(dev),
+	    MTREE_DEVICE_LINUX, "%d");
+	TEST_ASSERT_VALCMP((uintmax_t)mtree_device_get_value(dev,
+	    MTREE_DEVICE_FIELD_MAJOR), (uintmax_t)8, "%ju");
+	TEST_ASSERT_VALCMP((uintmax_t)mtree_device_get_value(dev,
+	    MTREE_DEVICE_FIELD_MINOR), (uintmax_t)1, "%ju");
+
+	TEST_ASSERT(mtree_device_parse(dev, "bsdos,1,2,3,") == 0);
+	TEST_ASSERT_VALCMP((uintmax_t)mtree_device_get_value(dev,
+	    MTREE_DEVICE_FIELD_SUBUNIT), (uintmax_t)3, "%ju");
+
+	TEST_ASSERT(mtree_device_parse(dev, "linux,8") == -1);
+	TEST_ASSERT_STRCMP(mtree_device_get_error(dev),
+	    "Device format must be followed by at least 2 numbers");
+	TEST_ASSERT(mtree_device_parse(dev, "linux,,8,") == -1);
+	mtree_device_free(dev);
+}
+
 static void
 test_atol()
 {
@@ -189,11 +278,39 @@ test_vispath()
 	free(vis);
 }
 
+static void
+test_scan()
+{
+	char	buf[128];
+	size_t	i, len, pos, ret;
+
+	/*
+	 * Place the character at every position after every start offset,
+	 * to cover both the vector and the scalar parts of the scan.
+	 */
+	memset(buf, 'a', sizeof(buf));
+	for (i = 0; i < 32; i++) {
+		for (pos = i; pos < 96; pos++) {
+			len = 96 - i;
+			buf[pos] = (pos % 2) ? '\n' : '\\';
+			ret = mtree_scan_line(buf + i, len);
+			TEST_ASSERT_MSG(ret == pos - i, "%zu: %zu != %zu", i,
+			    ret, pos - i);
+			buf[pos] = 'a';
+		}
+		TEST_ASSERT_VALCMP(mtree_scan_line(buf + i, 96 - i),
+		    96 - i, "%zu");
+	}
+}
+
 void
 test_mtree_misc()
 {
 	TEST_RUN(test_basic, "mtree_basic");
+	TEST_RUN(test_parse_names, "mtree_parse_names");
+	TEST_RUN(test_device_parse, "mtree_device_parse");
 	TEST_RUN(test_atol, "mtree_atol");
 	TEST_RUN(test_cleanup_path, "mtree_cleanup_path");
 	TEST_RUN(test_vispath, "mtree_vispath");
+	TEST_RUN(test_scan, "mtree_scan");
 }
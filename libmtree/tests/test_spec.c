@@ -0,0 +1,1134 @@
+/*-
+ * Copyright (c) 2015 Michal Ratajsky <michal@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#include "libmtree/mtree.h"
+#include "libmtree/mtree_file.h"
+#include "libmtree/mtree_private.h"
+
+#define SPEC_DIR	"/tmp/mtree-test-spec"
+
+/*
+ * Directory structure read by the tests, directories end with a slash.
+ */
+static const char *spec_paths[] = {
+	"a/",
+	"a/file1",
+	"a/file2",
+	"a/b/",
+	"a/b/file3",
+	"a/b/c/",
+	"a/b/c/file4",
+	"a/d/",
+	"e/",
+	"e/file5",
+	"e/f/",
+	"e/f/file6",
+	"file7",
+	"file8",
+	NULL
+};
+
+static void
+remove_tree(void)
+{
+	char	path[256];
+	int	i;
+
+	for (i = 0; spec_paths[i] != NULL; i++)
+		;
+	while (i-- > 0) {
+		snprintf(path, sizeof(path), "%s/%s", SPEC_DIR, spec_paths[i]);
+		if (path[strlen(path) - 1] == '/')
+			rmdir(path);
+		else
+			unlink(path);
+	}
+	rmdir(SPEC_DIR);
+}
+
+static int
+create_tree(void)
+{
+	char	path[256];
+	size_t	len;
+	int	fd;
+	int	i;
+
+	remove_tree();
+	if (mkdir(SPEC_DIR, 0755) == -1) {
+		TEST_ASSERT_ERRNO(0);
+		return (-1);
+	}
+	for (i = 0; spec_paths[i] != NULL; i++) {
+		snprintf(path, sizeof(path), "%s/%s", SPEC_DIR, spec_paths[i]);
+		len = strlen(path);
+		if (path[len - 1] == '/') {
+			if (mkdir(path, 0755) == -1)
+				break;
+			continue;
+		}
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1)
+			break;
+		if (write(fd, path, len) != (ssize_t)len) {
+			close(fd);
+			break;
+		}
+		close(fd);
+	}
+	TEST_ASSERT_ERRNO(spec_paths[i] == NULL);
+	if (spec_paths[i] != NULL) {
+		remove_tree();
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+skip_dir_b(struct mtree_entry *entry, void *user_data)
+{
+
+	(void)user_data;
+	if (strcmp(mtree_entry_get_name(entry), "b") == 0)
+		return (MTREE_ENTRY_SKIP | MTREE_ENTRY_SKIP_CHILDREN);
+	if (strcmp(mtree_entry_get_name(entry), "e") == 0)
+		return (MTREE_ENTRY_SKIP);
+	return (MTREE_ENTRY_KEEP);
+}
+
+static struct mtree_entry *
+read_tree(uint64_t keywords, int options, int threads,
+    mtree_entry_filter_fn filter)
+{
+	struct mtree_spec	*spec;
+	struct mtree_entry	*entries;
+	int			 ret;
+
+	spec = mtree_spec_create();
+	TEST_ASSERT_ERRNO(spec != NULL);
+	if (spec == NULL)
+		return (NULL);
+	mtree_spec_set_read_path_keywords(spec, keywords);
+	mtree_spec_set_read_options(spec, options);
+	mtree_spec_set_read_threads(spec, threads);
+	mtree_spec_set_read_filter(spec, filter, NULL);
+
+	ret = mtree_spec_read_path(spec, SPEC_DIR);
+	TEST_ASSERT_ERRNO(ret == 0);
+	if (ret != 0) {
+		mtree_spec_free(spec);
+		return (NULL);
+	}
+	entries = mtree_spec_take_entries(spec);
+	mtree_spec_free(spec);
+	return (entries);
+}
+
+static struct mtree_entry *
+read_tree_checksum_threads(uint64_t keywords, int options, int threads)
+{
+	struct mtree_spec	*spec;
+	struct mtree_entry	*entries;
+	int			 ret;
+
+	spec = mtree_spec_create();
+	TEST_ASSERT_ERRNO(spec != NULL);
+	if (spec == NULL)
+		return (NULL);
+	mtree_spec_set_read_path_keywords(spec, keywords);
+	mtree_spec_set_read_options(spec, options);
+	mtree_spec_set_read_checksum_threads(spec, threads);
+
+	ret = mtree_spec_read_path(spec, SPEC_DIR);
+	TEST_ASSERT_ERRNO(ret == 0);
+	entries = mtree_spec_take_entries(spec);
+	mtree_spec_free(spec);
+	return (entries);
+}
+
+/*
+ * Check that the entry lists are equal, including the order of entries.
+ */
+static void
+compare_entries(struct mtree_entry *e1, struct mtree_entry *e2,
+    uint64_t keywords)
+{
+	uint64_t diff;
+
+	while (e1 != NULL && e2 != NULL) {
+		TEST_ASSERT_STRCMP(mtree_entry_get_path(e1),
+		    mtree_entry_get_path(e2));
+		TEST_ASSERT_MSG(mtree_entry_compare(e1, e2, keywords,
+		    &diff) == 0, "%s: different keywords %#llx",
+		    mtree_entry_get_path(e1), (unsigned long long)diff);
+		e1 = mtree_entry_get_next(e1);
+		e2 = mtree_entry_get_next(e2);
+	}
+	TEST_ASSERT(e1 == NULL && e2 == NULL);
+}
+
+static void
+test_spec_read_path_parallel(void)
+{
+	struct mtree_entry	*serial;
+	struct mtree_entry	*parallel;
+	uint64_t		 keywords;
+	int			 options;
+	int			 threads;
+
+	if (create_tree() != 0)
+		return;
+
+	keywords = MTREE_KEYWORD_MASK_DEFAULT | MTREE_KEYWORD_SHA256;
+	options = MTREE_READ_PATH_SKIP_ON_ERROR;
+	for (threads = 1; threads <= 4; threads++) {
+		serial = read_tree(keywords, options, 0, NULL);
+		parallel = read_tree(keywords,
+		    options | MTREE_READ_PATH_PARALLEL, threads, NULL);
+		TEST_ASSERT(mtree_entry_count(serial) ==
+		    sizeof(spec_paths) / sizeof(spec_paths[0]));
+		compare_entries(serial, parallel, keywords);
+		mtree_entry_free_all(serial);
+		mtree_entry_free_all(parallel);
+
+		/* Same with a filter. */
+		serial = read_tree(keywords, options, 0, skip_dir_b);
+		parallel = read_tree(keywords,
+		    options | MTREE_READ_PATH_PARALLEL, threads, skip_dir_b);
+		TEST_ASSERT(mtree_entry_find(serial, "./a/b/c/file4") == NULL);
+		TEST_ASSERT(mtree_entry_find(serial, "./e") == NULL);
+		TEST_ASSERT(mtree_entry_find(serial, "./e/f/file6") != NULL);
+		compare_entries(serial, parallel, keywords);
+		mtree_entry_free_all(serial);
+		mtree_entry_free_all(parallel);
+	}
+	remove_tree();
+}
+
+/*
+ * Check that deferred checksums and checksums calculated by the pool match
+ * the ones calculated while reading.
+ */
+static void
+test_spec_read_path_deferred(void)
+{
+	struct mtree_entry	*entries;
+	struct mtree_entry	*deferred;
+	struct mtree_entry	*pipeline;
+	struct mtree_entry	*entry;
+	uint64_t		 keywords;
+	int			 threads;
+
+	if (create_tree() != 0)
+		return;
+
+	keywords = MTREE_KEYWORD_TYPE | MTREE_KEYWORD_SIZE |
+	    MTREE_KEYWORD_CKSUM | MTREE_KEYWORD_MD5 | MTREE_KEYWORD_SHA256;
+	entries = read_tree(keywords, 0, 0, NULL);
+	deferred = read_tree(keywords, MTREE_READ_PATH_DEFER_CHECKSUMS, 0,
+	    NULL);
+	compare_entries(entries, deferred, keywords);
+	/* Files read in the order of their location. */
+	pipeline = read_tree(keywords, MTREE_READ_PATH_DEFER_CHECKSUMS |
+	    MTREE_READ_PATH_LAYOUT_ORDER, 0, NULL);
+	compare_entries(entries, pipeline, keywords);
+	mtree_entry_free_all(pipeline);
+	for (threads = 1; threads <= 4; threads++) {
+		pipeline = read_tree_checksum_threads(keywords,
+		    MTREE_READ_PATH_PIPELINE, threads);
+		compare_entries(entries, pipeline, keywords);
+		mtree_entry_free_all(pipeline);
+		/* Together with the parallel walk. */
+		pipeline = read_tree_checksum_threads(keywords,
+		    MTREE_READ_PATH_PIPELINE | MTREE_READ_PATH_PARALLEL, threads);
+		compare_entries(entries, pipeline, keywords);
+		mtree_entry_free_all(pipeline);
+	}
+
+	entry = mtree_entry_find(deferred, "./a/b/c/file4");
+	TEST_ASSERT(entry != NULL);
+	if (entry != NULL)
+		TEST_ASSERT((mtree_entry_get_keywords(entry) &
+		    MTREE_KEYWORD_SHA256) != 0);
+	entry = mtree_entry_find(deferred, "./a/b");
+	TEST_ASSERT(entry != NULL);
+	if (entry != NULL)
+		TEST_ASSERT((mtree_entry_get_keywords(entry) &
+		    MTREE_KEYWORD_SHA256) == 0);
+	mtree_entry_free_all(entries);
+	mtree_entry_free_all(deferred);
+	remove_tree();
+}
+
+#define LARGE_DIR_FILES	5000
+
+/*
+ * Read a directory with enough entries to require several reads of
+ * the directory.
+ */
+static void
+test_spec_read_path_large_dir(void)
+{
+	struct mtree_entry	*entries;
+	struct mtree_entry	*entry;
+	char			 path[256];
+	int			 fd;
+	int			 i;
+
+	rmdir(SPEC_DIR);
+	if (mkdir(SPEC_DIR, 0755) == -1) {
+		TEST_ASSERT_ERRNO(0);
+		return;
+	}
+	for (i = 0; i < LARGE_DIR_FILES; i++) {
+		snprintf(path, sizeof(path), "%s/large-dir-file-%05d", SPEC_DIR,
+		    i);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1)
+			break;
+		close(fd);
+	}
+	TEST_ASSERT_ERRNO(i == LARGE_DIR_FILES);
+	if (i == LARGE_DIR_FILES) {
+		entries = read_tree(MTREE_KEYWORD_TYPE, 0, 0, NULL);
+		/* All the files and the dot. */
+		TEST_ASSERT_VALCMP(mtree_entry_count(entries),
+		    (size_t)LARGE_DIR_FILES + 1, "%zu");
+		snprintf(path, sizeof(path), "./large-dir-file-%05d",
+		    LARGE_DIR_FILES - 1);
+		entry = mtree_entry_find(entries, path);
+		TEST_ASSERT(entry != NULL);
+		if (entry != NULL)
+			TEST_ASSERT(mtree_entry_get_type(entry) ==
+			    MTREE_ENTRY_FILE);
+		mtree_entry_free_all(entries);
+	}
+	while (i-- > 0) {
+		snprintf(path, sizeof(path), "%s/large-dir-file-%05d", SPEC_DIR,
+		    i);
+		unlink(path);
+	}
+	rmdir(SPEC_DIR);
+}
+
+#define DEEP_DIR_LEVELS	200
+
+/*
+ * Read a directory structure deeper than the number of available file
+ * descriptors.
+ */
+static void
+test_spec_read_path_deep(void)
+{
+	struct mtree_entry	*entries;
+	struct rlimit		 rl, low;
+	char			 path[1024];
+	size_t			 len;
+	int			 i;
+
+	rmdir(SPEC_DIR);
+	if (mkdir(SPEC_DIR, 0755) == -1) {
+		TEST_ASSERT_ERRNO(0);
+		return;
+	}
+	len = strlen(SPEC_DIR);
+	memcpy(path, SPEC_DIR, len + 1);
+	for (i = 0; i < DEEP_DIR_LEVELS; i++) {
+		memcpy(path + len, "/d", 3);
+		if (mkdir(path, 0755) == -1) {
+			path[len] = '\0';
+			break;
+		}
+		len += 2;
+	}
+	TEST_ASSERT_ERRNO(i == DEEP_DIR_LEVELS);
+	if (i == DEEP_DIR_LEVELS && getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		low = rl;
+		low.rlim_cur = 64;
+		setrlimit(RLIMIT_NOFILE, &low);
+		entries = read_tree(MTREE_KEYWORD_TYPE, 0, 0, NULL);
+		setrlimit(RLIMIT_NOFILE, &rl);
+		/* All the directories and the dot. */
+		TEST_ASSERT_VALCMP(mtree_entry_count(entries),
+		    (size_t)DEEP_DIR_LEVELS + 1, "%zu");
+		mtree_entry_free_all(entries);
+	}
+	while (i-- > 0) {
+		rmdir(path);
+		len -= 2;
+		path[len] = '\0';
+	}
+	rmdir(SPEC_DIR);
+}
+
+#define FAKE_MD5	"0123456789abcdef0123456789abcdef"
+
+/*
+ * Check that digests of unchanged files are taken from the previous spec,
+ * while changed files are read again.
+ */
+static void
+test_spec_read_path_incremental(void)
+{
+	static const int	 options[] = {
+		0,
+		MTREE_READ_PATH_DEFER_CHECKSUMS,
+		MTREE_READ_PATH_PIPELINE,
+		MTREE_READ_PATH_PIPELINE | MTREE_READ_PATH_PARALLEL
+	};
+	struct mtree_spec	*previous;
+	struct mtree_spec	*spec;
+	struct mtree_entry	*entry;
+	char			*md5;
+	uint64_t		 keywords;
+	size_t			 i;
+	int			 fd;
+	int			 ret;
+
+	if (create_tree() != 0)
+		return;
+
+	keywords = MTREE_KEYWORD_TYPE | MTREE_KEYWORD_SIZE |
+	    MTREE_KEYWORD_TIME | MTREE_KEYWORD_MD5;
+	previous = mtree_spec_create();
+	TEST_ASSERT_ERRNO(previous != NULL);
+	if (previous == NULL)
+		goto out;
+	mtree_spec_set_read_path_keywords(previous, keywords);
+	ret = mtree_spec_read_path(previous, SPEC_DIR);
+	TEST_ASSERT_ERRNO(ret == 0);
+
+	/* Fake digests tell whether they have been reused. */
+	entry = mtree_entry_find(mtree_spec_get_entries(previous), "./file7");
+	TEST_ASSERT(entry != NULL);
+	if (entry != NULL)
+		mtree_entry_set_md5digest(entry, FAKE_MD5, MTREE_KEYWORD_MD5);
+	entry = mtree_entry_find(mtree_spec_get_entries(previous), "./file8");
+	TEST_ASSERT(entry != NULL);
+	if (entry != NULL)
+		mtree_entry_set_md5digest(entry, FAKE_MD5, MTREE_KEYWORD_MD5);
+	entry = mtree_entry_find(mtree_spec_get_entries(previous),
+	    "./a/file1");
+	TEST_ASSERT(entry != NULL);
+	if (entry != NULL) {
+		mtree_entry_set_md5digest(entry, FAKE_MD5, MTREE_KEYWORD_MD5);
+		/* A different inode is a different file. */
+		mtree_entry_set_inode(entry, 0);
+	}
+	fd = open(SPEC_DIR "/file8", O_WRONLY | O_APPEND);
+	TEST_ASSERT_ERRNO(fd != -1);
+	if (fd != -1) {
+		TEST_ASSERT_ERRNO(write(fd, "x", 1) == 1);
+		close(fd);
+	}
+
+	for (i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+		spec = mtree_spec_create();
+		TEST_ASSERT_ERRNO(spec != NULL);
+		if (spec == NULL)
+			break;
+		mtree_spec_set_read_path_keywords(spec, keywords);
+		mtree_spec_set_read_options(spec, options[i]);
+		ret = mtree_spec_read_path_incremental(spec, SPEC_DIR,
+		    previous);
+		TEST_ASSERT_ERRNO(ret == 0);
+
+		entry = mtree_entry_find(mtree_spec_get_entries(spec),
+		    "./file7");
+		TEST_ASSERT(entry != NULL);
+		if (entry != NULL)
+			TEST_ASSERT_STRCMP(mtree_entry_get_md5digest(entry),
+			    FAKE_MD5);
+		entry = mtree_entry_find(mtree_spec_get_entries(spec),
+		    "./file8");
+		TEST_ASSERT(entry != NULL);
+		if (entry != NULL) {
+			md5 = mtree_digest_path(MTREE_DIGEST_MD5,
+			    SPEC_DIR "/file8");
+			TEST_ASSERT(md5 != NULL);
+			if (md5 != NULL)
+				TEST_ASSERT_STRCMP(
+				    mtree_entry_get_md5digest(entry), md5);
+			free(md5);
+		}
+		entry = mtree_entry_find(mtree_spec_get_entries(spec),
+		    "./a/file1");
+		TEST_ASSERT(entry != NULL);
+		if (entry != NULL)
+			TEST_ASSERT(strcmp(mtree_entry_get_md5digest(entry),
+			    FAKE_MD5) != 0);
+		mtree_spec_free(spec);
+	}
+	mtree_spec_free(previous);
+out:
+	remove_tree();
+}
+
+/*
+ * Hard links are hashed once, the other links get the same digest.
+ */
+static void
+test_spec_read_path_hardlinks(void)
+{
+	static const int	 options[] = {
+		0,
+		MTREE_READ_PATH_DEFER_CHECKSUMS,
+		MTREE_READ_PATH_PIPELINE,
+		MTREE_READ_PATH_PIPELINE | MTREE_READ_PATH_PARALLEL
+	};
+	static const char	*links[] = {
+		"./file7",
+		"./a/link1",
+		"./e/f/link2"
+	};
+	struct mtree_entry	*entries;
+	struct mtree_entry	*entry;
+	char			*md5;
+	size_t			 i, j;
+
+	if (create_tree() != 0)
+		return;
+	TEST_ASSERT_ERRNO(link(SPEC_DIR "/file7", SPEC_DIR "/a/link1") == 0);
+	TEST_ASSERT_ERRNO(link(SPEC_DIR "/file7", SPEC_DIR "/e/f/link2") == 0);
+	md5 = mtree_digest_path(MTREE_DIGEST_MD5, SPEC_DIR "/file7");
+	TEST_ASSERT(md5 != NULL);
+	if (md5 == NULL)
+		goto out;
+
+	for (i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+		entries = read_tree(MTREE_KEYWORD_TYPE | MTREE_KEYWORD_MD5,
+		    options[i], 0, NULL);
+		TEST_ASSERT(entries != NULL);
+		if (entries == NULL)
+			break;
+		for (j = 0; j < sizeof(links) / sizeof(links[0]); j++) {
+			entry = mtree_entry_find(entries, links[j]);
+			TEST_ASSERT_MSG(entry != NULL, "%s", links[j]);
+			if (entry == NULL)
+				continue;
+			TEST_ASSERT(mtree_entry_get_keywords(entry) &
+			    MTREE_KEYWORD_MD5);
+			TEST_ASSERT_STRCMP(mtree_entry_get_md5digest(entry),
+			    md5);
+			TEST_ASSERT((entry->flags & __MTREE_ENTRY_LINKED) == 0);
+		}
+		entry = mtree_entry_find(entries, "./file8");
+		TEST_ASSERT(entry != NULL);
+		if (entry != NULL)
+			TEST_ASSERT(strcmp(mtree_entry_get_md5digest(entry),
+			    md5) != 0);
+		mtree_entry_free_all(entries);
+	}
+	free(md5);
+out:
+	unlink(SPEC_DIR "/a/link1");
+	unlink(SPEC_DIR "/e/f/link2");
+	remove_tree();
+}
+
+/*
+ * Limits of reading file contents don't change the results.
+ */
+static void
+test_spec_read_path_limits(void)
+{
+	static const int	 options[] = {
+		0,
+		MTREE_READ_PATH_DEFER_CHECKSUMS,
+		MTREE_READ_PATH_PIPELINE,
+		MTREE_READ_PATH_PIPELINE | MTREE_READ_PATH_PARALLEL
+	};
+	struct mtree_spec	*spec;
+	struct mtree_entry	*entries;
+	struct mtree_entry	*limited;
+	uint64_t		 keywords;
+	size_t			 i;
+	int			 ret;
+
+	if (create_tree() != 0)
+		return;
+
+	keywords = MTREE_KEYWORD_TYPE | MTREE_KEYWORD_CKSUM |
+	    MTREE_KEYWORD_SHA256;
+	entries = read_tree(keywords, 0, 0, NULL);
+	for (i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+		spec = mtree_spec_create();
+		TEST_ASSERT_ERRNO(spec != NULL);
+		if (spec == NULL)
+			break;
+		mtree_spec_set_read_path_keywords(spec, keywords);
+		mtree_spec_set_read_options(spec, options[i]);
+		mtree_spec_set_read_byte_rate(spec, 1024 * 1024 * 1024);
+		mtree_spec_set_read_file_rate(spec, 100000);
+		mtree_spec_set_read_latency(spec, 1);
+		mtree_spec_set_read_io_priority(spec, MTREE_IO_PRIORITY_LOW);
+		TEST_ASSERT(mtree_spec_get_read_byte_rate(spec) ==
+		    1024 * 1024 * 1024);
+		TEST_ASSERT(mtree_spec_get_read_file_rate(spec) == 100000);
+		TEST_ASSERT(mtree_spec_get_read_latency(spec) == 1);
+		TEST_ASSERT(mtree_spec_get_read_io_priority(spec) ==
+		    MTREE_IO_PRIORITY_LOW);
+
+		ret = mtree_spec_read_path(spec, SPEC_DIR);
+		TEST_ASSERT_ERRNO(ret == 0);
+		if (ret == 0) {
+			limited = mtree_spec_take_entries(spec);
+			compare_entries(entries, limited, keywords);
+			mtree_entry_free_all(limited);
+		}
+		mtree_spec_free(spec);
+	}
+	mtree_entry_free_all(entries);
+	remove_tree();
+}
+
+/*
+ * Only the stat fields needed by the keywords are requested, check that the
+ * requested keywords are still filled in.
+ */
+static void
+test_spec_read_path_stat_keywords(void)
+{
+	static const uint64_t	 stat_keywords[] = {
+		MTREE_KEYWORD_GID,
+		MTREE_KEYWORD_INODE,
+		MTREE_KEYWORD_LINK,
+		MTREE_KEYWORD_MODE,
+		MTREE_KEYWORD_NLINK,
+		MTREE_KEYWORD_SIZE,
+		MTREE_KEYWORD_TIME,
+		MTREE_KEYWORD_UID
+	};
+	struct mtree_entry	*entries;
+	struct mtree_entry	*reduced;
+	struct mtree_entry	*entry;
+	struct stat		 st;
+	uint64_t		 keywords;
+	size_t			 i;
+
+	if (create_tree() != 0)
+		return;
+	TEST_ASSERT_ERRNO(symlink("file8", SPEC_DIR "/a/symlink") == 0);
+	TEST_ASSERT_ERRNO(lstat(SPEC_DIR "/file7", &st) == 0);
+
+	keywords = MTREE_KEYWORD_MASK_STAT;
+	entries = read_tree(keywords, 0, 0, NULL);
+	TEST_ASSERT(entries != NULL);
+	if (entries == NULL)
+		goto out;
+	for (i = 0; i < sizeof(stat_keywords) / sizeof(stat_keywords[0]);
+	    i++) {
+		keywords = MTREE_KEYWORD_TYPE | stat_keywords[i];
+		reduced = read_tree(keywords, 0, 0, NULL);
+		compare_entries(entries, reduced, keywords);
+		entry = mtree_entry_find(reduced,
+		    stat_keywords[i] == MTREE_KEYWORD_LINK ?
+		    "./a/symlink" : "./file7");
+		TEST_ASSERT(entry != NULL);
+		if (entry != NULL)
+			TEST_ASSERT_MSG(mtree_entry_get_keywords(entry) ==
+			    keywords, "keywords %#llx",
+			    (unsigned long long)stat_keywords[i]);
+		mtree_entry_free_all(reduced);
+	}
+
+	/* Compare with lstat() too, a link needs the size of its target. */
+	reduced = read_tree(MTREE_KEYWORD_SIZE | MTREE_KEYWORD_INODE |
+	    MTREE_KEYWORD_LINK, 0, 0, NULL);
+	entry = mtree_entry_find(reduced, "./file7");
+	TEST_ASSERT(entry != NULL);
+	if (entry != NULL) {
+		TEST_ASSERT(mtree_entry_get_size(entry) == st.st_size);
+		TEST_ASSERT(mtree_entry_get_inode(entry) ==
+		    (uint64_t)st.st_ino);
+	}
+	entry = mtree_entry_find(reduced, "./a/symlink");
+	TEST_ASSERT(entry != NULL);
+	if (entry != NULL)
+		TEST_ASSERT_STRCMP(mtree_entry_get_link(entry), "file8");
+	mtree_entry_free_all(reduced);
+
+	/* Attributes taken from cache are the same on local file systems. */
+	keywords = MTREE_KEYWORD_MASK_STAT;
+	reduced = read_tree(keywords, MTREE_READ_PATH_DONT_SYNC, 0, NULL);
+	compare_entries(entries, reduced, keywords);
+	mtree_entry_free_all(reduced);
+	mtree_entry_free_all(entries);
+out:
+	unlink(SPEC_DIR "/a/symlink");
+	remove_tree();
+}
+
+/*
+ * Checksums are reused by incremental reads even if the size, time and
+ * inode are not requested, these are added only to the stat fields.
+ */
+static void
+test_spec_read_path_incremental_stat(void)
+{
+	struct mtree_spec	*previous;
+	struct mtree_spec	*spec;
+	struct mtree_entry	*entry;
+	int			 ret;
+
+	if (create_tree() != 0)
+		return;
+
+	previous = mtree_spec_create();
+	TEST_ASSERT_ERRNO(previous != NULL);
+	if (previous == NULL)
+		goto out;
+	mtree_spec_set_read_path_keywords(previous, MTREE_KEYWORD_TYPE |
+	    MTREE_KEYWORD_SIZE | MTREE_KEYWORD_TIME | MTREE_KEYWORD_INODE |
+	    MTREE_KEYWORD_MD5);
+	ret = mtree_spec_read_path(previous, SPEC_DIR);
+	TEST_ASSERT_ERRNO(ret == 0);
+	entry = mtree_entry_find(mtree_spec_get_entries(previous), "./file7");
+	TEST_ASSERT(entry != NULL);
+	if (entry != NULL)
+		mtree_entry_set_md5digest(entry, FAKE_MD5, MTREE_KEYWORD_MD5);
+	entry = mtree_entry_find(mtree_spec_get_entries(previous),
+	    "./a/file1");
+	TEST_ASSERT(entry != NULL);
+	if (entry != NULL) {
+		mtree_entry_set_md5digest(entry, FAKE_MD5, MTREE_KEYWORD_MD5);
+		mtree_entry_set_inode(entry, 0);
+	}
+
+	spec = mtree_spec_create();
+	TEST_ASSERT_ERRNO(spec != NULL);
+	if (spec == NULL) {
+		mtree_spec_free(previous);
+		goto out;
+	}
+	mtree_spec_set_read_path_keywords(spec, MTREE_KEYWORD_TYPE |
+	    MTREE_KEYWORD_MD5);
+	ret = mtree_spec_read_path_incremental(spec, SPEC_DIR, previous);
+	TEST_ASSERT_ERRNO(ret == 0);
+	entry = mtree_entry_find(mtree_spec_get_entries(spec), "./file7");
+	TEST_ASSERT(entry != NULL);
+	if (entry != NULL) {
+		TEST_ASSERT_STRCMP(mtree_entry_get_md5digest(entry),
+		    FAKE_MD5);
+		TEST_ASSERT(mtree_entry_get_keywords(entry) ==
+		    (MTREE_KEYWORD_TYPE | MTREE_KEYWORD_MD5));
+	}
+	entry = mtree_entry_find(mtree_spec_get_entries(spec), "./a/file1");
+	TEST_ASSERT(entry != NULL);
+	if (entry != NULL)
+		TEST_ASSERT(strcmp(mtree_entry_get_md5digest(entry),
+		    FAKE_MD5) != 0);
+	mtree_spec_free(spec);
+	mtree_spec_free(previous);
+out:
+	remove_tree();
+}
+
+#define SPEC_FILE	"/tmp/mtree-test-spec.mtree"
+
+static const char spec_data[] =
+    "#\t   user: test\n"
+    "/set type=file uid=0 mode=0644\n"
+    "\n"
+    ".\t\ttype=dir mode=0755\n"
+    "    file1\tsize=10 \\\n"
+    "\t\ttime=1.0\n"
+    "    file\\0402\tsize=20 # comment\n"
+    "    b\t\ttype=dir \\\n"
+    "\\\n"
+    "\t\tnlink=2\n"
+    "\tfile3\tmode=0600\n"
+    "    ..\n"
+    "..\n"
+    "./file4 size=5";
+
+static struct mtree_entry *
+read_spec_data(void)
+{
+	struct mtree_spec	*spec;
+	struct mtree_entry	*entries;
+	int			 ret;
+
+	spec = mtree_spec_create();
+	TEST_ASSERT_ERRNO(spec != NULL);
+	if (spec == NULL)
+		return (NULL);
+	ret = mtree_spec_read_spec_data(spec, spec_data, sizeof(spec_data) - 1);
+	TEST_ASSERT_ERRNO(ret == 0);
+	ret = mtree_spec_read_spec_data_finish(spec);
+	TEST_ASSERT_ERRNO(ret == 0);
+	entries = mtree_spec_take_entries(spec);
+	mtree_spec_free(spec);
+	return (entries);
+}
+
+/*
+ * Read the spec data in two pieces split at `pos'.
+ */
+static struct mtree_entry *
+read_spec_data_split(const char *data, size_t pos)
+{
+	struct mtree_spec	*spec;
+	struct mtree_entry	*entries;
+	int			 ret;
+
+	spec = mtree_spec_create();
+	TEST_ASSERT_ERRNO(spec != NULL);
+	if (spec == NULL)
+		return (NULL);
+	ret = mtree_spec_read_spec_data(spec, data, pos);
+	TEST_ASSERT_MSG(ret == 0, "%zu: %s", pos,
+	    mtree_spec_get_read_error(spec));
+	ret = mtree_spec_read_spec_data(spec, data + pos, strlen(data + pos));
+	TEST_ASSERT_MSG(ret == 0, "%zu: %s", pos,
+	    mtree_spec_get_read_error(spec));
+	ret = mtree_spec_read_spec_data_finish(spec);
+	TEST_ASSERT_MSG(ret == 0, "%zu: %s", pos,
+	    mtree_spec_get_read_error(spec));
+	entries = mtree_spec_take_entries(spec);
+	mtree_spec_free(spec);
+	return (entries);
+}
+
+/*
+ * Pass the spec data in two pieces split at every position, escaped
+ * newlines may be split from their backslash.
+ */
+static void
+test_spec_read_spec_data_split(void)
+{
+	static const char *data[] = {
+		spec_data,
+		"./file1 type=file \\\nsize=1 \\\n\\\nmode=0644\n",
+		NULL
+	};
+	struct mtree_entry	*e1, *e2;
+	size_t			 i, j;
+
+	for (i = 0; data[i] != NULL; i++) {
+		e1 = read_spec_data_split(data[i], 0);
+		for (j = 1; j < strlen(data[i]); j++) {
+			e2 = read_spec_data_split(data[i], j);
+			compare_entries(e1, e2, MTREE_KEYWORD_MASK_ALL);
+			mtree_entry_free_all(e2);
+		}
+		mtree_entry_free_all(e1);
+	}
+}
+
+static void
+test_spec_read_spec_path(void)
+{
+	struct mtree_spec	*spec;
+	struct mtree_entry	*e1, *e2;
+	int			 fd;
+	int			 i;
+	int			 ret;
+
+	fd = open(SPEC_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	TEST_ASSERT_ERRNO(fd != -1);
+	if (fd == -1)
+		return;
+	ret = write(fd, spec_data, sizeof(spec_data) - 1) ==
+	    (ssize_t)sizeof(spec_data) - 1;
+	close(fd);
+	TEST_ASSERT_ERRNO(ret);
+	if (!ret)
+		goto out;
+
+	e1 = read_spec_data();
+	TEST_ASSERT_VALCMP(mtree_entry_count(e1), (size_t)6, "%zu");
+
+	/* Read, then mapped and parsed in place. */
+	for (i = 0; i < 2; i++) {
+		spec = mtree_spec_create();
+		TEST_ASSERT_ERRNO(spec != NULL);
+		if (spec == NULL)
+			goto out;
+		if (i == 1)
+			mtree_spec_set_read_options(spec,
+			    MTREE_READ_SPEC_MMAP);
+		ret = mtree_spec_read_spec_path(spec, SPEC_FILE);
+		TEST_ASSERT_MSG(ret == 0, "%s",
+		    mtree_spec_get_read_error(spec));
+		e2 = mtree_spec_get_entries(spec);
+		compare_entries(e1, e2, MTREE_KEYWORD_MASK_ALL);
+		mtree_spec_free(spec);
+	}
+
+	/* The same with descriptors, which are read to the end. */
+	for (i = 0; i < 2; i++) {
+		spec = mtree_spec_create();
+		TEST_ASSERT_ERRNO(spec != NULL);
+		fd = open(SPEC_FILE, O_RDONLY);
+		TEST_ASSERT_ERRNO(fd != -1);
+		if (spec != NULL && fd != -1) {
+			if (i == 1)
+				mtree_spec_set_read_options(spec,
+				    MTREE_READ_SPEC_MMAP);
+			ret = mtree_spec_read_spec_fd(spec, fd);
+			TEST_ASSERT_MSG(ret == 0, "%s",
+			    mtree_spec_get_read_error(spec));
+			TEST_ASSERT(lseek(fd, 0, SEEK_CUR) ==
+			    (off_t)sizeof(spec_data) - 1);
+			e2 = mtree_spec_get_entries(spec);
+			compare_entries(e1, e2, MTREE_KEYWORD_MASK_ALL);
+		}
+		if (fd != -1)
+			close(fd);
+		if (spec != NULL)
+			mtree_spec_free(spec);
+	}
+
+	/* Missing files are reported. */
+	spec = mtree_spec_create();
+	TEST_ASSERT_ERRNO(spec != NULL);
+	if (spec != NULL) {
+		ret = mtree_spec_read_spec_path(spec, SPEC_FILE ".missing");
+		TEST_ASSERT(ret == -1);
+		TEST_ASSERT(mtree_spec_get_read_error(spec) != NULL);
+		mtree_spec_free(spec);
+	}
+	mtree_entry_free_all(e1);
+out:
+	unlink(SPEC_FILE);
+}
+
+static void
+test_spec_read_spec_arena(void)
+{
+	struct mtree_spec	*spec;
+	struct mtree_entry	*e1, *e2, *e;
+	int			 ret;
+
+	e1 = read_spec_data();
+	spec = mtree_spec_create();
+	TEST_ASSERT_ERRNO(spec != NULL);
+	if (spec == NULL) {
+		mtree_entry_free_all(e1);
+		return;
+	}
+	mtree_spec_set_read_options(spec, MTREE_READ_SPEC_ARENA);
+	ret = mtree_spec_read_spec_data(spec, spec_data, sizeof(spec_data) - 1);
+	TEST_ASSERT_ERRNO(ret == 0);
+	ret = mtree_spec_read_spec_data_finish(spec);
+	TEST_ASSERT_ERRNO(ret == 0);
+
+	/* Entries taken from the spec outlive it. */
+	e2 = mtree_spec_take_entries(spec);
+	mtree_spec_free(spec);
+	for (e = e2; e != NULL; e = e->next)
+		TEST_ASSERT(e->arena != NULL);
+	compare_entries(e1, e2, MTREE_KEYWORD_MASK_ALL);
+
+	/* Entries can also be freed one by one. */
+	e = mtree_entry_get_next(e2);
+	TEST_ASSERT(e != NULL);
+	if (e != NULL) {
+		e2 = mtree_entry_unlink(e2, e);
+		mtree_entry_free(e);
+	}
+	TEST_ASSERT_VALCMP(mtree_entry_count(e2), mtree_entry_count(e1) - 1,
+	    "%zu");
+	mtree_entry_free_all(e2);
+	mtree_entry_free_all(e1);
+}
+
+/*
+ * Write a spec in the 2.0 format large enough to be split into chunks, with
+ * defaults changing along the way. If `relative' is set, the spec ends with
+ * entries in the 1.0 format.
+ */
+static int
+write_large_spec(int relative)
+{
+	FILE	*fp;
+	int	 i;
+
+	fp = fopen(SPEC_FILE, "w");
+	if (fp == NULL)
+		return (-1);
+	fprintf(fp, "/set type=file uid=0 mode=0644\n");
+	for (i = 0; i < 200000; i++) {
+		if (i % 9000 == 0)
+			fprintf(fp, "/set uid=%d gid=%d\n", i, i / 2);
+		if (i % 13000 == 0)
+			fprintf(fp, "  /unset gid\n");
+		if (i % 7 == 0)
+			fprintf(fp, "./dir%d/file\\040%d \\\n size=%d\n",
+			    i / 100, i, i);
+		else
+			fprintf(fp, "./dir%d/file%d size=%d time=%d.0 # %d\n",
+			    i / 100, i, i, i, i);
+		if (relative && i == 150000)
+			fprintf(fp, ". type=dir\ndir type=dir\nfile\n..\n");
+	}
+	return (fclose(fp) == 0 ? 0 : -1);
+}
+
+static struct mtree_entry *
+read_large_spec(int options)
+{
+	struct mtree_spec	*spec;
+	struct mtree_entry	*entries;
+	int			 ret;
+
+	spec = mtree_spec_create();
+	TEST_ASSERT_ERRNO(spec != NULL);
+	if (spec == NULL)
+		return (NULL);
+	mtree_spec_set_read_options(spec, options);
+	mtree_spec_set_read_threads(spec, 4);
+	ret = mtree_spec_read_spec_path(spec, SPEC_FILE);
+	TEST_ASSERT_MSG(ret == 0, "%s", mtree_spec_get_read_error(spec));
+	entries = mtree_spec_take_entries(spec);
+	mtree_spec_free(spec);
+	return (entries);
+}
+
+/*
+ * Check that the entry lists are equal like compare_entries(), but only
+ * report the first difference.
+ */
+static void
+compare_large_entries(struct mtree_entry *e1, struct mtree_entry *e2)
+{
+	struct mtree_entry	*p1, *p2;
+	uint64_t		 diff;
+
+	TEST_ASSERT_VALCMP(mtree_entry_count(e1), mtree_entry_count(e2),
+	    "%zu");
+	for (p1 = e1, p2 = e2; p1 != NULL && p2 != NULL;
+	     p1 = p1->next, p2 = p2->next) {
+		if (strcmp(p1->path, p2->path) != 0 ||
+		    mtree_entry_compare(p1, p2, MTREE_KEYWORD_MASK_ALL,
+		    &diff) != 0)
+			break;
+	}
+	TEST_ASSERT_MSG(p1 == NULL && p2 == NULL, "%s: %s",
+	    p1 != NULL ? p1->path : "(null)",
+	    p2 != NULL ? p2->path : "(null)");
+}
+
+static void
+test_spec_read_spec_path_parallel(void)
+{
+	struct mtree_entry	*e1, *e2;
+	int			 relative;
+
+	for (relative = 0; relative < 2; relative++) {
+		TEST_ASSERT_ERRNO(write_large_spec(relative) == 0);
+
+		e1 = read_large_spec(0);
+		e2 = read_large_spec(MTREE_READ_SPEC_MMAP |
+		    MTREE_READ_SPEC_PARALLEL);
+		compare_large_entries(e1, e2);
+		mtree_entry_free_all(e1);
+		mtree_entry_free_all(e2);
+	}
+	unlink(SPEC_FILE);
+}
+
+/*
+ * Size of a spec split into two chunks by the parallel parser.
+ */
+#define SPLIT_SPEC_SIZE	(8 * 1024 * 1024)
+
+/*
+ * Write entries and a comment to fill the spec up to `size' bytes.
+ */
+static long
+fill_spec(FILE *fp, long off, long size)
+{
+
+	while (off < size - 64)
+		off += fprintf(fp, "./dir/file%ld size=1\n", off);
+	fprintf(fp, "#%*s\n", (int)(size - off - 2), "");
+	return (size);
+}
+
+/*
+ * The parallel parser splits the spec in the middle. Check that an entry
+ * continued with an escaped newline right there is not split.
+ */
+static void
+test_spec_read_spec_path_parallel_split(void)
+{
+	static const char	 link[] = "./dir/link type=link \\";
+	struct mtree_entry	*e1, *e2;
+	FILE			*fp;
+	long			 off;
+
+	fp = fopen(SPEC_FILE, "w");
+	TEST_ASSERT_ERRNO(fp != NULL);
+	if (fp == NULL)
+		return;
+	/* The newline after the backslash is at the middle. */
+	off = fill_spec(fp, 0, SPLIT_SPEC_SIZE / 2 - (sizeof(link) - 1));
+	off += fprintf(fp, "%s\n link=/target\n", link);
+	fill_spec(fp, off, SPLIT_SPEC_SIZE);
+	TEST_ASSERT_ERRNO(fclose(fp) == 0);
+
+	e1 = read_large_spec(0);
+	e2 = read_large_spec(MTREE_READ_SPEC_MMAP | MTREE_READ_SPEC_PARALLEL);
+	compare_large_entries(e1, e2);
+	mtree_entry_free_all(e1);
+	mtree_entry_free_all(e2);
+	unlink(SPEC_FILE);
+}
+
+void
+test_mtree_spec(void)
+{
+	TEST_RUN(test_spec_read_path_parallel, "mtree_spec_read_path_parallel");
+	TEST_RUN(test_spec_read_path_large_dir, "mtree_spec_read_path (large directory)");
+	TEST_RUN(test_spec_read_path_deep, "mtree_spec_read_path (deep directory)");
+	TEST_RUN(test_spec_read_path_deferred, "mtree_spec_read_path (deferred checksums)");
+	TEST_RUN(test_spec_read_path_incremental, "mtree_spec_read_path_incremental");
+	TEST_RUN(test_spec_read_path_hardlinks, "mtree_spec_read_path (hard links)");
+	TEST_RUN(test_spec_read_path_limits, "mtree_spec_read_path (limits)");
+	TEST_RUN(test_spec_read_path_stat_keywords,
+	    "mtree_spec_read_path (stat keywords)");
+	TEST_RUN(test_spec_read_path_incremental_stat,
+	    "mtree_spec_read_path_incremental (stat keywords)");
+	TEST_RUN(test_spec_read_spec_data_split,
+	    "mtree_spec_read_spec_data (split)");
+	TEST_RUN(test_spec_read_spec_path, "mtree_spec_read_spec_path");
+	TEST_RUN(test_spec_read_spec_path_parallel,
+	    "mtree_spec_read_spec_path (parallel)");
+	TEST_RUN(test_spec_read_spec_path_parallel_split,
+	    "mtree_spec_read_spec_path (parallel, split line)");
+	TEST_RUN(test_spec_read_spec_arena, "mtree_spec_read_spec_data (arena)");
+}
@@ -76,6 +76,15 @@ extern int	 bflag, dflag, eflag, iflag, jflag, lflag, Lflag, mflag, Mflag,
 		 nflag, qflag, rflag, sflag, Sflag, tflag, uflag, xflag, Wflag;
 extern char	 fullpath[];
 extern long	 keywords;
+extern struct mtree_cache *cache;
+
+typedef struct {
+	uint64_t  bytes;	/* per second */
+	uint64_t  files;	/* per second */
+	uint64_t  latency;	/* in microseconds */
+	int	  io_priority;
+} readlimits;
+extern readlimits read_limits;
 
 typedef struct {
 	char	**list;
@@ -104,6 +113,7 @@ int			 compare_spec(FILE *f1, FILE *f2, FILE *fw);
 int			 verify_spec(FILE *fp);
 long			 parse_keyword(const char *name);
 void			 parse_tags(taglist *list, char *args);
+void			 parse_limits(readlimits *limits, char *args);
 int			 match_tags(const char *tags);
 char			*convert_flags_to_string(uint32_t flags, const char *def);
 int			 convert_string_to_flags(const char *s, uint32_t *flags);
@@ -101,6 +101,77 @@ parse_tags(taglist *list, char *args)
 	}
 }
 
+/*
+ * Parse a number with an optional k, m or g suffix of binary multiples.
+ */
+static uint64_t
+parse_size(const char *name, const char *value)
+{
+	uint64_t	 n;
+	char		*end;
+
+	errno = 0;
+	n = strtoull(value, &end, 10);
+	if (errno != 0 || end == value)
+		mtree_err("illegal %s value -- %s", name, value);
+	switch (*end) {
+	case 'g': case 'G':
+		n *= 1024;
+		/* FALLTHROUGH */
+	case 'm': case 'M':
+		n *= 1024;
+		/* FALLTHROUGH */
+	case 'k': case 'K':
+		n *= 1024;
+		end++;
+		break;
+	}
+	if (*end != '\0')
+		mtree_err("illegal %s value -- %s", name, value);
+	return (n);
+}
+
+/*
+ * Parse the limits of reading file contents, a list of name=value pairs
+ * separated by commas:
+ *
+ *	bytes=N		bytes per second, with an optional k, m or g suffix
+ *	files=N		files per second
+ *	latency=N	target latency of reads in microseconds
+ *	ioclass=C	I/O priority class: normal, low or idle
+ */
+void
+parse_limits(readlimits *limits, char *args)
+{
+	char *p, *value;
+
+	while ((p = strsep(&args, ",")) != NULL) {
+		if (*p == '\0')
+			continue;
+		value = strchr(p, '=');
+		if (value == NULL)
+			mtree_err("missing value of limit `%s'", p);
+		*value++ = '\0';
+		if (strcmp(p, "bytes") == 0)
+			limits->bytes = parse_size(p, value);
+		else if (strcmp(p, "files") == 0)
+			limits->files = parse_size(p, value);
+		else if (strcmp(p, "latency") == 0)
+			limits->latency = parse_size(p, value);
+		else if (strcmp(p, "ioclass") == 0) {
+			if (strcmp(value, "normal") == 0)
+				limits->io_priority = MTREE_IO_PRIORITY_NORMAL;
+			else if (strcmp(value, "low") == 0)
+				limits->io_priority = MTREE_IO_PRIORITY_LOW;
+			else if (strcmp(value, "idle") == 0)
+				limits->io_priority = MTREE_IO_PRIORITY_IDLE;
+			else
+				mtree_err("unknown I/O class `%s'", value);
+		} else
+			mtree_err("unknown limit `%s'", p);
+	}
+}
+
 /*
  * matchtags
  *	returns 0 if there's a match from the exclude list in the node's tags,
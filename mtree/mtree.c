@@ -53,6 +53,9 @@ int	bflag, dflag, eflag, iflag, jflag, lflag, Lflag, mflag, Mflag, nflag,
 // XXX needed for -s ???
 char	fullpath[MAXPATHLEN];
 
+struct mtree_cache *cache;
+readlimits read_limits;
+
 long	 keywords = KEYWORDS;
 taglist  include_tags;
 taglist  exclude_tags;
@@ -67,9 +70,9 @@ usage(void)
 
 	fprintf(stderr,
 	    "usage: %s [-bCcDdejLlMnPqrStUuWx] [-i|-m] [-E tags]\n"
-	    "\t\t[-f spec] [-f spec]\n"
+	    "\t\t[-f spec] [-f spec] [-H cachefile]\n"
 	    "\t\t[-I tags] [-K keywords] [-k keywords] [-N dbdir] [-p path]\n"
-	    "\t\t[-R keywords] [-s seed] [-X exclude-file]\n"
+	    "\t\t[-R keywords] [-s seed] [-T limits] [-X exclude-file]\n"
 	    "\t\t[-F flavor]\n",
 	    _progname);
 
@@ -114,12 +117,34 @@ mtree_err(const char *fmt, ...)
 	/* NOTREACHED */
 }
 
+/*
+ * Open the checksum cache, relative paths are resolved now as the current
+ * directory may change before the cache is written.
+ */
+static void
+open_cache(const char *path)
+{
+	char cwd[MAXPATHLEN];
+	char full[2 * MAXPATHLEN];
+
+	if (*path != '/') {
+		if (getcwd(cwd, sizeof(cwd)) == NULL)
+			mtree_err("getcwd: %s", strerror(errno));
+		snprintf(full, sizeof(full), "%s/%s", cwd, path);
+		path = full;
+	}
+	cache = mtree_cache_open(path, MTREE_CACHE_STRICT);
+	if (cache == NULL)
+		mtree_err("%s: %s", path, strerror(errno));
+}
+
 int
 main(int argc, char **argv)
 {
 	FILE	*spec1, *spec2;
 	char	*dir, *p;
 	char	*specfile1, *specfile2;
+	char	*cachefile;
 	size_t  i;
 	int	ch, status;
 	int	cflag, Cflag, Dflag, Pflag, Uflag, wflag;
@@ -132,9 +157,10 @@ main(int argc, char **argv)
 	spec2 = NULL;
 	specfile1 = NULL;
 	specfile2 = NULL;
+	cachefile = NULL;
 
 	while ((ch = getopt(argc, argv,
-	    "bcCdDeE:f:F:I:ijk:K:lLmMnN:O:p:PqrR:s:StuUwWxX:")) != -1) {
+	    "bcCdDeE:f:F:H:I:ijk:K:lLmMnN:O:p:PqrR:s:StT:uUwWxX:")) != -1) {
 		switch (ch) {
 		case 'b':
 			bflag = 1;
@@ -174,6 +200,9 @@ main(int argc, char **argv)
 			if (i == __arraycount(flavors))
 				usage();
 			break;
+		case 'H':
+			cachefile = optarg;
+			break;
 		case 'i':
 			iflag = 1;
 			break;
@@ -247,6 +276,9 @@ main(int argc, char **argv)
 		case 't':
 			tflag = 1;
 			break;
+		case 'T':
+			parse_limits(&read_limits, optarg);
+			break;
 		case 'u':
 			uflag = 1;
 			break;
@@ -322,7 +354,16 @@ main(int argc, char **argv)
 	 * Write a spec for `dir' to stdout
 	 */
 	if (cflag) {
+		if (cachefile != NULL)
+			open_cache(cachefile);
 		write_spec_tree(stdout, dir);
+		if (cache != NULL) {
+			/* Records of files no longer in the tree are dropped. */
+			if (mtree_cache_compact(cache) == -1)
+				mtree_warn("%s: %s", cachefile,
+				    strerror(errno));
+			mtree_cache_close(cache);
+		}
 		exit(0);
 	}
 
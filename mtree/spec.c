@@ -65,9 +65,24 @@ create_spec(void)
 		options |= MTREE_READ_PATH_FOLLOW_SYMLINKS;
 	if (xflag)
 		options |= MTREE_READ_PATH_DONT_CROSS_MOUNT;
+	/* The filter doesn't need checksums. */
+	options |= MTREE_READ_PATH_DEFER_CHECKSUMS;
+	/*
+	 * Spec files are not expected to change while they are read, so they
+	 * are mapped to memory. Large specs in the 2.0 format are parsed by
+	 * multiple threads, entries of specs are kept in arenas.
+	 */
+	options |= MTREE_READ_SPEC_MMAP | MTREE_READ_SPEC_PARALLEL |
+	    MTREE_READ_SPEC_ARENA;
 
 	mtree_spec_set_read_path_keywords(spec, keywords);
 	mtree_spec_set_read_options(spec, options);
+	if (cache != NULL)
+		mtree_spec_set_read_cache(spec, cache);
+	mtree_spec_set_read_byte_rate(spec, read_limits.bytes);
+	mtree_spec_set_read_file_rate(spec, read_limits.files);
+	mtree_spec_set_read_latency(spec, read_limits.latency);
+	mtree_spec_set_read_io_priority(spec, read_limits.io_priority);
 	return (spec);
 }
 
@@ -108,7 +123,11 @@ read_spec(FILE *fp)
 	assert(fp != NULL);
 
 	spec = create_spec();
-	if (mtree_spec_read_spec_file(spec, fp) != 0)
+	/*
+	 * Nothing has been read from the stream yet, pass the descriptor to
+	 * let the library map a regular file to memory.
+	 */
+	if (mtree_spec_read_spec_fd(spec, fileno(fp)) != 0)
 		mtree_err("%s", mtree_spec_get_read_error(spec));
 
 	return (spec);
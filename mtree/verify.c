@@ -133,15 +133,36 @@ compare(struct mtree_entry *e, struct mtree_entry *f)
 	const char	*path;
 	const char	*edigest;
 	const char	*fdigest;
-	long		 kw;
+	uint64_t	 kw;
+	uint64_t	 ckw;
 	int		 label;
 	int		 len;
 
 	kw = mtree_entry_get_keywords(e);
 	/*
-	 * Match entry's keywords in the file.
+	 * Only the uid and gid are verified when given.
+	 */
+	if (kw & MTREE_KEYWORD_UID)
+		kw &= ~MTREE_KEYWORD_UNAME;
+	if (kw & MTREE_KEYWORD_GID)
+		kw &= ~MTREE_KEYWORD_GNAME;
+	/*
+	 * Match entry's keywords in the file. The contents are only read if
+	 * the keywords which are verified first match, otherwise the file is
+	 * reported without its checksums.
 	 */
-	mtree_entry_set_keywords(f, kw, 0);
+	if (Wflag)
+		ckw = kw & (MTREE_KEYWORD_TYPE | MTREE_KEYWORD_LINK |
+		    MTREE_KEYWORD_MASK_DIGEST);
+	else if (lflag && (kw & MTREE_KEYWORD_MODE)) {
+		/*
+		 * The mode may be accepted even if it differs.
+		 */
+		mtree_entry_set_keywords(f, MTREE_KEYWORD_MODE, 0);
+		ckw = kw & ~MTREE_KEYWORD_MODE;
+	} else
+		ckw = kw;
+	mtree_entry_compare_file(e, f, ckw, 0, NULL);
 	kw = kw & mtree_entry_get_keywords(f);
 
 	path  = mtree_entry_get_path(e);